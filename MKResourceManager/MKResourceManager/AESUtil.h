@@ -8,10 +8,112 @@
 
 #import <Foundation/Foundation.h>
 
+// Length of the header of encrypted file: magic, chunk size and nonce
+#define MKEncryptionHeaderLength 24
+// Length of the authentication tag that follows each encrypted chunk
+#define MKEncryptionTagLength 16
+#define MKEncryptionNonceLength 16
+// Default length of plain data in a chunk
+#define MKEncryptionDefaultChunkSize (64 * 1024)
+
 @interface AESUtil : NSObject {
 }
 
+// Whole buffer encryption without IV. Kept for compatibility, data of resources is encrypted with MKEncryptedFileWriter.
 + (NSData*)decryptAES:(NSString*)key data:(NSData*)data;
 + (NSData*)encryptAES:(NSString*)key data:(NSData*)data;
 
 @end
+
+/**
+ * Keys of chunked encryption derived from the key string. The keys are derived once, the object can be shared between threads.
+ */
+@interface MKEncryptionKey : NSObject {
+@private
+    unsigned char           _cipherKey[32];
+    unsigned char           _authenticationKey[32];
+}
+
+- (id)initWithKey:(NSString*)key;
+
+@end
+
+/**
+ * Writes file encrypted in chunks, so that memory used does not depend on the length of the data.
+ * File starts with header: magic "MKE1", chunk size (4 bytes, big endian) and random nonce.
+ * Data follows in chunks of chunk size, the last chunk may be shorter. Each chunk is encrypted with AES-256 in CTR mode
+ * and followed by the tag: first 16 bytes of HMAC-SHA256 of nonce, chunk index, final chunk flag and encrypted chunk.
+ * A chunk is verified and decrypted independently, so a range of data is read without reading the whole file,
+ * and chunks that are reordered, replaced or cut off are detected.
+ */
+@interface MKEncryptedFileWriter : NSObject {
+@private
+    MKEncryptionKey*        _key;
+    NSString*               _path;
+    int                     _fileDescriptor;
+    NSUInteger              _chunkSize;
+    unsigned char           _nonce[MKEncryptionNonceLength];
+    unsigned char*          _chunk;
+    NSUInteger              _chunkLength;
+    uint64_t                _chunkIndex;
+    BOOL                    _errorOccured;
+}
+
+// Creates file at path. Returns nil if the file can not be created.
+- (id)initWithKey:(MKEncryptionKey*)key path:(NSString*)path;
+// Chunk size is rounded up to the AES block size.
+- (id)initWithKey:(MKEncryptionKey*)key path:(NSString*)path chunkSize:(NSUInteger)chunkSize;
+- (BOOL)appendBytes:(const void*)bytes length:(NSUInteger)length;
+// Writes the final chunk and closes the file. File that has not been finished is removed when the writer is deallocated.
+- (BOOL)finish;
+
+@end
+
+/**
+ * Reads file written by MKEncryptedFileWriter. Only chunks covering the requested range are read, each of them is verified
+ * before it is decrypted. The reader should be used from one thread at a time.
+ */
+@interface MKEncryptedFileReader : NSObject {
+@private
+    MKEncryptionKey*        _key;
+    int                     _fileDescriptor;
+    NSUInteger              _chunkSize;
+    unsigned char           _nonce[MKEncryptionNonceLength];
+    uint64_t                _chunksCount;
+    NSUInteger              _lastChunkLength;
+    unsigned long long      _length;
+    unsigned char*          _chunk;
+    uint64_t                _decryptedChunkIndex;
+    NSUInteger              _decryptedChunkLength;
+}
+
+// Length of the plain data
+@property (nonatomic, readonly) unsigned long long length;
+
+// Returns YES if the file starts with the header of encrypted file
++ (BOOL)isEncryptedFileAtPath:(NSString*)path;
+// Returns nil if the file can not be opened or it has no valid header.
+- (id)initWithKey:(MKEncryptionKey*)key path:(NSString*)path;
+// Returns number of bytes read, 0 at the end of data and -1 if data can not be read or verified.
+- (NSInteger)readBytes:(void*)bytes length:(NSUInteger)length atOffset:(unsigned long long)offset;
+// Range is clipped to the length of the data. Returns nil if data can not be read or verified.
+- (NSData*)dataInRange:(NSRange)range;
+- (NSData*)data;
+
+@end
+
+/**
+ * Stream of plain data of encrypted file. Reading is synchronous, scheduling in run loop has no effect.
+ */
+@interface MKDecryptingInputStream : NSInputStream {
+@private
+    MKEncryptedFileReader*  _reader;
+    unsigned long long      _offset;
+    NSStreamStatus          _streamStatus;
+    NSError*                _streamError;
+    __weak id<NSStreamDelegate> _delegate;
+}
+
+- (id)initWithReader:(MKEncryptedFileReader*)reader;
+
+@end
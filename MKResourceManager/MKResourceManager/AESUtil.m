@@ -8,6 +8,14 @@
 
 #import "AESUtil.h"
 #import <CommonCrypto/CommonCryptor.h>
+#import <CommonCrypto/CommonHMAC.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/stat.h>
+
+static const char MKEncryptionMagic[4] = {'M', 'K', 'E', '1'};
+// Larger chunk size in the header means the file is damaged
+static NSUInteger const MKEncryptionMaxChunkSize = 16 * 1024 * 1024;
 
 @implementation AESUtil
 
@@ -86,3 +94,410 @@
 }
 
 @end
+
+static void MKWriteBigEndian64(unsigned char* bytes, uint64_t value) {
+    for (NSInteger i = 7; i >= 0; i--) {
+        bytes[i] = (unsigned char)(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static BOOL MKWriteAll(int fileDescriptor, const void* bytes, size_t length) {
+    size_t writtenLength = 0;
+    while (writtenLength < length) {
+        ssize_t result = write(fileDescriptor, (const uint8_t*)bytes + writtenLength, length - writtenLength);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return NO;
+        }
+        writtenLength += result;
+    }
+    return YES;
+}
+
+static size_t MKReadAll(int fileDescriptor, void* bytes, size_t length, off_t offset) {
+    size_t readLength = 0;
+    while (readLength < length) {
+        ssize_t result = pread(fileDescriptor, (uint8_t*)bytes + readLength, length - readLength, offset + readLength);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        readLength += result;
+    }
+    return readLength;
+}
+
+// Counter of the chunk continues the counter of the previous one, so no counter block is used twice in a file
+static BOOL MKCryptChunk(const unsigned char* key, const unsigned char* nonce, NSUInteger chunkSize, uint64_t index, void* bytes, size_t length) {
+    if (length == 0) {
+        return YES;
+    }
+    unsigned char iv[kCCBlockSizeAES128];
+    memcpy(iv, nonce, 8);
+    MKWriteBigEndian64(iv + 8, index * (chunkSize / kCCBlockSizeAES128));
+    
+    CCCryptorRef cryptor = NULL;
+    CCCryptorStatus status = CCCryptorCreateWithMode(kCCEncrypt, kCCModeCTR, kCCAlgorithmAES128, ccNoPadding, iv, key, kCCKeySizeAES256,
+                                                     NULL, 0, 0, kCCModeOptionCTR_BE, &cryptor);
+    if (status != kCCSuccess) {
+        return NO;
+    }
+    size_t movedLength = 0;
+    status = CCCryptorUpdate(cryptor, bytes, length, bytes, length, &movedLength);
+    CCCryptorRelease(cryptor);
+    return status == kCCSuccess && movedLength == length;
+}
+
+static void MKChunkTag(const unsigned char* key, const unsigned char* nonce, uint64_t index, BOOL final, const void* bytes, size_t length, unsigned char* tag) {
+    unsigned char chunkHeader[9];
+    MKWriteBigEndian64(chunkHeader, index);
+    chunkHeader[8] = final ? 1 : 0;
+    
+    unsigned char mac[CC_SHA256_DIGEST_LENGTH];
+    CCHmacContext context;
+    CCHmacInit(&context, kCCHmacAlgSHA256, key, 32);
+    CCHmacUpdate(&context, nonce, MKEncryptionNonceLength);
+    CCHmacUpdate(&context, chunkHeader, sizeof(chunkHeader));
+    CCHmacUpdate(&context, bytes, length);
+    CCHmacFinal(&context, mac);
+    memcpy(tag, mac, MKEncryptionTagLength);
+}
+
+@interface MKEncryptionKey ()
+- (const unsigned char*)cipherKey;
+- (const unsigned char*)authenticationKey;
+@end
+
+@implementation MKEncryptionKey
+
+// Keys for encryption and authentication are separate HMAC-SHA256 of fixed labels with the key string
+- (id)initWithKey:(NSString*)key {
+    self = [super init];
+    if (self != nil) {
+        NSData* keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+        if ([keyData length] == 0) {
+            return nil;
+        }
+        const char* cipherLabel = "MKResourceManager cipher key";
+        const char* authenticationLabel = "MKResourceManager authentication key";
+        CCHmac(kCCHmacAlgSHA256, [keyData bytes], [keyData length], cipherLabel, strlen(cipherLabel), _cipherKey);
+        CCHmac(kCCHmacAlgSHA256, [keyData bytes], [keyData length], authenticationLabel, strlen(authenticationLabel), _authenticationKey);
+    }
+    return self;
+}
+
+- (void)dealloc {
+    memset(_cipherKey, 0, sizeof(_cipherKey));
+    memset(_authenticationKey, 0, sizeof(_authenticationKey));
+}
+
+- (const unsigned char*)cipherKey {
+    return _cipherKey;
+}
+
+- (const unsigned char*)authenticationKey {
+    return _authenticationKey;
+}
+
+@end
+
+@implementation MKEncryptedFileWriter
+
+- (id)initWithKey:(MKEncryptionKey*)key path:(NSString*)path {
+    return [self initWithKey:key path:path chunkSize:MKEncryptionDefaultChunkSize];
+}
+
+- (id)initWithKey:(MKEncryptionKey*)key path:(NSString*)path chunkSize:(NSUInteger)chunkSize {
+    self = [super init];
+    if (self != nil) {
+        _fileDescriptor = -1;
+        if (key == nil || path == nil || chunkSize == 0 || chunkSize > MKEncryptionMaxChunkSize) {
+            return nil;
+        }
+        _key = key;
+        _path = [path copy];
+        _chunkSize = (chunkSize + kCCBlockSizeAES128 - 1) / kCCBlockSizeAES128 * kCCBlockSizeAES128;
+        _fileDescriptor = open([path fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (_fileDescriptor < 0) {
+            NSLog(@"%@: Fail to create encrypted file at path: %@, %s", NSStringFromClass ([self class]), path, strerror(errno));//Error
+            return nil;
+        }
+        _chunk = malloc(_chunkSize + MKEncryptionTagLength);
+        arc4random_buf(_nonce, sizeof(_nonce));
+        
+        unsigned char header[MKEncryptionHeaderLength];
+        memcpy(header, MKEncryptionMagic, sizeof(MKEncryptionMagic));
+        header[4] = (unsigned char)(_chunkSize >> 24);
+        header[5] = (unsigned char)(_chunkSize >> 16);
+        header[6] = (unsigned char)(_chunkSize >> 8);
+        header[7] = (unsigned char)_chunkSize;
+        memcpy(header + 8, _nonce, sizeof(_nonce));
+        if (_chunk == NULL || !MKWriteAll(_fileDescriptor, header, sizeof(header))) {
+            _errorOccured = YES;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (_fileDescriptor >= 0) {
+        close(_fileDescriptor);
+        unlink([_path fileSystemRepresentation]);
+    }
+    free(_chunk);
+}
+
+- (BOOL)sealChunkFinal:(BOOL)final {
+    if (!MKCryptChunk([_key cipherKey], _nonce, _chunkSize, _chunkIndex, _chunk, _chunkLength)) {
+        _errorOccured = YES;
+        return NO;
+    }
+    MKChunkTag([_key authenticationKey], _nonce, _chunkIndex, final, _chunk, _chunkLength, _chunk + _chunkLength);
+    if (!MKWriteAll(_fileDescriptor, _chunk, _chunkLength + MKEncryptionTagLength)) {
+        NSLog(@"%@: Fail to write encrypted file at path: %@, %s", NSStringFromClass ([self class]), _path, strerror(errno));//Error
+        _errorOccured = YES;
+        return NO;
+    }
+    _chunkIndex++;
+    _chunkLength = 0;
+    return YES;
+}
+
+- (BOOL)appendBytes:(const void*)bytes length:(NSUInteger)length {
+    if (_errorOccured || _fileDescriptor < 0) {
+        return NO;
+    }
+    NSUInteger appendedLength = 0;
+    while (appendedLength < length) {
+        // full chunk is sealed when more data comes, the last chunk is sealed as final
+        if (_chunkLength == _chunkSize && ![self sealChunkFinal:NO]) {
+            return NO;
+        }
+        NSUInteger copyLength = MIN(length - appendedLength, _chunkSize - _chunkLength);
+        memcpy(_chunk + _chunkLength, (const uint8_t*)bytes + appendedLength, copyLength);
+        _chunkLength += copyLength;
+        appendedLength += copyLength;
+    }
+    return YES;
+}
+
+- (BOOL)finish {
+    if (_fileDescriptor < 0) {
+        return NO;
+    }
+    BOOL result = !_errorOccured && [self sealChunkFinal:YES];
+    result = (close(_fileDescriptor) == 0) && result;
+    _fileDescriptor = -1;
+    if (!result) {
+        unlink([_path fileSystemRepresentation]);
+    }
+    return result;
+}
+
+@end
+
+@implementation MKEncryptedFileReader
+@synthesize length = _length;
+
++ (BOOL)isEncryptedFileAtPath:(NSString*)path {
+    int fileDescriptor = open([path fileSystemRepresentation], O_RDONLY);
+    if (fileDescriptor < 0) {
+        return NO;
+    }
+    char magic[sizeof(MKEncryptionMagic)];
+    BOOL result = MKReadAll(fileDescriptor, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, MKEncryptionMagic, sizeof(magic)) == 0;
+    close(fileDescriptor);
+    return result;
+}
+
+- (id)initWithKey:(MKEncryptionKey*)key path:(NSString*)path {
+    self = [super init];
+    if (self != nil) {
+        _key = key;
+        _fileDescriptor = open([path fileSystemRepresentation], O_RDONLY);
+        if (key == nil || _fileDescriptor < 0) {
+            return nil;
+        }
+        
+        struct stat fileStat;
+        unsigned char header[MKEncryptionHeaderLength];
+        if (fstat(_fileDescriptor, &fileStat) != 0 || fileStat.st_size < MKEncryptionHeaderLength + MKEncryptionTagLength ||
+            MKReadAll(_fileDescriptor, header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header, MKEncryptionMagic, sizeof(MKEncryptionMagic)) != 0) {
+            return nil;
+        }
+        _chunkSize = ((NSUInteger)header[4] << 24) | ((NSUInteger)header[5] << 16) | ((NSUInteger)header[6] << 8) | header[7];
+        if (_chunkSize == 0 || _chunkSize > MKEncryptionMaxChunkSize || _chunkSize % kCCBlockSizeAES128 != 0) {
+            return nil;
+        }
+        memcpy(_nonce, header + 8, sizeof(_nonce));
+        
+        unsigned long long bodyLength = fileStat.st_size - MKEncryptionHeaderLength;
+        unsigned long long unitLength = _chunkSize + MKEncryptionTagLength;
+        _chunksCount = (bodyLength + unitLength - 1) / unitLength;
+        unsigned long long lastUnitLength = bodyLength - (_chunksCount - 1) * unitLength;
+        if (lastUnitLength < MKEncryptionTagLength) {
+            return nil;
+        }
+        _lastChunkLength = (NSUInteger)(lastUnitLength - MKEncryptionTagLength);
+        _length = bodyLength - _chunksCount * MKEncryptionTagLength;
+        _chunk = malloc(unitLength);
+        _decryptedChunkIndex = UINT64_MAX;
+        if (_chunk == NULL) {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (_fileDescriptor >= 0) {
+        close(_fileDescriptor);
+    }
+    free(_chunk);
+}
+
+// Sequential reads of the same chunk decrypt it once
+- (BOOL)decryptChunkAtIndex:(uint64_t)index {
+    if (index == _decryptedChunkIndex) {
+        return YES;
+    }
+    _decryptedChunkIndex = UINT64_MAX;
+    
+    BOOL final = index == _chunksCount - 1;
+    NSUInteger chunkLength = final ? _lastChunkLength : _chunkSize;
+    off_t offset = MKEncryptionHeaderLength + (off_t)index * (_chunkSize + MKEncryptionTagLength);
+    if (MKReadAll(_fileDescriptor, _chunk, chunkLength + MKEncryptionTagLength, offset) != chunkLength + MKEncryptionTagLength) {
+        return NO;
+    }
+    
+    unsigned char tag[MKEncryptionTagLength];
+    MKChunkTag([_key authenticationKey], _nonce, index, final, _chunk, chunkLength, tag);
+    unsigned char difference = 0;
+    for (NSUInteger i = 0; i < MKEncryptionTagLength; i++) {
+        difference |= tag[i] ^ _chunk[chunkLength + i];
+    }
+    if (difference != 0) {
+        NSLog(@"%@: Fail to verify chunk %llu of encrypted data", NSStringFromClass ([self class]), index);//Error
+        return NO;
+    }
+    if (!MKCryptChunk([_key cipherKey], _nonce, _chunkSize, index, _chunk, chunkLength)) {
+        return NO;
+    }
+    _decryptedChunkIndex = index;
+    _decryptedChunkLength = chunkLength;
+    return YES;
+}
+
+- (NSInteger)readBytes:(void*)bytes length:(NSUInteger)length atOffset:(unsigned long long)offset {
+    NSUInteger readLength = 0;
+    while (readLength < length && offset + readLength < _length) {
+        unsigned long long position = offset + readLength;
+        uint64_t index = position / _chunkSize;
+        if (![self decryptChunkAtIndex:index]) {
+            return -1;
+        }
+        NSUInteger chunkOffset = (NSUInteger)(position - index * _chunkSize);
+        NSUInteger copyLength = MIN(length - readLength, _decryptedChunkLength - chunkOffset);
+        memcpy((uint8_t*)bytes + readLength, _chunk + chunkOffset, copyLength);
+        readLength += copyLength;
+    }
+    return readLength;
+}
+
+- (NSData*)dataInRange:(NSRange)range {
+    unsigned long long location = MIN((unsigned long long)range.location, _length);
+    NSUInteger length = (NSUInteger)MIN((unsigned long long)range.length, _length - location);
+    NSMutableData* data = [NSMutableData dataWithLength:length];
+    if (data == nil || [self readBytes:[data mutableBytes] length:length atOffset:location] != (NSInteger)length) {
+        return nil;
+    }
+    return data;
+}
+
+- (NSData*)data {
+    return [self dataInRange:NSMakeRange(0, (NSUInteger)_length)];
+}
+
+@end
+
+@implementation MKDecryptingInputStream
+
+- (id)initWithReader:(MKEncryptedFileReader*)reader {
+    self = [super init];
+    if (self != nil) {
+        _reader = reader;
+        _streamStatus = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+- (void)open {
+    _streamStatus = NSStreamStatusOpen;
+}
+
+- (void)close {
+    _streamStatus = NSStreamStatusClosed;
+}
+
+- (NSInteger)read:(uint8_t*)buffer maxLength:(NSUInteger)length {
+    if (_streamStatus != NSStreamStatusOpen) {
+        return _streamStatus == NSStreamStatusAtEnd ? 0 : -1;
+    }
+    NSInteger readLength = [_reader readBytes:buffer length:length atOffset:_offset];
+    if (readLength < 0) {
+        _streamStatus = NSStreamStatusError;
+        _streamError = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:nil];
+    } else {
+        _offset += readLength;
+        if (_offset >= [_reader length]) {
+            _streamStatus = NSStreamStatusAtEnd;
+        }
+    }
+    return readLength;
+}
+
+- (BOOL)getBuffer:(uint8_t**)buffer length:(NSUInteger*)length {
+    return NO;
+}
+
+- (BOOL)hasBytesAvailable {
+    return _streamStatus == NSStreamStatusOpen && _offset < [_reader length];
+}
+
+- (NSStreamStatus)streamStatus {
+    return _streamStatus;
+}
+
+- (NSError*)streamError {
+    return _streamError;
+}
+
+- (id<NSStreamDelegate>)delegate {
+    return _delegate;
+}
+
+- (void)setDelegate:(id<NSStreamDelegate>)delegate {
+    _delegate = delegate;
+}
+
+- (id)propertyForKey:(NSString*)key {
+    return nil;
+}
+
+- (BOOL)setProperty:(id)property forKey:(NSString*)key {
+    return NO;
+}
+
+- (void)scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (void)removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+@end
@@ -10,10 +10,41 @@
 #import "MKResource.h"
 
 @class MKResourceManager;
+@class MKResourceBuffer;
 
 @interface MKResource ()
 
 @property (nonatomic, strong)   NSDate* lastAccessDate;
+// Number of bytes the resource data occupies in the cache directory.
+@property (nonatomic, assign)   unsigned long long storedLength;
+// SHA-256 digest of the data in hex when the file of the resource is a link to the blob with this data. The value is persistent.
+@property (nonatomic, copy)     NSString* contentDigest;
+// YES if the file of the resource keeps the data compressed by the manager. The value is persistent.
+@property (nonatomic, assign)   BOOL storesCompressedData;
+
+// Links of the manager's recently used list. Maintained by MKResourceLRUList only.
+@property (nonatomic, unsafe_unretained) MKResource* previousRecentlyUsed;
+@property (nonatomic, unsafe_unretained) MKResource* nextRecentlyUsed;
+@property (nonatomic, assign)   BOOL inRecentlyUsedList;
+// YES for resource restored from index whose data has not been checked in the cache directory yet.
+@property (nonatomic, assign)   BOOL needsValidation;
+// Priority level of the scheduler queue the resource has been put in. Maintained by MKResourceDownloadScheduler only.
+@property (nonatomic, assign)   NSUInteger scheduledPriorityLevel;
+// YES while downloaded resource is refreshed in background and its cached data remains available.
+@property (nonatomic, assign)   BOOL revalidating;
+// Changed each time data of the resource is replaced or removed. Guarded by the manager lock.
+@property (nonatomic, assign)   NSUInteger dataGeneration;
+// Times the resource has been put in the download queue and its download has been started, 0 if it is not downloading.
+// Guarded by the manager lock.
+@property (nonatomic, assign)   CFAbsoluteTime scheduledTime;
+@property (nonatomic, assign)   CFAbsoluteTime downloadStartTime;
+// Number of retries of the failed download and whether the next one is waiting for its delay. Guarded by the manager lock.
+@property (nonatomic, assign)   NSUInteger retryCount;
+@property (nonatomic, assign)   BOOL retryPending;
+// Priority the resource had before a prefetch batch gave its priority to the download, restored when the download
+// finishes or is cancelled. Guarded by the manager lock.
+@property (nonatomic, assign)   MKResourcePriority priorityBeforeBatch;
+@property (nonatomic, assign)   BOOL hasBatchPriority;
 
 - (id)initWithResourceManager:(MKResourceManager*)manager andURL:(NSURL*)aURL;
 - (void)setExpectedContentLength:(long long)expectedContentLength;
@@ -23,11 +54,28 @@
 - (void)notifyWillStartDownload:(NSMutableURLRequest*)request;
 - (void)didFinishDownloadMR:(NSData*)data error:(NSError*)error;
 - (void)didFinishDownloadMR:(NSData*)data error:(NSError*)error httpResponse:(NSHTTPURLResponse *)httpResponse;
+- (void)didFinishDownloadMRWithBuffer:(MKResourceBuffer*)buffer error:(NSError*)error httpResponse:(NSHTTPURLResponse *)httpResponse;
 - (void)setStatus:(MKStatus)newStatus;
 - (void)setResourceManager:(MKResourceManager*)manager;
 - (void)setLoadedDate:(NSDate*)date;
 - (void)setLastError:(NSError*)error;
 - (void)setLastResponse:(NSHTTPURLResponse*)httpResponse;
 - (void)setContentType:(NSString*)contentType;
+- (void)setETag:(NSString*)eTag;
+- (void)setLastModified:(NSString*)lastModified;
+// Takes validators from response headers. Response 304 Not Modified updates only validators it contains.
+- (void)setValidatorsFromResponse:(NSHTTPURLResponse*)httpResponse;
+// Sets last access date as is, without comparing to the current one. Used when resource is restored from index.
+- (void)setRestoredLastAccessDate:(NSDate*)date;
+// Records time of a read without the manager lock, the later of recorded times is kept.
+// Returns YES if there has been no recorded time, so the resource should be passed to the manager for applying.
+- (BOOL)recordReadAccessTime:(CFAbsoluteTime)time;
+// Returns the recorded time and clears it, 0 if there is none
+- (CFAbsoluteTime)takeReadAccessTime;
+// Returns YES if data has been loaded earlier than interval ago or its load time is not known. Data set by client
+// is never stale. Checked without the manager lock.
+- (BOOL)isStaleAfterInterval:(NSTimeInterval)interval;
+// Takes over persistent state of the restored resource.
+- (void)adoptStateOfRestoredResource:(MKResource*)resource;
 
 @end
@@ -20,6 +20,28 @@ typedef enum {
     MKStatusInProgress = 2
 } MKStatus;
 
+/**
+ * Options for reading resource data.
+ */
+typedef enum {
+      /** The data is read into memory.*/
+    MKResourceReadingDefault = 0,
+      /** The data is backed by memory mapping of the cached file, pages are read only when they are touched.*/
+    MKResourceReadingMapped = 1 << 0
+} MKResourceReadingOptions;
+
+/**
+ * Download priority of the resource.
+ */
+typedef enum {
+      /** The resource is downloaded after resources with higher priority.*/
+    MKResourcePriorityLow = -1,
+      /** Default priority.*/
+    MKResourcePriorityNormal = 0,
+      /** The resource is downloaded before resources with lower priority.*/
+    MKResourcePriorityHigh = 1
+} MKResourcePriority;
+
 @class MKResourceManager;
 
 @protocol MKResourceStatusWatcher;
@@ -31,6 +53,7 @@ typedef enum {
 @interface MKResource : NSObject<NSCoding> {
     NSMutableArray*             _watchers;
     NSMutableArray*             _completionHandlers;
+    NSMutableArray*             _fileCompletionHandlers;
     MKResourceManager*          _manager;
     MKStatus                   _status;
     NSURL*                      _resourceURL;
@@ -41,6 +64,13 @@ typedef enum {
     NSError*                    _lastError;
     NSTimeInterval              _expirationPeriod;
     NSDate*                     _lastAccessDate;
+    MKResourcePriority          _priority;
+    NSString*                   _eTag;
+    NSString*                   _lastModified;
+    NSMutableArray*             _progressWatchers;
+    float                       _notifiedProgress;
+    CFAbsoluteTime              _progressNotificationTime;
+    BOOL                        _progressNotificationScheduled;
 }
 
 @property (nonatomic, readonly) MKStatus status;
@@ -54,8 +84,14 @@ typedef enum {
 // Returns HTTP response from last download. The value is not persistent.
 // It lives during application session in which resource was downloaded.
 @property (nonatomic, readonly) NSHTTPURLResponse* lastResponse;
+// Validators of the downloaded data taken from ETag and Last-Modified response headers. The values are persistent.
+// When the resource is downloaded again they are sent in conditional request, so unchanged data is not transferred.
+@property (nonatomic, readonly) NSString* eTag;
+@property (nonatomic, readonly) NSString* lastModified;
 @property (nonatomic, assign)   NSTimeInterval expirationPeriod;
 @property (nonatomic, readonly) MKResourceManager* manager;
+// Download priority. Can be changed while the resource is waiting for download. The value is not persistent.
+@property (nonatomic, assign)   MKResourcePriority priority;
 
 /** Returns resource data.
  *  @return NSData object with content of resource. Returns nil if the resource has not been downloaded yet.
@@ -63,6 +99,25 @@ typedef enum {
 - (NSData*)data;
 - (NSData*)data:(NSError**)error;
 
+/** Returns resource data read according to options.
+ *  @param options Reading options
+ *  @param error On output, an error object if the data can not be accessed
+ *  @return NSData object with content of resource. Returns nil if the resource has not been downloaded yet.
+ */
+- (NSData*)dataWithOptions:(MKResourceReadingOptions)options error:(NSError**)error;
+
+/** Returns part of resource data. Only the requested bytes are read.
+ *  @param range Range of bytes. The range is clipped to the length of the data.
+ *  @param error On output, an error object if the data can not be accessed
+ *  @return NSData object with requested bytes. Returns nil if the resource has not been downloaded yet.
+ */
+- (NSData*)dataInRange:(NSRange)range error:(NSError**)error;
+
+/** Returns stream for reading resource data.
+ *  @return Unopened NSInputStream object. Returns nil if the resource has not been downloaded yet.
+ */
+- (NSInputStream*)inputStream;
+
 /** Sets resource data and if data is not nil marks the corresponding resource as downloaded.
  *	@param data NSData object with content of resource
  */
@@ -93,6 +148,14 @@ typedef enum {
  */
 - (void)addCompletionHandler:(void (^)(MKResource* resource, NSData* data, NSError* error))completion;
 
+/** Adds completion handler that receives location of the downloaded data instead of the data itself.
+ *  Nothing is read from disk for this handler, so it is preferable for large resources.
+ *  @param completion completion handler that will be invoked. The handler is stronged. Will be removed automatically when download is completed.
+ *      fileURL is nil if the download has been cancelled or failed.
+ *      The file keeps data as it is stored in the cache, so for compressed content types of the manager it holds compressed data.
+ */
+- (void)addFileCompletionHandler:(void (^)(MKResource* resource, NSURL* fileURL, NSError* error))completion;
+
 @end
 
 // ! MKResourceStatusWatcher is protocol that should be implemented by resource watcher.
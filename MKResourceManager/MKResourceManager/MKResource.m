@@ -10,9 +10,16 @@
 #import "MKResource+Private.h"
 #import "MKResourceManager.h"
 #import "MKResourceManager+Private.h"
+#import <stdatomic.h>
 
 
-@interface MKResource ()
+@interface MKResource () {
+      // time of the last read that has not been applied to lastAccessDate yet, 0 if there is none
+    _Atomic(CFAbsoluteTime)     _readAccessTime;
+      // time the data has been loaded at, 0 if it is not known and INFINITY if there is nothing to revalidate it against.
+      // Mirrors loadedDate and the validators for readers that do not take the manager lock.
+    _Atomic(CFAbsoluteTime)     _freshnessTime;
+}
 @end
 
 @implementation MKResource
@@ -27,18 +34,40 @@
 @synthesize expirationPeriod        = _expirationPeriod;
 @synthesize lastAccessDate          = _lastAccessDate;
 @synthesize manager                 = _manager;
+@synthesize storedLength            = _storedLength;
+@synthesize contentDigest           = _contentDigest;
+@synthesize storesCompressedData    = _storesCompressedData;
+@synthesize previousRecentlyUsed    = _previousRecentlyUsed;
+@synthesize nextRecentlyUsed        = _nextRecentlyUsed;
+@synthesize inRecentlyUsedList      = _inRecentlyUsedList;
+@synthesize needsValidation         = _needsValidation;
+@synthesize priority                = _priority;
+@synthesize scheduledPriorityLevel  = _scheduledPriorityLevel;
+@synthesize revalidating            = _revalidating;
+@synthesize dataGeneration          = _dataGeneration;
+@synthesize scheduledTime           = _scheduledTime;
+@synthesize downloadStartTime       = _downloadStartTime;
+@synthesize retryCount              = _retryCount;
+@synthesize retryPending            = _retryPending;
+@synthesize priorityBeforeBatch     = _priorityBeforeBatch;
+@synthesize hasBatchPriority        = _hasBatchPriority;
+@synthesize eTag                    = _eTag;
+@synthesize lastModified            = _lastModified;
 
 - (id)initWithResourceManager:(MKResourceManager*)manager andURL:(NSURL*)aURL {
     self = [super init];
     if (self != nil) {
         _watchers = [[NSMutableArray alloc] init];
+        _progressWatchers = [[NSMutableArray alloc] init];
         _completionHandlers = [[NSMutableArray alloc] init];
+        _fileCompletionHandlers = [[NSMutableArray alloc] init];
         _manager = manager;
         _resourceURL = [aURL copy];
         _expectedContentLength = 0;
         _progress = 0.0f;
         _expirationPeriod = -1.0;
         _lastAccessDate = [NSDate date];
+        [self updateFreshnessTime];
     }
     return self;
 }
@@ -55,6 +84,11 @@
         [coder encodeObject:_contentType forKey:@"contentType_"];
         [coder encodeDouble:_expirationPeriod forKey:@"expirationPeriod_"];
         [coder encodeObject:_lastAccessDate forKey:@"lastAccessDate_"];
+        [coder encodeObject:[NSNumber numberWithUnsignedLongLong:_storedLength] forKey:@"storedLength_"];
+        [coder encodeObject:_eTag forKey:@"eTag_"];
+        [coder encodeObject:_lastModified forKey:@"lastModified_"];
+        [coder encodeObject:_contentDigest forKey:@"contentDigest_"];
+        [coder encodeBool:_storesCompressedData forKey:@"storesCompressedData_"];
     }
 }
 
@@ -68,13 +102,22 @@
         _expectedContentLength = [[decoder decodeObjectForKey:@"expectedContentLength_"] longLongValue];
         _loadedDate = [decoder decodeObjectForKey:@"loadedDate_"];
         _watchers = [[NSMutableArray alloc] init];
+        _progressWatchers = [[NSMutableArray alloc] init];
+        _completionHandlers = [[NSMutableArray alloc] init];
+        _fileCompletionHandlers = [[NSMutableArray alloc] init];
         _progress = 0.0f;
         _expirationPeriod = [decoder decodeDoubleForKey:@"expirationPeriod_"];
         _lastAccessDate = [decoder decodeObjectForKey:@"lastAccessDate_"];
+        _storedLength = [[decoder decodeObjectForKey:@"storedLength_"] unsignedLongLongValue];
+        _eTag = [decoder decodeObjectForKey:@"eTag_"];
+        _lastModified = [decoder decodeObjectForKey:@"lastModified_"];
+        _contentDigest = [decoder decodeObjectForKey:@"contentDigest_"];
+        _storesCompressedData = [decoder decodeBoolForKey:@"storesCompressedData_"];
 
         if (_status == MKStatusDownloaded) {
             _progress = 1.0f;
         }
+        [self updateFreshnessTime];
     }
     return self;
 }
@@ -87,6 +130,7 @@
 
 - (void)setLoadedDate:(NSDate*)date {
     _loadedDate = date;
+    [self updateFreshnessTime];
 
       // make sure that our last access date is at least as recent as loaded date
     self.lastAccessDate = _loadedDate;
@@ -100,9 +144,47 @@
     _lastResponse = httpResponse;
 }
 
+- (void)setETag:(NSString*)eTag {
+    _eTag = [eTag copy];
+    [self updateFreshnessTime];
+}
+
+- (void)setLastModified:(NSString*)lastModified {
+    _lastModified = [lastModified copy];
+    [self updateFreshnessTime];
+}
+
+- (void)updateFreshnessTime {
+    CFAbsoluteTime freshnessTime = 0.0;
+    if (_loadedDate != nil) {
+        freshnessTime = [_loadedDate timeIntervalSinceReferenceDate];
+    } else if (_eTag == nil && _lastModified == nil) {
+        // data set by client has not been downloaded
+        freshnessTime = INFINITY;
+    }
+    atomic_store(&_freshnessTime, freshnessTime);
+}
+
+- (BOOL)isStaleAfterInterval:(NSTimeInterval)interval {
+    return CFAbsoluteTimeGetCurrent() - atomic_load(&_freshnessTime) >= interval;
+}
+
+- (void)setValidatorsFromResponse:(NSHTTPURLResponse*)httpResponse {
+    NSDictionary* headers = [httpResponse allHeaderFields];
+    NSString* eTag = [headers objectForKey:@"Etag"];
+    NSString* lastModified = [headers objectForKey:@"Last-Modified"];
+    if ([httpResponse statusCode] != 304 || eTag != nil) {
+        [self setETag:eTag];
+    }
+    if ([httpResponse statusCode] != 304 || lastModified != nil) {
+        [self setLastModified:lastModified];
+    }
+}
+
 - (void)setLastAccessDate:(NSDate*)lastAccessDate {
       // we shouldn't let to just change the last access date,
       // so the new value is always compared to the previous, and more recent is used
+    [_manager lock];
     NSDate* laterDate = nil;
     if (lastAccessDate != nil) {
         laterDate = [lastAccessDate laterDate:_lastAccessDate];
@@ -110,9 +192,55 @@
 
     if (_lastAccessDate != laterDate) {
         _lastAccessDate = laterDate;
+        [_manager resourceWasAccessed:self];
+    }
+    [_manager unlock];
+}
+
+- (BOOL)recordReadAccessTime:(CFAbsoluteTime)time {
+    CFAbsoluteTime previousTime = atomic_load(&_readAccessTime);
+    while (previousTime < time) {
+        if (atomic_compare_exchange_weak(&_readAccessTime, &previousTime, time)) {
+            return previousTime == 0.0;
+        }
+    }
+    return NO;
+}
+
+- (CFAbsoluteTime)takeReadAccessTime {
+    return atomic_exchange(&_readAccessTime, 0.0);
+}
+
+- (void)setRestoredLastAccessDate:(NSDate*)date {
+    _lastAccessDate = date;
+}
+
+- (void)adoptStateOfRestoredResource:(MKResource*)resource {
+    _expectedContentLength = resource.expectedContentLength;
+    _storedLength = resource.storedLength;
+    self.contentDigest = resource.contentDigest;
+    _storesCompressedData = resource.storesCompressedData;
+    _expirationPeriod = resource.expirationPeriod;
+    [self setContentType:resource.contentType];
+    [self setLoadedDate:resource.loadedDate];
+    [self setETag:resource.eTag];
+    [self setLastModified:resource.lastModified];
+    self.lastAccessDate = resource.lastAccessDate;
+    [self setStatus:resource.status];
+}
+
+- (void)setPriority:(MKResourcePriority)priority {
+    if (_priority != priority) {
+        _priority = priority;
+        [_manager resourcePriorityDidChange:self];
     }
 }
 
+- (void)setExpirationPeriod:(NSTimeInterval)expirationPeriod {
+    _expirationPeriod = expirationPeriod;
+    [_manager setNeedsSaveResource:self];
+}
+
 - (NSData*)data {
     return [self data:nil];
 }
@@ -121,6 +249,18 @@
 	return [_manager dataForResource:self error:error];
 }
 
+- (NSData*)dataWithOptions:(MKResourceReadingOptions)options error:(NSError**)error {
+    return [_manager dataForResource:self options:options error:error];
+}
+
+- (NSData*)dataInRange:(NSRange)range error:(NSError**)error {
+    return [_manager dataInRange:range forResource:self error:error];
+}
+
+- (NSInputStream*)inputStream {
+    return [_manager inputStreamForResource:self];
+}
+
 - (void)setData:(NSData*)data {
     [_manager setData:data forResource:self];
 }
@@ -132,42 +272,97 @@
 - (void)cancelDownload {
     [_manager cancelDownloadResource:self];
 
-    id<MKResourceStatusWatcher> watcher = nil;
-    NSArray* watchers = [_watchers copy];
-    for (NSValue* nonRetainedWacher in watchers) {
-        watcher = (id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue];
+    [self notifyWatchersUsingBlock:^(id<MKResourceStatusWatcher> watcher) {
         if ([watcher respondsToSelector:@selector(resourceDidCancelDownload:)]) {
             [watcher resourceDidCancelDownload:self];
         }
-    }
+    }];
 
-    for (void (^completionHandler)(MKResource* resource, NSData* data, NSError* error) in _completionHandlers) {
-        completionHandler(self, nil, nil);
-    }
-    [_completionHandlers removeAllObjects];
+    [self notifyCompletionHandlersWithData:nil fileURL:nil error:nil];
 }
 
 - (void)addWatcher:(id<MKResourceStatusWatcher>)watcher {
     NSValue* nonRetainedWatcher = [NSValue valueWithNonretainedObject:watcher];
+    [_manager lock];
     if (![_watchers containsObject:nonRetainedWatcher]) {
         [_watchers addObject:nonRetainedWatcher];
+        // watchers interested in progress are found once, so that progress updates do not check each of them
+        if ([watcher respondsToSelector:@selector(resource:loadProgressChanged:)]) {
+            [_progressWatchers addObject:nonRetainedWatcher];
+        }
     }
+    [_manager unlock];
 }
 
 - (void)removeWatcher:(id<MKResourceStatusWatcher>)watcher {
     NSValue* nonRetainedWatcher = [NSValue valueWithNonretainedObject:watcher];
+    [_manager lock];
     [_watchers removeObject:nonRetainedWatcher];
+    [_progressWatchers removeObject:nonRetainedWatcher];
+    [_manager unlock];
 }
 
 - (void)addCompletionHandler:(void (^)(MKResource* resource, NSData* data, NSError* error))completion {
     if (completion != NULL) {
         id blockCopy = [completion copy];
+        [_manager lock];
         [_completionHandlers addObject:blockCopy];
+        [_manager unlock];
+    }
+}
+
+- (void)addFileCompletionHandler:(void (^)(MKResource* resource, NSURL* fileURL, NSError* error))completion {
+    if (completion != NULL) {
+        id blockCopy = [completion copy];
+        [_manager lock];
+        [_fileCompletionHandlers addObject:blockCopy];
+        [_manager unlock];
+    }
+}
+
+- (void)notifyCompletionHandlersWithData:(NSData*)data fileURL:(NSURL*)fileURL error:(NSError*)error {
+    [_manager lock];
+    NSArray* completionHandlers = [_completionHandlers copy];
+    NSArray* fileCompletionHandlers = [_fileCompletionHandlers copy];
+    [_completionHandlers removeAllObjects];
+    [_fileCompletionHandlers removeAllObjects];
+    [_manager unlock];
+
+    if ([completionHandlers count] == 0 && [fileCompletionHandlers count] == 0) {
+        return;
+    }
+    [self performCallback:^{
+        for (void (^completionHandler)(MKResource* resource, NSData* data, NSError* error) in completionHandlers) {
+            completionHandler(self, data, error);
+        }
+        for (void (^completionHandler)(MKResource* resource, NSURL* fileURL, NSError* error) in fileCompletionHandlers) {
+            completionHandler(self, fileURL, error);
+        }
+    }];
+}
+
+- (void)performCallback:(void (^)(void))block {
+    if (_manager != nil) {
+        [_manager performCallback:block];
+    } else {
+        block();
     }
 }
 
+// Watchers are taken when the notification is delivered, so the watcher removed on the callback queue meanwhile is not notified
+- (void)notifyWatchersUsingBlock:(void (^)(id<MKResourceStatusWatcher> watcher))block {
+    [self performCallback:^{
+        for (NSValue* nonRetainedWacher in [self watchers]) {
+            block((id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue]);
+        }
+    }];
+}
+
 - (NSArray*)watchers {
-    return [NSArray arrayWithArray:_watchers];
+    [_manager lock];
+    NSArray* watchers = [NSArray arrayWithArray:_watchers];
+    [_manager unlock];
+    return watchers;
 }
 
 - (void)setStatus:(MKStatus)newStatus {
@@ -182,17 +377,18 @@
         _expectedContentLength = 0;
         self.loadedDate = nil;
     }
+    if (_status != MKStatusDownloaded) {
+        _notifiedProgress = 0.0f;
+        _progressNotificationTime = 0.0;
+    }
 
     if (_status == MKStatusDownloaded) {
 		_progress = 1.0f;
 	}
 	
-    id<MKResourceStatusWatcher> watcher = nil;
-    NSArray* watchers = [_watchers copy];
-    for (NSValue* nonRetainedWacher in watchers) {
-        watcher = (id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue];
+    [self notifyWatchersUsingBlock:^(id<MKResourceStatusWatcher> watcher) {
         [watcher resourceStatusDidChange:self];
-    }
+    }];
 }
 
 - (void)setExpectedContentLength:(long long)expectedContentLength {
@@ -205,6 +401,9 @@
     }
 }
 
+// Called for each received chunk. Updates are coalesced: watchers are notified not more often than
+// progressNotificationInterval of the manager and when progress has changed by progressNotificationMinimumDelta.
+// Completion is always notified. Notification that has not been delivered yet takes the latest progress.
 - (void)setDownloadedLength:(NSUInteger)downloadedLength {
     float progress = 0;
 
@@ -212,61 +411,77 @@
         progress = downloadedLength / (double)_expectedContentLength;
     }
 
+    // the flag is cleared by the notification under the manager lock, so it is set under the lock as well
+    [_manager lock];
     _progress = progress;
 
-    NSNumber* progressObj = [NSNumber numberWithFloat:progress];
-
-    id<MKResourceStatusWatcher> watcher = nil;
-    NSArray* watchers = [_watchers copy];
-    for (NSValue* nonRetainedWacher in watchers) {
-        watcher = (id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue];
-        if ([watcher respondsToSelector:@selector(resource:loadProgressChanged:)]) {
-            [watcher resource:self loadProgressChanged:progressObj];
-        }
+    if ([_progressWatchers count] == 0 || _progressNotificationScheduled) {
+        [_manager unlock];
+        return;
+    }
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    if (progress < 1.0f && _manager != nil &&
+        (now - _progressNotificationTime < _manager.progressNotificationInterval ||
+         fabsf(progress - _notifiedProgress) < _manager.progressNotificationMinimumDelta)) {
+        [_manager unlock];
+        return;
     }
+    _notifiedProgress = progress;
+    _progressNotificationTime = now;
+    _progressNotificationScheduled = YES;
+    [_manager unlock];
+
+    [self performCallback:^{
+        [_manager lock];
+        _progressNotificationScheduled = NO;
+        NSNumber* progressObj = [NSNumber numberWithFloat:_progress];
+        NSArray* progressWatchers = [NSArray arrayWithArray:_progressWatchers];
+        [_manager unlock];
+
+        for (NSValue* nonRetainedWacher in progressWatchers) {
+            [(id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue] resource:self loadProgressChanged:progressObj];
+        }
+    }];
 }
 
 - (void)notifyDidCancelDownload {
     
-	id<MKResourceStatusWatcher> watcher = nil;
-    NSArray* watchers = [_watchers copy];
-	for (NSValue *nonRetainedWacher in watchers) {
-		watcher = (id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue];
+    [self notifyWatchersUsingBlock:^(id<MKResourceStatusWatcher> watcher) {
 		if ([watcher respondsToSelector:@selector(resourceDidCancelDownload:)]) {
 			[watcher resourceDidCancelDownload:self];
 		}
-	}
+    }];
     
-    for (void (^completionHandler)(MKResource* resource, NSData* data, NSError* error) in _completionHandlers) {
-        completionHandler(self, nil, nil);
-    }
-    [_completionHandlers removeAllObjects];
-
+    [self notifyCompletionHandlersWithData:nil fileURL:nil error:nil];
 }
 
 - (void)notifyDidFinishDownload:(NSError*)error {
 
-    id<MKResourceStatusWatcher> watcher = nil;
-    NSArray* watchers = [_watchers copy];
-    for (NSValue* nonRetainedWacher in watchers) {
-        watcher = (id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue];
+    [self notifyWatchersUsingBlock:^(id<MKResourceStatusWatcher> watcher) {
         if ([watcher respondsToSelector:@selector(resource:loadCompletedWithError:)]) {
             [watcher resource:self loadCompletedWithError:error];
         }
-    }
+    }];
 
-    for (void (^completionHandler)(MKResource* resource, NSData* data, NSError* error) in _completionHandlers) {
-        completionHandler(self, [self data], [self lastError]);
+    // the data is mapped once for all the handlers, pages are read only when handlers touch them
+    NSData* data = nil;
+    NSURL* fileURL = nil;
+    if (_status == MKStatusDownloaded) {
+        if ([_completionHandlers count] > 0) {
+            data = [_manager dataForResource:self options:MKResourceReadingMapped error:nil];
+        }
+        if ([_fileCompletionHandlers count] > 0) {
+            fileURL = [_manager pathForResource:self];
+        }
     }
-    [_completionHandlers removeAllObjects];
+    [self notifyCompletionHandlersWithData:data fileURL:fileURL error:[self lastError]];
 }
 
 - (void)notifyWillStartDownload:(NSMutableURLRequest*)request {
     
-    id<MKResourceStatusWatcher> watcher = nil;
-    NSArray* watchers = [_watchers copy];
-    for (NSValue* nonRetainedWacher in watchers) {
-        watcher = (id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue];
+    // the request is modified by watchers before it is sent, so they are notified right away
+    for (NSValue* nonRetainedWacher in [self watchers]) {
+        id<MKResourceStatusWatcher> watcher = (id<MKResourceStatusWatcher>)[nonRetainedWacher pointerValue];
         if ([watcher respondsToSelector:@selector(resource:willSendRequest:)]) {
             [watcher resource:self willSendRequest:request];
         }
@@ -281,4 +496,8 @@
 	[_manager didFinishDownloadResource:self data:data error:error httpResponse:(NSHTTPURLResponse *)httpResponse];
 }
 
+- (void)didFinishDownloadMRWithBuffer:(MKResourceBuffer*)buffer error:(NSError*)error httpResponse:(NSHTTPURLResponse *)httpResponse {
+    [_manager didFinishDownloadResource:self buffer:buffer error:error httpResponse:httpResponse];
+}
+
 @end
@@ -0,0 +1,35 @@
+//
+//  MKResourceBase64.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+// Length of encoded line when encoding on separate lines, as in MIME
+#define MKBase64LineLength 64
+
+// Returns number of chars the encoding of length bytes takes. Lines of lineLength chars, a multiple of 4,
+// are separated by '\n'; 0 means no line breaks.
+size_t MKBase64EncodedLength(size_t length, size_t lineLength);
+// Encodes bytes into output, which should hold MKBase64EncodedLength chars. Returns number of chars written.
+// Does not allocate memory and does not write terminating zero.
+size_t MKBase64Encode(const void* bytes, size_t length, char* output, size_t lineLength);
+
+// Returns maximum number of bytes decoding of length chars produces, including the bytes of the group left by previous chars
+size_t MKBase64MaxDecodedLength(size_t length);
+
+// State of decoding of chars that come in pieces: valid chars that have not made a group of 4 yet.
+typedef struct {
+    uint8_t             values[4];
+    size_t              count;
+} MKBase64DecodingState;
+
+void MKBase64DecodingStateInit(MKBase64DecodingState* state);
+// Decodes chars into output, which should hold MKBase64MaxDecodedLength(length) bytes. Returns number of bytes written.
+// Chars other than the alphabet, e.g. line breaks and padding, are skipped.
+size_t MKBase64Decode(MKBase64DecodingState* state, const char* chars, size_t length, void* output);
+// Writes bytes of the incomplete group at the end of chars, up to 2 bytes. Returns number of bytes written.
+size_t MKBase64DecodeFinish(MKBase64DecodingState* state, void* output);
@@ -0,0 +1,245 @@
+//
+//  MKResourceBase64.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceBase64.h"
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#import <arm_neon.h>
+#define MK_BASE64_NEON 1
+#endif
+
+// Value of chars that are not in the alphabet
+#define MKBase64InvalidValue 65
+// Set in the values of decoding tables for chars that are not in the alphabet, above 24 bits of decoded group
+#define MKBase64InvalidGroup 0x01000000
+
+static const char MKBase64EncodingTable[64] = {
+    'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P','Q','R','S','T',
+    'U','V','W','X','Y','Z','a','b','c','d','e','f','g','h','i','j','k','l','m','n',
+    'o','p','q','r','s','t','u','v','w','x','y','z','0','1','2','3','4','5','6','7',
+    '8','9','+','/'
+};
+
+static const uint8_t MKBase64DecodingTable[256] = {
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 62, 65, 65, 65, 63, 52, 53, 54, 55, 56, 57,
+    58, 59, 60, 61, 65, 65, 65, 65, 65, 65, 65,  0,  1,  2,  3,  4,  5,  6,
+    7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
+    25, 65, 65, 65, 65, 65, 65, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36,
+    37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
+    65, 65, 65, 65,
+};
+
+// Values of each of 4 chars of a group already shifted to their place in 24 bits, so a group is decoded with 4 lookups
+static uint32_t MKBase64GroupDecodingTables[4][256];
+
+static void MKBase64PrepareGroupDecodingTables(void) {
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        for (NSUInteger c = 0; c < 256; c++) {
+            uint32_t value = MKBase64DecodingTable[c];
+            for (NSUInteger position = 0; position < 4; position++) {
+                MKBase64GroupDecodingTables[position][c] = value == MKBase64InvalidValue ? MKBase64InvalidGroup : value << (18 - 6 * position);
+            }
+        }
+    });
+}
+
+#if MK_BASE64_NEON
+// Maps 6-bit values to the alphabet by adding offset of the range each value falls in
+static inline uint8x16_t MKBase64NEONEncodeValues(uint8x16_t values) {
+    uint8x16_t offsets = vdupq_n_u8('A');
+    offsets = vbslq_u8(vcgeq_u8(values, vdupq_n_u8(26)), vdupq_n_u8('a' - 26), offsets);
+    offsets = vbslq_u8(vcgeq_u8(values, vdupq_n_u8(52)), vdupq_n_u8((uint8_t)('0' - 52)), offsets);
+    offsets = vbslq_u8(vceqq_u8(values, vdupq_n_u8(62)), vdupq_n_u8((uint8_t)('+' - 62)), offsets);
+    offsets = vbslq_u8(vceqq_u8(values, vdupq_n_u8(63)), vdupq_n_u8((uint8_t)('/' - 63)), offsets);
+    return vaddq_u8(values, offsets);
+}
+
+// Maps chars of the alphabet to 6-bit values by adding offset of the range each char falls in.
+// Lanes of chars that are not in the alphabet are set in invalid.
+static inline uint8x16_t MKBase64NEONDecodeChars(uint8x16_t chars, uint8x16_t* invalid) {
+    uint8x16_t upper = vcleq_u8(vsubq_u8(chars, vdupq_n_u8('A')), vdupq_n_u8(25));
+    uint8x16_t lower = vcleq_u8(vsubq_u8(chars, vdupq_n_u8('a')), vdupq_n_u8(25));
+    uint8x16_t digit = vcleq_u8(vsubq_u8(chars, vdupq_n_u8('0')), vdupq_n_u8(9));
+    uint8x16_t plus = vceqq_u8(chars, vdupq_n_u8('+'));
+    uint8x16_t slash = vceqq_u8(chars, vdupq_n_u8('/'));
+    uint8x16_t offsets = vandq_u8(upper, vdupq_n_u8((uint8_t)(0 - 'A')));
+    offsets = vorrq_u8(offsets, vandq_u8(lower, vdupq_n_u8((uint8_t)(26 - 'a'))));
+    offsets = vorrq_u8(offsets, vandq_u8(digit, vdupq_n_u8((uint8_t)(52 - '0'))));
+    offsets = vorrq_u8(offsets, vandq_u8(plus, vdupq_n_u8((uint8_t)(62 - '+'))));
+    offsets = vorrq_u8(offsets, vandq_u8(slash, vdupq_n_u8((uint8_t)(63 - '/'))));
+    uint8x16_t valid = vorrq_u8(vorrq_u8(vorrq_u8(upper, lower), vorrq_u8(digit, plus)), slash);
+    *invalid = vorrq_u8(*invalid, vmvnq_u8(valid));
+    return vaddq_u8(chars, offsets);
+}
+#endif
+
+// Encodes bytes without line breaks, pads the last group with '='
+static size_t MKBase64EncodeBlock(const uint8_t* bytes, size_t length, char* output) {
+    char* out = output;
+#if MK_BASE64_NEON
+    // 48 bytes are deinterleaved into 3 vectors of 16 and 64 chars are interleaved back from 4 vectors
+    uint8x16_t mask = vdupq_n_u8(0x3F);
+    while (length >= 48) {
+        uint8x16x3_t input = vld3q_u8(bytes);
+        uint8x16x4_t values;
+        values.val[0] = vshrq_n_u8(input.val[0], 2);
+        values.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(input.val[0], 4), vshrq_n_u8(input.val[1], 4)), mask);
+        values.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(input.val[1], 2), vshrq_n_u8(input.val[2], 6)), mask);
+        values.val[3] = vandq_u8(input.val[2], mask);
+        values.val[0] = MKBase64NEONEncodeValues(values.val[0]);
+        values.val[1] = MKBase64NEONEncodeValues(values.val[1]);
+        values.val[2] = MKBase64NEONEncodeValues(values.val[2]);
+        values.val[3] = MKBase64NEONEncodeValues(values.val[3]);
+        vst4q_u8((uint8_t*)out, values);
+        bytes += 48;
+        length -= 48;
+        out += 64;
+    }
+#endif
+    while (length >= 3) {
+        uint32_t group = ((uint32_t)bytes[0] << 16) | ((uint32_t)bytes[1] << 8) | bytes[2];
+        out[0] = MKBase64EncodingTable[group >> 18];
+        out[1] = MKBase64EncodingTable[(group >> 12) & 0x3F];
+        out[2] = MKBase64EncodingTable[(group >> 6) & 0x3F];
+        out[3] = MKBase64EncodingTable[group & 0x3F];
+        bytes += 3;
+        length -= 3;
+        out += 4;
+    }
+    if (length > 0) {
+        uint32_t group = ((uint32_t)bytes[0] << 16) | (length > 1 ? (uint32_t)bytes[1] << 8 : 0);
+        out[0] = MKBase64EncodingTable[group >> 18];
+        out[1] = MKBase64EncodingTable[(group >> 12) & 0x3F];
+        out[2] = length > 1 ? MKBase64EncodingTable[(group >> 6) & 0x3F] : '=';
+        out[3] = '=';
+        out += 4;
+    }
+    return out - output;
+}
+
+size_t MKBase64EncodedLength(size_t length, size_t lineLength) {
+    size_t encodedLength = (length + 2) / 3 * 4;
+    if (lineLength >= 4 && encodedLength > 0) {
+        encodedLength += (encodedLength - 1) / (lineLength / 4 * 4);
+    }
+    return encodedLength;
+}
+
+size_t MKBase64Encode(const void* bytes, size_t length, char* output, size_t lineLength) {
+    if (lineLength < 4) {
+        return MKBase64EncodeBlock(bytes, length, output);
+    }
+    const uint8_t* input = bytes;
+    size_t lineInputLength = lineLength / 4 * 3;
+    char* out = output;
+    while (length > 0) {
+        size_t blockLength = MIN(length, lineInputLength);
+        out += MKBase64EncodeBlock(input, blockLength, out);
+        input += blockLength;
+        length -= blockLength;
+        if (length > 0) {
+            *out++ = '\n';
+        }
+    }
+    return out - output;
+}
+
+size_t MKBase64MaxDecodedLength(size_t length) {
+    return (length + 3) / 4 * 3;
+}
+
+void MKBase64DecodingStateInit(MKBase64DecodingState* state) {
+    memset(state, 0, sizeof(*state));
+}
+
+size_t MKBase64Decode(MKBase64DecodingState* state, const char* chars, size_t length, void* output) {
+    MKBase64PrepareGroupDecodingTables();
+    const uint8_t* input = (const uint8_t*)chars;
+    uint8_t* out = output;
+    size_t i = 0;
+    while (i < length) {
+        if (state->count == 0) {
+#if MK_BASE64_NEON
+            // 64 chars are deinterleaved into 4 vectors of 16 and 48 bytes are interleaved back from 3 vectors.
+            // A block with a char out of the alphabet, e.g. a line break, is left to the loops below,
+            // lines of MIME encoding are 64 chars so the following lines are decoded here again.
+            while (i + 64 <= length) {
+                uint8x16x4_t lanes = vld4q_u8(input + i);
+                uint8x16_t invalid = vdupq_n_u8(0);
+                uint8x16_t values0 = MKBase64NEONDecodeChars(lanes.val[0], &invalid);
+                uint8x16_t values1 = MKBase64NEONDecodeChars(lanes.val[1], &invalid);
+                uint8x16_t values2 = MKBase64NEONDecodeChars(lanes.val[2], &invalid);
+                uint8x16_t values3 = MKBase64NEONDecodeChars(lanes.val[3], &invalid);
+                uint64x2_t invalidLanes = vreinterpretq_u64_u8(invalid);
+                if ((vgetq_lane_u64(invalidLanes, 0) | vgetq_lane_u64(invalidLanes, 1)) != 0) {
+                    break;
+                }
+                uint8x16x3_t bytes;
+                bytes.val[0] = vorrq_u8(vshlq_n_u8(values0, 2), vshrq_n_u8(values1, 4));
+                bytes.val[1] = vorrq_u8(vshlq_n_u8(values1, 4), vshrq_n_u8(values2, 2));
+                bytes.val[2] = vorrq_u8(vshlq_n_u8(values2, 6), values3);
+                vst3q_u8(out, bytes);
+                out += 48;
+                i += 64;
+            }
+#endif
+            // groups of valid chars are decoded at once, others char by char
+            while (i + 4 <= length) {
+                uint32_t group = MKBase64GroupDecodingTables[0][input[i]] | MKBase64GroupDecodingTables[1][input[i + 1]] |
+                                 MKBase64GroupDecodingTables[2][input[i + 2]] | MKBase64GroupDecodingTables[3][input[i + 3]];
+                if (group >= MKBase64InvalidGroup) {
+                    break;
+                }
+                out[0] = (uint8_t)(group >> 16);
+                out[1] = (uint8_t)(group >> 8);
+                out[2] = (uint8_t)group;
+                out += 3;
+                i += 4;
+            }
+            if (i >= length) {
+                break;
+            }
+        }
+        uint8_t value = MKBase64DecodingTable[input[i++]];
+        if (value != MKBase64InvalidValue) {
+            state->values[state->count++] = value;
+            if (state->count == 4) {
+                out[0] = (uint8_t)((state->values[0] << 2) | (state->values[1] >> 4));
+                out[1] = (uint8_t)((state->values[1] << 4) | (state->values[2] >> 2));
+                out[2] = (uint8_t)((state->values[2] << 6) | state->values[3]);
+                out += 3;
+                state->count = 0;
+            }
+        }
+    }
+    return out - (uint8_t*)output;
+}
+
+size_t MKBase64DecodeFinish(MKBase64DecodingState* state, void* output) {
+    uint8_t* out = output;
+    size_t length = 0;
+    // a single char does not make a byte
+    if (state->count >= 2) {
+        out[length++] = (uint8_t)((state->values[0] << 2) | (state->values[1] >> 4));
+    }
+    if (state->count == 3) {
+        out[length++] = (uint8_t)((state->values[1] << 4) | (state->values[2] >> 2));
+    }
+    state->count = 0;
+    return length;
+}
@@ -7,20 +7,79 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <CommonCrypto/CommonDigest.h>
+
+@class MKResourceBufferPool;
+@class MKEncryptionKey;
+@class MKEncryptedFileWriter;
+
+// Default maximum length of data kept in memory before it is spilled to file
+extern NSUInteger const MKResourceBufferDefaultMaxMemoryLength;
 
 @interface MKResourceBuffer : NSObject {
 @private
     BOOL                _errorOccured;
     NSUInteger          _length;
     NSOutputStream*     _outputStream;
+    MKEncryptedFileWriter* _fileWriter;
+    BOOL                _encryptsDataFile;
+    NSData*             _data;
+    BOOL                _keepsDataFile;
+    BOOL                _computesDigest;
+    CC_SHA256_CTX       _digestContext;
+    unsigned long long  _digestedLength;
+    void**              _chunks;
+    NSUInteger          _chunksCount;
+    NSUInteger          _chunksCapacity;
 }
 
 @property (nonatomic, strong) NSString* dataFileName;
+// Directory where the data is spilled when it does not fit in memory.
+// Should be on the same volume as the cache, so that the file can be moved to the cache by rename.
+@property (nonatomic, strong) NSString* temporaryDirectory;
+// When YES, SHA-256 digest of the data is updated as the data is appended. Should be set before data is appended.
+@property (nonatomic, assign) BOOL computesDigest;
+// Pool in-memory data is kept in. Chunks are allocated by the buffer itself if the pool is nil.
+// Should be set before data is appended.
+@property (nonatomic, strong) MKResourceBufferPool* pool;
+// Maximum length of data kept in memory, longer data is spilled to file in temporaryDirectory.
+// Default value is MKResourceBufferDefaultMaxMemoryLength.
+@property (nonatomic, assign) NSUInteger maxMemoryLength;
+// When set, data spilled to file is encrypted with the key, so no plain data is written to disk. The file stays
+// encrypted when it is moved. Should be set before data is appended. Partial file buffers are not encrypted.
+@property (nonatomic, strong) MKEncryptionKey* encryptionKey;
 
 + (id)buffer;
++ (id)bufferWithData:(NSData*)data;
+// Creates file backed buffer that appends data to the file at path. The file is not removed when the buffer
+// is deallocated, so partially downloaded data can be resumed later.
++ (id)bufferWithPartialFileAtPath:(NSString*)path;
+// Creates file backed buffer that owns the complete file at path, e.g. data written by ranges.
+// The file is removed when the buffer is deallocated unless it has been moved.
++ (id)bufferWithFileAtPath:(NSString*)path;
+// Chooses where the data is kept before it is appended: data expected to be longer than maxMemoryLength
+// is written to file from the start, memory for shorter data is taken at once. Ignored if data has been appended.
+- (void)prepareForExpectedLength:(long long)expectedLength;
 - (void)appendData:(NSData*)data;
 - (NSUInteger)length;
+- (BOOL)isFileBacked;
+// YES if the data has been spilled to file encrypted with encryptionKey
+- (BOOL)isEncryptedFileBacked;
 - (NSInputStream*)inputStream;
 - (NSData*)data;
+// Returns SHA-256 digest of buffered data in hex. Data that has not been digested while it was appended is read,
+// only once if computesDigest is set.
+// Returns nil if the data can not be read.
+- (NSString*)digest;
+// Discards buffered data. The file of partial file buffer is truncated.
+- (void)removeAllData;
+
+/** Moves buffered data to the file at path. File backed buffer is renamed without reading its content,
+ *  in-memory buffer is written once. The buffer has no data after successful move.
+ *  @param path Destination path. Existing file is replaced.
+ *  @param error On output, an error object if the data can not be moved
+ *  @return YES if the data has been moved
+ */
+- (BOOL)moveToPath:(NSString*)path error:(NSError**)error;
 
-@end
\ No newline at end of file
+@end
@@ -8,74 +8,324 @@
 
 #import "MKResourceBuffer.h"
 #import "MKResourceUtility.h"
+#import "MKResourceBufferPool.h"
+#import "AESUtil.h"
+#import <stdio.h>
+#import <unistd.h>
+#import <sys/stat.h>
+
+NSUInteger const MKResourceBufferDefaultMaxMemoryLength = 300 * 1024;
 
 @implementation MKResourceBuffer
 @synthesize dataFileName = _dataFileName;
+@synthesize temporaryDirectory = _temporaryDirectory;
+@synthesize computesDigest = _computesDigest;
+@synthesize pool = _pool;
+@synthesize maxMemoryLength = _maxMemoryLength;
+@synthesize encryptionKey = _encryptionKey;
 
 + (id)buffer {
     return [[self alloc] init];
 }
 
++ (id)bufferWithData:(NSData*)data {
+    MKResourceBuffer* buffer = [[self alloc] init];
+    // mutable data of the caller may change after it is kept in the memory cache
+    buffer->_data = [data copy];
+    buffer->_length = [data length];
+    return buffer;
+}
+
++ (id)bufferWithPartialFileAtPath:(NSString*)path {
+    MKResourceBuffer* buffer = [[self alloc] init];
+    buffer.dataFileName = path;
+    buffer->_keepsDataFile = YES;
+    struct stat fileStat;
+    if (stat([path fileSystemRepresentation], &fileStat) == 0) {
+        buffer->_length = (NSUInteger)fileStat.st_size;
+    }
+    return buffer;
+}
+
++ (id)bufferWithFileAtPath:(NSString*)path {
+    MKResourceBuffer* buffer = [[self alloc] init];
+    buffer.dataFileName = path;
+    struct stat fileStat;
+    if (stat([path fileSystemRepresentation], &fileStat) == 0) {
+        buffer->_length = (NSUInteger)fileStat.st_size;
+    }
+    return buffer;
+}
+
 - (id)init {
     self = [super init];
     if (self) {
+        _maxMemoryLength = MKResourceBufferDefaultMaxMemoryLength;
     }
     return self;
 }
 
 - (void)dealloc {
+    [self releaseChunks];
     [_outputStream close];
+    if (self.dataFileName != nil && !_keepsDataFile) {
+        unlink([self.dataFileName fileSystemRepresentation]);
+    }
+}
+
+#pragma mark - Chunks
+
+// In-memory data is kept in chunks of MKResourceBufferPoolChunkLength bytes, the last one may be partially filled
+- (BOOL)addChunk {
+    if (_chunksCount == _chunksCapacity) {
+        NSUInteger chunksCapacity = MAX(_chunksCapacity * 2, 4U);
+        void** chunks = realloc(_chunks, chunksCapacity * sizeof(void*));
+        if (chunks == NULL) {
+            return NO;
+        }
+        _chunks = chunks;
+        _chunksCapacity = chunksCapacity;
+    }
+    void* chunk = _pool != nil ? [_pool takeChunk] : malloc(MKResourceBufferPoolChunkLength);
+    if (chunk == NULL) {
+        return NO;
+    }
+    _chunks[_chunksCount++] = chunk;
+    return YES;
+}
+
+- (void)releaseChunks {
+    for (NSUInteger i = 0; i < _chunksCount; i++) {
+        if (_pool != nil) {
+            [_pool returnChunk:_chunks[i]];
+        } else {
+            free(_chunks[i]);
+        }
+    }
+    free(_chunks);
+    _chunks = NULL;
+    _chunksCount = 0;
+    _chunksCapacity = 0;
+}
+
+- (BOOL)appendBytesToChunks:(const uint8_t*)bytes length:(NSUInteger)length {
+    NSUInteger offset = _length;
+    while (length > 0) {
+        NSUInteger chunkIndex = offset / MKResourceBufferPoolChunkLength;
+        if (chunkIndex == _chunksCount && ![self addChunk]) {
+            return NO;
+        }
+        NSUInteger chunkOffset = offset % MKResourceBufferPoolChunkLength;
+        NSUInteger copiedLength = MIN(length, MKResourceBufferPoolChunkLength - chunkOffset);
+        memcpy((uint8_t*)_chunks[chunkIndex] + chunkOffset, bytes, copiedLength);
+        bytes += copiedLength;
+        offset += copiedLength;
+        length -= copiedLength;
+    }
+    return YES;
+}
+
+- (BOOL)writeChunksToStream:(NSOutputStream*)outputStream {
+    NSUInteger remainingLength = _length;
+    for (NSUInteger i = 0; i < _chunksCount && remainingLength > 0; i++) {
+        const uint8_t* bytes = _chunks[i];
+        NSUInteger length = MIN(remainingLength, MKResourceBufferPoolChunkLength);
+        remainingLength -= length;
+        while (length > 0) {
+            NSInteger writtenLength = [outputStream write:bytes maxLength:length];
+            if (writtenLength <= 0) {
+                return NO;
+            }
+            bytes += writtenLength;
+            length -= writtenLength;
+        }
+    }
+    return YES;
+}
+
+- (BOOL)writeChunksToFileWriter:(MKEncryptedFileWriter*)fileWriter {
+    NSUInteger remainingLength = _length;
+    for (NSUInteger i = 0; i < _chunksCount && remainingLength > 0; i++) {
+        NSUInteger length = MIN(remainingLength, MKResourceBufferPoolChunkLength);
+        remainingLength -= length;
+        if (![fileWriter appendBytes:_chunks[i] length:length]) {
+            return NO;
+        }
+    }
+    return YES;
 }
 
+#pragma mark -
+
 - (void)handleOutputStreamError {
     NSError* error = _outputStream.streamError;
     NSLog(@"Buffer error occured error: %@",error);//Error
     _outputStream = nil;
     _errorOccured = YES;
+    [self releaseChunks];
 }
 
-static NSUInteger maxLengthAllowedInMemory = 300 * 1024; // 300 * 1024 = 300 kb
+- (void)handleFileWriterError {
+    NSLog(@"Buffer error occured: fail to write encrypted file %@", self.dataFileName);//Error
+    _fileWriter = nil;
+    _errorOccured = YES;
+    [self releaseChunks];
+}
 
-- (NSOutputStream*)outputStreamForExpectedContentLength:(NSUInteger)expectedLength {
-    if (_errorOccured) {
-        return nil;
-    }
-    
-    NSUInteger currLength = _length + expectedLength;
-    
-    if (currLength > maxLengthAllowedInMemory && self.dataFileName == nil) {
-        NSData* inMemoryData = [_outputStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
-        [_outputStream close];
-        self.dataFileName = [MKTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"networkTemp%f",[NSDate timeIntervalSinceReferenceDate]]];
-        _outputStream = [NSOutputStream outputStreamToFileAtPath:self.dataFileName append:NO];
-        if (_outputStream.streamStatus == NSStreamStatusNotOpen) {
-            [_outputStream open];
+// Encrypted file can be read only after its final chunk is written, nothing is appended after that.
+// Returns NO if the file can not be finished.
+- (BOOL)finishFileWriter {
+    if (_fileWriter != nil) {
+        if (![_fileWriter finish]) {
+            [self handleFileWriterError];
         }
-        if ([inMemoryData length] > 0) {
-            NSInteger writedButesLength = [_outputStream write:[inMemoryData bytes] maxLength:[inMemoryData length]];
-            if (writedButesLength == -1) {
-                [self handleOutputStreamError];
-            }
+        _fileWriter = nil;
+    }
+    return !_errorOccured;
+}
+
+// Moves data kept in memory to a new file in temporaryDirectory
+- (void)spillToFile {
+    NSString* temporaryDirectory = self.temporaryDirectory ?: MKTemporaryDirectory();
+    self.dataFileName = [temporaryDirectory stringByAppendingPathComponent:[NSString stringWithFormat:@"networkTemp%@",[[NSProcessInfo processInfo] globallyUniqueString]]];
+    if (_encryptionKey != nil) {
+        _encryptsDataFile = YES;
+        _fileWriter = [[MKEncryptedFileWriter alloc] initWithKey:_encryptionKey path:self.dataFileName];
+        if (_fileWriter == nil || ![self writeChunksToFileWriter:_fileWriter]) {
+            [self handleFileWriterError];
         }
-    } else if (_outputStream == nil) {
-        _outputStream = [[NSOutputStream alloc] initToMemory];
+        [self releaseChunks];
+        return;
+    }
+    _outputStream = [NSOutputStream outputStreamToFileAtPath:self.dataFileName append:NO];
+    if (_outputStream.streamStatus == NSStreamStatusNotOpen) {
+        [_outputStream open];
+    }
+    if (![self writeChunksToStream:_outputStream]) {
+        [self handleOutputStreamError];
+    }
+    [self releaseChunks];
+}
+
+- (NSOutputStream*)fileOutputStream {
+    if (_outputStream == nil && !_errorOccured) {
+        _outputStream = [NSOutputStream outputStreamToFileAtPath:self.dataFileName append:YES];
         if (_outputStream.streamStatus == NSStreamStatusNotOpen) {
             [_outputStream open];
         }
     }
-    
     return _outputStream;
 }
 
+- (void)prepareForExpectedLength:(long long)expectedLength {
+    if (_errorOccured || expectedLength <= 0 || _length > 0 || _data != nil || self.dataFileName != nil) {
+        return;
+    }
+    if ((unsigned long long)expectedLength > _maxMemoryLength) {
+        [self spillToFile];
+        return;
+    }
+    NSUInteger chunksCount = (NSUInteger)((expectedLength + MKResourceBufferPoolChunkLength - 1) / MKResourceBufferPoolChunkLength);
+    while (_chunksCount < chunksCount && [self addChunk]) {
+    }
+}
+
+- (NSUInteger)appendBytes:(const void*)bytes length:(NSUInteger)length {
+    if (_errorOccured || length == 0) {
+        return 0;
+    }
+    if (self.dataFileName == nil && _length + length > _maxMemoryLength) {
+        [self spillToFile];
+        if (_errorOccured) {
+            return 0;
+        }
+    }
+    if (_encryptsDataFile) {
+        if (_fileWriter == nil || ![_fileWriter appendBytes:bytes length:length]) {
+            [self handleFileWriterError];
+            return 0;
+        }
+        return length;
+    }
+    if (self.dataFileName != nil) {
+        NSInteger writtenLength = [[self fileOutputStream] write:bytes maxLength:length];
+        if (writtenLength == -1) {
+            [self handleOutputStreamError];
+            return 0;
+        }
+        return writtenLength;
+    }
+    if (![self appendBytesToChunks:bytes length:length]) {
+        NSLog(@"Buffer error occured: out of memory");//Error
+        _errorOccured = YES;
+        [self releaseChunks];
+        return 0;
+    }
+    return length;
+}
+
 - (void)appendData:(NSData*)data {
-    NSUInteger expLength = [data length];
-    NSOutputStream* output = [self outputStreamForExpectedContentLength:expLength];
-    NSInteger writedButesLength = [output write:[data bytes] maxLength:expLength];
-    if (writedButesLength == -1) {
-        [self handleOutputStreamError];
+    if (_data != nil) {
+        // data of the buffer continues to grow in chunks
+        NSData* bufferedData = _data;
+        _data = nil;
+        _length = 0;
+        _length = [self appendBytes:[bufferedData bytes] length:[bufferedData length]];
+    }
+    NSUInteger writtenLength = [self appendBytes:[data bytes] length:[data length]];
+    if (writtenLength > 0) {
+        if (_computesDigest && _digestedLength == _length) {
+            CC_SHA256_Update(&_digestContext, [data bytes], (CC_LONG)writtenLength);
+            _digestedLength += writtenLength;
+        }
+        _length += writtenLength;
+    }
+}
+
+- (void)setComputesDigest:(BOOL)computesDigest {
+    _computesDigest = computesDigest;
+    _digestedLength = 0;
+    CC_SHA256_Init(&_digestContext);
+    if (_length > 0) {
+        // data appended before is read when the digest is requested
+        _digestedLength = ULLONG_MAX;
+    }
+}
+
+- (NSString*)digest {
+    if (_errorOccured) {
+        return nil;
+    }
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    if (_computesDigest && _digestedLength == _length) {
+        CC_SHA256_CTX context = _digestContext;
+        CC_SHA256_Final(digest, &context);
+    } else if (_data != nil) {
+        CC_SHA256([_data bytes], (CC_LONG)[_data length], digest);
     } else {
-        _length += writedButesLength;
+        NSInputStream* inputStream = [self inputStream];
+        [inputStream open];
+        CC_SHA256_CTX context;
+        CC_SHA256_Init(&context);
+        uint8_t bytes[16 * 1024];
+        NSInteger readLength = 0;
+        unsigned long long digestedLength = 0;
+        while ((readLength = [inputStream read:bytes maxLength:sizeof(bytes)]) > 0) {
+            CC_SHA256_Update(&context, bytes, (CC_LONG)readLength);
+            digestedLength += readLength;
+        }
+        [inputStream close];
+        if (inputStream == nil || readLength < 0 || digestedLength != _length) {
+            return nil;
+        }
+        if (_computesDigest) {
+            // data is not read again for the next request
+            _digestContext = context;
+            _digestedLength = _length;
+        }
+        CC_SHA256_Final(digest, &context);
     }
+    return MKResourceHexString(digest, sizeof(digest));
 }
 
 - (NSUInteger)length {
@@ -85,22 +335,32 @@ static NSUInteger maxLengthAllowedInMemory = 300 * 1024; // 300 * 1024 = 300 kb
     return _length;
 }
 
+- (BOOL)isFileBacked {
+    return self.dataFileName != nil;
+}
+
+- (BOOL)isEncryptedFileBacked {
+    return self.dataFileName != nil && _encryptsDataFile;
+}
+
 - (NSInputStream*)inputStream {
     if (_errorOccured) {
         return nil;
     }
     
     NSInputStream* inputStream = nil;
-    if (self.dataFileName) { // in file stream
+    if (_data) {
+        inputStream = [NSInputStream inputStreamWithData:_data];
+    } else if (self.dataFileName && _encryptsDataFile) {
+        if ([self finishFileWriter]) {
+            MKEncryptedFileReader* reader = [[MKEncryptedFileReader alloc] initWithKey:_encryptionKey path:self.dataFileName];
+            inputStream = reader != nil ? [[MKDecryptingInputStream alloc] initWithReader:reader] : nil;
+        }
+    } else if (self.dataFileName) { // in file stream
         [_outputStream close];
         inputStream = [NSInputStream inputStreamWithFileAtPath:self.dataFileName];
     } else {
-        // In memory stream
-        NSData* data = [_outputStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
-        [_outputStream close];
-        if (data) {
-            inputStream = [NSInputStream inputStreamWithData:data];
-        }
+        inputStream = [NSInputStream inputStreamWithData:[self data]];
     }
     return inputStream;
 }
@@ -111,14 +371,108 @@ static NSUInteger maxLengthAllowedInMemory = 300 * 1024; // 300 * 1024 = 300 kb
     }
     
     NSData* data = nil;
-    if (self.dataFileName) { // in file stream
+    if (_data) {
+        data = _data;
+    } else if (self.dataFileName && _encryptsDataFile) {
+        if ([self finishFileWriter]) {
+            data = [[[MKEncryptedFileReader alloc] initWithKey:_encryptionKey path:self.dataFileName] data];
+        }
+    } else if (self.dataFileName) { // in file stream
         data = [NSData dataWithContentsOfFile:self.dataFileName];
     } else {
-        // In memory stream
-        data = [_outputStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
-        [_outputStream close];
+        // chunks are joined once and returned to the pool
+        NSMutableData* joinedData = [NSMutableData dataWithCapacity:_length];
+        NSUInteger remainingLength = _length;
+        for (NSUInteger i = 0; i < _chunksCount && remainingLength > 0; i++) {
+            NSUInteger length = MIN(remainingLength, MKResourceBufferPoolChunkLength);
+            [joinedData appendBytes:_chunks[i] length:length];
+            remainingLength -= length;
+        }
+        [self releaseChunks];
+        _data = joinedData;
+        data = joinedData;
     }
     return data;
 }
 
+- (void)removeAllData {
+    [_outputStream close];
+    _outputStream = nil;
+    _fileWriter = nil;
+    _data = nil;
+    [self releaseChunks];
+    _length = 0;
+    _errorOccured = NO;
+    _digestedLength = 0;
+    CC_SHA256_Init(&_digestContext);
+    if (self.dataFileName != nil) {
+        if (_keepsDataFile) {
+            truncate([self.dataFileName fileSystemRepresentation], 0);
+        } else {
+            unlink([self.dataFileName fileSystemRepresentation]);
+            self.dataFileName = nil;
+            _encryptsDataFile = NO;
+        }
+    }
+}
+
+- (BOOL)moveToPath:(NSString*)path error:(NSError**)error {
+    if (_errorOccured) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:EIO userInfo:nil];
+        }
+        return NO;
+    }
+    
+    BOOL result = NO;
+    if (_data == nil && self.dataFileName && ![self finishFileWriter]) {
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:EIO userInfo:nil];
+        }
+    } else if (_data == nil && self.dataFileName) {
+        [_outputStream close];
+        _outputStream = nil;
+        if (rename([self.dataFileName fileSystemRepresentation], [path fileSystemRepresentation]) == 0) {
+            result = YES;
+        } else if (errno == EXDEV) {
+            // temporary directory is on another volume
+            NSFileManager* fileManager = [NSFileManager defaultManager];
+            [fileManager removeItemAtPath:path error:nil];
+            result = [fileManager moveItemAtPath:self.dataFileName toPath:path error:error];
+        } else if (error != NULL) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        }
+        if (result) {
+            self.dataFileName = nil;
+            _encryptsDataFile = NO;
+        }
+    } else if (_data != nil) {
+        result = [_data writeToFile:path options:NSDataWritingAtomic error:error];
+    } else {
+        // chunks are written to file as they are, without joining them in memory
+        NSString* temporaryPath = [path stringByAppendingFormat:@".%@", [[NSProcessInfo processInfo] globallyUniqueString]];
+        NSOutputStream* outputStream = [NSOutputStream outputStreamToFileAtPath:temporaryPath append:NO];
+        [outputStream open];
+        result = [self writeChunksToStream:outputStream];
+        [outputStream close];
+        if (result && rename([temporaryPath fileSystemRepresentation], [path fileSystemRepresentation]) != 0) {
+            result = NO;
+        }
+        if (!result) {
+            if (error != NULL) {
+                *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno != 0 ? errno : EIO userInfo:nil];
+            }
+            unlink([temporaryPath fileSystemRepresentation]);
+        }
+    }
+    
+    if (result) {
+        _data = nil;
+        _outputStream = nil;
+        [self releaseChunks];
+        _length = 0;
+    }
+    return result;
+}
+
 @end
@@ -0,0 +1,46 @@
+//
+//  MKResourceBufferPool.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import <pthread.h>
+
+// Length of chunks in-memory buffers are made of
+extern NSUInteger const MKResourceBufferPoolChunkLength;
+
+/**
+ * Fixed length chunks of memory shared by in-memory download buffers. Chunks returned by finished downloads
+ * are kept for next ones up to maxPooledLength, so concurrent small downloads do not reallocate their data
+ * as it grows. The pool is thread safe.
+ */
+@interface MKResourceBufferPool : NSObject {
+@private
+    pthread_mutex_t         _lock;
+    void*                   _freeChunks;
+    NSUInteger              _freeChunksCount;
+    NSUInteger              _maxPooledLength;
+    NSUInteger              _usedLength;
+    NSUInteger              _peakUsedLength;
+}
+
+// Maximum length of unused chunks kept in the pool. Default value is 1MB.
+@property (nonatomic, assign) NSUInteger maxPooledLength;
+// Length of unused chunks kept in the pool
+@property (nonatomic, readonly) NSUInteger pooledLength;
+// Length of chunks taken by buffers
+@property (nonatomic, readonly) NSUInteger usedLength;
+// Maximum usedLength since the pool has been created or resetPeakUsedLength has been called
+@property (nonatomic, readonly) NSUInteger peakUsedLength;
+
+// Returns chunk of MKResourceBufferPoolChunkLength bytes, NULL if memory can not be allocated
+- (void*)takeChunk;
+- (void)returnChunk:(void*)chunk;
+// Frees unused chunks, e.g. on memory warning
+- (void)removeAllChunks;
+- (void)resetPeakUsedLength;
+
+@end
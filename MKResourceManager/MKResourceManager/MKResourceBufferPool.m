@@ -0,0 +1,131 @@
+//
+//  MKResourceBufferPool.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceBufferPool.h"
+
+NSUInteger const MKResourceBufferPoolChunkLength = 32 * 1024;
+static NSUInteger const MKResourceBufferPoolDefaultMaxPooledLength = 1024 * 1024;
+
+@implementation MKResourceBufferPool
+
+- (id)init {
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        _maxPooledLength = MKResourceBufferPoolDefaultMaxPooledLength;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self removeAllChunks];
+    pthread_mutex_destroy(&_lock);
+}
+
+- (NSUInteger)maxPooledLength {
+    pthread_mutex_lock(&_lock);
+    NSUInteger maxPooledLength = _maxPooledLength;
+    pthread_mutex_unlock(&_lock);
+    return maxPooledLength;
+}
+
+- (void)setMaxPooledLength:(NSUInteger)maxPooledLength {
+    pthread_mutex_lock(&_lock);
+    _maxPooledLength = maxPooledLength;
+    // chunks above the new limit are freed
+    while (_freeChunks != NULL && _freeChunksCount * MKResourceBufferPoolChunkLength > _maxPooledLength) {
+        void* chunk = _freeChunks;
+        _freeChunks = *(void**)chunk;
+        _freeChunksCount--;
+        free(chunk);
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (NSUInteger)pooledLength {
+    pthread_mutex_lock(&_lock);
+    NSUInteger pooledLength = _freeChunksCount * MKResourceBufferPoolChunkLength;
+    pthread_mutex_unlock(&_lock);
+    return pooledLength;
+}
+
+- (NSUInteger)usedLength {
+    pthread_mutex_lock(&_lock);
+    NSUInteger usedLength = _usedLength;
+    pthread_mutex_unlock(&_lock);
+    return usedLength;
+}
+
+- (NSUInteger)peakUsedLength {
+    pthread_mutex_lock(&_lock);
+    NSUInteger peakUsedLength = _peakUsedLength;
+    pthread_mutex_unlock(&_lock);
+    return peakUsedLength;
+}
+
+- (void*)takeChunk {
+    pthread_mutex_lock(&_lock);
+    // unused chunks are linked through their first bytes
+    void* chunk = _freeChunks;
+    if (chunk != NULL) {
+        _freeChunks = *(void**)chunk;
+        _freeChunksCount--;
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (chunk == NULL) {
+        chunk = malloc(MKResourceBufferPoolChunkLength);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+    pthread_mutex_lock(&_lock);
+    _usedLength += MKResourceBufferPoolChunkLength;
+    if (_usedLength > _peakUsedLength) {
+        _peakUsedLength = _usedLength;
+    }
+    pthread_mutex_unlock(&_lock);
+    return chunk;
+}
+
+- (void)returnChunk:(void*)chunk {
+    if (chunk == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&_lock);
+    _usedLength -= MKResourceBufferPoolChunkLength;
+    if ((_freeChunksCount + 1) * MKResourceBufferPoolChunkLength <= _maxPooledLength) {
+        *(void**)chunk = _freeChunks;
+        _freeChunks = chunk;
+        _freeChunksCount++;
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&_lock);
+    free(chunk);
+}
+
+- (void)removeAllChunks {
+    pthread_mutex_lock(&_lock);
+    void* chunk = _freeChunks;
+    _freeChunks = NULL;
+    _freeChunksCount = 0;
+    pthread_mutex_unlock(&_lock);
+    while (chunk != NULL) {
+        void* nextChunk = *(void**)chunk;
+        free(chunk);
+        chunk = nextChunk;
+    }
+}
+
+- (void)resetPeakUsedLength {
+    pthread_mutex_lock(&_lock);
+    _peakUsedLength = _usedLength;
+    pthread_mutex_unlock(&_lock);
+}
+
+@end
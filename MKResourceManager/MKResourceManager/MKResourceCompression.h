@@ -0,0 +1,64 @@
+//
+//  MKResourceCompression.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import <zlib.h>
+
+// Length of the header of compressed data: magic "MKZ1" and length of uncompressed data (8 bytes, big endian)
+#define MKCompressionHeaderLength 12
+
+// Returns YES if bytes start with the header of compressed data. Length of uncompressed data is returned in dataLength if it is not NULL.
+BOOL MKIsCompressedDataHeader(const void* bytes, NSUInteger length, unsigned long long* dataLength);
+
+/**
+ * Compresses data with zlib as it is appended and passes compressed bytes to the output block.
+ * The output starts with the header, so that compressed data is recognized on read whatever name the file has.
+ */
+@interface MKDeflater : NSObject {
+@private
+    z_stream                _stream;
+    BOOL                    _streamInitialized;
+    BOOL                    _errorOccured;
+    BOOL                    (^_output)(const void* bytes, NSUInteger length);
+    unsigned char*          _outputBuffer;
+}
+
+// Length is the length of data that will be appended. Output block returns NO if bytes can not be written.
+- (id)initWithLength:(unsigned long long)length output:(BOOL (^)(const void* bytes, NSUInteger length))output;
+- (BOOL)appendBytes:(const void*)bytes length:(NSUInteger)length;
+// Flushes the rest of compressed data to the output
+- (BOOL)finish;
+
+@end
+
+/**
+ * Stream of uncompressed data read from the stream of data written by MKDeflater.
+ * The header is read when the stream is opened. Reading is synchronous, scheduling in run loop has no effect.
+ */
+@interface MKInflatingInputStream : NSInputStream {
+@private
+    NSInputStream*          _sourceStream;
+    z_stream                _stream;
+    BOOL                    _streamInitialized;
+    unsigned char*          _inputBuffer;
+    unsigned long long      _length;
+    unsigned long long      _offset;
+    NSStreamStatus          _streamStatus;
+    NSError*                _streamError;
+    __weak id<NSStreamDelegate> _delegate;
+}
+
+// Length of uncompressed data, known after the stream is opened
+@property (nonatomic, readonly) unsigned long long length;
+
+- (id)initWithStream:(NSInputStream*)stream;
+// Reads the range of uncompressed data from the stream, data before the range is inflated and skipped.
+// Range is clipped to the length of the data. Returns nil if data is not compressed or can not be inflated.
++ (NSData*)dataInRange:(NSRange)range ofStream:(NSInputStream*)stream;
+
+@end
@@ -0,0 +1,269 @@
+//
+//  MKResourceCompression.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceCompression.h"
+
+static const unsigned char MKCompressionMagic[4] = {'M', 'K', 'Z', '1'};
+// Length of compressed data passed to the output or read from the source at once
+#define MKCompressionBufferLength (16 * 1024)
+
+BOOL MKIsCompressedDataHeader(const void* bytes, NSUInteger length, unsigned long long* dataLength) {
+    if (bytes == NULL || length < MKCompressionHeaderLength || memcmp(bytes, MKCompressionMagic, sizeof(MKCompressionMagic)) != 0) {
+        return NO;
+    }
+    if (dataLength != NULL) {
+        const unsigned char* lengthBytes = (const unsigned char*)bytes + sizeof(MKCompressionMagic);
+        unsigned long long value = 0;
+        for (int i = 0; i < 8; i++) {
+            value = (value << 8) | lengthBytes[i];
+        }
+        *dataLength = value;
+    }
+    return YES;
+}
+
+@implementation MKDeflater
+
+- (id)initWithLength:(unsigned long long)length output:(BOOL (^)(const void* bytes, NSUInteger length))output {
+    self = [super init];
+    if (self != nil) {
+        if (deflateInit(&_stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return nil;
+        }
+        _streamInitialized = YES;
+        _output = [output copy];
+        _outputBuffer = malloc(MKCompressionBufferLength);
+
+        unsigned char header[MKCompressionHeaderLength];
+        memcpy(header, MKCompressionMagic, sizeof(MKCompressionMagic));
+        for (int i = 0; i < 8; i++) {
+            header[sizeof(MKCompressionMagic) + i] = (unsigned char)(length >> (56 - 8 * i));
+        }
+        _errorOccured = _outputBuffer == NULL || !_output(header, sizeof(header));
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (_streamInitialized) {
+        deflateEnd(&_stream);
+    }
+    free(_outputBuffer);
+}
+
+- (BOOL)deflateWithFlush:(int)flush {
+    int result = Z_OK;
+    do {
+        _stream.next_out = _outputBuffer;
+        _stream.avail_out = MKCompressionBufferLength;
+        result = deflate(&_stream, flush);
+        if (result == Z_STREAM_ERROR) {
+            return NO;
+        }
+        NSUInteger producedLength = MKCompressionBufferLength - _stream.avail_out;
+        if (producedLength > 0 && !_output(_outputBuffer, producedLength)) {
+            return NO;
+        }
+    } while (_stream.avail_out == 0 || (flush == Z_FINISH && result != Z_STREAM_END));
+    return YES;
+}
+
+- (BOOL)appendBytes:(const void*)bytes length:(NSUInteger)length {
+    const unsigned char* input = bytes;
+    while (!_errorOccured && length > 0) {
+        // avail_in is 32 bit
+        uInt inputLength = (uInt)MIN(length, (NSUInteger)UINT_MAX);
+        _stream.next_in = (Bytef*)input;
+        _stream.avail_in = inputLength;
+        _errorOccured = ![self deflateWithFlush:Z_NO_FLUSH];
+        input += inputLength;
+        length -= inputLength;
+    }
+    return !_errorOccured;
+}
+
+- (BOOL)finish {
+    if (!_errorOccured && _streamInitialized) {
+        _stream.next_in = NULL;
+        _stream.avail_in = 0;
+        _errorOccured = ![self deflateWithFlush:Z_FINISH];
+        deflateEnd(&_stream);
+        _streamInitialized = NO;
+    }
+    return !_errorOccured;
+}
+
+@end
+
+@implementation MKInflatingInputStream
+
+@synthesize length = _length;
+
+- (id)initWithStream:(NSInputStream*)stream {
+    self = [super init];
+    if (self != nil) {
+        _sourceStream = stream;
+        _streamStatus = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (_streamInitialized) {
+        inflateEnd(&_stream);
+    }
+    free(_inputBuffer);
+}
+
+- (void)failWithCode:(NSInteger)code {
+    _streamStatus = NSStreamStatusError;
+    _streamError = [NSError errorWithDomain:NSCocoaErrorDomain code:code userInfo:nil];
+}
+
+- (void)open {
+    if (_streamStatus != NSStreamStatusNotOpen) {
+        return;
+    }
+    [_sourceStream open];
+    unsigned char header[MKCompressionHeaderLength];
+    NSUInteger headerLength = 0;
+    while (headerLength < sizeof(header)) {
+        NSInteger readLength = [_sourceStream read:header + headerLength maxLength:sizeof(header) - headerLength];
+        if (readLength <= 0) {
+            break;
+        }
+        headerLength += readLength;
+    }
+    _inputBuffer = malloc(MKCompressionBufferLength);
+    if (!MKIsCompressedDataHeader(header, headerLength, &_length) || _inputBuffer == NULL) {
+        [self failWithCode:NSFileReadCorruptFileError];
+        return;
+    }
+    if (inflateInit(&_stream) != Z_OK) {
+        [self failWithCode:NSFileReadUnknownError];
+        return;
+    }
+    _streamInitialized = YES;
+    _streamStatus = _length > 0 ? NSStreamStatusOpen : NSStreamStatusAtEnd;
+}
+
+- (void)close {
+    [_sourceStream close];
+    if (_streamInitialized) {
+        inflateEnd(&_stream);
+        _streamInitialized = NO;
+    }
+    _streamStatus = NSStreamStatusClosed;
+}
+
+- (NSInteger)read:(uint8_t*)buffer maxLength:(NSUInteger)length {
+    if (_streamStatus != NSStreamStatusOpen) {
+        return _streamStatus == NSStreamStatusAtEnd ? 0 : -1;
+    }
+    _stream.next_out = buffer;
+    _stream.avail_out = (uInt)MIN(length, (NSUInteger)UINT_MAX);
+    uInt requestedLength = _stream.avail_out;
+    while (_stream.avail_out > 0) {
+        if (_stream.avail_in == 0) {
+            NSInteger readLength = [_sourceStream read:_inputBuffer maxLength:MKCompressionBufferLength];
+            if (readLength <= 0) {
+                // data ends before the end of compressed stream
+                [self failWithCode:NSFileReadCorruptFileError];
+                return -1;
+            }
+            _stream.next_in = _inputBuffer;
+            _stream.avail_in = (uInt)readLength;
+        }
+        int result = inflate(&_stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) {
+            _streamStatus = NSStreamStatusAtEnd;
+            break;
+        }
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            [self failWithCode:NSFileReadCorruptFileError];
+            return -1;
+        }
+    }
+    NSInteger readLength = requestedLength - _stream.avail_out;
+    _offset += readLength;
+    if (_streamStatus == NSStreamStatusAtEnd && _offset != _length) {
+        [self failWithCode:NSFileReadCorruptFileError];
+        return -1;
+    }
+    return readLength;
+}
+
++ (NSData*)dataInRange:(NSRange)range ofStream:(NSInputStream*)stream {
+    MKInflatingInputStream* inflatingStream = [[MKInflatingInputStream alloc] initWithStream:stream];
+    [inflatingStream open];
+    if ([inflatingStream streamStatus] == NSStreamStatusError) {
+        [inflatingStream close];
+        return nil;
+    }
+    unsigned long long length = [inflatingStream length];
+    unsigned long long location = MIN((unsigned long long)range.location, length);
+    NSUInteger rangeLength = (NSUInteger)MIN((unsigned long long)range.length, length - location);
+
+    BOOL result = YES;
+    uint8_t bytes[MKCompressionBufferLength];
+    unsigned long long skippedLength = 0;
+    while (result && skippedLength < location) {
+        NSInteger readLength = [inflatingStream read:bytes maxLength:(NSUInteger)MIN((unsigned long long)sizeof(bytes), location - skippedLength)];
+        result = readLength > 0;
+        skippedLength += MAX(readLength, 0);
+    }
+    NSMutableData* data = result ? [NSMutableData dataWithLength:rangeLength] : nil;
+    NSUInteger dataLength = 0;
+    while (result && dataLength < rangeLength) {
+        NSInteger readLength = [inflatingStream read:(uint8_t*)[data mutableBytes] + dataLength maxLength:rangeLength - dataLength];
+        result = readLength > 0;
+        dataLength += MAX(readLength, 0);
+    }
+    [inflatingStream close];
+    return result ? data : nil;
+}
+
+- (BOOL)getBuffer:(uint8_t**)buffer length:(NSUInteger*)length {
+    return NO;
+}
+
+- (BOOL)hasBytesAvailable {
+    return _streamStatus == NSStreamStatusOpen;
+}
+
+- (NSStreamStatus)streamStatus {
+    return _streamStatus;
+}
+
+- (NSError*)streamError {
+    return _streamError;
+}
+
+- (id<NSStreamDelegate>)delegate {
+    return _delegate;
+}
+
+- (void)setDelegate:(id<NSStreamDelegate>)delegate {
+    _delegate = delegate;
+}
+
+- (id)propertyForKey:(NSString*)key {
+    return nil;
+}
+
+- (BOOL)setProperty:(id)property forKey:(NSString*)key {
+    return NO;
+}
+
+- (void)scheduleInRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+- (void)removeFromRunLoop:(NSRunLoop*)runLoop forMode:(NSString*)mode {
+}
+
+@end
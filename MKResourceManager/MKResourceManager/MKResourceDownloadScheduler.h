@@ -0,0 +1,55 @@
+//
+//  MKResourceDownloadScheduler.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "MKResource.h"
+
+/**
+ * Queue of resources waiting for download and accounting of running downloads.
+ * Resources are taken by priority, resources of the same priority are taken in turn from each host
+ * and in order of enqueue within a host. Enqueue, remove and reprioritize do not depend on the queue length.
+ * Custom resources are scheduled and accounted as any other resource.
+ * A running resource may take more slots for additional connections, e.g. ranges of segmented download.
+ */
+@interface MKResourceDownloadScheduler : NSObject {
+@private
+    NSMutableArray*         _queuesByPriority;
+    NSMutableArray*         _hostsByPriority;
+    NSMutableSet*           _runningResources;
+    NSCountedSet*           _runningHosts;
+    NSUInteger              _queuedCount;
+    NSCountedSet*           _runningSegments;
+    NSUInteger              _runningSegmentsCount;
+}
+
+// Maximum number of running downloads. 0 means no limit.
+@property (nonatomic, assign) NSUInteger maxConcurrentDownloadsCount;
+// Maximum number of running downloads from the same host. 0 means no limit.
+@property (nonatomic, assign) NSUInteger maxConcurrentDownloadsPerHostCount;
+@property (nonatomic, readonly) NSUInteger queuedCount;
+// Number of running downloads, including additional connections of running resources
+@property (nonatomic, readonly) NSUInteger runningCount;
+
+// Adds resource to the queue with its current priority. Does nothing if resource is queued or running.
+- (void)enqueueResource:(MKResource*)resource;
+// Moves queued resource to the queue of its current priority.
+- (void)reprioritizeResource:(MKResource*)resource;
+// Removes resource from the queue or from running downloads with all its additional connections.
+// Returns YES if the download was running.
+- (BOOL)removeResource:(MKResource*)resource;
+- (BOOL)isResourceQueued:(MKResource*)resource;
+- (BOOL)isResourceRunning:(MKResource*)resource;
+// Takes the next resource that fits the limits and accounts it as running. Returns nil if there is no such resource.
+- (MKResource*)dequeueNextResource;
+- (void)removeAllResources;
+// Accounts up to count additional connections of the running resource within the limits. Returns number of connections accounted.
+- (NSUInteger)addRunningSegmentsOfResource:(MKResource*)resource count:(NSUInteger)count;
+// Removes one additional connection of the resource. Returns NO if the resource has none.
+- (BOOL)removeRunningSegmentOfResource:(MKResource*)resource;
+
+@end
@@ -0,0 +1,211 @@
+//
+//  MKResourceDownloadScheduler.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceDownloadScheduler.h"
+#import "MKResource+Private.h"
+
+static NSUInteger const MKResourcePriorityLevelsCount = MKResourcePriorityHigh - MKResourcePriorityLow + 1;
+
+static NSUInteger MKPriorityLevel(MKResourcePriority priority) {
+    if (priority < MKResourcePriorityLow) {
+        priority = MKResourcePriorityLow;
+    } else if (priority > MKResourcePriorityHigh) {
+        priority = MKResourcePriorityHigh;
+    }
+    return priority - MKResourcePriorityLow;
+}
+
+static NSString* MKHostOfResource(MKResource* resource) {
+    NSString* host = [resource.resourceURL host];
+    return host != nil ? host : @"";
+}
+
+@implementation MKResourceDownloadScheduler
+@synthesize maxConcurrentDownloadsCount = _maxConcurrentDownloadsCount;
+@synthesize maxConcurrentDownloadsPerHostCount = _maxConcurrentDownloadsPerHostCount;
+@synthesize queuedCount = _queuedCount;
+
+- (id)init {
+    self = [super init];
+    if (self != nil) {
+        // for each priority level: queues of resources by host and order in which hosts are served
+        _queuesByPriority = [[NSMutableArray alloc] initWithCapacity:MKResourcePriorityLevelsCount];
+        _hostsByPriority = [[NSMutableArray alloc] initWithCapacity:MKResourcePriorityLevelsCount];
+        for (NSUInteger level = 0; level < MKResourcePriorityLevelsCount; level++) {
+            [_queuesByPriority addObject:[NSMutableDictionary dictionary]];
+            [_hostsByPriority addObject:[NSMutableOrderedSet orderedSet]];
+        }
+        _runningResources = [[NSMutableSet alloc] init];
+        _runningHosts = [[NSCountedSet alloc] init];
+        _runningSegments = [[NSCountedSet alloc] init];
+    }
+    return self;
+}
+
+- (NSUInteger)runningCount {
+    return [_runningResources count] + _runningSegmentsCount;
+}
+
+- (NSMutableOrderedSet*)queueForHost:(NSString*)host level:(NSUInteger)level {
+    return [[_queuesByPriority objectAtIndex:level] objectForKey:host];
+}
+
+- (BOOL)isResourceQueued:(MKResource*)resource {
+    if (resource == nil) {
+        return NO;
+    }
+    NSMutableOrderedSet* queue = [self queueForHost:MKHostOfResource(resource) level:resource.scheduledPriorityLevel];
+    return [queue containsObject:resource];
+}
+
+- (BOOL)isResourceRunning:(MKResource*)resource {
+    return resource != nil && [_runningResources containsObject:resource];
+}
+
+- (void)addResource:(MKResource*)resource level:(NSUInteger)level {
+    NSString* host = MKHostOfResource(resource);
+    NSMutableOrderedSet* queue = [self queueForHost:host level:level];
+    if (queue == nil) {
+        queue = [[NSMutableOrderedSet alloc] init];
+        [[_queuesByPriority objectAtIndex:level] setObject:queue forKey:host];
+        [[_hostsByPriority objectAtIndex:level] addObject:host];
+    }
+    [queue addObject:resource];
+    resource.scheduledPriorityLevel = level;
+    _queuedCount++;
+}
+
+- (BOOL)unqueueResource:(MKResource*)resource {
+    NSUInteger level = resource.scheduledPriorityLevel;
+    NSString* host = MKHostOfResource(resource);
+    NSMutableOrderedSet* queue = [self queueForHost:host level:level];
+    if (![queue containsObject:resource]) {
+        return NO;
+    }
+    [queue removeObject:resource];
+    if ([queue count] == 0) {
+        [[_queuesByPriority objectAtIndex:level] removeObjectForKey:host];
+        [[_hostsByPriority objectAtIndex:level] removeObject:host];
+    }
+    _queuedCount--;
+    return YES;
+}
+
+- (void)enqueueResource:(MKResource*)resource {
+    if (resource == nil || [self isResourceRunning:resource] || [self isResourceQueued:resource]) {
+        return;
+    }
+    [self addResource:resource level:MKPriorityLevel(resource.priority)];
+}
+
+- (void)reprioritizeResource:(MKResource*)resource {
+    NSUInteger level = MKPriorityLevel(resource.priority);
+    if (level != resource.scheduledPriorityLevel && [self unqueueResource:resource]) {
+        [self addResource:resource level:level];
+    }
+}
+
+- (BOOL)removeResource:(MKResource*)resource {
+    if (resource == nil) {
+        return NO;
+    }
+    if ([_runningResources containsObject:resource]) {
+        while ([self removeRunningSegmentOfResource:resource]) {
+        }
+        [_runningResources removeObject:resource];
+        [_runningHosts removeObject:MKHostOfResource(resource)];
+        return YES;
+    }
+    [self unqueueResource:resource];
+    return NO;
+}
+
+- (BOOL)canRunResourceFromHost:(NSString*)host {
+    return _maxConcurrentDownloadsPerHostCount == 0 || [_runningHosts countForObject:host] < _maxConcurrentDownloadsPerHostCount;
+}
+
+- (MKResource*)dequeueNextResource {
+    if (_queuedCount == 0) {
+        return nil;
+    }
+    if (_maxConcurrentDownloadsCount > 0 && [self runningCount] >= _maxConcurrentDownloadsCount) {
+        return nil;
+    }
+
+    for (NSInteger level = MKResourcePriorityLevelsCount - 1; level >= 0; level--) {
+        NSMutableOrderedSet* hosts = [_hostsByPriority objectAtIndex:level];
+        NSUInteger hostsCount = [hosts count];
+        for (NSUInteger hostIndex = 0; hostIndex < hostsCount; hostIndex++) {
+            NSString* host = [hosts objectAtIndex:hostIndex];
+            if (![self canRunResourceFromHost:host]) {
+                continue;
+            }
+
+            NSMutableOrderedSet* queue = [self queueForHost:host level:level];
+            MKResource* resource = [queue objectAtIndex:0];
+            [queue removeObjectAtIndex:0];
+            if ([queue count] == 0) {
+                [[_queuesByPriority objectAtIndex:level] removeObjectForKey:host];
+                [hosts removeObjectAtIndex:hostIndex];
+            } else {
+                // the host is served again after all the other hosts of the same priority
+                [hosts removeObjectAtIndex:hostIndex];
+                [hosts addObject:host];
+            }
+            _queuedCount--;
+
+            [_runningResources addObject:resource];
+            [_runningHosts addObject:host];
+            return resource;
+        }
+    }
+    return nil;
+}
+
+- (void)removeAllResources {
+    for (NSMutableDictionary* queues in _queuesByPriority) {
+        [queues removeAllObjects];
+    }
+    for (NSMutableOrderedSet* hosts in _hostsByPriority) {
+        [hosts removeAllObjects];
+    }
+    [_runningResources removeAllObjects];
+    [_runningHosts removeAllObjects];
+    [_runningSegments removeAllObjects];
+    _runningSegmentsCount = 0;
+    _queuedCount = 0;
+}
+
+- (NSUInteger)addRunningSegmentsOfResource:(MKResource*)resource count:(NSUInteger)count {
+    if (![self isResourceRunning:resource]) {
+        return 0;
+    }
+    NSString* host = MKHostOfResource(resource);
+    NSUInteger addedCount = 0;
+    while (addedCount < count &&
+           (_maxConcurrentDownloadsCount == 0 || [self runningCount] < _maxConcurrentDownloadsCount) &&
+           [self canRunResourceFromHost:host]) {
+        [_runningSegments addObject:resource];
+        [_runningHosts addObject:host];
+        _runningSegmentsCount++;
+        addedCount++;
+    }
+    return addedCount;
+}
+
+- (BOOL)removeRunningSegmentOfResource:(MKResource*)resource {
+    if (resource == nil || [_runningSegments countForObject:resource] == 0) {
+        return NO;
+    }
+    [_runningSegments removeObject:resource];
+    [_runningHosts removeObject:MKHostOfResource(resource)];
+    _runningSegmentsCount--;
+    return YES;
+}
+
+@end
@@ -20,6 +20,12 @@
     NSInteger                           _statusCode;
     NSURLConnection*                    _theConnection;
     MKResource*                        _resource;
+    unsigned long long                  _resumeOffset;
+    NSMutableArray*                     _segments;
+    NSUInteger                          _finishedSegmentsCount;
+    unsigned long long                  _segmentsReceivedLength;
+    int                                 _segmentsFile;
+    NSString*                           _segmentsFilePath;
 }
 @property (nonatomic, strong) MKResourceBuffer* urlData;
 @property (nonatomic, strong) MKResource* resource;
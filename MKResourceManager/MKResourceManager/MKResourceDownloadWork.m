@@ -8,9 +8,67 @@
 
 #import "MKResourceDownloadWork.h"
 #import "MKResource+Private.h"
+#import "MKResourceManager+Private.h"
 #import "MKResourceUtility.h"
+#import <fcntl.h>
+#import <unistd.h>
 //#import "MKHTTPHandlerClientPrivate.h"
 
+// Downloads shorter than this are kept in memory and started over if interrupted
+static long long const MKResourceResumableDownloadMinLength = 300 * 1024;
+static NSString* const MKResourceValidatorFileExtension = @"validator";
+static NSString* const MKResourceValidatorURLKey = @"URL";
+static NSString* const MKResourceValidatorETagKey = @"ETag";
+static NSString* const MKResourceValidatorLastModifiedKey = @"Last-Modified";
+// Segmented download does not split data into ranges shorter than this
+static unsigned long long const MKResourceDownloadSegmentMinLength = 1024 * 1024;
+
+// Byte range of segmented download and the connection that fetches it. The first range is fetched by the
+// connection of the initial request, which is cancelled once the range is received.
+@interface MKResourceDownloadSegment : NSObject
+@property (nonatomic, strong) NSURLConnection* connection;
+@property (nonatomic, assign) unsigned long long offset;
+@property (nonatomic, assign) unsigned long long length;
+@property (nonatomic, assign) unsigned long long receivedLength;
+@property (nonatomic, assign) NSInteger statusCode;
+@end
+
+@implementation MKResourceDownloadSegment
+@synthesize connection = _connection;
+@synthesize offset = _offset;
+@synthesize length = _length;
+@synthesize receivedLength = _receivedLength;
+@synthesize statusCode = _statusCode;
+@end
+
+static BOOL MKWriteAllBytesAtOffset(int file, const uint8_t* bytes, size_t length, unsigned long long offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(file, bytes, length, (off_t)offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return NO;
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+    return YES;
+}
+
+// Reserves space for the whole file, so that ranges written at their offsets do not fragment it
+static BOOL MKPreallocateFile(int file, unsigned long long length) {
+#ifdef F_PREALLOCATE
+    fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)length, 0};
+    if (fcntl(file, F_PREALLOCATE, &store) == -1) {
+        store.fst_flags = F_ALLOCATEALL;
+        fcntl(file, F_PREALLOCATE, &store);
+    }
+#endif
+    return ftruncate(file, (off_t)length) == 0;
+}
+
 @interface MKResourceDownloadWork ()
 
 @property (nonatomic, weak) MKResourceManager* manager;
@@ -19,6 +77,7 @@
 @property (nonatomic, strong) id<MKHTTPHandlerClientPrivate> httpClient;
 @property (nonatomic, strong) NSError* httpError;
 @property (nonatomic, strong) NSURLConnection* theConnection;
+@property (nonatomic, strong) NSString* partialDataPath;
 
 @end
 
@@ -33,9 +92,19 @@
 @synthesize httpClient      = _httpClient;
 @synthesize httpError       = _httpError;
 @synthesize theConnection   = _theConnection;
+@synthesize partialDataPath = _partialDataPath;
+
+- (id)init {
+    self = [super init];
+    if (self != nil) {
+        _segmentsFile = -1;
+    }
+    return self;
+}
 
 - (void)dealloc {
     [_theConnection cancel];
+    [self cancelSegments];
 }
 
 - (NSError*)formattedError {
@@ -81,14 +150,21 @@
     self.manager = aManager;
     _statusCode = 0;
 
-	NSMutableURLRequest *dataRequest = [NSMutableURLRequest requestWithURL:self.resource.resourceURL cachePolicy:NSURLRequestReturnCacheDataElseLoad
+    NSURLRequestCachePolicy cachePolicy = [aManager usesSharedURLCache] ? NSURLRequestReturnCacheDataElseLoad : NSURLRequestReloadIgnoringLocalCacheData;
+	NSMutableURLRequest *dataRequest = [NSMutableURLRequest requestWithURL:self.resource.resourceURL cachePolicy:cachePolicy
                                              timeoutInterval:60];
+    if ([aManager hasStoredDataForResource:aResource]) {
+        [self prepareConditionalRequest:dataRequest];
+    }
+    // partial data is written as is, so it is not kept when data is encrypted
+    self.partialDataPath = [aManager encryptionKey] == nil ? [aManager partialDownloadPathForResource:aResource] : nil;
+    [self prepareResumeRequest:dataRequest];
 	self.urlRequest = dataRequest;
 //    if (self.httpClient) {
 //        [self.httpClient willSendRequest:dataRequest];
 //    }
 
-    self.theConnection = [[NSURLConnection alloc] initWithRequest:dataRequest delegate:self startImmediately:YES];
+    self.theConnection = [self startConnectionWithRequest:dataRequest];
 
     if (self.theConnection == nil) {
         self.urlData = nil;
@@ -96,21 +172,432 @@
     } else {
         NSLog(@"Start loading url:%@", self.resource.resourceURL);//Info
         self.urlData = [MKResourceBuffer buffer];
+        self.urlData.temporaryDirectory = [aManager temporaryDirectoryPath];
+        self.urlData.pool = [aManager downloadBufferPool];
+        self.urlData.maxMemoryLength = [aManager downloadBufferMaxMemoryLength];
+        self.urlData.computesDigest = [aManager deduplicatesData];
+        self.urlData.encryptionKey = [aManager encryptionKey];
+    }
+}
+
+// Asks server to send the data only if it has changed since it was downloaded
+- (void)prepareConditionalRequest:(NSMutableURLRequest*)request {
+    if (self.resource.eTag == nil && self.resource.lastModified == nil) {
+        return;
+    }
+    if (self.resource.eTag != nil) {
+        [request setValue:self.resource.eTag forHTTPHeaderField:@"If-None-Match"];
+    }
+    if (self.resource.lastModified != nil) {
+        [request setValue:self.resource.lastModified forHTTPHeaderField:@"If-Modified-Since"];
+    }
+      // response 304 is delivered as is only if the URL cache is not consulted
+    [request setCachePolicy:NSURLRequestReloadIgnoringLocalCacheData];
+}
+
+#pragma mark - Resumable download
+
+- (NSString*)validatorPath {
+    return [self.partialDataPath stringByAppendingPathExtension:MKResourceValidatorFileExtension];
+}
+
+- (void)removePartialData {
+    if (self.partialDataPath == nil) {
+        return;
+    }
+    [[NSFileManager defaultManager] removeItemAtPath:self.partialDataPath error:nil];
+    [[NSFileManager defaultManager] removeItemAtPath:[self validatorPath] error:nil];
+}
+
+// Returns validator that may be sent in If-Range header. Weak entity tags can not be used for ranges.
++ (NSString*)rangeValidatorFromETag:(NSString*)eTag lastModified:(NSString*)lastModified {
+    if (eTag != nil && ![eTag hasPrefix:@"W/"]) {
+        return eTag;
+    }
+    return lastModified;
+}
+
+// Asks for the rest of the data if partial data of the resource has been kept by previous download
+- (void)prepareResumeRequest:(NSMutableURLRequest*)request {
+    _resumeOffset = 0;
+    if (self.partialDataPath == nil) {
+        return;
+    }
+    
+    NSDictionary* validator = [NSDictionary dictionaryWithContentsOfFile:[self validatorPath]];
+    NSString* rangeValidator = [MKResourceDownloadWork rangeValidatorFromETag:[validator objectForKey:MKResourceValidatorETagKey]
+                                                                  lastModified:[validator objectForKey:MKResourceValidatorLastModifiedKey]];
+    NSDictionary* attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:self.partialDataPath error:nil];
+    if (rangeValidator == nil ||
+        [attributes fileSize] == 0 ||
+        ![[validator objectForKey:MKResourceValidatorURLKey] isEqualToString:[request.URL absoluteString]]) {
+        return;
     }
+    
+    _resumeOffset = [attributes fileSize];
+    [request setValue:[NSString stringWithFormat:@"bytes=%llu-", _resumeOffset] forHTTPHeaderField:@"Range"];
+    [request setValue:rangeValidator forHTTPHeaderField:@"If-Range"];
+    // ranges of encoded body would not continue the decoded partial data
+    [request setValue:@"identity" forHTTPHeaderField:@"Accept-Encoding"];
+      // partial response must not be answered from or stored to the URL cache
+    [request setCachePolicy:NSURLRequestReloadIgnoringLocalCacheData];
+    NSLog(@"Resume loading url:%@ from offset:%llu", request.URL, _resumeOffset);//Info
+}
+
+// Returns first byte position from Content-Range header, e.g. "bytes 100-999/1000", or -1 if the header is malformed
++ (long long)firstBytePositionFromContentRange:(NSString*)contentRange totalLength:(long long*)totalLength {
+    NSScanner* scanner = [NSScanner scannerWithString:contentRange];
+    long long firstBytePosition = -1;
+    long long lastBytePosition = -1;
+    if (![scanner scanString:@"bytes" intoString:NULL] ||
+        ![scanner scanLongLong:&firstBytePosition] ||
+        ![scanner scanString:@"-" intoString:NULL] ||
+        ![scanner scanLongLong:&lastBytePosition] ||
+        ![scanner scanString:@"/" intoString:NULL]) {
+        return -1;
+    }
+    if (![scanner scanLongLong:totalLength]) {
+        *totalLength = -1;
+    }
+    return firstBytePosition;
+}
+
+// Chooses buffer for the response. Large responses with validator are written to the partial data file,
+// so they can be resumed after cancel, failure or restart.
+// Returns NO if the download has been restarted.
+- (BOOL)prepareBufferForResponse:(NSHTTPURLResponse*)httpResponse {
+    NSDictionary* headers = [httpResponse allHeaderFields];
+    
+    if (_resumeOffset > 0) {
+        if (_statusCode == 206) {
+            long long totalLength = -1;
+            long long firstBytePosition = [MKResourceDownloadWork firstBytePositionFromContentRange:[headers objectForKey:@"Content-Range"] totalLength:&totalLength];
+            MKResourceBuffer* buffer = [MKResourceBuffer bufferWithPartialFileAtPath:self.partialDataPath];
+            if (firstBytePosition >= 0 && (unsigned long long)firstBytePosition == _resumeOffset && [buffer length] == _resumeOffset) {
+                self.urlData = buffer;
+                [self.resource setExpectedContentLength:totalLength >= 0 ? totalLength : [httpResponse expectedContentLength] + _resumeOffset];
+                [self.resource setDownloadedLength:[buffer length]];
+                return YES;
+            }
+        }
+        if (_statusCode == 206 || _statusCode == 416) {
+              // the partial data does not match the range sent by server
+            NSLog(@"Fail to resume loading url:%@ with status code: %ld", self.resource.resourceURL, (long)_statusCode);//Warning
+            [self restartWithoutRange];
+            return NO;
+        }
+        if ((_statusCode / 100) != 2) {
+              // the partial data is kept for next attempt
+            return YES;
+        }
+          // the server ignored the range or the resource has changed, the full data is sent
+        _resumeOffset = 0;
+    }
+    
+    [self removePartialData];
+    if ((_statusCode / 100) != 2 || self.partialDataPath == nil) {
+        return YES;
+    }
+    
+    long long contentLength = [httpResponse expectedContentLength];
+    NSString* eTag = [headers objectForKey:@"Etag"];
+    NSString* lastModified = [headers objectForKey:@"Last-Modified"];
+    BOOL acceptsRanges = ![[headers objectForKey:@"Accept-Ranges"] isEqualToString:@"none"];
+    if (acceptsRanges &&
+        [MKResourceDownloadWork rangeValidatorFromETag:eTag lastModified:lastModified] != nil &&
+        (contentLength < 0 || contentLength >= MKResourceResumableDownloadMinLength)) {
+        NSMutableDictionary* validator = [NSMutableDictionary dictionary];
+        [validator setObject:[self.resource.resourceURL absoluteString] forKey:MKResourceValidatorURLKey];
+        if (eTag != nil) {
+            [validator setObject:eTag forKey:MKResourceValidatorETagKey];
+        }
+        if (lastModified != nil) {
+            [validator setObject:lastModified forKey:MKResourceValidatorLastModifiedKey];
+        }
+        if ([validator writeToFile:[self validatorPath] atomically:YES]) {
+            [[NSFileManager defaultManager] createFileAtPath:self.partialDataPath contents:nil attributes:nil];
+            self.urlData = [MKResourceBuffer bufferWithPartialFileAtPath:self.partialDataPath];
+            self.urlData.computesDigest = [self.manager deduplicatesData];
+        }
+    }
+    return YES;
+}
+
+- (void)restartWithoutRange {
+    [self.theConnection cancel];
+    [self removePartialData];
+    _resumeOffset = 0;
+    _statusCode = 0;
+    
+    NSMutableURLRequest* dataRequest = [NSMutableURLRequest requestWithURL:self.resource.resourceURL cachePolicy:NSURLRequestReloadIgnoringLocalCacheData
+                                                           timeoutInterval:60];
+    self.urlRequest = dataRequest;
+    self.theConnection = [self startConnectionWithRequest:dataRequest];
+    if (self.theConnection == nil) {
+        self.urlData = nil;
+        [self.resource didFinishDownloadMR:nil error:nil httpResponse:nil];
+    }
+}
+
+// In thread-safe mode delegate messages are delivered on the serial network queue of the manager
+- (NSURLConnection*)startConnectionWithRequest:(NSURLRequest*)request {
+    NSURLConnection* connection = [[NSURLConnection alloc] initWithRequest:request delegate:self startImmediately:NO];
+    NSOperationQueue* delegateQueue = [self.manager networkDelegateQueue];
+    if (delegateQueue != nil) {
+        [connection setDelegateQueue:delegateQueue];
+    }
+    [connection start];
+    return connection;
 }
 
 - (void)cancelLoading {
     [self.theConnection cancel];
     self.theConnection = nil;
+    [self cancelSegments];
 }
 
+#pragma mark - Segmented download
+
+// Returns YES if the response is worth fetching in several ranges
+- (BOOL)shouldSegmentResponse:(NSHTTPURLResponse*)httpResponse {
+    unsigned long long minLength = [self.manager segmentedDownloadMinimumLength];
+    long long contentLength = [httpResponse expectedContentLength];
+    if (_statusCode != 200 || _resumeOffset > 0 || minLength == 0 || contentLength <= 0 || (unsigned long long)contentLength < minLength) {
+        return NO;
+    }
+    if ([self.manager encryptionKey] != nil) {
+        // ranges are written in place to a plain file
+        return NO;
+    }
+    NSDictionary* headers = [httpResponse allHeaderFields];
+    NSString* contentEncoding = [headers objectForKey:@"Content-Encoding"];
+    if (contentEncoding != nil && [contentEncoding caseInsensitiveCompare:@"identity"] != NSOrderedSame) {
+        // length and ranges of encoded body count encoded bytes, while the connection hands over decoded data
+        return NO;
+    }
+    NSString* acceptRanges = [headers objectForKey:@"Accept-Ranges"];
+    // ranges of different versions of the resource must not be mixed, If-Range guards them
+    return acceptRanges != nil && [acceptRanges rangeOfString:@"bytes" options:NSCaseInsensitiveSearch].location != NSNotFound &&
+           [MKResourceDownloadWork rangeValidatorFromETag:[headers objectForKey:@"Etag"] lastModified:[headers objectForKey:@"Last-Modified"]] != nil;
+}
+
+// Splits the rest of the response into ranges fetched by additional connections, as many as there are free download slots.
+// Returns NO if the response is received over one connection.
+- (BOOL)startSegmentsForResponse:(NSHTTPURLResponse*)httpResponse {
+    unsigned long long contentLength = (unsigned long long)[httpResponse expectedContentLength];
+    NSUInteger segmentsCount = (NSUInteger)MIN((unsigned long long)MAX([self.manager maxDownloadSegmentsCount], 1U), MAX(contentLength / MKResourceDownloadSegmentMinLength, 1ULL));
+    if (segmentsCount < 2) {
+        return NO;
+    }
+    NSUInteger additionalCount = [self.manager acquireDownloadSlotsForResource:self.resource count:segmentsCount - 1];
+    if (additionalCount == 0) {
+        return NO;
+    }
+    segmentsCount = additionalCount + 1;
+
+    NSString* path = [[self.manager temporaryDirectoryPath] stringByAppendingPathComponent:[NSString stringWithFormat:@"segments%@", [[NSProcessInfo processInfo] globallyUniqueString]]];
+    int file = open([path fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0 || !MKPreallocateFile(file, contentLength)) {
+        NSLog(@"%@: Fail to create file of %llu bytes for segmented download, %s", NSStringFromClass ([self class]), contentLength, strerror(errno));//Warning
+        if (file >= 0) {
+            close(file);
+            unlink([path fileSystemRepresentation]);
+        }
+        for (NSUInteger i = 0; i < additionalCount; i++) {
+            [self.manager releaseDownloadSlotForResource:self.resource];
+        }
+        return NO;
+    }
+    _segmentsFile = file;
+    _segmentsFilePath = path;
+    _finishedSegmentsCount = 0;
+    _segmentsReceivedLength = 0;
+    // ranges are not resumable, the partial data file is not used
+    [self removePartialData];
+    self.urlData = nil;
+
+    NSDictionary* headers = [httpResponse allHeaderFields];
+    NSString* rangeValidator = [MKResourceDownloadWork rangeValidatorFromETag:[headers objectForKey:@"Etag"] lastModified:[headers objectForKey:@"Last-Modified"]];
+    unsigned long long segmentLength = (contentLength + segmentsCount - 1) / segmentsCount;
+    _segments = [[NSMutableArray alloc] initWithCapacity:segmentsCount];
+    for (NSUInteger i = 0; i < segmentsCount; i++) {
+        MKResourceDownloadSegment* segment = [[MKResourceDownloadSegment alloc] init];
+        segment.offset = i * segmentLength;
+        segment.length = MIN(segmentLength, contentLength - segment.offset);
+        [_segments addObject:segment];
+        if (i == 0) {
+            segment.statusCode = _statusCode;
+            segment.connection = self.theConnection;
+        } else {
+            NSMutableURLRequest* request = [NSMutableURLRequest requestWithURL:self.resource.resourceURL cachePolicy:NSURLRequestReloadIgnoringLocalCacheData
+                                                               timeoutInterval:60];
+            [request setValue:[NSString stringWithFormat:@"bytes=%llu-%llu", segment.offset, segment.offset + segment.length - 1] forHTTPHeaderField:@"Range"];
+            [request setValue:rangeValidator forHTTPHeaderField:@"If-Range"];
+            [request setValue:@"identity" forHTTPHeaderField:@"Accept-Encoding"];
+            segment.connection = [self startConnectionWithRequest:request];
+        }
+    }
+    NSLog(@"Load url:%@ in %lu ranges of %llu bytes", self.resource.resourceURL, (unsigned long)segmentsCount, segmentLength);//Info
+    return YES;
+}
+
+- (MKResourceDownloadSegment*)segmentForConnection:(NSURLConnection*)connection {
+    for (MKResourceDownloadSegment* segment in _segments) {
+        if (segment.connection == connection) {
+            return segment;
+        }
+    }
+    return nil;
+}
+
+// Cancels connections of the ranges and removes their data
+- (void)cancelSegments {
+    for (MKResourceDownloadSegment* segment in _segments) {
+        [segment.connection cancel];
+        segment.connection = nil;
+    }
+    _segments = nil;
+    if (_segmentsFile >= 0) {
+        close(_segmentsFile);
+        _segmentsFile = -1;
+    }
+    if (_segmentsFilePath != nil) {
+        unlink([_segmentsFilePath fileSystemRepresentation]);
+        _segmentsFilePath = nil;
+    }
+}
+
+- (void)handleResponse:(NSURLResponse*)response ofSegment:(MKResourceDownloadSegment*)segment {
+    NSHTTPURLResponse* httpResponse = (NSHTTPURLResponse*) response;
+    segment.statusCode = [httpResponse statusCode];
+    long long totalLength = -1;
+    long long firstBytePosition = -1;
+    if (segment.statusCode == 206) {
+        firstBytePosition = [MKResourceDownloadWork firstBytePositionFromContentRange:[[httpResponse allHeaderFields] objectForKey:@"Content-Range"] totalLength:&totalLength];
+    }
+    if (firstBytePosition < 0 || (unsigned long long)firstBytePosition != segment.offset ||
+        (totalLength >= 0 && totalLength != self.resource.expectedContentLength)) {
+          // the server has ignored the range or the resource has changed since the first response
+        NSLog(@"Fail to load range at offset:%llu of url:%@ with status code: %ld", segment.offset, self.resource.resourceURL, (long)segment.statusCode);//Error
+        [self handleError:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorBadServerResponse userInfo:nil]];
+    }
+}
+
+- (void)handleData:(NSData*)incrementalData ofSegment:(MKResourceDownloadSegment*)segment {
+    if ((segment.statusCode / 100) != 2) {
+        return;
+    }
+    // the first connection receives the whole data, only its range is kept
+    size_t length = (size_t)MIN((unsigned long long)[incrementalData length], segment.length - segment.receivedLength);
+    if (!MKWriteAllBytesAtOffset(_segmentsFile, [incrementalData bytes], length, segment.offset + segment.receivedLength)) {
+        [self handleError:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil]];
+        return;
+    }
+    segment.receivedLength += length;
+    _segmentsReceivedLength += length;
+    [[self.manager metrics] addValue:length toCounter:MKResourceMetricsCounterBytesDownloaded];
+    [self.resource setDownloadedLength:(NSUInteger)_segmentsReceivedLength];
+    if (segment.receivedLength == segment.length) {
+        [segment.connection cancel];
+        segment.connection = nil;
+        [self didFinishSegment];
+    }
+}
+
+- (void)handleFinishLoadingOfSegment:(MKResourceDownloadSegment*)segment {
+    if (segment.receivedLength < segment.length) {
+        NSLog(@"Fail to load range at offset:%llu of url:%@, received %llu of %llu bytes", segment.offset, self.resource.resourceURL, segment.receivedLength, segment.length);//Error
+        [self handleError:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorNetworkConnectionLost userInfo:nil]];
+    }
+}
+
+// The slot of finished range is given to queued downloads. The file is handed over to the manager when all the ranges are received.
+- (void)didFinishSegment {
+    _finishedSegmentsCount++;
+    if (_finishedSegmentsCount < [_segments count]) {
+        [self.manager releaseDownloadSlotForResource:self.resource];
+        return;
+    }
+    close(_segmentsFile);
+    _segmentsFile = -1;
+    MKResourceBuffer* buffer = [MKResourceBuffer bufferWithFileAtPath:_segmentsFilePath];
+    // ranges arrive out of order, the assembled file is read once when the manager asks for the digest
+    buffer.computesDigest = [self.manager deduplicatesData];
+    _segmentsFilePath = nil;
+    _segments = nil;
+    [self.resource didFinishDownloadMRWithBuffer:buffer error:nil httpResponse:self.urlResponse];
+}
+
+#pragma mark - NSURLConnection delegate
+
+// Messages of a cancelled or replaced connection are ignored. The manager lock serializes them with
+// the calls made from other threads when the manager is thread-safe.
 - (void)connection:(NSURLConnection*)connection didReceiveResponse:(NSURLResponse*)response {
+    [self.manager lock];
+    if (connection == self.theConnection) {
+        [self handleResponse:response];
+    } else {
+        MKResourceDownloadSegment* segment = [self segmentForConnection:connection];
+        if (segment != nil) {
+            [self handleResponse:response ofSegment:segment];
+        }
+    }
+    [self.manager unlock];
+}
+
+- (void)connection:(NSURLConnection*)connection didReceiveData:(NSData*)incrementalData {
+    [self.manager lock];
+    if (connection == self.theConnection) {
+        [self handleData:incrementalData];
+    } else {
+        MKResourceDownloadSegment* segment = [self segmentForConnection:connection];
+        if (segment != nil) {
+            [self handleData:incrementalData ofSegment:segment];
+        }
+    }
+    [self.manager unlock];
+}
+
+- (void)connectionDidFinishLoading:(NSURLConnection*)connection {
+    [self.manager lock];
+    if (connection == self.theConnection) {
+        [self handleFinishLoading];
+    } else {
+        MKResourceDownloadSegment* segment = [self segmentForConnection:connection];
+        if (segment != nil) {
+            [self handleFinishLoadingOfSegment:segment];
+        }
+    }
+    [self.manager unlock];
+}
+
+- (void)connection:(NSURLConnection*)connection didFailWithError:(NSError*)error {
+    [self.manager lock];
+    if (connection == self.theConnection || [self segmentForConnection:connection] != nil) {
+        [self handleError:error];
+    }
+    [self.manager unlock];
+}
+
+#pragma mark - Private
+
+- (void)handleResponse:(NSURLResponse*)response {
     NSHTTPURLResponse* httpResponse = (NSHTTPURLResponse*) response;
     self.urlResponse = httpResponse;
     
     _statusCode = [httpResponse statusCode];
+    if (self.resource.downloadStartTime > 0.0) {
+        NSTimeInterval timeToFirstByte = CFAbsoluteTimeGetCurrent() - self.resource.downloadStartTime;
+        [[self.manager metrics] addDuration:timeToFirstByte toLatency:MKResourceMetricsLatencyTimeToFirstByte];
+        [self.manager traceEvent:MKResourceTraceEventReceivedResponse forResource:self.resource duration:timeToFirstByte];
+    }
     NSDictionary* dict = [httpResponse allHeaderFields];
     NSLog(@"response headers = %@ with status code: %ld", dict, (long)_statusCode);//Info
+    
+    if (![self prepareBufferForResponse:httpResponse] || _statusCode == 304) {
+          // response 304 Not Modified describes the cached data, the resource keeps its content type and length
+        return;
+    }
 
     NSString* contentType = [dict objectForKey:@"Content-Type"];
     if (contentType == nil || [contentType isEqualToString:@""]) {
@@ -118,23 +605,59 @@
     }
     [self.resource setContentType:contentType];
 
-    long long contentLength = [response expectedContentLength];
-    [self.resource setExpectedContentLength:contentLength];
+    if (_resumeOffset == 0) {
+        long long contentLength = [response expectedContentLength];
+        [self.resource setExpectedContentLength:contentLength];
+    }
+    if ([self shouldSegmentResponse:httpResponse] && [self startSegmentsForResponse:httpResponse]) {
+        return;
+    }
+    if (_resumeOffset == 0) {
+        [self.urlData prepareForExpectedLength:[response expectedContentLength]];
+    }
 }
 
-- (void)connection:(NSURLConnection*)connection didReceiveData:(NSData*)incrementalData {
+- (void)handleData:(NSData*)incrementalData {
+    if (_segments != nil) {
+        [self handleData:incrementalData ofSegment:[_segments objectAtIndex:0]];
+        return;
+    }
     long code = _statusCode / 100;
     if (code == 2) {
         [self.urlData appendData:incrementalData];
+        [[self.manager metrics] addValue:[incrementalData length] toCounter:MKResourceMetricsCounterBytesDownloaded];
         NSUInteger downloadedLength = [self.urlData length];
         [self.resource setDownloadedLength:downloadedLength];
     }
 }
 
-- (void)connectionDidFinishLoading:(NSURLConnection*)connection {
-    if ((_statusCode / 100) == 2) {
+- (NSCachedURLResponse*)connection:(NSURLConnection*)connection willCacheResponse:(NSCachedURLResponse*)cachedResponse {
+    if (![self.manager usesSharedURLCache] || _resumeOffset > 0 || _segments != nil) {
+        return nil;
+    }
+    return cachedResponse;
+}
+
+- (void)handleFinishLoading {
+    if (_segments != nil) {
+          // the first connection is cancelled when its range is received, so the response has been cut short
+        [self handleFinishLoadingOfSegment:[_segments objectAtIndex:0]];
+        return;
+    }
+    if (_statusCode == 304) {
+          // the cached data is still valid, nothing is written
+        self.urlData = nil;
+        [self.resource didFinishDownloadMRWithBuffer:nil error:nil httpResponse:self.urlResponse];
+    } else if ((_statusCode / 100) == 2) {
           // status 200, OK
-        [self.resource didFinishDownloadMR:[self.urlData data] error:nil httpResponse:self.urlResponse];
+          // the buffer is handed over to the manager, which moves its file into the cache.
+          // Empty body is stored as empty data, only nil buffer of response 304 keeps the cached data.
+        MKResourceBuffer* buffer = self.urlData ?: [MKResourceBuffer buffer];
+        self.urlData = nil;
+        [[NSFileManager defaultManager] removeItemAtPath:[self validatorPath] error:nil];
+        [self.resource didFinishDownloadMRWithBuffer:buffer error:nil httpResponse:self.urlResponse];
+        // data that has not been moved into the cache is not resumable
+        [[NSFileManager defaultManager] removeItemAtPath:self.partialDataPath error:nil];
     } else {
           // !OK
         NSError *mediaError = [self formattedError];
@@ -146,8 +669,11 @@
     }
 }
 
-- (void)connection:(NSURLConnection*)connection didFailWithError:(NSError*)error {
+- (void)handleError:(NSError*)error {
     NSLog(@"Error download data, url=%@: %@", self.resource.resourceURL, [error localizedDescription]);//Error
+    // failure of any range fails the download; the slots of the ranges are given back when it finishes
+    [self.theConnection cancel];
+    [self cancelSegments];
     self.httpError = error;
     NSError *mediaError = [self formattedError];
 	[self.resource didFinishDownloadMR:nil error:mediaError httpResponse:self.urlResponse];
@@ -0,0 +1,65 @@
+//
+//  MKResourceIndex.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MKResource;
+
+/**
+ * Persistent index of downloaded resources.
+ * The index consists of a snapshot file and an append-only journal of changes. Every save appends
+ * records only for the changed resources. When the journal grows comparable to the snapshot it is
+ * merged into a new snapshot in background, so the cost of persisting is proportional to the changes.
+ * Records are framed with length and checksum, so a torn tail left by a crash is dropped on restore.
+ * Shared index may be used by several processes at once. Its files are changed under an exclusive lock
+ * of a lock file next to them, and each process reads records appended by the others with changedResources.
+ */
+@interface MKResourceIndex : NSObject {
+@private
+    NSString*           _snapshotPath;
+    NSString*           _journalPath;
+    dispatch_queue_t    _queue;
+    int                 _journalDescriptor;
+    uint64_t            _generation;
+    unsigned long long  _snapshotLength;
+    unsigned long long  _journalLength;
+    BOOL                _shared;
+    int                 _lockDescriptor;
+    uint64_t            _readGeneration;
+    unsigned long long  _readLength;
+    volatile BOOL       _restored;
+}
+
+- (id)initWithDirectoryPath:(NSString*)path;
+- (id)initWithDirectoryPath:(NSString*)path shared:(BOOL)shared;
+
+/** Reads snapshot and journal and returns resources in the state they were last saved.
+ *  Saves made before the index is restored are queued till restore finishes, so they never overwrite
+ *  the journal before it is read. waitUntilSaved waits for restore as well.
+ *  @return Array of MKResource objects without resource manager.
+ */
+- (NSArray*)restoreResources;
+
+/** Saves state of the resources. Downloaded resources are written to the index, the others are removed from it.
+ *  Records are encoded on the calling thread and written in background.
+ *  @param resources Array of MKResource objects
+ */
+- (void)saveResources:(NSArray*)resources;
+
+/** Blocks until all the scheduled writes are finished.
+ */
+- (void)waitUntilSaved;
+
+/** Reads records appended to the shared index by other processes since the previous call.
+ *  If another process has compacted the index meanwhile, all the resources are read again.
+ *  @return Array of MKResource objects without resource manager in the state they were last saved,
+ *  removed ones have status MKStatusNotDownloaded. nil if the index is not shared or there are no changes.
+ */
+- (NSArray*)changedResources;
+
+@end
@@ -0,0 +1,713 @@
+//
+//  MKResourceIndex.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceIndex.h"
+#import "MKResource+Private.h"
+#import "MKResourceUtility.h"
+#import "MKResourceUtility+Private.h"
+#import <zlib.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/file.h>
+#import <sys/stat.h>
+
+static NSString* const MKResourceIndexSnapshotFileName = @"ResourceIndex.snapshot";
+static NSString* const MKResourceIndexJournalFileName = @"ResourceIndex.journal";
+// Locked by the processes sharing the index while they change or read its files
+static NSString* const MKResourceIndexLockFileName = @"ResourceIndex.lock";
+
+static uint32_t const MKResourceIndexSnapshotMagic = 0x53524B4D; // "MKRS"
+static uint32_t const MKResourceIndexJournalMagic = 0x4A524B4D; // "MKRJ"
+static uint32_t const MKResourceIndexVersion = 1;
+static size_t const MKResourceIndexHeaderLength = 16;
+static size_t const MKResourceIndexRecordHeaderLength = 8;
+static unsigned long long const MKResourceIndexMinimumCompactionLength = 256 * 1024;
+static NSUInteger const MKResourceIndexWriteChunkLength = 256 * 1024;
+
+typedef enum {
+    MKResourceIndexRecordPut = 1,
+    MKResourceIndexRecordRemove = 2
+} MKResourceIndexRecordType;
+
+typedef enum {
+    MKResourceIndexFieldURL = 1,
+    MKResourceIndexFieldStatus = 2,
+    MKResourceIndexFieldExpectedContentLength = 3,
+    MKResourceIndexFieldStoredLength = 4,
+    MKResourceIndexFieldLoadedDate = 5,
+    MKResourceIndexFieldLastAccessDate = 6,
+    MKResourceIndexFieldExpirationPeriod = 7,
+    MKResourceIndexFieldContentType = 8,
+    MKResourceIndexFieldETag = 9,
+    MKResourceIndexFieldLastModified = 10,
+    MKResourceIndexFieldContentDigest = 11,
+    MKResourceIndexFieldCompressed = 12
+} MKResourceIndexField;
+
+#pragma mark - Encoding
+
+static void MKIndexAppendField(NSMutableData* data, uint8_t tag, const void* bytes, uint16_t length) {
+    uint16_t littleLength = CFSwapInt16HostToLittle(length);
+    [data appendBytes:&tag length:sizeof(tag)];
+    [data appendBytes:&littleLength length:sizeof(littleLength)];
+    [data appendBytes:bytes length:length];
+}
+
+static void MKIndexAppendUInt64(NSMutableData* data, uint8_t tag, uint64_t value) {
+    uint64_t littleValue = CFSwapInt64HostToLittle(value);
+    MKIndexAppendField(data, tag, &littleValue, sizeof(littleValue));
+}
+
+static void MKIndexAppendDouble(NSMutableData* data, uint8_t tag, double value) {
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    MKIndexAppendUInt64(data, tag, bits);
+}
+
+static void MKIndexAppendDate(NSMutableData* data, uint8_t tag, NSDate* date) {
+    if (date != nil) {
+        MKIndexAppendDouble(data, tag, [date timeIntervalSinceReferenceDate]);
+    }
+}
+
+static BOOL MKIndexAppendString(NSMutableData* data, uint8_t tag, NSString* string) {
+    const char* utf8String = [string UTF8String];
+    if (utf8String == NULL) {
+        return NO;
+    }
+    size_t length = strlen(utf8String);
+    if (length > UINT16_MAX) {
+        return NO;
+    }
+    MKIndexAppendField(data, tag, utf8String, (uint16_t)length);
+    return YES;
+}
+
+// Appends record framing: payload length and checksum followed by payload
+static void MKIndexAppendRecord(NSMutableData* data, const void* payload, uint32_t payloadLength) {
+    uint32_t header[2];
+    header[0] = CFSwapInt32HostToLittle(payloadLength);
+    header[1] = CFSwapInt32HostToLittle((uint32_t)crc32(0, payload, payloadLength));
+    [data appendBytes:header length:sizeof(header)];
+    [data appendBytes:payload length:payloadLength];
+}
+
+#pragma mark - Decoding
+
+static uint64_t MKIndexReadUInt64(const uint8_t* bytes) {
+    uint64_t value = 0;
+    memcpy(&value, bytes, sizeof(value));
+    return CFSwapInt64LittleToHost(value);
+}
+
+static uint32_t MKIndexReadUInt32(const uint8_t* bytes) {
+    uint32_t value = 0;
+    memcpy(&value, bytes, sizeof(value));
+    return CFSwapInt32LittleToHost(value);
+}
+
+static double MKIndexReadDouble(const uint8_t* bytes) {
+    uint64_t bits = MKIndexReadUInt64(bytes);
+    double value = 0;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Returns next valid record payload. Returns NO at the end of data or at the first torn or corrupted record.
+static BOOL MKIndexNextRecord(const uint8_t* bytes, size_t length, size_t* offset, const uint8_t** payload, uint32_t* payloadLength) {
+    if (length < *offset + MKResourceIndexRecordHeaderLength) {
+        return NO;
+    }
+    uint32_t recordLength = MKIndexReadUInt32(bytes + *offset);
+    uint32_t checksum = MKIndexReadUInt32(bytes + *offset + 4);
+    if (recordLength == 0 || recordLength > length - *offset - MKResourceIndexRecordHeaderLength) {
+        return NO;
+    }
+    const uint8_t* recordPayload = bytes + *offset + MKResourceIndexRecordHeaderLength;
+    if ((uint32_t)crc32(0, recordPayload, recordLength) != checksum) {
+        return NO;
+    }
+    *payload = recordPayload;
+    *payloadLength = recordLength;
+    *offset += MKResourceIndexRecordHeaderLength + recordLength;
+    return YES;
+}
+
+// Iterates fields of the record payload. The first byte of payload is record type.
+static void MKIndexEnumerateFields(const uint8_t* payload, uint32_t payloadLength, void (^block)(uint8_t tag, const uint8_t* bytes, uint16_t length)) {
+    size_t offset = 1;
+    while (offset + 3 <= payloadLength) {
+        uint8_t tag = payload[offset];
+        uint16_t length = 0;
+        memcpy(&length, payload + offset + 1, sizeof(length));
+        length = CFSwapInt16LittleToHost(length);
+        offset += 3;
+        if (offset + length > payloadLength) {
+            break;
+        }
+        block(tag, payload + offset, length);
+        offset += length;
+    }
+}
+
+static NSString* MKIndexRecordURLString(const uint8_t* payload, uint32_t payloadLength) {
+    __block NSString* urlString = nil;
+    MKIndexEnumerateFields(payload, payloadLength, ^(uint8_t tag, const uint8_t* bytes, uint16_t length) {
+        if (tag == MKResourceIndexFieldURL && urlString == nil) {
+            urlString = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+        }
+    });
+    return urlString;
+}
+
+static BOOL MKIndexReadHeader(NSData* data, uint32_t magic, uint64_t* generation) {
+    if ([data length] < MKResourceIndexHeaderLength) {
+        return NO;
+    }
+    const uint8_t* bytes = [data bytes];
+    if (MKIndexReadUInt32(bytes) != magic || MKIndexReadUInt32(bytes + 4) != MKResourceIndexVersion) {
+        return NO;
+    }
+    *generation = MKIndexReadUInt64(bytes + 8);
+    return YES;
+}
+
+static NSData* MKIndexHeader(uint32_t magic, uint64_t generation) {
+    uint32_t header[2];
+    header[0] = CFSwapInt32HostToLittle(magic);
+    header[1] = CFSwapInt32HostToLittle(MKResourceIndexVersion);
+    uint64_t littleGeneration = CFSwapInt64HostToLittle(generation);
+    NSMutableData* data = [NSMutableData dataWithBytes:header length:sizeof(header)];
+    [data appendBytes:&littleGeneration length:sizeof(littleGeneration)];
+    return data;
+}
+
+static BOOL MKIndexWriteAll(int fileDescriptor, const void* bytes, size_t length) {
+    const uint8_t* buffer = bytes;
+    while (length > 0) {
+        ssize_t written = write(fileDescriptor, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NO;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return YES;
+}
+
+static NSData* MKIndexReadAll(int fileDescriptor, unsigned long long offset, size_t length) {
+    NSMutableData* data = [NSMutableData dataWithLength:length];
+    uint8_t* buffer = [data mutableBytes];
+    size_t readLength = 0;
+    while (readLength < length) {
+        ssize_t result = pread(fileDescriptor, buffer + readLength, length - readLength, (off_t)(offset + readLength));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        readLength += result;
+    }
+    [data setLength:readLength];
+    return data;
+}
+
+
+@implementation MKResourceIndex
+
+- (id)initWithDirectoryPath:(NSString*)path {
+    self = [super init];
+    if (self != nil) {
+        _snapshotPath = [path stringByAppendingPathComponent:MKResourceIndexSnapshotFileName];
+        _journalPath = [path stringByAppendingPathComponent:MKResourceIndexJournalFileName];
+        _queue = dispatch_queue_create("MKResourceIndex journal queue", NULL);
+        // nothing is written till the journal is read by restoreResources
+        dispatch_suspend(_queue);
+        _journalDescriptor = -1;
+        _lockDescriptor = -1;
+    }
+    return self;
+}
+
+- (id)initWithDirectoryPath:(NSString*)path shared:(BOOL)shared {
+    self = [self initWithDirectoryPath:path];
+    if (self != nil) {
+        _shared = shared;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    if (!_restored) {
+        // suspended queue can not be released
+        dispatch_resume(_queue);
+    }
+    if (_journalDescriptor >= 0) {
+        close(_journalDescriptor);
+    }
+    if (_lockDescriptor >= 0) {
+        close(_lockDescriptor);
+    }
+}
+
+// Locks the files of shared index against other processes, operation is LOCK_SH, LOCK_EX or LOCK_UN
+- (void)lockFiles:(int)operation {
+    if (_shared && _lockDescriptor < 0) {
+        // the directory may be created after the index
+        NSString* lockPath = [[_snapshotPath stringByDeletingLastPathComponent] stringByAppendingPathComponent:MKResourceIndexLockFileName];
+        _lockDescriptor = open([lockPath fileSystemRepresentation], O_RDONLY | O_CREAT, 0644);
+        if (_lockDescriptor < 0) {
+            NSLog(@"%@: Fail to open resource index lock at path: %@", NSStringFromClass ([self class]), lockPath);//Error
+        }
+    }
+    if (_lockDescriptor >= 0) {
+        while (flock(_lockDescriptor, operation) != 0 && errno == EINTR) {
+        }
+    }
+}
+
+#pragma mark - Records
+
++ (void)appendRecordForResource:(MKResource*)resource toData:(NSMutableData*)data {
+    NSMutableData* payload = [NSMutableData dataWithCapacity:128];
+    uint8_t type = resource.status == MKStatusDownloaded ? MKResourceIndexRecordPut : MKResourceIndexRecordRemove;
+    [payload appendBytes:&type length:sizeof(type)];
+
+    if (!MKIndexAppendString(payload, MKResourceIndexFieldURL, [resource.resourceURL absoluteString])) {
+        NSLog(@"%@: Resource URL can not be indexed: %@", NSStringFromClass ([self class]), resource.resourceURL);//Error
+        return;
+    }
+
+    if (type == MKResourceIndexRecordPut) {
+        uint8_t status = (uint8_t)resource.status;
+        MKIndexAppendField(payload, MKResourceIndexFieldStatus, &status, sizeof(status));
+        MKIndexAppendUInt64(payload, MKResourceIndexFieldExpectedContentLength, (uint64_t)resource.expectedContentLength);
+        MKIndexAppendUInt64(payload, MKResourceIndexFieldStoredLength, resource.storedLength);
+        MKIndexAppendDate(payload, MKResourceIndexFieldLoadedDate, resource.loadedDate);
+        MKIndexAppendDate(payload, MKResourceIndexFieldLastAccessDate, resource.lastAccessDate);
+        MKIndexAppendDouble(payload, MKResourceIndexFieldExpirationPeriod, resource.expirationPeriod);
+        if (resource.contentType != nil) {
+            MKIndexAppendString(payload, MKResourceIndexFieldContentType, resource.contentType);
+        }
+        if (resource.eTag != nil) {
+            MKIndexAppendString(payload, MKResourceIndexFieldETag, resource.eTag);
+        }
+        if (resource.lastModified != nil) {
+            MKIndexAppendString(payload, MKResourceIndexFieldLastModified, resource.lastModified);
+        }
+        if (resource.contentDigest != nil) {
+            MKIndexAppendString(payload, MKResourceIndexFieldContentDigest, resource.contentDigest);
+        }
+        if (resource.storesCompressedData) {
+            uint8_t compressed = 1;
+            MKIndexAppendField(payload, MKResourceIndexFieldCompressed, &compressed, sizeof(compressed));
+        }
+    }
+
+    MKIndexAppendRecord(data, [payload bytes], (uint32_t)[payload length]);
+}
+
++ (MKResource*)resourceWithRecordPayload:(const uint8_t*)payload length:(uint32_t)payloadLength {
+    __block NSString* urlString = nil;
+    __block MKStatus status = MKStatusNotDownloaded;
+    __block long long expectedContentLength = 0;
+    __block unsigned long long storedLength = 0;
+    __block NSDate* loadedDate = nil;
+    __block NSDate* lastAccessDate = nil;
+    __block NSTimeInterval expirationPeriod = -1.0;
+    __block NSString* contentType = nil;
+    __block NSString* eTag = nil;
+    __block NSString* lastModified = nil;
+    __block NSString* contentDigest = nil;
+    __block BOOL compressed = NO;
+
+    MKIndexEnumerateFields(payload, payloadLength, ^(uint8_t tag, const uint8_t* bytes, uint16_t length) {
+        switch (tag) {
+            case MKResourceIndexFieldURL:
+                urlString = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+                break;
+            case MKResourceIndexFieldStatus:
+                if (length == 1) {
+                    status = (MKStatus)bytes[0];
+                }
+                break;
+            case MKResourceIndexFieldExpectedContentLength:
+                if (length == 8) {
+                    expectedContentLength = (long long)MKIndexReadUInt64(bytes);
+                }
+                break;
+            case MKResourceIndexFieldStoredLength:
+                if (length == 8) {
+                    storedLength = MKIndexReadUInt64(bytes);
+                }
+                break;
+            case MKResourceIndexFieldLoadedDate:
+                if (length == 8) {
+                    loadedDate = [NSDate dateWithTimeIntervalSinceReferenceDate:MKIndexReadDouble(bytes)];
+                }
+                break;
+            case MKResourceIndexFieldLastAccessDate:
+                if (length == 8) {
+                    lastAccessDate = [NSDate dateWithTimeIntervalSinceReferenceDate:MKIndexReadDouble(bytes)];
+                }
+                break;
+            case MKResourceIndexFieldExpirationPeriod:
+                if (length == 8) {
+                    expirationPeriod = MKIndexReadDouble(bytes);
+                }
+                break;
+            case MKResourceIndexFieldContentType:
+                contentType = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+                break;
+            case MKResourceIndexFieldETag:
+                eTag = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+                break;
+            case MKResourceIndexFieldLastModified:
+                lastModified = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+                break;
+            case MKResourceIndexFieldContentDigest:
+                contentDigest = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+                break;
+            case MKResourceIndexFieldCompressed:
+                if (length == 1) {
+                    compressed = bytes[0] != 0;
+                }
+                break;
+            default:
+                // fields written by newer versions are skipped
+                break;
+        }
+    });
+
+    NSURL* resourceURL = urlString != nil ? [NSURL URLWithString:urlString] : nil;
+    if (resourceURL == nil) {
+        return nil;
+    }
+
+    MKResource* resource = [[MKResource alloc] initWithResourceManager:nil andURL:resourceURL];
+    [resource setStatus:status];
+    [resource setExpectedContentLength:expectedContentLength];
+    [resource setStoredLength:storedLength];
+    [resource setContentType:contentType];
+    [resource setETag:eTag];
+    [resource setLastModified:lastModified];
+    [resource setContentDigest:contentDigest];
+    [resource setStoresCompressedData:compressed];
+    [resource setExpirationPeriod:expirationPeriod];
+    [resource setLoadedDate:loadedDate];
+    [resource setRestoredLastAccessDate:lastAccessDate];
+    return resource;
+}
+
+// Replays records of data into resourcesByURL, the later record for the same URL wins. Removed resources are
+// kept with status MKStatusNotDownloaded if keepsRemoved is YES. Returns length of the valid part of data.
++ (size_t)replayRecords:(NSData*)data fromOffset:(size_t)offset into:(NSMutableDictionary*)resourcesByURL keepsRemoved:(BOOL)keepsRemoved {
+    const uint8_t* bytes = [data bytes];
+    size_t length = [data length];
+    const uint8_t* payload = NULL;
+    uint32_t payloadLength = 0;
+
+    while (MKIndexNextRecord(bytes, length, &offset, &payload, &payloadLength)) {
+        if (payload[0] == MKResourceIndexRecordPut) {
+            MKResource* resource = [self resourceWithRecordPayload:payload length:payloadLength];
+            if (resource != nil) {
+                [resourcesByURL setObject:resource forKey:[resource.resourceURL absoluteString]];
+            }
+        } else if (payload[0] == MKResourceIndexRecordRemove) {
+            NSString* urlString = MKIndexRecordURLString(payload, payloadLength);
+            NSURL* resourceURL = urlString != nil ? [NSURL URLWithString:urlString] : nil;
+            if (resourceURL != nil && keepsRemoved) {
+                [resourcesByURL setObject:[[MKResource alloc] initWithResourceManager:nil andURL:resourceURL] forKey:urlString];
+            } else if (urlString != nil) {
+                [resourcesByURL removeObjectForKey:urlString];
+            }
+        }
+    }
+    return offset;
+}
+
+#pragma mark - Restore
+
+- (NSArray*)restoreResources {
+    __block NSArray* resources = nil;
+    if (!_restored) {
+        // the queue is suspended, saves made meanwhile run after the journal is read
+        resources = [self readResources];
+        _restored = YES;
+        dispatch_resume(_queue);
+    } else {
+        dispatch_sync(_queue, ^{
+            resources = [self readResources];
+        });
+    }
+    return resources;
+}
+
+// Should be called on the queue or while it is suspended before restore
+- (NSArray*)readResources {
+    NSMutableDictionary* resourcesByURL = [NSMutableDictionary dictionary];
+    // torn tail of the journal is dropped, so no other process may write it meanwhile
+    [self lockFiles:LOCK_EX];
+
+    uint64_t snapshotGeneration = 0;
+    NSData* snapshot = [NSData dataWithContentsOfFile:_snapshotPath options:NSDataReadingMappedIfSafe error:nil];
+    if (MKIndexReadHeader(snapshot, MKResourceIndexSnapshotMagic, &snapshotGeneration)) {
+        _snapshotLength = [MKResourceIndex replayRecords:snapshot fromOffset:MKResourceIndexHeaderLength into:resourcesByURL keepsRemoved:NO];
+    } else {
+        snapshotGeneration = 0;
+        _snapshotLength = 0;
+    }
+    _generation = snapshotGeneration;
+
+    // journal of another generation has already been merged into the snapshot
+    uint64_t journalGeneration = 0;
+    NSData* journal = [NSData dataWithContentsOfFile:_journalPath options:NSDataReadingMappedIfSafe error:nil];
+    size_t validJournalLength = 0;
+    if (MKIndexReadHeader(journal, MKResourceIndexJournalMagic, &journalGeneration) && journalGeneration == _generation) {
+        validJournalLength = [MKResourceIndex replayRecords:journal fromOffset:MKResourceIndexHeaderLength into:resourcesByURL keepsRemoved:NO];
+    }
+    journal = nil;
+    snapshot = nil;
+
+    [self openJournalTruncatingToLength:validJournalLength];
+    _readGeneration = _generation;
+    _readLength = _journalLength;
+    [self lockFiles:LOCK_UN];
+    return [resourcesByURL allValues];
+}
+
+- (void)openJournalTruncatingToLength:(size_t)length {
+    if (_journalDescriptor >= 0) {
+        close(_journalDescriptor);
+    }
+
+    _journalDescriptor = open([_journalPath fileSystemRepresentation], O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (_journalDescriptor < 0) {
+        NSLog(@"%@: Fail to open resource index journal at path: %@", NSStringFromClass ([self class]), _journalPath);//Error
+        return;
+    }
+
+    if (length < MKResourceIndexHeaderLength) {
+        [self resetJournal];
+    } else {
+        // drop torn tail left by a crash
+        ftruncate(_journalDescriptor, length);
+        _journalLength = length;
+    }
+    [MKResourceUtility markNonPurgeableNonBackedUpFileAtURL:[NSURL fileURLWithPath:_journalPath]];
+}
+
+- (void)resetJournal {
+    ftruncate(_journalDescriptor, 0);
+    NSData* header = MKIndexHeader(MKResourceIndexJournalMagic, _generation);
+    MKIndexWriteAll(_journalDescriptor, [header bytes], [header length]);
+    _journalLength = [header length];
+}
+
+#pragma mark - Save
+
+- (void)saveResources:(NSArray*)resources {
+    NSMutableData* records = [NSMutableData data];
+    for (MKResource* resource in resources) {
+        [MKResourceIndex appendRecordForResource:resource toData:records];
+    }
+
+    if ([records length] == 0) {
+        return;
+    }
+
+    dispatch_async(_queue, ^{
+        [self lockFiles:LOCK_EX];
+        if (_shared) {
+            [self synchronizeJournalState];
+        }
+        [self appendRecords:records];
+        if (_journalLength > MKResourceIndexMinimumCompactionLength && _journalLength > _snapshotLength / 2) {
+            [self compact];
+        }
+        [self lockFiles:LOCK_UN];
+    });
+}
+
+- (void)waitUntilSaved {
+    dispatch_sync(_queue, ^{
+    });
+}
+
+- (void)appendRecords:(NSData*)records {
+    if (_journalDescriptor < 0) {
+        // the journal that has failed to open on restore is not truncated unread
+        NSLog(@"%@: Fail to append to resource index journal without descriptor at path: %@", NSStringFromClass ([self class]), _journalPath);//Error
+        return;
+    }
+
+    if (MKIndexWriteAll(_journalDescriptor, [records bytes], [records length])) {
+        if (_readGeneration == _generation && _readLength == _journalLength) {
+            // own records are not read back as changes
+            _readLength += [records length];
+        }
+        _journalLength += [records length];
+    } else {
+        NSLog(@"%@: Fail to append to resource index journal at path: %@", NSStringFromClass ([self class]), _journalPath);//Error
+    }
+}
+
+// Merges the journal into a new snapshot. Memory usage is proportional to the journal, the old snapshot is streamed.
+- (void)compact {
+    NSMutableDictionary* journalRecords = [NSMutableDictionary dictionary];
+    NSMutableArray* journalURLs = [NSMutableArray array];
+    NSData* journal = [NSData dataWithContentsOfFile:_journalPath options:NSDataReadingMappedIfSafe error:nil];
+    const uint8_t* bytes = [journal bytes];
+    size_t offset = MKResourceIndexHeaderLength;
+    const uint8_t* payload = NULL;
+    uint32_t payloadLength = 0;
+    while (MKIndexNextRecord(bytes, [journal length], &offset, &payload, &payloadLength)) {
+        NSString* urlString = MKIndexRecordURLString(payload, payloadLength);
+        if (urlString != nil) {
+            if ([journalRecords objectForKey:urlString] == nil) {
+                [journalURLs addObject:urlString];
+            }
+            [journalRecords setObject:[NSData dataWithBytes:payload length:payloadLength] forKey:urlString];
+        }
+    }
+    journal = nil;
+
+    NSString* temporaryPath = [_snapshotPath stringByAppendingPathExtension:@"tmp"];
+    int snapshotDescriptor = open([temporaryPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (snapshotDescriptor < 0) {
+        NSLog(@"%@: Fail to create resource index snapshot at path: %@", NSStringFromClass ([self class]), temporaryPath);//Error
+        return;
+    }
+
+    BOOL succeeded = YES;
+    unsigned long long snapshotLength = 0;
+    NSMutableData* chunk = [NSMutableData dataWithCapacity:MKResourceIndexWriteChunkLength + 1024];
+    [chunk appendData:MKIndexHeader(MKResourceIndexSnapshotMagic, _generation + 1)];
+
+    NSData* snapshot = [NSData dataWithContentsOfFile:_snapshotPath options:NSDataReadingMappedIfSafe error:nil];
+    uint64_t snapshotGeneration = 0;
+    if (MKIndexReadHeader(snapshot, MKResourceIndexSnapshotMagic, &snapshotGeneration)) {
+        bytes = [snapshot bytes];
+        offset = MKResourceIndexHeaderLength;
+        while (succeeded && MKIndexNextRecord(bytes, [snapshot length], &offset, &payload, &payloadLength)) {
+            NSString* urlString = MKIndexRecordURLString(payload, payloadLength);
+            NSData* journalRecord = urlString != nil ? [journalRecords objectForKey:urlString] : nil;
+            if (journalRecord == nil) {
+                // unchanged record is copied as is
+                [chunk appendBytes:payload - MKResourceIndexRecordHeaderLength length:payloadLength + MKResourceIndexRecordHeaderLength];
+            } else {
+                if (((const uint8_t*)[journalRecord bytes])[0] == MKResourceIndexRecordPut) {
+                    MKIndexAppendRecord(chunk, [journalRecord bytes], (uint32_t)[journalRecord length]);
+                }
+                [journalRecords removeObjectForKey:urlString];
+            }
+
+            if ([chunk length] >= MKResourceIndexWriteChunkLength) {
+                succeeded = MKIndexWriteAll(snapshotDescriptor, [chunk bytes], [chunk length]);
+                snapshotLength += [chunk length];
+                [chunk setLength:0];
+            }
+        }
+    }
+    snapshot = nil;
+
+    // records of the resources that are not in the old snapshot, in order they were added
+    for (NSString* urlString in journalURLs) {
+        NSData* journalRecord = [journalRecords objectForKey:urlString];
+        if (journalRecord != nil && ((const uint8_t*)[journalRecord bytes])[0] == MKResourceIndexRecordPut) {
+            MKIndexAppendRecord(chunk, [journalRecord bytes], (uint32_t)[journalRecord length]);
+        }
+    }
+
+    if (succeeded && [chunk length] > 0) {
+        succeeded = MKIndexWriteAll(snapshotDescriptor, [chunk bytes], [chunk length]);
+        snapshotLength += [chunk length];
+    }
+    if (succeeded) {
+        succeeded = fsync(snapshotDescriptor) == 0;
+    }
+    close(snapshotDescriptor);
+
+    if (succeeded && rename([temporaryPath fileSystemRepresentation], [_snapshotPath fileSystemRepresentation]) == 0) {
+        // a crash before journal reset is harmless: journal of the previous generation is ignored on restore
+        _generation++;
+        _snapshotLength = snapshotLength;
+        [self resetJournal];
+        [MKResourceUtility markNonPurgeableNonBackedUpFileAtURL:[NSURL fileURLWithPath:_snapshotPath]];
+    } else {
+        NSLog(@"%@: Fail to compact resource index at path: %@", NSStringFromClass ([self class]), _snapshotPath);//Error
+        unlink([temporaryPath fileSystemRepresentation]);
+    }
+}
+
+#pragma mark - Sharing
+
+// Other processes may have appended to the journal or compacted the index since this one has written it.
+// Should be called with the files locked.
+- (void)synchronizeJournalState {
+    struct stat fileStat;
+    if (_journalDescriptor < 0 || fstat(_journalDescriptor, &fileStat) != 0) {
+        return;
+    }
+    uint64_t generation = 0;
+    if (!MKIndexReadHeader(MKIndexReadAll(_journalDescriptor, 0, MKResourceIndexHeaderLength), MKResourceIndexJournalMagic, &generation)) {
+        [self resetJournal];
+        return;
+    }
+    _generation = generation;
+    _journalLength = (unsigned long long)fileStat.st_size;
+    _snapshotLength = stat([_snapshotPath fileSystemRepresentation], &fileStat) == 0 ? (unsigned long long)fileStat.st_size : 0;
+}
+
+- (NSArray*)changedResources {
+    if (!_shared || !_restored) {
+        return nil;
+    }
+    __block NSArray* resources = nil;
+    dispatch_sync(_queue, ^{
+        if (_journalDescriptor < 0) {
+            return;
+        }
+        [self lockFiles:LOCK_SH];
+        struct stat fileStat;
+        uint64_t generation = 0;
+        if (fstat(_journalDescriptor, &fileStat) != 0 ||
+            !MKIndexReadHeader(MKIndexReadAll(_journalDescriptor, 0, MKResourceIndexHeaderLength), MKResourceIndexJournalMagic, &generation)) {
+            [self lockFiles:LOCK_UN];
+            return;
+        }
+        unsigned long long journalLength = (unsigned long long)fileStat.st_size;
+        if (generation == _readGeneration && journalLength <= _readLength) {
+            [self lockFiles:LOCK_UN];
+            return;
+        }
+
+        NSMutableDictionary* resourcesByURL = [NSMutableDictionary dictionary];
+        if (generation != _readGeneration) {
+            // the journal has been merged into a new snapshot, both are read again
+            NSData* snapshot = [NSData dataWithContentsOfFile:_snapshotPath options:NSDataReadingMappedIfSafe error:nil];
+            uint64_t snapshotGeneration = 0;
+            if (MKIndexReadHeader(snapshot, MKResourceIndexSnapshotMagic, &snapshotGeneration) && snapshotGeneration == generation) {
+                [MKResourceIndex replayRecords:snapshot fromOffset:MKResourceIndexHeaderLength into:resourcesByURL keepsRemoved:YES];
+            }
+            _readGeneration = generation;
+            _readLength = MKResourceIndexHeaderLength;
+        }
+        NSData* journalTail = MKIndexReadAll(_journalDescriptor, _readLength, (size_t)(journalLength - _readLength));
+        _readLength += [MKResourceIndex replayRecords:journalTail fromOffset:0 into:resourcesByURL keepsRemoved:YES];
+        [self lockFiles:LOCK_UN];
+        resources = [resourcesByURL count] > 0 ? [resourcesByURL allValues] : nil;
+    });
+    return resources;
+}
+
+@end
@@ -0,0 +1,44 @@
+//
+//  MKResourceLRUList.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MKResource;
+
+/**
+ * Intrusive doubly linked list of resources that have data in the cache.
+ * The most recently accessed resource is at the head, the eviction candidate at the tail.
+ * All operations are O(1). The list does not retain resources, they are owned by the manager.
+ */
+@interface MKResourceLRUList : NSObject {
+@private
+    __unsafe_unretained MKResource*     _head;
+    __unsafe_unretained MKResource*     _tail;
+    NSUInteger                          _count;
+    unsigned long long                  _totalLength;
+}
+
+@property (nonatomic, readonly) NSUInteger count;
+@property (nonatomic, readonly) unsigned long long totalLength;
+
+- (MKResource*)head;
+- (MKResource*)tail;
+- (BOOL)containsResource:(MKResource*)resource;
+
+// Inserts resource at the head of the list or moves it there if it is already in the list.
+- (void)addResource:(MKResource*)resource;
+// Inserts resource at the tail of the list. Does nothing if resource is already in the list.
+- (void)appendResource:(MKResource*)resource;
+// Moves resource to the head of the list. Does nothing if resource is not in the list.
+- (void)touchResource:(MKResource*)resource;
+- (void)removeResource:(MKResource*)resource;
+// Updates accounted length of the resource in the list.
+- (void)setStoredLength:(unsigned long long)length forResource:(MKResource*)resource;
+- (void)removeAllResources;
+
+@end
@@ -0,0 +1,143 @@
+//
+//  MKResourceLRUList.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceLRUList.h"
+#import "MKResource+Private.h"
+
+@implementation MKResourceLRUList
+@synthesize count = _count;
+@synthesize totalLength = _totalLength;
+
+- (void)dealloc {
+    [self removeAllResources];
+}
+
+- (MKResource*)head {
+    return _head;
+}
+
+- (MKResource*)tail {
+    return _tail;
+}
+
+- (BOOL)containsResource:(MKResource*)resource {
+    return resource != nil && resource.inRecentlyUsedList;
+}
+
+- (void)unlinkResource:(MKResource*)resource {
+    MKResource* previous = resource.previousRecentlyUsed;
+    MKResource* next = resource.nextRecentlyUsed;
+
+    if (previous != nil) {
+        previous.nextRecentlyUsed = next;
+    } else {
+        _head = next;
+    }
+
+    if (next != nil) {
+        next.previousRecentlyUsed = previous;
+    } else {
+        _tail = previous;
+    }
+
+    resource.previousRecentlyUsed = nil;
+    resource.nextRecentlyUsed = nil;
+}
+
+- (void)linkResourceAtHead:(MKResource*)resource {
+    resource.previousRecentlyUsed = nil;
+    resource.nextRecentlyUsed = _head;
+    if (_head != nil) {
+        _head.previousRecentlyUsed = resource;
+    }
+    _head = resource;
+    if (_tail == nil) {
+        _tail = resource;
+    }
+}
+
+- (void)addResource:(MKResource*)resource {
+    if (resource == nil) {
+        return;
+    }
+
+    if (resource.inRecentlyUsedList) {
+        [self touchResource:resource];
+        return;
+    }
+
+    [self linkResourceAtHead:resource];
+    resource.inRecentlyUsedList = YES;
+    _count++;
+    _totalLength += resource.storedLength;
+}
+
+- (void)appendResource:(MKResource*)resource {
+    if (resource == nil || resource.inRecentlyUsedList) {
+        return;
+    }
+
+    resource.previousRecentlyUsed = _tail;
+    resource.nextRecentlyUsed = nil;
+    if (_tail != nil) {
+        _tail.nextRecentlyUsed = resource;
+    }
+    _tail = resource;
+    if (_head == nil) {
+        _head = resource;
+    }
+
+    resource.inRecentlyUsedList = YES;
+    _count++;
+    _totalLength += resource.storedLength;
+}
+
+- (void)touchResource:(MKResource*)resource {
+    if (resource == nil || !resource.inRecentlyUsedList || _head == resource) {
+        return;
+    }
+
+    [self unlinkResource:resource];
+    [self linkResourceAtHead:resource];
+}
+
+- (void)removeResource:(MKResource*)resource {
+    if (resource == nil || !resource.inRecentlyUsedList) {
+        return;
+    }
+
+    [self unlinkResource:resource];
+    resource.inRecentlyUsedList = NO;
+    _count--;
+    _totalLength -= MIN(_totalLength, resource.storedLength);
+}
+
+- (void)setStoredLength:(unsigned long long)length forResource:(MKResource*)resource {
+    if (resource.inRecentlyUsedList) {
+        _totalLength -= MIN(_totalLength, resource.storedLength);
+        _totalLength += length;
+    }
+    resource.storedLength = length;
+}
+
+- (void)removeAllResources {
+    MKResource* resource = _head;
+    while (resource != nil) {
+        MKResource* next = resource.nextRecentlyUsed;
+        resource.previousRecentlyUsed = nil;
+        resource.nextRecentlyUsed = nil;
+        resource.inRecentlyUsedList = NO;
+        resource = next;
+    }
+    _head = nil;
+    _tail = nil;
+    _count = 0;
+    _totalLength = 0;
+}
+
+@end
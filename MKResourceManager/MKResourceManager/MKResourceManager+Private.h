@@ -9,21 +9,80 @@
 #import <Foundation/Foundation.h>
 //#import "MKHTTPHandlerClientPrivate.h"
 
-@interface MKResourceManager ()
+@class MKResourceBuffer;
+@class MKEncryptionKey;
+@class MKResourceIndex;
+
+// The manager lock guards all the state except the map of resources by URL. The lock is recursive.
+@interface MKResourceManager () <NSLocking>
 
 //- (void)setHttpClient:(id<MKHTTPHandlerClientPrivate>)client;
 //- (id<MKHTTPHandlerClientPrivate>)httpClient;
 - (void)startDownloadResource:(MKResource*)resource;
 - (void)cancelDownloadResource:(MKResource*)resource;
 - (NSData*)dataForResource:(MKResource *)resource error:(NSError**)error;
+- (NSData*)dataForResource:(MKResource *)resource options:(MKResourceReadingOptions)options error:(NSError**)error;
+- (NSData*)dataInRange:(NSRange)range forResource:(MKResource*)resource error:(NSError**)error;
+- (NSInputStream*)inputStreamForResource:(MKResource*)resource;
 - (void)setData:(NSData*)data forResource:(MKResource*)resource;
 - (void)didFinishDownloadResource:(MKResource *)resource data:(NSData *)data error:(NSError *)error httpResponse:(NSHTTPURLResponse*)httpResponse;
+- (void)didFinishDownloadResource:(MKResource *)resource buffer:(MKResourceBuffer *)buffer error:(NSError *)error httpResponse:(NSHTTPURLResponse*)httpResponse;
+- (void)setBuffer:(MKResourceBuffer*)buffer forResource:(MKResource*)resource;
+- (BOOL)saveBufferInCache:(MKResourceBuffer*)buffer atPath:(NSString*)stringURL;
+// Length of the file written is returned in storedLength, it differs from the length of the buffer if data is compressed or encrypted.
+- (BOOL)saveBufferInCache:(MKResourceBuffer*)buffer atPath:(NSString*)stringURL compress:(BOOL)compress storedLength:(unsigned long long*)storedLength;
+- (NSString*)temporaryDirectoryPath;
+// Index the resources are saved in. Saves are written in background, waitUntilSaved waits for them.
+- (MKResourceIndex*)resourceIndex;
+// YES if data is stored once per content digest. Download buffers should compute the digest then.
+- (BOOL)deduplicatesData;
+// Key data is encrypted with in the cache directory, nil if data is not encrypted. Download buffers spill data encrypted
+// with it and partial data is not kept then.
+- (MKEncryptionKey*)encryptionKey;
+// Pool of memory chunks of download buffers
+- (MKResourceBufferPool*)downloadBufferPool;
+// Path of the blob that keeps data with the SHA-256 digest in hex, compressed or as is
+- (NSString*)blobPathForDigest:(NSString*)digest compressed:(BOOL)compressed;
+// Returns YES if data of the resource is in the cache directory, so the download may be conditional.
+- (BOOL)hasStoredDataForResource:(MKResource*)resource;
+// Path of the file where partially downloaded data of the resource is kept between sessions.
+- (NSString*)partialDownloadPathForResource:(MKResource*)resource;
 - (void)restoreResources;
 - (BOOL)existMRinCache:(NSString*)stringURL;
 - (NSString*)nameFromURLString:(NSString*)stringURL;
-- (NSMutableData*)readMediaResourceFromCacheAtPath:(NSString*)stringURL;
+// Compressed data is inflated, whether the file is compressed is kept by the resource
+- (NSData*)readMediaResourceFromCacheAtPath:(NSString*)stringURL compressed:(BOOL)compressed options:(MKResourceReadingOptions)options;
+- (NSData*)readMediaResourceFromCacheAtPath:(NSString*)stringURL range:(NSRange)range compressed:(BOOL)compressed;
 - (NSString*)fullFilePath:(NSString*)stringURL;
-- (void)saveInCache:(NSData*)data atPath:(NSString*)stringURL;
+- (BOOL)saveInCache:(NSData*)data atPath:(NSString*)stringURL;
 - (BOOL)removeResourceFromStorage:(MKResource*)aResource;
+- (void)resourceWasAccessed:(MKResource*)resource;
+// Records a read of the resource without the manager lock. Reads are applied to the recently used list in batches.
+- (void)resourceWasRead:(MKResource*)resource;
+// Applies recorded reads to access dates and the recently used list
+- (void)applyReadAccesses;
+- (void)resourcePriorityDidChange:(MKResource*)resource;
+// Writes changed resources into the index, not more often than once in 5 seconds
+- (void)saveResourcesInfo;
+// Writes changed resources into the index at once
+- (void)flushResourcesInfo;
+- (void)setNeedsSaveResource:(MKResource*)resource;
+- (void)trimCache;
+// Invokes block on callbackQueue or right away if callbackQueue is not set.
+- (void)performCallback:(void (^)(void))block;
+// Queue for delegate callbacks of network connections. nil means the current run loop.
+- (NSOperationQueue*)networkDelegateQueue;
+// Takes up to count free download slots for additional connections of the running resource. Returns number of slots taken.
+- (NSUInteger)acquireDownloadSlotsForResource:(MKResource*)resource count:(NSUInteger)count;
+// Gives back one slot taken by acquireDownloadSlotsForResource and starts queued downloads.
+// The slots left are given back when the download of the resource finishes or is cancelled.
+- (void)releaseDownloadSlotForResource:(MKResource*)resource;
+// Takes the lock of the URL shared with other processes, download of the URL is owned by its holder.
+// Returns NO if another process holds it. The lock is released when the download finishes or is cancelled.
+- (BOOL)lockSharedDownloadOfResource:(MKResource*)resource;
+// Counters and histograms updated by the manager and its downloads
+- (MKResourceMetrics*)metrics;
+// Sends the event to metricsSink on callbackQueue if tracesResources is YES
+- (void)traceEvent:(MKResourceTraceEvent)event forResource:(MKResource*)resource duration:(NSTimeInterval)duration;
 
 @end
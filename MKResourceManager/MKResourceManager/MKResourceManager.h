@@ -7,8 +7,51 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <pthread.h>
 #import "MKResource.h"
+#import "MKResourceMetrics.h"
+#import "MKResourceRetryPolicy.h"
 
+@class MKResourceLRUList;
+@class MKResourceIndex;
+@class MKResourceDownloadScheduler;
+@class MKResourcesController;
+@class MKEncryptionKey;
+@class MKResourceBufferPool;
+
+/**
+ * Options of the resource manager initialization.
+ */
+typedef enum {
+    MKResourceManagerOptionNone = 0,
+      /** Resources saved in the cache directory are restored in background, the manager is usable immediately.
+       *  Restored resources are merged on the main queue, the ones looked up earlier are validated on first lookup.*/
+    MKResourceManagerOptionAsynchronousRestore = 1 << 0,
+      /** The manager may be used from several threads at once. Network callbacks are handled on a background queue
+       *  and watchers and completion handlers are notified on callbackQueue, which is the main queue by default.
+       *  Resource properties should be read on callbackQueue. Watchers should be added and removed on callbackQueue as well.*/
+    MKResourceManagerOptionThreadSafe = 1 << 1,
+      /** Data is encrypted in the cache directory with the key the manager is created with. Data is encrypted while it is
+       *  stored and decrypted while it is read, a range of data is read without decrypting the whole file.
+       *  Encrypted data is not mapped. File that has not been encrypted, e.g. stored by a manager created without
+       *  this option or replaced in the cache directory, is treated as corrupt: it is removed and downloaded again.
+       *  File URLs passed to file completion handlers point to encrypted data. Downloads that do not fit in memory
+       *  are spilled to disk encrypted as well, so interrupted downloads are not resumed and are not fetched in ranges.*/
+    MKResourceManagerOptionEncryptsData = 1 << 2,
+      /** Identical data of different URLs is stored once. Data is kept in the blob directory under its SHA-256 digest,
+       *  which is computed while the data is downloaded, and the file of each URL is a hard link to the blob.
+       *  The blob is removed when no URL refers to it. Each URL is accounted in cacheSize with the full length of the data.*/
+    MKResourceManagerOptionDeduplicatesData = 1 << 3,
+      /** The cache directory is used by several processes at once, e.g. by the application and its extensions in
+       *  a shared container. Each process should create its manager with this option. Changes of the index made by
+       *  the others are picked up periodically and with synchronizeSharedCache. A URL is downloaded by one process
+       *  at a time, the others wait for its result instead of downloading it again.
+       *  Resources picked up from the others count toward maxCacheSize and maxCacheEntriesCount of this process only
+       *  once they are read, so each process applies the limits to its own resources and the directory may grow to
+       *  the sum of the limits. Trimming removes files whether or not the other processes still use them; those
+       *  processes fail to read the removed data and download it again.*/
+    MKResourceManagerOptionSharesCache = 1 << 4
+} MKResourceManagerOptions;
 
 /**
  \defgroup MediaResourcesDoxyGroup Fetching Media Resources
@@ -40,22 +83,242 @@
     NSString*               _pathCache;
     NSMutableArray*         _customSchemesHandlers;
     NSMutableArray*         _suspendedResources;
-    NSMutableArray*         _downloadResourcesQueue;
+    MKResourceDownloadScheduler* _downloadScheduler;
     BOOL                    _suspended;
     NSTimeInterval          _lastTimeWhenResourceInfoSaved;
     BOOL                    _saveDalayed;
-    dispatch_queue_t        _saveResourceInfoQueue;
+    MKResourceIndex*        _resourceIndex;
+    NSMutableSet*           _dirtyResources;
+    NSMutableArray*         _unvalidatedResources;
+    NSMutableArray*         _readinessHandlers;
+    CFAbsoluteTime          _startupTime;
+    MKResourceLRUList*      _recentlyUsedResources;
+    dispatch_queue_t        _cacheMaintenanceQueue;
+    BOOL                    _cacheTrimScheduled;
+    NSCache*                _memoryCache;
+    pthread_rwlock_t        _resourcesLock;
+    pthread_mutex_t         _stateLock;
+    pthread_mutex_t         _readAccessLock;
+    NSMutableArray*         _readResources;
+    BOOL                    _readAccessesScheduled;
+    BOOL                    _threadSafe;
+    NSOperationQueue*       _networkQueue;
+    char*                   _fileSystemPathCache;
+    size_t                  _fileSystemPathCacheLength;
+    volatile BOOL           _migratingFlatLayout;
+    MKEncryptionKey*        _encryptionKey;
+    BOOL                    _deduplicatesData;
+    MKResourceMetrics*      _metrics;
+    __weak id<MKResourceMetricsSink> _metricsSink;
+    NSTimeInterval          _metricsReportingInterval;
+    dispatch_source_t       _metricsTimer;
+    BOOL                    _tracesResources;
+    MKResourceRetryPolicy*  _retryPolicy;
+    NSMutableDictionary*    _circuitBreakers;
+    NSMutableDictionary*    _negativeCache;
+    MKResourceBufferPool*   _downloadBufferPool;
+    BOOL                    _sharesCache;
+    NSMutableDictionary*    _sharedDownloadLocks;
+    NSMutableArray*         _sharedDownloadWaiters;
+    NSMutableDictionary*    _sharedDownloadResults;
+    dispatch_source_t       _sharedCacheTimer;
+    int                     _temporaryDirectoryLock;
+    NSString*               _temporaryDirectoryPath;
 }
 
 @property (nonatomic, readonly) NSString* pathCache;
 
+/**
+ * Sets/gets queue on which watchers and completion handlers are notified.
+ * NULL means they are notified synchronously on the thread that changed the resource.
+ * Default value is the main queue for the manager created with MKResourceManagerOptionThreadSafe and NULL otherwise.
+ */
+@property (nonatomic, strong) dispatch_queue_t callbackQueue;
+
+/**
+ * Returns YES when all the resources saved in the cache directory are restored and validated.
+ */
+@property (nonatomic, readonly, getter = isReady) BOOL ready;
+
+/**
+ * Returns time passed from the initialization till the manager became ready, in seconds.
+ */
+@property (nonatomic, readonly) NSTimeInterval startupDuration;
+
 /**
  * Sets/gets the maximum number of concurrent downloads that the receiver can execute.
  * Default value is 10
  */
 @property (nonatomic, assign) NSUInteger maxConcurrentDownloadsCount;
 
+/**
+ * Sets/gets the maximum number of concurrent downloads from the same host.
+ * Default value is 0 which means no limit other than maxConcurrentDownloadsCount.
+ */
+@property (nonatomic, assign) NSUInteger maxConcurrentDownloadsPerHostCount;
+
+/**
+ * Sets/gets the maximum number of bytes that downloaded resources may occupy in the cache directory.
+ * When the limit is exceeded the least recently accessed resources are removed from storage.
+ * With MKResourceManagerOptionSharesCache the limit applies only to the resources this process uses, not to the whole directory.
+ * Default value is 0 which means no limit.
+ */
+@property (nonatomic, assign) unsigned long long maxCacheSize;
+
+/**
+ * Sets/gets the maximum number of downloaded resources kept in the cache directory.
+ * When the limit is exceeded the least recently accessed resources are removed from storage.
+ * With MKResourceManagerOptionSharesCache the limit applies only to the resources this process uses, not to the whole directory.
+ * Default value is 0 which means no limit.
+ */
+@property (nonatomic, assign) NSUInteger maxCacheEntriesCount;
+
+/**
+ * Returns the number of bytes currently occupied by downloaded resources.
+ */
+@property (nonatomic, readonly) unsigned long long cacheSize;
+
+/**
+ * Returns the number of downloaded resources currently kept in the cache directory.
+ */
+@property (nonatomic, readonly) NSUInteger cacheEntriesCount;
+
+/**
+ * Sets/gets the maximum number of bytes of resource data kept in memory.
+ * Recently read and recently downloaded small resources are returned from memory without touching the cache directory.
+ * Data is evicted by its length when the limit is exceeded and purged on memory warning.
+ * Default value is 0 which means the memory cache is disabled.
+ */
+@property (nonatomic, assign) NSUInteger memoryCacheCapacity;
+
+/**
+ * Sets/gets the maximum length of resource data that may be kept in memory.
+ * Default value is 64KB
+ */
+@property (nonatomic, assign) NSUInteger memoryCacheMaxDataLength;
+
+/**
+ * Returns the number of data reads served from memory.
+ */
+@property (nonatomic, readonly) NSUInteger memoryCacheHitCount;
+
+/**
+ * Returns the number of data reads that missed the memory cache and went to the cache directory.
+ */
+@property (nonatomic, readonly) NSUInteger memoryCacheMissCount;
+
+/**
+ * Sets/gets the maximum length of downloaded data kept in memory till the download finishes.
+ * Responses expected to be longer are written to file from the first byte, shorter ones are kept in memory chunks
+ * reused by next downloads. Default value is 300KB.
+ */
+@property (nonatomic, assign) NSUInteger downloadBufferMaxMemoryLength;
+
+/**
+ * Sets/gets the maximum length of unused memory chunks kept for next downloads. Default value is 1MB.
+ */
+@property (nonatomic, assign) NSUInteger downloadBufferPoolCapacity;
+
+/**
+ * Returns the length of memory taken by running downloads, its peak since the manager has been created
+ * or resetMetrics has been called, and the length of unused chunks kept for next downloads.
+ */
+@property (nonatomic, readonly) NSUInteger downloadBufferMemoryLength;
+@property (nonatomic, readonly) NSUInteger downloadBufferPeakMemoryLength;
+@property (nonatomic, readonly) NSUInteger downloadBufferPooledMemoryLength;
+
+/**
+ * Sets/gets whether downloads go through the shared NSURLCache.
+ * Downloaded data is kept in the cache directory anyway, so NO avoids keeping second copy of it in NSURLCache.
+ * Default value is YES
+ */
+@property (nonatomic, assign) BOOL usesSharedURLCache;
+
+/**
+ * Sets/gets period after which downloaded data is considered stale.
+ * Stale data is returned as is and the resource is revalidated in background, its status remains MKStatusDownloaded
+ * during revalidation. Downloading of downloaded resource also keeps the status. Data set by client is not revalidated.
+ * Default value is 0 which means data is never revalidated automatically.
+ */
+@property (nonatomic, assign) NSTimeInterval staleWhileRevalidateInterval;
+
+/**
+ * Sets/gets minimum period between download progress notifications of a resource.
+ * Updates received meanwhile are coalesced, watchers are notified with the latest progress on callbackQueue.
+ * Default value is 0.05 seconds. 0 means each received chunk is notified.
+ */
+@property (nonatomic, assign) NSTimeInterval progressNotificationInterval;
+
+/**
+ * Sets/gets minimum change of progress between download progress notifications of a resource.
+ * Completion of the download is notified anyway.
+ * Default value is 0.
+ */
+@property (nonatomic, assign) float progressNotificationMinimumDelta;
+
+/**
+ * Sets/gets content types of resources whose data is compressed in the cache directory, e.g. application/json or text/xml.
+ * Types are lowercase without parameters. Type starting with "+" matches structured syntax suffix, e.g. +xml matches image/svg+xml.
+ * Data is compressed while it is stored and inflated when it is read, before encryption if the manager encrypts data.
+ * Files of such resources keep compressed data, so read them with the data methods or inputStreamForResource: rather than by file path.
+ * Default value is nil which means data is stored as is.
+ */
+@property (nonatomic, copy) NSSet* compressedContentTypes;
+
+/**
+ * Sets/gets minimum length of data that is compressed. Shorter data is stored as is.
+ * Default value is 1KB.
+ */
+@property (nonatomic, assign) unsigned long long compressionMinimumLength;
+
+/**
+ * Sets/gets minimum length of resource data that is downloaded in several byte ranges at once.
+ * The ranges are fetched when the server sends Accept-Ranges: bytes and a validator, and are written in place
+ * into one file. Each additional connection takes a download slot, so ranges are fetched only while slots are free.
+ * Responses with Content-Encoding other than identity are received over one connection.
+ * Default value is 0 which means each resource is downloaded over one connection.
+ */
+@property (nonatomic, assign) unsigned long long segmentedDownloadMinimumLength;
+
+/**
+ * Sets/gets maximum number of ranges a resource is downloaded in, including the range of the first connection.
+ * Default value is 4.
+ */
+@property (nonatomic, assign) NSUInteger maxDownloadSegmentsCount;
+
+/**
+ * Sets/gets object that receives snapshots of metrics every metricsReportingInterval, and trace events if tracesResources is YES.
+ * The sink is not retained. Default value is nil.
+ */
+@property (nonatomic, weak) id<MKResourceMetricsSink> metricsSink;
+
+/**
+ * Sets/gets period between snapshots sent to metricsSink.
+ * Default value is 60 seconds. 0 means snapshots are not sent, metricsSnapshot may still be called.
+ */
+@property (nonatomic, assign) NSTimeInterval metricsReportingInterval;
+
+/**
+ * Sets/gets whether metricsSink receives events of each resource: scheduling, start, response, completion, eviction and reading.
+ * Default value is NO.
+ */
+@property (nonatomic, assign) BOOL tracesResources;
+
+/**
+ * Sets/gets rules of retrying failed downloads, of the per-host circuit breaker and of the negative cache.
+ * Retried resource stays in progress and its watchers are notified only of the last failure.
+ * Default value is nil which means failed downloads are reported at once and 401 failures wait till the manager is resumed.
+ */
+@property (nonatomic, strong) MKResourceRetryPolicy* retryPolicy;
+
 - (id)initWithKey:(NSString*)aKeyEncoding pathCache:(NSString*)path;
+- (id)initWithKey:(NSString*)aKeyEncoding pathCache:(NSString*)path options:(MKResourceManagerOptions)options;
+
+/** Adds handler that will be invoked on the main queue when the manager becomes ready.
+ *  If the manager is ready already the handler is invoked immediately.
+ *  @param handler Handler block
+ */
+- (void)addReadinessHandler:(void (^)(MKResourceManager* manager))handler;
 
 /** Returns resource for specified resource URL.
  *	@param aURL Resource URL
@@ -69,6 +332,16 @@
  */
 - (MKResource*)downloadResourceForNSURL:(NSURL*)aURL;
 
+/** Downloads resources that have not been downloaded yet.
+ *  Resources that are being downloaded are not downloaded again, the batch shares their downloads and raises their priority
+ *  if it is lower. Resource info is saved once for the batch.
+ *	@param URLs Array of resource URLs. Repeated URLs are downloaded once.
+ *	@param priority Download priority of the resources
+ *	@param completion Block called once on callbackQueue when all the downloads have finished. Error is not nil if some of them have failed.
+ *  @return Controller of the resources that are being downloaded for the batch. It is retained until completion is called.
+ */
+- (MKResourcesController*)prefetchResourcesForNSURLs:(NSArray*)URLs priority:(MKResourcePriority)priority completion:(void (^)(MKResourcesController* controller, NSError* error))completion;
+
 /** Cancels resource download if it is in progress.
  *	@param aURL Resource URL
  *  @return MKResource object with resource information.
@@ -82,6 +355,31 @@
 - (NSData*)dataForResourceForNSURL:(NSURL*)aURL;
 - (NSData *)dataForResourceForNSURL:(NSURL *)aURL error:(NSError**)error;
 
+/** Returns resource data read according to options.
+ *	@param aURL Resource URL
+ *	@param options Reading options. Use MKResourceReadingMapped for large resources to avoid reading whole file into memory.
+ *	@param error On output, an error object if the data can not be accessed
+ *  @return NSData object with content of resource. Returns nil if the resource has not been downloaded yet.
+ */
+- (NSData*)dataForResourceForNSURL:(NSURL*)aURL options:(MKResourceReadingOptions)options error:(NSError**)error;
+
+/** Returns part of resource data. Only the requested bytes are read from disk.
+ *	@param range Range of bytes. The range is clipped to the length of the data.
+ *	@param aURL Resource URL
+ *	@param error On output, an error object if the data can not be accessed
+ *  @return NSData object with requested bytes. Returns nil if the resource has not been downloaded yet.
+ */
+- (NSData*)dataInRange:(NSRange)range forResourceForNSURL:(NSURL*)aURL error:(NSError**)error;
+
+/** Returns stream for reading resource data.
+ *	@param aURL Resource URL
+ *  @return Unopened NSInputStream object. Returns nil if the resource has not been downloaded yet.
+ */
+- (NSInputStream*)inputStreamForResourceForNSURL:(NSURL*)aURL;
+
+/** Returns location of the file of resource data.
+ *  The file keeps data as it is stored in the cache, i.e. compressed for compressedContentTypes and encrypted for MKResourceManagerOptionEncryptsData.
+ */
 - (NSURL*)pathForResource:(MKResource*)resource;
 
 /** Sets resource data and if data is not nil marks the corresponding resource as downloaded.
@@ -117,4 +415,22 @@
  */
 - (void)resume;
 
+/**
+ * Returns counters, latency histograms, download queue depth and number of running downloads at the moment.
+ * Counters are collected since the manager was created or resetMetrics was called.
+ */
+- (MKResourceMetricsSnapshot*)metricsSnapshot;
+
+/**
+ * Sets all the counters and histograms to zero, and the peak memory length of download buffers to the current one.
+ */
+- (void)resetMetrics;
+
+/**
+ * Picks up resources downloaded, stored and removed by other processes sharing the cache directory and starts
+ * downloads that have been waiting for them. It is done periodically as well. Does nothing if the manager has been
+ * created without MKResourceManagerOptionSharesCache.
+ */
+- (void)synchronizeSharedCache;
+
 @end
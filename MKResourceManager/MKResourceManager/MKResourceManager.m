@@ -14,9 +14,47 @@
 #import "MKResourceUtility.h"
 #import "MKResourceUtility+Private.h"
 #import "MKCustomResource.h"
+#import "MKResourceLRUList.h"
+#import "MKResourceIndex.h"
+#import "MKResourceBuffer.h"
+#import "MKResourceBufferPool.h"
+#import "MKResourceDownloadScheduler.h"
+#import "MKResourcesController.h"
+#import "MKResourceCompression.h"
+#import <fcntl.h>
+#import <unistd.h>
+#import <dirent.h>
+#import <sys/stat.h>
+#import <sys/file.h>
 
 static NSString* const MKMediaResourceSavedResourcesFileName = @"ResourceInfo.plist";
+static NSString* const MKMediaResourceTrashDirectoryName = @".trash";
+static NSString* const MKMediaResourceTemporaryDirectoryName = @".downloads";
+static NSString* const MKMediaResourcePartialDirectoryName = @".partial";
+// Lock files of URLs downloaded by processes sharing the cache directory
+static NSString* const MKMediaResourceLocksDirectoryName = @".locks";
+// Locked by the process the temporary directory belongs to while its manager exists
+static NSString* const MKMediaResourceTemporaryDirectoryOwnerName = @".owner";
+// Data stored once per content digest, in subdirectories named after the first two hex digits of the digest
+static NSString* const MKMediaResourceBlobsDirectoryName = @".blobs";
+static NSString* const MKMediaResourceCompressedBlobExtension = @"z";
+// Present when data files are kept in subdirectories named after the first two hex digits of their names
+static NSString* const MKMediaResourceShardedLayoutMarkerName = @".sharded";
+static NSUInteger const MKMediaResourceShardsCount = 256;
+// Partially downloaded data that has not been resumed for this time is removed
+static NSTimeInterval const MKMediaResourcePartialDownloadLifetime = 7 * 24 * 60 * 60;
 NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
+NSUInteger const MKMediaResourceMemoryCacheMaxDataLength = 64 * 1024;
+NSTimeInterval const MKMediaResourceProgressNotificationInterval = 0.05;
+unsigned long long const MKMediaResourceCompressionMinimumLength = 1024;
+NSTimeInterval const MKMediaResourceMetricsReportingInterval = 60;
+NSUInteger const MKMediaResourceMaxDownloadSegmentsCount = 4;
+// Number of failed URLs after which expired ones are removed from the negative cache
+static NSUInteger const MKMediaResourceNegativeCacheCapacity = 256;
+// Interval of picking up changes made by other processes sharing the cache directory
+static NSTimeInterval const MKMediaResourceSharedCacheSyncInterval = 0.5;
+// UIApplicationDidReceiveMemoryWarningNotification, the library does not link UIKit
+static NSString* const MKMediaResourceMemoryWarningNotification = @"UIApplicationDidReceiveMemoryWarningNotification";
 
 
 @interface MKResourceManager () {
@@ -28,20 +66,78 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
 @implementation MKResourceManager
 
 @synthesize pathCache = _pathCache;
+@synthesize ready = _ready;
+@synthesize startupDuration = _startupDuration;
+@synthesize callbackQueue = _callbackQueue;
+@synthesize metricsSink = _metricsSink;
+@synthesize metricsReportingInterval = _metricsReportingInterval;
+@synthesize tracesResources = _tracesResources;
 
 - (id)initWithKey:(NSString*)aKeyEncoding pathCache:(NSString*)path {
+    return [self initWithKey:aKeyEncoding pathCache:path options:MKResourceManagerOptionNone];
+}
+
+- (id)initWithKey:(NSString*)aKeyEncoding pathCache:(NSString*)path options:(MKResourceManagerOptions)options {
     self = [super init];
     if (self != nil) {
+        _startupTime = CFAbsoluteTimeGetCurrent();
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&_stateLock, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        pthread_rwlock_init(&_resourcesLock, NULL);
+        pthread_mutex_init(&_readAccessLock, NULL);
+        _readResources = [[NSMutableArray alloc] init];
+        if ((options & MKResourceManagerOptionThreadSafe) != 0) {
+            _threadSafe = YES;
+            _callbackQueue = dispatch_get_main_queue();
+            _networkQueue = [[NSOperationQueue alloc] init];
+            [_networkQueue setMaxConcurrentOperationCount:1];
+        }
         _workDictionary = [[NSMutableDictionary alloc] init];
         _statusByURL = [[NSMutableDictionary alloc] init];
         _keyEncoding = [aKeyEncoding copy];
+        if ((options & MKResourceManagerOptionEncryptsData) != 0) {
+            _encryptionKey = [[MKEncryptionKey alloc] initWithKey:_keyEncoding];
+            if (_encryptionKey == nil) {
+                NSLog(@"%@: Fail to encrypt data without key", NSStringFromClass ([self class]));//Warning
+            }
+        }
+        _deduplicatesData = (options & MKResourceManagerOptionDeduplicatesData) != 0;
+        _sharesCache = (options & MKResourceManagerOptionSharesCache) != 0;
+        _temporaryDirectoryLock = -1;
+        if (_sharesCache) {
+            _sharedDownloadLocks = [[NSMutableDictionary alloc] init];
+            _sharedDownloadWaiters = [[NSMutableArray alloc] init];
+            _sharedDownloadResults = [[NSMutableDictionary alloc] init];
+        }
         _pathCache = [path copy];
         _customSchemesHandlers = [[NSMutableArray alloc] init];
         _suspendedResources = [[NSMutableArray alloc] init];
-        _downloadResourcesQueue = [[NSMutableArray alloc] init];
+        _downloadScheduler = [[MKResourceDownloadScheduler alloc] init];
+        [_downloadScheduler setMaxConcurrentDownloadsCount:MKMediaResourceMaxConcurrentDownloadsCount];
 		_suspended = YES;
-        _saveResourceInfoQueue = dispatch_queue_create("MKResourceManager save resource info queue", NULL);
-        _maxConcurrentDownloadsCount = MKMediaResourceMaxConcurrentDownloadsCount;
+        _resourceIndex = [[MKResourceIndex alloc] initWithDirectoryPath:_pathCache shared:_sharesCache];
+        _dirtyResources = [[NSMutableSet alloc] init];
+        _recentlyUsedResources = [[MKResourceLRUList alloc] init];
+        _cacheMaintenanceQueue = dispatch_queue_create("MKResourceManager cache maintenance queue", NULL);
+        _unvalidatedResources = [[NSMutableArray alloc] init];
+        _readinessHandlers = [[NSMutableArray alloc] init];
+        _memoryCache = [[NSCache alloc] init];
+        _memoryCacheMaxDataLength = MKMediaResourceMemoryCacheMaxDataLength;
+        _usesSharedURLCache = YES;
+        _progressNotificationInterval = MKMediaResourceProgressNotificationInterval;
+        _compressionMinimumLength = MKMediaResourceCompressionMinimumLength;
+        _maxDownloadSegmentsCount = MKMediaResourceMaxDownloadSegmentsCount;
+        _metrics = [[MKResourceMetrics alloc] init];
+        _circuitBreakers = [[NSMutableDictionary alloc] init];
+        _negativeCache = [[NSMutableDictionary alloc] init];
+        _downloadBufferPool = [[MKResourceBufferPool alloc] init];
+        _downloadBufferMaxMemoryLength = MKResourceBufferDefaultMaxMemoryLength;
+        _metricsReportingInterval = MKMediaResourceMetricsReportingInterval;
+        [self startMetricsTimer];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(didReceiveMemoryWarning:) name:MKMediaResourceMemoryWarningNotification object:nil];
 
         BOOL isDir = YES;
         NSFileManager* fileManager = [NSFileManager defaultManager];
@@ -49,17 +145,76 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
             [fileManager createDirectoryAtPath:_pathCache withIntermediateDirectories:YES attributes:nil error:nil];
         }
 
-        [self restoreResources];
+        const char* fileSystemPathCache = [_pathCache fileSystemRepresentation];
+        _fileSystemPathCacheLength = strlen(fileSystemPathCache);
+        _fileSystemPathCache = strdup(fileSystemPathCache);
+
+        [self prepareTemporaryDirectory];
+        [self migrateFlatLayoutIfNeeded];
+        // another process may be between storing a blob and linking it
+        if (_deduplicatesData && !_sharesCache) {
+            [self removeUnreferencedBlobs];
+        }
+
+        if ((options & MKResourceManagerOptionAsynchronousRestore) != 0) {
+            [self restoreResourcesAsynchronously];
+        } else {
+            [self restoreResources];
+        }
+        [self emptyTrash];
+        if (_sharesCache) {
+            [self startSharedCacheTimer];
+        }
     }
     return self;
 }
 
 - (void)dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    // downloads cancelled below are not traced, the callbacks would outlive the manager
+    _tracesResources = NO;
+    if (_metricsTimer != NULL) {
+        dispatch_source_cancel(_metricsTimer);
+    }
+    if (_sharedCacheTimer != NULL) {
+        dispatch_source_cancel(_sharedCacheTimer);
+    }
     [self suspend];
+    [self flushResourcesInfo];
+    for (NSNumber* lockDescriptor in [_sharedDownloadLocks allValues]) {
+        close([lockDescriptor intValue]);
+    }
+    if (_temporaryDirectoryLock >= 0) {
+        close(_temporaryDirectoryLock);
+    }
     for (MKResource* resource in [_statusByURL allValues]) {
         [resource setResourceManager:nil];
     }
-//    dispatch_release(_saveResourceInfoQueue);
+    pthread_rwlock_destroy(&_resourcesLock);
+    pthread_mutex_destroy(&_readAccessLock);
+    pthread_mutex_destroy(&_stateLock);
+    free(_fileSystemPathCache);
+}
+
+- (void)lock {
+    pthread_mutex_lock(&_stateLock);
+}
+
+- (void)unlock {
+    pthread_mutex_unlock(&_stateLock);
+}
+
+- (void)performCallback:(void (^)(void))block {
+    dispatch_queue_t callbackQueue = self.callbackQueue;
+    if (callbackQueue != NULL) {
+        dispatch_async(callbackQueue, block);
+    } else {
+        block();
+    }
+}
+
+- (NSOperationQueue*)networkDelegateQueue {
+    return _networkQueue;
 }
 
 - (void)setHttpClient:(id<MKHTTPHandlerClientPrivate>)client {
@@ -72,165 +227,507 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
 
 
 - (void)suspend {
+    [self lock];
     _suspended = YES;
     for (MKResourceDownloadWork* work in [_workDictionary allValues]) {
         [self cancelDownloadResource:[work resource]];
     }
+    // downloads waiting for other processes are started again on resume
+    [_suspendedResources addObjectsFromArray:_sharedDownloadWaiters];
+    [_sharedDownloadWaiters removeAllObjects];
+    [_sharedDownloadResults removeAllObjects];
+    [self unlock];
 }
 
 - (void)resume {
+    [self lock];
     _suspended = NO;
-    for (MKResource* resource in _suspendedResources) {
+    NSArray* suspendedResources = [_suspendedResources copy];
+    [_suspendedResources removeAllObjects];
+    for (MKResource* resource in suspendedResources) {
         [self startDownloadResource:resource];
     }
-    [_suspendedResources removeAllObjects];
+    [self downloadResourceQueueChanged];
+    [self unlock];
 }
 
-- (NSArray*)validateResources:(NSArray*)resources {
-    NSMutableArray* validResources = [NSMutableArray array];
-    NSString* pathToResource = nil;
-    BOOL isDirectory = NO;
-    BOOL fileExists = NO;
+- (NSString*)resourceInfoPath {
+    return [self.pathCache stringByAppendingPathComponent:MKMediaResourceSavedResourcesFileName];
+}
+
+// Reads resources saved in the index. Resource info saved by previous versions is read if the index is empty.
++ (NSArray*)restoredResourcesFromIndex:(MKResourceIndex*)resourceIndex resourceInfoPath:(NSString*)resourceInfoPath migrate:(BOOL*)migrate {
+    NSArray* restoredResources = [resourceIndex restoreResources];
+    
+    NSFileManager* fileManager = [[NSFileManager alloc] init];
+    if ([restoredResources count] == 0 && [fileManager fileExistsAtPath:resourceInfoPath]) {
+        NSData* data = [NSData dataWithContentsOfFile:resourceInfoPath];
+        restoredResources = data == nil ? nil : [NSKeyedUnarchiver unarchiveObjectWithData:data];
+        *migrate = YES;
+    }
+    return restoredResources;
+}
+
+// Reads the cache directory once, so that restored resources are validated without a stat for each of them.
+// Names of data files in subdirectories and of files that have not been moved into them yet are returned.
++ (NSSet*)storedFileNamesAtPath:(NSString*)path {
+    NSFileManager* fileManager = [[NSFileManager alloc] init];
+    NSMutableSet* names = [NSMutableSet setWithArray:[fileManager contentsOfDirectoryAtPath:path error:nil]];
+    for (NSUInteger shard = 0; shard < MKMediaResourceShardsCount; shard++) {
+        NSString* shardPath = [path stringByAppendingPathComponent:[NSString stringWithFormat:@"%02lX", (unsigned long)shard]];
+        NSArray* shardNames = [fileManager contentsOfDirectoryAtPath:shardPath error:nil];
+        if (shardNames != nil) {
+            [names addObjectsFromArray:shardNames];
+        }
+    }
+    return names;
+}
+
+- (void)restoreResources {
+    BOOL migrateResourceInfo = NO;
+    NSArray* restoredResources = [MKResourceManager restoredResourcesFromIndex:_resourceIndex resourceInfoPath:[self resourceInfoPath] migrate:&migrateResourceInfo];
+    [self mergeRestoredResources:restoredResources];
+    
+    NSArray* validatedResources = [self validateRestoredResourcesWithStoredFileNames:[MKResourceManager storedFileNamesAtPath:_pathCache]];
+    if (migrateResourceInfo) {
+        [self finishResourceInfoMigration:validatedResources];
+    }
+    [self didBecomeReady];
+}
+
+- (void)restoreResourcesAsynchronously {
+    MKResourceIndex* resourceIndex = _resourceIndex;
+    NSString* resourceInfoPath = [self resourceInfoPath];
+    NSString* pathCache = _pathCache;
+    __weak MKResourceManager* weakSelf = self;
     
-    for (MKResource* res in resources) {
-        pathToResource = [self fullFilePath:[res.resourceURL absoluteString]];
-        fileExists = [[NSFileManager defaultManager] fileExistsAtPath:pathToResource isDirectory:&isDirectory];
+    dispatch_async(_cacheMaintenanceQueue, ^{
+        BOOL migrateResourceInfo = NO;
+        NSArray* restoredResources = [MKResourceManager restoredResourcesFromIndex:resourceIndex resourceInfoPath:resourceInfoPath migrate:&migrateResourceInfo];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [weakSelf mergeRestoredResources:restoredResources];
+        });
         
-        if (!isDirectory && fileExists) {
-            // now check for resource's expiration time; lastAccessDate should be earlier, so multiply by -1.0
-            NSTimeInterval passedPeriod = [res.lastAccessDate timeIntervalSinceNow] * -1.0;
-            if (res.expirationPeriod > 0.0 &&
-                passedPeriod >= res.expirationPeriod) {
-                // only resources with expiration period greater than 0.0 are cleaned;
-                // this resource should be removed if passed period is greater than resource's expiration period
-                [self removeResourceFromStorage:res];
-            } else {
-                [validResources addObject:res];
+        NSSet* storedFileNames = [MKResourceManager storedFileNamesAtPath:pathCache];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            MKResourceManager* strongSelf = weakSelf;
+            NSArray* validatedResources = [strongSelf validateRestoredResourcesWithStoredFileNames:storedFileNames];
+            if (migrateResourceInfo) {
+                [strongSelf finishResourceInfoMigration:validatedResources];
             }
+            [strongSelf didBecomeReady];
+        });
+    });
+}
+
+// Adds restored resources to the manager. They remain unvalidated until first lookup or the validation pass.
+- (void)mergeRestoredResources:(NSArray*)restoredResources {
+    [self lock];
+    for (MKResource* restoredResource in restoredResources) {
+        NSString* urlString = [restoredResource.resourceURL absoluteString];
+        MKResource* resource = [self registeredResourceForURLString:urlString];
+        if (resource == nil) {
+            resource = restoredResource;
+            [resource setResourceManager:self];
+            [self registerResource:resource forURLString:urlString];
+        } else if (resource.status == MKStatusNotDownloaded) {
+            // the resource has been looked up before restore finished
+            [resource adoptStateOfRestoredResource:restoredResource];
+        } else {
+            continue;
         }
+        resource.needsValidation = YES;
+        [_unvalidatedResources addObject:resource];
     }
-    
-    return [NSArray arrayWithArray:validResources];
+    [self unlock];
 }
 
-- (void)restoreResources {
-    NSString* resourceInfoPath = [self.pathCache stringByAppendingPathComponent:MKMediaResourceSavedResourcesFileName];
+// Checks that data of restored resource is in the cache directory and it is not expired.
+// If storedFileNames is nil the file is checked directly.
+- (BOOL)validateRestoredResource:(MKResource*)resource storedFileNames:(NSSet*)storedFileNames {
+    resource.needsValidation = NO;
+    
+    NSString* urlString = [resource.resourceURL absoluteString];
+    BOOL fileExists = NO;
+    if (storedFileNames != nil) {
+        fileExists = [storedFileNames containsObject:[self nameFromURLString:urlString]];
+    }
+    if (storedFileNames == nil || (fileExists && resource.storedLength == 0)) {
+        // resources saved by previous versions have no stored length
+        NSDictionary* attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:[self fullFilePath:urlString] error:nil];
+        fileExists = attributes != nil && ![[attributes fileType] isEqualToString:NSFileTypeDirectory];
+        resource.storedLength = [attributes fileSize];
+    }
+    
+    if (!fileExists) {
+        // data is lost, forget the resource
+        [resource setStatus:MKStatusNotDownloaded];
+        [self setNeedsSaveResource:resource];
+        return NO;
+    }
     
-    NSData* data = [NSData dataWithContentsOfFile:resourceInfoPath];
-    NSArray* restoredResources = data == nil ? nil : [NSKeyedUnarchiver unarchiveObjectWithData:data];
+    // now check for resource's expiration time; lastAccessDate should be earlier, so multiply by -1.0
+    NSTimeInterval passedPeriod = [resource.lastAccessDate timeIntervalSinceNow] * -1.0;
+    if (resource.expirationPeriod > 0.0 &&
+        passedPeriod >= resource.expirationPeriod) {
+        // only resources with expiration period greater than 0.0 are cleaned;
+        // this resource should be removed if passed period is greater than resource's expiration period
+        [self removeResourceFromStorage:resource];
+        return NO;
+    }
     
-    NSArray* validatedResources = [self validateResources:restoredResources];
+    return YES;
+}
+
+- (void)validateResourceIfNeeded:(MKResource*)resource {
+    if (resource.needsValidation) {
+        [self lock];
+        if (resource.needsValidation && [self validateRestoredResource:resource storedFileNames:nil]) {
+            [_recentlyUsedResources addResource:resource];
+            [self setNeedsCacheTrim];
+        }
+        [self unlock];
+    }
+}
+
+- (NSArray*)validateRestoredResourcesWithStoredFileNames:(NSSet*)storedFileNames {
+    [self lock];
+    NSMutableArray* validatedResources = [NSMutableArray array];
+    for (MKResource* resource in _unvalidatedResources) {
+        if (resource.needsValidation && [self validateRestoredResource:resource storedFileNames:storedFileNames]) {
+            [validatedResources addObject:resource];
+        }
+    }
+    [_unvalidatedResources removeAllObjects];
     
+    // most recently accessed resources are appended first so that the oldest end up at the tail of the recently used list
+    [validatedResources sortUsingComparator:^NSComparisonResult(MKResource* obj1, MKResource* obj2) {
+        NSDate* date1 = obj1.lastAccessDate ?: [NSDate distantPast];
+        NSDate* date2 = obj2.lastAccessDate ?: [NSDate distantPast];
+        return [date2 compare:date1];
+    }];
     for (MKResource* resource in validatedResources) {
-        [resource setResourceManager:self];
-        [_statusByURL setObject:resource forKey:[resource.resourceURL absoluteString]];
+        [_recentlyUsedResources appendResource:resource];
+    }
+    
+    [self setNeedsCacheTrim];
+    [self unlock];
+    return validatedResources;
+}
+
+- (void)finishResourceInfoMigration:(NSArray*)validatedResources {
+    [self lock];
+    [_dirtyResources addObjectsFromArray:validatedResources];
+    [self flushResourcesInfo];
+    [self unlock];
+    [_resourceIndex waitUntilSaved];
+    [[NSFileManager defaultManager] removeItemAtPath:[self resourceInfoPath] error:nil];
+}
+
+- (void)didBecomeReady {
+    [self lock];
+    _ready = YES;
+    _startupDuration = CFAbsoluteTimeGetCurrent() - _startupTime;
+    
+    NSArray* readinessHandlers = [_readinessHandlers copy];
+    [_readinessHandlers removeAllObjects];
+    [self unlock];
+    for (void (^readinessHandler)(MKResourceManager* manager) in readinessHandlers) {
+        readinessHandler(self);
+    }
+}
+
+- (void)addReadinessHandler:(void (^)(MKResourceManager* manager))handler {
+    if (handler == NULL) {
+        return;
+    }
+    [self lock];
+    BOOL ready = _ready;
+    if (!ready) {
+        [_readinessHandlers addObject:[handler copy]];
+    }
+    [self unlock];
+    if (ready) {
+        handler(self);
     }
 }
 
 - (void)saveResourcesInfo {
     float minTimeIntervalBetweenSavings = 5; //In seconds
     
+    [self lock];
     double currentInterval = [NSDate timeIntervalSinceReferenceDate] - _lastTimeWhenResourceInfoSaved;
     if (currentInterval < minTimeIntervalBetweenSavings) {
         if (!_saveDalayed) {
-            [self performSelector:@selector(saveResourcesInfo) withObject:nil afterDelay:minTimeIntervalBetweenSavings];
+            if (_threadSafe) {
+                // the calling thread may have no run loop
+                __weak MKResourceManager* weakSelf = self;
+                dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(minTimeIntervalBetweenSavings * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+                    [weakSelf saveResourcesInfo];
+                });
+            } else {
+                [self performSelector:@selector(saveResourcesInfo) withObject:nil afterDelay:minTimeIntervalBetweenSavings];
+            }
             _saveDalayed = YES;
         }
-        return;
+    } else {
+        [self flushResourcesInfo];
     }
-    
-    NSString* resourceInfoPath = [self.pathCache stringByAppendingPathComponent:MKMediaResourceSavedResourcesFileName];
-    NSMutableArray* resourcesToSave = [NSMutableArray array];
-    
-    for (MKResource* resource in [_statusByURL allValues]) {
-        if (resource.status == MKStatusDownloaded) {
-            [resourcesToSave addObject:resource];
-        }
+    [self unlock];
+}
+
+// Writes changed resources into the index regardless of the time passed since the previous save
+- (void)flushResourcesInfo {
+    [self lock];
+    [self applyReadAccesses];
+    if ([_dirtyResources count] > 0) {
+        NSArray* resourcesToSave = [_dirtyResources allObjects];
+        [_dirtyResources removeAllObjects];
+        [_resourceIndex saveResources:resourcesToSave];
+        [_metrics addValue:1 toCounter:MKResourceMetricsCounterIndexSaves];
     }
     
-    dispatch_async(_saveResourceInfoQueue, ^{
-        NSData* data = [NSKeyedArchiver archivedDataWithRootObject:resourcesToSave];
-        BOOL achivresult = [data writeToFile:resourceInfoPath atomically:YES];
-        if (!achivresult) {
-            NSLog(@"%@: Fail to save Resource Info at path: %@", NSStringFromClass ([self class]), resourceInfoPath);//Error
-        } else {
-            // successfully saved; apply attributes
-            NSURL* fileURL = [NSURL fileURLWithPath:resourceInfoPath];
-            [MKResourceUtility markNonPurgeableNonBackedUpFileAtURL:fileURL];
-        }
-    });
-    
     _lastTimeWhenResourceInfoSaved = [NSDate timeIntervalSinceReferenceDate];
     _saveDalayed = NO;
+    [self unlock];
+}
+
+- (void)setNeedsSaveResource:(MKResource*)resource {
+    if (resource != nil) {
+        [self lock];
+        [_dirtyResources addObject:resource];
+        [self unlock];
+    }
+}
+
+- (NSUInteger)maxConcurrentDownloadsCount {
+    return [_downloadScheduler maxConcurrentDownloadsCount];
+}
+
+- (void)setMaxConcurrentDownloadsCount:(NSUInteger)maxConcurrentDownloadsCount {
+    [self lock];
+    [_downloadScheduler setMaxConcurrentDownloadsCount:maxConcurrentDownloadsCount];
+    [self downloadResourceQueueChanged];
+    [self unlock];
 }
 
-- (void)enqueueResource:(MKResource*)resource {
-    [_downloadResourcesQueue addObject:resource];
+- (NSUInteger)maxConcurrentDownloadsPerHostCount {
+    return [_downloadScheduler maxConcurrentDownloadsPerHostCount];
+}
+
+- (void)setMaxConcurrentDownloadsPerHostCount:(NSUInteger)maxConcurrentDownloadsPerHostCount {
+    [self lock];
+    [_downloadScheduler setMaxConcurrentDownloadsPerHostCount:maxConcurrentDownloadsPerHostCount];
     [self downloadResourceQueueChanged];
+    [self unlock];
+}
+
+- (NSUInteger)acquireDownloadSlotsForResource:(MKResource*)resource count:(NSUInteger)count {
+    [self lock];
+    NSUInteger acquiredCount = [_downloadScheduler addRunningSegmentsOfResource:resource count:count];
+    [self unlock];
+    return acquiredCount;
+}
+
+- (void)releaseDownloadSlotForResource:(MKResource*)resource {
+    [self lock];
+    if ([_downloadScheduler removeRunningSegmentOfResource:resource]) {
+        [self downloadResourceQueueChanged];
+    }
+    [self unlock];
+}
+
+- (void)resourcePriorityDidChange:(MKResource*)resource {
+    [self lock];
+    [_downloadScheduler reprioritizeResource:resource];
+    [self unlock];
 }
 
 - (void)dequeueResource:(MKResource*)resource {
+    [_downloadScheduler removeResource:resource];
     [self downloadResourceQueueChanged];
 }
 
+// Starts queued resources while there are free download slots
 - (void)downloadResourceQueueChanged {
-    if ([[_workDictionary allValues] count] >= self.maxConcurrentDownloadsCount) {
+    if (_suspended) {
         return;
     }
     
     MKResource* resource = nil;
-    if ([_downloadResourcesQueue count] > 0) {
-        resource = [_downloadResourcesQueue objectAtIndex:0];
-        [_downloadResourcesQueue removeObject:resource];
-    }
-    
-    if (resource == nil) {
-        return;
-    }
-    
-    if ([resource isKindOfClass:[MKCustomResource class]]) {
-        [(MKCustomResource*)resource startCustomDownload];
-    } else {
-        MKResourceDownloadWork* work = [[MKResourceDownloadWork alloc] init];
-        [_workDictionary setObject:work forKey:[resource.resourceURL absoluteString]];
-        [work startDownloadWork:resource manager:self httpClient:_httpClient];
-        //        [[MKNetworkActivity sharedInstance] incrementLoadingItems];
+    while ((resource = [_downloadScheduler dequeueNextResource]) != nil) {
+        NSError* rejectionError = [self rejectionErrorForResource:resource];
+        if (rejectionError != nil) {
+            [self rejectDownloadResource:resource error:rejectionError];
+            continue;
+        }
+        if (_sharesCache && ![resource isKindOfClass:[MKCustomResource class]] && ![self lockSharedDownloadOfResource:resource]) {
+            // another process is downloading the URL, its result is picked up by synchronizeSharedCache
+            [_downloadScheduler removeResource:resource];
+            [_sharedDownloadWaiters addObject:resource];
+            continue;
+        }
+        CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+        NSTimeInterval queueWait = resource.scheduledTime > 0.0 ? startTime - resource.scheduledTime : 0.0;
+        [_metrics addDuration:queueWait toLatency:MKResourceMetricsLatencyQueueWait];
+        resource.downloadStartTime = startTime;
+        [self traceEvent:MKResourceTraceEventStarted forResource:resource duration:queueWait];
+        if ([resource isKindOfClass:[MKCustomResource class]]) {
+            [(MKCustomResource*)resource startCustomDownload];
+        } else {
+            MKResourceDownloadWork* work = [[MKResourceDownloadWork alloc] init];
+            [_workDictionary setObject:work forKey:[resource.resourceURL absoluteString]];
+            [work startDownloadWork:resource manager:self httpClient:_httpClient];
+            //        [[MKNetworkActivity sharedInstance] incrementLoadingItems];
+        }
     }
 }
 
 - (void)startDownloadResource:(MKResource*)resource {
     if (resource != nil) {
+        [self lock];
         if (_suspended) {
             [_suspendedResources addObject:resource];
         } else {
-            resource.lastAccessDate = [NSDate date];
-            [resource setLastError:nil];
-            [resource setStatus:MKStatusInProgress];
-            [self enqueueResource:resource];
+            [self scheduleDownloadResource:resource accessDate:[NSDate date]];
+            [self downloadResourceQueueChanged];
+        }
+        [self unlock];
+    }
+}
+
+// Puts resource in the download queue without starting queued downloads. Should be called with the manager lock held.
+// The resource that is queued or running already is not scheduled again, so all the callers share one download.
+- (void)scheduleDownloadResource:(MKResource*)resource accessDate:(NSDate*)accessDate {
+    resource.lastAccessDate = accessDate;
+    [resource setLastError:nil];
+    if (resource.retryPending) {
+        // the download started meanwhile replaces the pending retry and gets retries of its own
+        resource.retryPending = NO;
+        resource.retryCount = 0;
+    }
+    if (_staleWhileRevalidateInterval > 0.0 && resource.status == MKStatusDownloaded) {
+        // cached data remains available while the resource is revalidated
+        resource.revalidating = YES;
+    } else {
+        [resource setStatus:MKStatusInProgress];
+    }
+    [_downloadScheduler enqueueResource:resource];
+    // resource queued already keeps the time it has been queued first
+    if (resource.scheduledTime == 0.0) {
+        resource.scheduledTime = CFAbsoluteTimeGetCurrent();
+        [self traceEvent:MKResourceTraceEventScheduled forResource:resource duration:0.0];
+    }
+}
+
+// Gives back the priority the resource had before a prefetch batch. Should be called with the manager lock held.
+- (void)restorePriorityOfResource:(MKResource*)resource {
+    if (resource.hasBatchPriority) {
+        resource.priority = resource.priorityBeforeBatch;
+        resource.hasBatchPriority = NO;
+    }
+}
+
+- (MKResourcesController*)prefetchResourcesForNSURLs:(NSArray*)URLs priority:(MKResourcePriority)priority completion:(void (^)(MKResourcesController* controller, NSError* error))completion {
+    MKResourcesController* controller = [[MKResourcesController alloc] init];
+    NSDate* accessDate = [NSDate date];
+    NSMutableSet* batchURLStrings = [NSMutableSet setWithCapacity:[URLs count]];
+    
+    [self lock];
+    for (NSURL* url in URLs) {
+        NSString* urlString = [url absoluteString];
+        if (urlString == nil || [batchURLStrings containsObject:urlString]) {
+            continue;
+        }
+        [batchURLStrings addObject:urlString];
+        
+        MKResource* resource = [self registeredResourceForURLString:urlString];
+        if (resource == nil) {
+            resource = [self createResourceForNSURL:url];
+        }
+        [self validateResourceIfNeeded:resource];
+        
+        BOOL inFlight = resource.status == MKStatusInProgress || resource.revalidating;
+        if (!inFlight && resource.status == MKStatusDownloaded) {
+            resource.lastAccessDate = accessDate;
+            continue;
+        }
+        if (!inFlight || priority > resource.priority) {
+            // the download in flight is shared, it is only moved up if the batch needs it sooner.
+            // The priority is given to the download only, the resource gets its own back when the download ends.
+            if (!resource.hasBatchPriority) {
+                resource.priorityBeforeBatch = resource.priority;
+                resource.hasBatchPriority = YES;
+            }
+            resource.priority = priority;
+        }
+        if (!inFlight) {
+            if (_suspended) {
+                [_suspendedResources addObject:resource];
+                [resource setStatus:MKStatusInProgress];
+            } else {
+                [self scheduleDownloadResource:resource accessDate:accessDate];
+            }
+        }
+        [controller addResource:resource];
+    }
+    
+    if (completion != NULL) {
+        if ([controller count] == 0) {
+            [self performCallback:^{
+                completion(controller, nil);
+            }];
+        } else {
+            [controller addCompletionHandler:^(MKResource* resource, NSData* data, NSError* error) {
+                completion(controller, error);
+            }];
         }
     }
+    [self saveResourcesInfo];
+    [self downloadResourceQueueChanged];
+    [self unlock];
+    
+    return controller;
 }
 
 - (void)cancelDownloadResource:(MKResource*)resource {
-    if (resource != nil && resource.status == MKStatusInProgress) {
+    [self lock];
+    if (resource != nil && (resource.status == MKStatusInProgress || resource.revalidating)) {
         resource.lastAccessDate = [NSDate distantPast];
-        if ([resource isKindOfClass:[MKCustomResource class]]) {
-            [(MKCustomResource*) resource cancelCustomDownload];
-        } else {
-            //            [[MKNetworkActivity sharedInstance] decrementLoadingItems];
-            MKResourceDownloadWork* work = (MKResourceDownloadWork*)[_workDictionary objectForKey:[resource.resourceURL absoluteString]];
-            [work cancelLoading];
-            [_workDictionary removeObjectForKey:[resource.resourceURL absoluteString]];
+        // resource waiting in the queue has nothing to cancel
+        if ([_downloadScheduler removeResource:resource]) {
+            if ([resource isKindOfClass:[MKCustomResource class]]) {
+                [(MKCustomResource*) resource cancelCustomDownload];
+            } else {
+                //            [[MKNetworkActivity sharedInstance] decrementLoadingItems];
+                MKResourceDownloadWork* work = (MKResourceDownloadWork*)[_workDictionary objectForKey:[resource.resourceURL absoluteString]];
+                [work cancelLoading];
+                [_workDictionary removeObjectForKey:[resource.resourceURL absoluteString]];
+            }
         }
+        resource.scheduledTime = 0.0;
+        resource.downloadStartTime = 0.0;
+        resource.retryCount = 0;
+        resource.retryPending = NO;
+        [self restorePriorityOfResource:resource];
+        [_sharedDownloadWaiters removeObject:resource];
+        [_sharedDownloadResults removeObjectForKey:[resource.resourceURL absoluteString]];
+        [self traceEvent:MKResourceTraceEventCancelled forResource:resource duration:0.0];
         
         if (_suspended) {
             [_suspendedResources addObject:resource];
         } else {
-            [resource setStatus:MKStatusNotDownloaded];
+            if (resource.revalidating) {
+                resource.revalidating = NO;
+            } else {
+                [resource setStatus:MKStatusNotDownloaded];
+            }
             [resource notifyDidCancelDownload];
             [self dequeueResource:resource];
         }
+        [self unlockSharedDownloadOfResource:resource];
     }
+    [self unlock];
 }
 
 - (void)didFinishDownloadResource:(MKResource *)resource data:(NSData *)data error:(NSError *)error {
@@ -238,90 +735,722 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
 }
 
 - (void)didFinishDownloadResource:(MKResource *)resource data:(NSData *)data error:(NSError *)error httpResponse:(NSHTTPURLResponse*)httpResponse {
+    MKResourceBuffer* buffer = data != nil ? [MKResourceBuffer bufferWithData:data] : nil;
+    [self didFinishDownloadResource:resource buffer:buffer error:error httpResponse:httpResponse];
+}
+
+- (void)didFinishDownloadResource:(MKResource *)resource buffer:(MKResourceBuffer *)buffer error:(NSError *)error httpResponse:(NSHTTPURLResponse*)httpResponse {
+    [self lock];
     [_workDictionary removeObjectForKey:[resource.resourceURL absoluteString]];
+    [_downloadScheduler removeResource:resource];
     if ([resource isKindOfClass:[MKCustomResource class]] == NO) {
         //        [[MKNetworkActivity sharedInstance] decrementLoadingItems];
     }
+    NSTimeInterval transferDuration = resource.downloadStartTime > 0.0 ? CFAbsoluteTimeGetCurrent() - resource.downloadStartTime : 0.0;
+    [_metrics addDuration:transferDuration toLatency:MKResourceMetricsLatencyTransfer];
+    if (error != nil) {
+        // response of failed connection may be successful one, the failure is counted as network error then
+        NSInteger statusCode = [httpResponse statusCode];
+        [_metrics addErrorWithStatusCode:(statusCode / 100) == 2 ? 0 : statusCode];
+    }
+    resource.scheduledTime = 0.0;
+    resource.downloadStartTime = 0.0;
+    [self traceEvent:(error != nil ? MKResourceTraceEventFailed : MKResourceTraceEventFinished) forResource:resource duration:transferDuration];
     
-    if (_suspended || [error code] == 401) {
+    if (_suspended || ([error code] == 401 && _retryPolicy == nil)) {
         [_suspendedResources addObject:resource];
+        [self unlockSharedDownloadOfResource:resource];
+    } else if ([self shouldRetryDownloadResource:resource error:error httpResponse:httpResponse]) {
+        // watchers learn about the failure when retries are over, the URL stays locked for the retry
+        [self dequeueResource:resource];
     } else {
-        if (error == nil) {
-            resource.loadedDate = [NSDate date];
-        }
-        [resource setLastError:error];
-        [resource setLastResponse:httpResponse];
-        [self setData:data forResource:resource];
-        [resource notifyDidFinishDownload:error];
+        [self completeDownloadResource:resource buffer:buffer error:error httpResponse:httpResponse];
+        [self unlockSharedDownloadOfResource:resource];
         [self dequeueResource:resource];
     }
+    [self unlock];
+}
+
+// Stores result of the download and notifies watchers of the resource. Should be called with the manager lock held.
+- (void)completeDownloadResource:(MKResource *)resource buffer:(MKResourceBuffer *)buffer error:(NSError *)error httpResponse:(NSHTTPURLResponse*)httpResponse {
+    resource.revalidating = NO;
+    [self restorePriorityOfResource:resource];
+    if (error == nil) {
+        resource.loadedDate = [NSDate date];
+        if (httpResponse != nil) {
+            [resource setValidatorsFromResponse:httpResponse];
+        }
+    }
+    [resource setLastError:error];
+    [resource setLastResponse:httpResponse];
+    [self setBuffer:buffer forResource:resource];
+    [resource notifyDidFinishDownload:error];
+}
+
+// Returns YES if data of the resource can be read from the cache
+- (BOOL)canReadDataForResource:(MKResource *)resource error:(NSError**)error {
+    if (_suspended) {
+        if (error != NULL) {
+            NSDictionary* userInfo = [NSDictionary dictionaryWithObjectsAndKeys:@"Access denied",NSLocalizedFailureReasonErrorKey, nil];
+            *error = [NSError errorWithDomain:@"MKResourceManagerErrorDomain" code:60 userInfo:userInfo];
+        }
+        return NO;
+    }
+    
+    [self validateResourceIfNeeded:resource];
+    if (resource == nil || resource.status != MKStatusDownloaded) {
+        return NO;
+    }
+    // fresh data is served without the manager lock, it is taken only to schedule the revalidation
+    NSTimeInterval staleWhileRevalidateInterval = _staleWhileRevalidateInterval;
+    if (staleWhileRevalidateInterval > 0.0 && [resource isStaleAfterInterval:staleWhileRevalidateInterval]) {
+        [self lock];
+        [self revalidateResourceIfStale:resource];
+        [self unlock];
+    }
+    return YES;
+}
+
+- (void)revalidateResourceIfStale:(MKResource*)resource {
+    if (_staleWhileRevalidateInterval <= 0.0 || resource.revalidating) {
+        return;
+    }
+    if (resource.loadedDate == nil && resource.eTag == nil && resource.lastModified == nil) {
+        // data set by client has not been downloaded, there is nothing to revalidate
+        return;
+    }
+    // loadedDate should be earlier, so multiply by -1.0
+    if (resource.loadedDate == nil || [resource.loadedDate timeIntervalSinceNow] * -1.0 >= _staleWhileRevalidateInterval) {
+        [self startDownloadResource:resource];
+    }
+}
+
+- (BOOL)hasStoredDataForResource:(MKResource*)resource {
+    [self lock];
+    BOOL result = [_recentlyUsedResources containsResource:resource];
+    [self unlock];
+    return result;
 }
 
 - (NSData*)dataForResource:(MKResource *)resource error:(NSError**)error {
+    return [self dataForResource:resource options:MKResourceReadingDefault error:error];
+}
+
+- (NSData*)dataForResource:(MKResource *)resource options:(MKResourceReadingOptions)options error:(NSError**)error {
     NSData* decryptedData = nil;
     
-    if (_suspended == NO) {
-        if (resource != nil &&
-            resource.status == MKStatusDownloaded) {
-            if ([self existMRinCache:[resource.resourceURL absoluteString]]) {
-                NSMutableData* data = [self readMediaResourceFromCacheAtPath:[resource.resourceURL absoluteString]];
-                //                decryptedData = [AESUtil decryptAES:_keyEncoding data:data];
-                decryptedData = data;
-                resource.lastAccessDate = [NSDate date];
+    if ([self canReadDataForResource:resource error:error]) {
+        NSTimeInterval readDuration = 0.0;
+        decryptedData = [self memoryCachedDataForResource:resource];
+        if (decryptedData == nil) {
+            // the data is read without the lock; it is kept in memory only if it has not been replaced meanwhile
+            NSUInteger dataGeneration = resource.dataGeneration;
+            CFAbsoluteTime readStartTime = CFAbsoluteTimeGetCurrent();
+            decryptedData = [self readMediaResourceFromCacheAtPath:[resource.resourceURL absoluteString] compressed:resource.storesCompressedData options:options];
+            readDuration = CFAbsoluteTimeGetCurrent() - readStartTime;
+            [_metrics addDuration:readDuration toLatency:MKResourceMetricsLatencyDiskRead];
+            if ((options & MKResourceReadingMapped) == 0 && decryptedData != nil && _memoryCacheCapacity > 0) {
+                [self lock];
+                if (resource.dataGeneration == dataGeneration) {
+                    [self setMemoryCachedData:decryptedData forResource:resource];
+                }
+                [self unlock];
             }
         }
-    } else {
-        if (error != NULL) {
-            NSDictionary* userInfo = [NSDictionary dictionaryWithObjectsAndKeys:@"Access denied",NSLocalizedFailureReasonErrorKey, nil];
-            *error = [NSError errorWithDomain:@"MKResourceManagerErrorDomain" code:60 userInfo:userInfo];
+        if (decryptedData != nil) {
+            [self resourceWasRead:resource];
+            [self didServeData:decryptedData ofResource:resource readDuration:readDuration];
+        } else {
+            [self discardUnencryptedDataOfResource:resource];
         }
     }
+    if (decryptedData == nil && resource != nil) {
+        [_metrics addValue:1 toCounter:MKResourceMetricsCounterMisses];
+    }
     
     return decryptedData;
 }
 
+- (NSData*)dataInRange:(NSRange)range forResource:(MKResource*)resource error:(NSError**)error {
+    NSData* data = nil;
+    
+    if ([self canReadDataForResource:resource error:error]) {
+        NSTimeInterval readDuration = 0.0;
+        NSData* memoryCachedData = [self memoryCachedDataForResource:resource];
+        if (memoryCachedData != nil) {
+            NSUInteger length = [memoryCachedData length];
+            NSUInteger location = MIN(range.location, length);
+            data = [memoryCachedData subdataWithRange:NSMakeRange(location, MIN(range.length, length - location))];
+        } else {
+            CFAbsoluteTime readStartTime = CFAbsoluteTimeGetCurrent();
+            data = [self readMediaResourceFromCacheAtPath:[resource.resourceURL absoluteString] range:range compressed:resource.storesCompressedData];
+            readDuration = CFAbsoluteTimeGetCurrent() - readStartTime;
+            [_metrics addDuration:readDuration toLatency:MKResourceMetricsLatencyDiskRead];
+        }
+        if (data != nil) {
+            [self resourceWasRead:resource];
+            [self didServeData:data ofResource:resource readDuration:readDuration];
+        } else {
+            [self discardUnencryptedDataOfResource:resource];
+        }
+    }
+    if (data == nil && resource != nil) {
+        [_metrics addValue:1 toCounter:MKResourceMetricsCounterMisses];
+    }
+    
+    return data;
+}
+
+- (NSInputStream*)inputStreamForResource:(MKResource*)resource {
+    NSInputStream* inputStream = nil;
+    
+    if ([self canReadDataForResource:resource error:NULL]) {
+        NSString* pathToResource = [self fullFilePath:[resource.resourceURL absoluteString]];
+        MKEncryptedFileReader* reader = [self encryptedFileReaderAtPath:pathToResource];
+        if (reader != nil) {
+            inputStream = [[MKDecryptingInputStream alloc] initWithReader:reader];
+        } else if (_encryptionKey != nil) {
+            [self discardUnencryptedDataOfResource:resource];
+        } else if ([[NSFileManager defaultManager] fileExistsAtPath:pathToResource]) {
+            inputStream = [NSInputStream inputStreamWithFileAtPath:pathToResource];
+        }
+        if (inputStream != nil && resource.storesCompressedData) {
+            inputStream = [[MKInflatingInputStream alloc] initWithStream:inputStream];
+        }
+        if (inputStream != nil) {
+            [self resourceWasRead:resource];
+            // bytes read from the stream are not known here, they are not counted as served
+            [_metrics addValue:1 toCounter:MKResourceMetricsCounterHits];
+            [self traceEvent:MKResourceTraceEventServed forResource:resource duration:0.0];
+        }
+    }
+    if (inputStream == nil && resource != nil) {
+        [_metrics addValue:1 toCounter:MKResourceMetricsCounterMisses];
+    }
+    
+    return inputStream;
+}
+
 - (void)setData:(NSData*)data forResource:(MKResource*)resource {
+    // validators of downloaded data do not describe data set by client
+    [resource setETag:nil];
+    [resource setLastModified:nil];
+    [resource setLoadedDate:nil];
+    MKResourceBuffer* buffer = data != nil ? [MKResourceBuffer bufferWithData:data] : nil;
+    [self setBuffer:buffer forResource:resource];
+}
+
+- (void)setBuffer:(MKResourceBuffer*)buffer forResource:(MKResource*)resource {
     if (resource != nil) {
+        [self lock];
         
         resource.lastAccessDate = [NSDate date];
-        if (data == nil && [self existMRinCache:[resource.resourceURL absoluteString]] == NO) {
+        [self setNeedsSaveResource:resource];
+        if (buffer == nil && [self existMRinCache:[resource.resourceURL absoluteString]] == NO) {
+            [self setMemoryCachedData:nil forResource:resource];
             [resource setStatus:MKStatusNotDownloaded];
         } else {
-            if (data) {
-                [self saveInCache:data atPath:[resource.resourceURL absoluteString]];
+            // nil buffer keeps the data, e.g. after response 304 Not Modified
+            if (buffer) {
+                [self setMemoryCachedData:nil forResource:resource];
+                unsigned long long length = [buffer length];
+                unsigned long long storedLength = length;
+                // small downloaded data is likely to be read right away; the buffer has no data after the move.
+                // Data that the memory cache would not keep is not joined from chunks, the move writes them as they are.
+                NSData* memoryCachedData = nil;
+                if (![buffer isFileBacked] && _memoryCacheCapacity > 0 && length <= _memoryCacheMaxDataLength) {
+                    memoryCachedData = [buffer data];
+                }
+                BOOL compress = [self shouldCompressDataOfResource:resource length:length];
+                BOOL saved = NO;
+                CFAbsoluteTime writeStartTime = CFAbsoluteTimeGetCurrent();
+                if (_deduplicatesData) {
+                    saved = [self saveBufferInBlobStore:buffer forResource:resource compress:compress storedLength:&storedLength];
+                } else {
+                    saved = [self saveBufferInCache:buffer atPath:[resource.resourceURL absoluteString] compress:compress storedLength:&storedLength];
+                    if (saved) {
+                        // data stored while deduplication was on
+                        [self releaseBlobOfResource:resource];
+                    }
+                }
+                [_metrics addDuration:CFAbsoluteTimeGetCurrent() - writeStartTime toLatency:MKResourceMetricsLatencyDiskWrite];
+                if (saved) {
+                    // the index keeps both lengths: logical for readers, stored for the cache size budget
+                    [resource setExpectedContentLength:(long long)length];
+                    resource.storesCompressedData = compress;
+                    [_recentlyUsedResources setStoredLength:storedLength forResource:resource];
+                    [_recentlyUsedResources addResource:resource];
+                    [self setMemoryCachedData:memoryCachedData forResource:resource];
+                }
+            } else if (![_recentlyUsedResources containsResource:resource]) {
+                // the data has been put into the cache directory by other means; account it once
+                NSString* pathToResource = [self fullFilePath:[resource.resourceURL absoluteString]];
+                NSDictionary* attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:pathToResource error:nil];
+                [_recentlyUsedResources setStoredLength:[attributes fileSize] forResource:resource];
+                [_recentlyUsedResources addResource:resource];
             }
             [resource setStatus:MKStatusDownloaded];
             [self saveResourcesInfo];
+            [self setNeedsCacheTrim];
         }
+        [self unlock];
     }
 }
 
-- (void)saveInCache:(NSData*)data atPath:(NSString*)stringURL {
-    NSString* fullURLString = [self fullFilePath:stringURL];
-    //    [[AESUtil encryptAES:_keyEncoding data:data] writeToFile:fullURLString atomically:YES];
-    [data writeToFile:fullURLString atomically:YES];
-    // also add attributes
-    NSURL* fileURL = [NSURL fileURLWithPath:fullURLString];
-    [MKResourceUtility markNonPurgeableNonBackedUpFileAtURL:fileURL];
+- (BOOL)saveInCache:(NSData*)data atPath:(NSString*)stringURL {
+    return [self saveBufferInCache:[MKResourceBuffer bufferWithData:data] atPath:stringURL];
 }
 
-- (NSMutableData*)readMediaResourceFromCacheAtPath:(NSString*)stringURL {
-    return [NSMutableData dataWithData:[NSData dataWithContentsOfFile:[self fullFilePath:stringURL]]];
+// Completed file backed buffer is moved into the cache by rename, in-memory buffer is written once.
+// Compressed and encrypted data is written chunk by chunk from the buffer.
+- (BOOL)saveBufferInCache:(MKResourceBuffer*)buffer atPath:(NSString*)stringURL {
+    return [self saveBufferInCache:buffer atPath:stringURL compress:NO storedLength:NULL];
 }
 
-- (BOOL)existMRinCache:(NSString*)stringURL {
-    return [[NSFileManager defaultManager] fileExistsAtPath:[self fullFilePath:stringURL]];
+- (BOOL)saveBufferInCache:(MKResourceBuffer*)buffer atPath:(NSString*)stringURL compress:(BOOL)compress storedLength:(unsigned long long*)storedLength {
+    NSString* fullURLString = [self fullFilePath:stringURL];
+    unsigned long long length = [buffer length];
+    NSError* error = nil;
+    BOOL result = [self storeBuffer:buffer atPath:fullURLString compress:compress error:&error];
+    if (!result && ![[NSFileManager defaultManager] fileExistsAtPath:[fullURLString stringByDeletingLastPathComponent]]) {
+        // the subdirectory has been removed along with its files
+        [[NSFileManager defaultManager] createDirectoryAtPath:[fullURLString stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:nil];
+        result = [self storeBuffer:buffer atPath:fullURLString compress:compress error:&error];
+    }
+    if (result) {
+        if (storedLength != NULL) {
+            struct stat fileStat;
+            // file written as is takes the length of the data
+            *storedLength = (compress || _encryptionKey != nil) && stat([fullURLString fileSystemRepresentation], &fileStat) == 0 ? (unsigned long long)fileStat.st_size : length;
+        }
+        // also add attributes
+        NSURL* fileURL = [NSURL fileURLWithPath:fullURLString];
+        [MKResourceUtility markNonPurgeableNonBackedUpFileAtURL:fileURL];
+    } else {
+        NSLog(@"%@: Fail to save resource data at path: %@, %@", NSStringFromClass ([self class]), fullURLString, [error localizedDescription]);//Error
+    }
+    return result;
 }
 
-// Method used for backward compotibiliti with previous AccessLibrary versions naming scheme
-- (NSString*)oldNameFromURLString:(NSString*)stringURL {
-    NSString* nameFromUrl = [stringURL stringByReplacingOccurrencesOfString:@"/" withString:@""];
-    nameFromUrl = [nameFromUrl stringByReplacingOccurrencesOfString:@":" withString:@""];
-    return nameFromUrl;
+- (BOOL)storeBuffer:(MKResourceBuffer*)buffer atPath:(NSString*)path compress:(BOOL)compress error:(NSError**)error {
+    if (_encryptionKey == nil && !compress) {
+        return [buffer moveToPath:path error:error];
+    }
+    if (!compress && buffer.encryptionKey == _encryptionKey && [buffer isEncryptedFileBacked]) {
+        // spilled data has been encrypted with the key already
+        return [buffer moveToPath:path error:error];
+    }
+    
+    // the file is written next to the cache and replaces the previous data by rename
+    NSString* temporaryPath = [[self temporaryDirectoryPath] stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    MKEncryptedFileWriter* writer = nil;
+    NSOutputStream* outputStream = nil;
+    BOOL (^output)(const void* bytes, NSUInteger length) = nil;
+    if (_encryptionKey != nil) {
+        writer = [[MKEncryptedFileWriter alloc] initWithKey:_encryptionKey path:temporaryPath];
+        output = ^BOOL(const void* bytes, NSUInteger length) {
+            return [writer appendBytes:bytes length:length];
+        };
+    } else {
+        outputStream = [NSOutputStream outputStreamToFileAtPath:temporaryPath append:NO];
+        [outputStream open];
+        output = ^BOOL(const void* bytes, NSUInteger length) {
+            NSUInteger writtenLength = 0;
+            while (writtenLength < length) {
+                NSInteger result = [outputStream write:(const uint8_t*)bytes + writtenLength maxLength:length - writtenLength];
+                if (result <= 0) {
+                    return NO;
+                }
+                writtenLength += result;
+            }
+            return YES;
+        };
+    }
+    // data is compressed before it is encrypted, encrypted data does not compress
+    MKDeflater* deflater = compress ? [[MKDeflater alloc] initWithLength:[buffer length] output:output] : nil;
+    NSInputStream* inputStream = [buffer inputStream];
+    [inputStream open];
+    BOOL result = (writer != nil || [outputStream streamStatus] == NSStreamStatusOpen) && (deflater != nil || !compress) && inputStream != nil;
+    uint8_t bytes[16 * 1024];
+    while (result) {
+        NSInteger readLength = [inputStream read:bytes maxLength:sizeof(bytes)];
+        if (readLength <= 0) {
+            result = readLength == 0;
+            break;
+        }
+        result = deflater != nil ? [deflater appendBytes:bytes length:readLength] : output(bytes, readLength);
+    }
+    [inputStream close];
+    
+    int errorCode = EIO;
+    result = result && (deflater == nil || [deflater finish]);
+    if (writer != nil) {
+        result = result && [writer finish];
+    } else {
+        result = result && [outputStream streamStatus] != NSStreamStatusError;
+        [outputStream close];
+    }
+    if (result && rename([temporaryPath fileSystemRepresentation], [path fileSystemRepresentation]) != 0) {
+        errorCode = errno;
+        result = NO;
+    }
+    if (result) {
+        [buffer removeAllData];
+    } else {
+        // unfinished writer removes its file itself
+        unlink([temporaryPath fileSystemRepresentation]);
+        if (error != NULL) {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errorCode userInfo:nil];
+        }
+    }
+    return result;
 }
 
-- (NSString*)oldFullFilePath:(NSString*)stringURL {
-    NSString* fileName = [self oldNameFromURLString:stringURL];
+#pragma mark - Blob store
+
+- (BOOL)deduplicatesData {
+    return _deduplicatesData;
+}
+
+- (MKEncryptionKey*)encryptionKey {
+    return _encryptionKey;
+}
+
+- (NSString*)blobPathForDigest:(NSString*)digest compressed:(BOOL)compressed {
+    NSString* blobsPath = [_pathCache stringByAppendingPathComponent:MKMediaResourceBlobsDirectoryName];
+    NSString* blobName = compressed ? [digest stringByAppendingPathExtension:MKMediaResourceCompressedBlobExtension] : digest;
+    return [[blobsPath stringByAppendingPathComponent:[digest substringToIndex:2]] stringByAppendingPathComponent:blobName];
+}
+
+// Data is kept once per digest in the blob directory and the file of the URL is a hard link to the blob.
+// The link count of the blob is its reference count: the blob itself and one link per URL that refers to it.
+- (BOOL)saveBufferInBlobStore:(MKResourceBuffer*)buffer forResource:(MKResource*)resource compress:(BOOL)compress storedLength:(unsigned long long*)storedLength {
+    NSString* stringURL = [resource.resourceURL absoluteString];
+    NSString* digest = [buffer digest];
+    if (digest == nil) {
+        BOOL result = [self saveBufferInCache:buffer atPath:stringURL compress:compress storedLength:storedLength];
+        if (result) {
+            [self releaseBlobOfResource:resource];
+        }
+        return result;
+    }
+    
+    NSFileManager* fileManager = [NSFileManager defaultManager];
+    // the same data stored compressed and as is are different blobs
+    NSString* blobPath = [self blobPathForDigest:digest compressed:compress];
+    struct stat blobStat;
+    BOOL blobExists = stat([blobPath fileSystemRepresentation], &blobStat) == 0;
+    if (blobExists) {
+        // the same data is stored already
+        [buffer removeAllData];
+    } else {
+        NSError* error = nil;
+        BOOL result = [self storeBuffer:buffer atPath:blobPath compress:compress error:&error];
+        if (!result && ![fileManager fileExistsAtPath:[blobPath stringByDeletingLastPathComponent]]) {
+            [fileManager createDirectoryAtPath:[blobPath stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:nil];
+            result = [self storeBuffer:buffer atPath:blobPath compress:compress error:&error];
+        }
+        if (!result || stat([blobPath fileSystemRepresentation], &blobStat) != 0) {
+            NSLog(@"%@: Fail to save resource data at path: %@, %@", NSStringFromClass ([self class]), blobPath, [error localizedDescription]);//Error
+            return NO;
+        }
+        [MKResourceUtility markNonPurgeableNonBackedUpFileAtURL:[NSURL fileURLWithPath:blobPath]];
+    }
+    
+    // the link replaces the previous file of the URL by rename
+    NSString* path = [self fullFilePath:stringURL];
+    NSString* linkPath = [[self temporaryDirectoryPath] stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    BOOL result = link([blobPath fileSystemRepresentation], [linkPath fileSystemRepresentation]) == 0;
+    int errorCode = errno;
+    if (result && rename([linkPath fileSystemRepresentation], [path fileSystemRepresentation]) != 0) {
+        // the subdirectory has been removed along with its files
+        [fileManager createDirectoryAtPath:[path stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:nil];
+        result = rename([linkPath fileSystemRepresentation], [path fileSystemRepresentation]) == 0;
+        errorCode = errno;
+    }
+    // rename does nothing if the file of the URL is a link to the same blob already
+    unlink([linkPath fileSystemRepresentation]);
+    if (!result) {
+        NSLog(@"%@: Fail to link resource data at path: %@, %s", NSStringFromClass ([self class]), path, strerror(errorCode));//Error
+        if (!blobExists) {
+            unlink([blobPath fileSystemRepresentation]);
+        }
+        return NO;
+    }
+    
+    if (![digest isEqualToString:resource.contentDigest] || compress != resource.storesCompressedData) {
+        [self releaseBlobOfResource:resource];
+        resource.contentDigest = digest;
+    }
+    if (storedLength != NULL) {
+        *storedLength = (unsigned long long)blobStat.st_size;
+    }
+    return YES;
+}
+
+// Called after the file of the resource has been removed or replaced. The blob is removed when no other URL links to it.
+- (void)releaseBlobOfResource:(MKResource*)resource {
+    NSString* digest = resource.contentDigest;
+    if (digest == nil) {
+        return;
+    }
+    resource.contentDigest = nil;
+    NSString* blobPath = [self blobPathForDigest:digest compressed:resource.storesCompressedData];
+    struct stat blobStat;
+    if (stat([blobPath fileSystemRepresentation], &blobStat) == 0 && blobStat.st_nlink <= 1) {
+        unlink([blobPath fileSystemRepresentation]);
+    }
+}
+
+// Blobs may be left without links when the application is terminated between storing and linking them
+// or when files of the cache directory are removed by other means. They are removed on the maintenance queue.
+- (void)removeUnreferencedBlobs {
+    NSString* blobsPath = [_pathCache stringByAppendingPathComponent:MKMediaResourceBlobsDirectoryName];
+    __weak MKResourceManager* weakSelf = self;
+    dispatch_async(_cacheMaintenanceQueue, ^{
+        NSFileManager* fileManager = [[NSFileManager alloc] init];
+        NSUInteger removedCount = 0;
+        for (NSString* shard in [fileManager contentsOfDirectoryAtPath:blobsPath error:nil]) {
+            NSString* shardPath = [blobsPath stringByAppendingPathComponent:shard];
+            for (NSString* item in [fileManager contentsOfDirectoryAtPath:shardPath error:nil]) {
+                MKResourceManager* strongSelf = weakSelf;
+                if (strongSelf == nil) {
+                    return;
+                }
+                // blobs are stored and linked under the lock
+                [strongSelf lock];
+                struct stat blobStat;
+                const char* blobPath = [[shardPath stringByAppendingPathComponent:item] fileSystemRepresentation];
+                if (lstat(blobPath, &blobStat) == 0 && S_ISREG(blobStat.st_mode) && blobStat.st_nlink <= 1 && unlink(blobPath) == 0) {
+                    removedCount++;
+                }
+                [strongSelf unlock];
+            }
+        }
+        if (removedCount > 0) {
+            NSLog(@"%@: %lu unreferenced blobs are removed", NSStringFromClass ([MKResourceManager class]), (unsigned long)removedCount);//Info
+        }
+    });
+}
+
+// Data of the resource is compressed if its content type is listed in compressedContentTypes and it is long enough.
+- (BOOL)shouldCompressDataOfResource:(MKResource*)resource length:(unsigned long long)length {
+    if ([_compressedContentTypes count] == 0 || length < _compressionMinimumLength || resource.contentType == nil) {
+        return NO;
+    }
+    NSString* contentType = resource.contentType;
+    NSRange parametersRange = [contentType rangeOfString:@";"];
+    if (parametersRange.location != NSNotFound) {
+        contentType = [contentType substringToIndex:parametersRange.location];
+    }
+    contentType = [[contentType stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] lowercaseString];
+    if ([_compressedContentTypes containsObject:contentType]) {
+        return YES;
+    }
+    NSRange suffixRange = [contentType rangeOfString:@"+" options:NSBackwardsSearch];
+    return suffixRange.location != NSNotFound && [_compressedContentTypes containsObject:[contentType substringFromIndex:suffixRange.location]];
+}
+
+// Returns nil if the manager does not encrypt data or the file has not been encrypted.
+// The manager that encrypts data does not read files that have not been encrypted.
+- (MKEncryptedFileReader*)encryptedFileReaderAtPath:(NSString*)path {
+    if (_encryptionKey == nil || ![MKEncryptedFileReader isEncryptedFileAtPath:path]) {
+        return nil;
+    }
+    return [[MKEncryptedFileReader alloc] initWithKey:_encryptionKey path:path];
+}
+
+// File that has not been encrypted is not authenticated, e.g. it may have been replaced in the cache directory.
+// It is treated as corrupt: removed, so that the resource is downloaded again.
+- (void)discardUnencryptedDataOfResource:(MKResource*)resource {
+    if (_encryptionKey == nil) {
+        return;
+    }
+    NSString* pathToResource = [self fullFilePath:[resource.resourceURL absoluteString]];
+    if (![[NSFileManager defaultManager] fileExistsAtPath:pathToResource] || [MKEncryptedFileReader isEncryptedFileAtPath:pathToResource]) {
+        return;
+    }
+    NSLog(@"%@: Fail to read data of url:%@, the file is not encrypted", NSStringFromClass ([self class]), resource.resourceURL);//Error
+    [self removeResourceFromStorage:resource];
+}
+
+- (NSData*)readMediaResourceFromCacheAtPath:(NSString*)stringURL compressed:(BOOL)compressed options:(MKResourceReadingOptions)options {
+    NSDataReadingOptions readingOptions = 0;
+    if ((options & MKResourceReadingMapped) != 0) {
+        readingOptions |= NSDataReadingMappedIfSafe;
+    }
+    NSString* pathToResource = [self fullFilePath:stringURL];
+    MKEncryptedFileReader* reader = [self encryptedFileReaderAtPath:pathToResource];
+    if (reader != nil) {
+        // encrypted data can not be mapped, it is decrypted into memory
+        if (compressed) {
+            return [MKInflatingInputStream dataInRange:NSMakeRange(0, NSUIntegerMax) ofStream:[[MKDecryptingInputStream alloc] initWithReader:reader]];
+        }
+        return [reader data];
+    }
+    if (_encryptionKey != nil) {
+        return nil;
+    }
+    NSData* data = [NSData dataWithContentsOfFile:pathToResource options:readingOptions error:nil];
+    if (data != nil && compressed) {
+        // compressed data is inflated from the mapped file
+        return [MKInflatingInputStream dataInRange:NSMakeRange(0, NSUIntegerMax) ofStream:[NSInputStream inputStreamWithData:data]];
+    }
+    return data;
+}
+
+- (NSData*)readMediaResourceFromCacheAtPath:(NSString*)stringURL range:(NSRange)range compressed:(BOOL)compressed {
+    char path[PATH_MAX];
+    if (![self getFileSystemPath:path forURLString:stringURL]) {
+        return nil;
+    }
+    if (_encryptionKey != nil) {
+        MKEncryptedFileReader* reader = [self encryptedFileReaderAtPath:[[NSFileManager defaultManager] stringWithFileSystemRepresentation:path length:strlen(path)]];
+        if (reader != nil) {
+            if (compressed) {
+                return [MKInflatingInputStream dataInRange:range ofStream:[[MKDecryptingInputStream alloc] initWithReader:reader]];
+            }
+            return [reader dataInRange:range];
+        }
+        return nil;
+    }
+    if (compressed) {
+        // compressed data is inflated from the start of the file up to the end of the range
+        if (access(path, R_OK) != 0) {
+            return nil;
+        }
+        NSString* pathToResource = [[NSFileManager defaultManager] stringWithFileSystemRepresentation:path length:strlen(path)];
+        return [MKInflatingInputStream dataInRange:range ofStream:[NSInputStream inputStreamWithFileAtPath:pathToResource]];
+    }
+    int fileDescriptor = open(path, O_RDONLY);
+    if (fileDescriptor < 0) {
+        return nil;
+    }
+    
+    // the range is clipped to the file before the data is allocated
+    struct stat fileStat;
+    if (fstat(fileDescriptor, &fileStat) != 0) {
+        close(fileDescriptor);
+        return nil;
+    }
+    unsigned long long fileLength = (unsigned long long)fileStat.st_size;
+    unsigned long long location = MIN((unsigned long long)range.location, fileLength);
+    NSUInteger length = (NSUInteger)MIN((unsigned long long)range.length, fileLength - location);
+    NSMutableData* data = [NSMutableData dataWithLength:length];
+    size_t readLength = 0;
+    while (readLength < length) {
+        ssize_t result = pread(fileDescriptor, (uint8_t*)[data mutableBytes] + readLength, length - readLength, (off_t)location + readLength);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        readLength += result;
+    }
+    close(fileDescriptor);
+    
+    [data setLength:readLength];
+    return data;
+}
+
+- (NSString*)temporaryDirectoryPath {
+    return _temporaryDirectoryPath;
+}
+
+- (MKResourceIndex*)resourceIndex {
+    return _resourceIndex;
+}
+
+// Downloads are spilled next to the cache, so that completed ones are moved into it by rename.
+// Leftovers of the previous session are moved to the trash.
+- (void)prepareTemporaryDirectory {
+    NSFileManager* fileManager = [NSFileManager defaultManager];
+    NSString* temporaryPath = [_pathCache stringByAppendingPathComponent:MKMediaResourceTemporaryDirectoryName];
+    if (_sharesCache) {
+        [self prepareSharedTemporaryDirectoryAtPath:temporaryPath];
+    } else {
+        if ([fileManager fileExistsAtPath:temporaryPath]) {
+            NSString* trashPath = [self trashDirectoryPath];
+            [fileManager createDirectoryAtPath:trashPath withIntermediateDirectories:YES attributes:nil error:nil];
+            [fileManager moveItemAtPath:temporaryPath toPath:[trashPath stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]] error:nil];
+        }
+        [fileManager createDirectoryAtPath:temporaryPath withIntermediateDirectories:YES attributes:nil error:nil];
+        _temporaryDirectoryPath = temporaryPath;
+    }
+    
+    NSString* partialPath = [_pathCache stringByAppendingPathComponent:MKMediaResourcePartialDirectoryName];
+    [fileManager createDirectoryAtPath:partialPath withIntermediateDirectories:YES attributes:nil error:nil];
+    dispatch_async(_cacheMaintenanceQueue, ^{
+        NSFileManager* fileManager = [[NSFileManager alloc] init];
+        NSDate* expirationDate = [NSDate dateWithTimeIntervalSinceNow:-MKMediaResourcePartialDownloadLifetime];
+        for (NSString* item in [fileManager contentsOfDirectoryAtPath:partialPath error:nil]) {
+            NSString* itemPath = [partialPath stringByAppendingPathComponent:item];
+            NSDate* modificationDate = [[fileManager attributesOfItemAtPath:itemPath error:nil] fileModificationDate];
+            if (modificationDate != nil && [modificationDate compare:expirationDate] == NSOrderedAscending) {
+                [fileManager removeItemAtPath:itemPath error:nil];
+            }
+        }
+    });
+}
+
+// Each process spills downloads into its own subdirectory, locked while the manager exists. Subdirectories
+// that are not locked have been left by processes that are gone and are moved to the trash.
+- (void)prepareSharedTemporaryDirectoryAtPath:(NSString*)temporaryPath {
+    NSFileManager* fileManager = [NSFileManager defaultManager];
+    [fileManager createDirectoryAtPath:temporaryPath withIntermediateDirectories:YES attributes:nil error:nil];
+    // subdirectory is not swept by another process before its owner is locked
+    int directoryDescriptor = open([temporaryPath fileSystemRepresentation], O_RDONLY);
+    if (directoryDescriptor >= 0) {
+        flock(directoryDescriptor, LOCK_EX);
+    }
+    NSString* trashPath = [self trashDirectoryPath];
+    [fileManager createDirectoryAtPath:trashPath withIntermediateDirectories:YES attributes:nil error:nil];
+    for (NSString* item in [fileManager contentsOfDirectoryAtPath:temporaryPath error:nil]) {
+        NSString* itemPath = [temporaryPath stringByAppendingPathComponent:item];
+        int ownerDescriptor = open([[itemPath stringByAppendingPathComponent:MKMediaResourceTemporaryDirectoryOwnerName] fileSystemRepresentation], O_RDONLY);
+        if (ownerDescriptor >= 0 && flock(ownerDescriptor, LOCK_EX | LOCK_NB) != 0) {
+            close(ownerDescriptor);
+            continue;
+        }
+        // the directory is moved while it is locked, so its new owner can not lock it meanwhile
+        [fileManager moveItemAtPath:itemPath toPath:[trashPath stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]] error:nil];
+        if (ownerDescriptor >= 0) {
+            close(ownerDescriptor);
+        }
+    }
+
+    NSString* ownPath = [temporaryPath stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+    [fileManager createDirectoryAtPath:ownPath withIntermediateDirectories:YES attributes:nil error:nil];
+    _temporaryDirectoryLock = open([[ownPath stringByAppendingPathComponent:MKMediaResourceTemporaryDirectoryOwnerName] fileSystemRepresentation], O_RDONLY | O_CREAT, 0644);
+    if (_temporaryDirectoryLock < 0 || flock(_temporaryDirectoryLock, LOCK_EX | LOCK_NB) != 0) {
+        NSLog(@"%@: Fail to lock temporary directory at path: %@", NSStringFromClass ([self class]), ownPath);//Warning
+    }
+    if (directoryDescriptor >= 0) {
+        close(directoryDescriptor);
+    }
+    _temporaryDirectoryPath = ownPath;
+}
+
+- (NSString*)partialDownloadPathForResource:(MKResource*)resource {
+    NSString* partialPath = [_pathCache stringByAppendingPathComponent:MKMediaResourcePartialDirectoryName];
+    return [partialPath stringByAppendingPathComponent:[self nameFromURLString:[resource.resourceURL absoluteString]]];
+}
+
+- (BOOL)existMRinCache:(NSString*)stringURL {
+    char path[PATH_MAX];
+    return [self getFileSystemPath:path forURLString:stringURL] && access(path, F_OK) == 0;
+}
+
+// Method used for backward compotibiliti with previous AccessLibrary versions naming scheme
+- (NSString*)oldNameFromURLString:(NSString*)stringURL {
+    NSString* nameFromUrl = [stringURL stringByReplacingOccurrencesOfString:@"/" withString:@""];
+    nameFromUrl = [nameFromUrl stringByReplacingOccurrencesOfString:@":" withString:@""];
+    return nameFromUrl;
+}
+
+- (NSString*)oldFullFilePath:(NSString*)stringURL {
+    NSString* fileName = [self oldNameFromURLString:stringURL];
     return [_pathCache stringByAppendingPathComponent:fileName];
 }
 
@@ -330,9 +1459,96 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
     return nameFromUrl;
 }
 
+// Data file of the URL is kept at <pathCache>/XX/<MD5 hex>, where XX are the first two hex digits.
+// The path is composed without allocations, so that file system calls can use it directly.
+- (BOOL)getFileSystemPath:(char*)path forURLString:(NSString*)stringURL {
+    if (stringURL == nil || _fileSystemPathCacheLength + 1 + MKResourceDigestPathLength + 1 > PATH_MAX) {
+        return NO;
+    }
+    memcpy(path, _fileSystemPathCache, _fileSystemPathCacheLength);
+    path[_fileSystemPathCacheLength] = '/';
+    char* digestPath = path + _fileSystemPathCacheLength + 1;
+    MKResourceDigestPathForString(stringURL, digestPath);
+    
+    if (_migratingFlatLayout && access(path, F_OK) != 0) {
+        // the file may still be in the cache directory itself, it is moved before it is used
+        char flatPath[PATH_MAX];
+        memcpy(flatPath, path, _fileSystemPathCacheLength + 1);
+        memcpy(flatPath + _fileSystemPathCacheLength + 1, digestPath + 3, MKResourceDigestPathLength - 3 + 1);
+        rename(flatPath, path);
+    }
+    return YES;
+}
+
 - (NSString*)fullFilePath:(NSString*)stringURL {
-    NSString* fileName = [self nameFromURLString:stringURL];
-    return [_pathCache stringByAppendingPathComponent:fileName];
+    char path[PATH_MAX];
+    if (![self getFileSystemPath:path forURLString:stringURL]) {
+        return nil;
+    }
+    return [[NSFileManager defaultManager] stringWithFileSystemRepresentation:path length:strlen(path)];
+}
+
+- (void)createShardDirectories {
+    char path[PATH_MAX];
+    if (_fileSystemPathCacheLength + 4 > PATH_MAX) {
+        return;
+    }
+    memcpy(path, _fileSystemPathCache, _fileSystemPathCacheLength);
+    for (NSUInteger shard = 0; shard < MKMediaResourceShardsCount; shard++) {
+        snprintf(path + _fileSystemPathCacheLength, 5, "/%02lX", (unsigned long)shard);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            NSLog(@"%@: Fail to create cache subdirectory at path: %s, %s", NSStringFromClass ([self class]), path, strerror(errno));//Error
+        }
+    }
+}
+
+// Caches of previous versions keep all data files in the cache directory itself. They are moved into subdirectories
+// by rename on the maintenance queue; until that is finished a file is also moved when its path is requested.
+- (void)migrateFlatLayoutIfNeeded {
+    NSString* markerPath = [_pathCache stringByAppendingPathComponent:MKMediaResourceShardedLayoutMarkerName];
+    if ([[NSFileManager defaultManager] fileExistsAtPath:markerPath]) {
+        return;
+    }
+    
+    [self createShardDirectories];
+    _migratingFlatLayout = YES;
+    
+    NSString* pathCache = _pathCache;
+    __weak MKResourceManager* weakSelf = self;
+    dispatch_async(_cacheMaintenanceQueue, ^{
+        NSUInteger movedCount = 0;
+        DIR* directory = opendir([pathCache fileSystemRepresentation]);
+        if (directory != NULL) {
+            const char* fileSystemPathCache = [pathCache fileSystemRepresentation];
+            size_t fileSystemPathCacheLength = strlen(fileSystemPathCache);
+            char flatPath[PATH_MAX];
+            char path[PATH_MAX];
+            struct dirent* entry = NULL;
+            while ((entry = readdir(directory)) != NULL) {
+                if (!MKResourceIsDigestName(entry->d_name) || fileSystemPathCacheLength + 1 + MKResourceDigestPathLength + 1 > PATH_MAX) {
+                    continue;
+                }
+                snprintf(flatPath, sizeof(flatPath), "%s/%s", fileSystemPathCache, entry->d_name);
+                snprintf(path, sizeof(path), "%s/%c%c/%s", fileSystemPathCache, entry->d_name[0], entry->d_name[1], entry->d_name);
+                if (access(path, F_OK) == 0) {
+                    // data has been saved after the file was left behind
+                    unlink(flatPath);
+                } else if (rename(flatPath, path) == 0) {
+                    movedCount++;
+                }
+            }
+            closedir(directory);
+        }
+        [[NSData data] writeToFile:[pathCache stringByAppendingPathComponent:MKMediaResourceShardedLayoutMarkerName] atomically:YES];
+        NSLog(@"%@: %lu data files are moved into cache subdirectories", NSStringFromClass ([MKResourceManager class]), (unsigned long)movedCount);//Info
+        
+        dispatch_async(dispatch_get_main_queue(), ^{
+            MKResourceManager* strongSelf = weakSelf;
+            if (strongSelf != nil) {
+                strongSelf->_migratingFlatLayout = NO;
+            }
+        });
+    });
 }
 
 - (MKResource*)tryToFindAndMigrateResourceInCacheWithOldNamingSchemeForNSURL:(NSURL*)aURL {
@@ -347,20 +1563,49 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
     
     if (!isDirectory && exists) {
         findedResource = [[MKResource alloc] initWithResourceManager:self andURL:aURL];
-        [_statusByURL setObject:findedResource forKey:urlAbsoluteString];
+        [self registerResource:findedResource forURLString:urlAbsoluteString];
         NSString* newPathToResource = [self fullFilePath:urlAbsoluteString];
-        [[NSFileManager defaultManager] copyItemAtPath:oldPathToResource toPath:newPathToResource error:nil];
-        [[NSFileManager defaultManager] removeItemAtPath:oldPathToResource error:nil];
+        [[NSFileManager defaultManager] moveItemAtPath:oldPathToResource toPath:newPathToResource error:nil];
     }
     return findedResource;
 }
 
+// Lookups take the resources lock for reading only, so concurrent lookups of known resources do not wait for each other
+- (MKResource*)registeredResourceForURLString:(NSString*)urlString {
+    pthread_rwlock_rdlock(&_resourcesLock);
+    MKResource* resource = [_statusByURL objectForKey:urlString];
+    pthread_rwlock_unlock(&_resourcesLock);
+    return resource;
+}
+
+- (void)registerResource:(MKResource*)resource forURLString:(NSString*)urlString {
+    pthread_rwlock_wrlock(&_resourcesLock);
+    [_statusByURL setObject:resource forKey:urlString];
+    pthread_rwlock_unlock(&_resourcesLock);
+}
+
 - (MKResource*)resourceForNSURL:(NSURL*)aURL {
     if (aURL == nil) {
         return nil;
     }
     
-    MKResource* resource = [_statusByURL objectForKey:[aURL absoluteString]];
+    MKResource* resource = [self registeredResourceForURLString:[aURL absoluteString]];
+    if (resource == nil) {
+        [self lock];
+        resource = [self createResourceForNSURL:aURL];
+        [self unlock];
+    }
+    
+    [self validateResourceIfNeeded:resource];
+    [self resourceWasRead:resource];
+    
+    return resource;
+}
+
+// Should be called with the manager lock held
+- (MKResource*)createResourceForNSURL:(NSURL*)aURL {
+    // the resource may have been created by another thread meanwhile
+    MKResource* resource = [self registeredResourceForURLString:[aURL absoluteString]];
     
     //need to find resources with old naming scheme
     if (resource == nil) {
@@ -381,11 +1626,9 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
             handlerClass = [MKResource class];
         }
         resource = [[handlerClass alloc] initWithResourceManager:self andURL:aURL];
-        [_statusByURL setObject:resource forKey:[aURL absoluteString]];
+        [self registerResource:resource forURLString:[aURL absoluteString]];
     }
     
-    resource.lastAccessDate = [NSDate date];
-    
     return resource;
 }
 
@@ -415,6 +1658,21 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
     return data;
 }
 
+- (NSData*)dataForResourceForNSURL:(NSURL*)aURL options:(MKResourceReadingOptions)options error:(NSError**)error {
+    MKResource* resource = [self resourceForNSURL:aURL];
+    return [self dataForResource:resource options:options error:error];
+}
+
+- (NSData*)dataInRange:(NSRange)range forResourceForNSURL:(NSURL*)aURL error:(NSError**)error {
+    MKResource* resource = [self resourceForNSURL:aURL];
+    return [self dataInRange:range forResource:resource error:error];
+}
+
+- (NSInputStream*)inputStreamForResourceForNSURL:(NSURL*)aURL {
+    MKResource* resource = [self resourceForNSURL:aURL];
+    return [self inputStreamForResource:resource];
+}
+
 - (NSURL*)pathForResource:(MKResource*)resource {
     return [NSURL fileURLWithPath:[self fullFilePath:[resource.resourceURL absoluteString]]];
 }
@@ -436,6 +1694,7 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
 }
 
 - (BOOL)removeResourceFromStorage:(MKResource*)aResource {
+    [self lock];
     BOOL result = NO;
     NSError* error = nil;
     NSString* pathToResource = [self fullFilePath:[aResource.resourceURL absoluteString]];
@@ -446,21 +1705,627 @@ NSUInteger const MKMediaResourceMaxConcurrentDownloadsCount = 10;
         NSLog(@"%@: Fail to remove file at path: %@, %@", NSStringFromClass ([self class]), pathToResource, [error localizedDescription]);//Error
     } else {
         result = YES;
+        [self releaseBlobOfResource:aResource];
+        [self setMemoryCachedData:nil forResource:aResource];
+        [_recentlyUsedResources removeResource:aResource];
         [aResource setStatus:MKStatusNotDownloaded];
+        [self setNeedsSaveResource:aResource];
     }
+    [self unlock];
     return result;
 }
 
+#pragma mark - Cache budget
+
+- (unsigned long long)cacheSize {
+    [self lock];
+    unsigned long long cacheSize = [_recentlyUsedResources totalLength];
+    [self unlock];
+    return cacheSize;
+}
+
+- (NSUInteger)cacheEntriesCount {
+    [self lock];
+    NSUInteger cacheEntriesCount = [_recentlyUsedResources count];
+    [self unlock];
+    return cacheEntriesCount;
+}
+
+- (void)setMaxCacheSize:(unsigned long long)maxCacheSize {
+    [self lock];
+    _maxCacheSize = maxCacheSize;
+    [self setNeedsCacheTrim];
+    [self unlock];
+}
+
+- (void)setMaxCacheEntriesCount:(NSUInteger)maxCacheEntriesCount {
+    [self lock];
+    _maxCacheEntriesCount = maxCacheEntriesCount;
+    [self setNeedsCacheTrim];
+    [self unlock];
+}
+
+// Should be called with the manager lock held
+- (void)resourceWasAccessed:(MKResource*)resource {
+    if ([_recentlyUsedResources containsResource:resource]) {
+        [_recentlyUsedResources touchResource:resource];
+        // the new access date is written with the next save
+        [self setNeedsSaveResource:resource];
+    }
+}
+
+- (void)resourceWasRead:(MKResource*)resource {
+    if (resource == nil || ![resource recordReadAccessTime:CFAbsoluteTimeGetCurrent()]) {
+        // the resource waits for the batch already, it takes the later time
+        return;
+    }
+    pthread_mutex_lock(&_readAccessLock);
+    [_readResources addObject:resource];
+    BOOL scheduled = _readAccessesScheduled;
+    _readAccessesScheduled = YES;
+    pthread_mutex_unlock(&_readAccessLock);
+    if (scheduled) {
+        return;
+    }
+    if (_threadSafe) {
+        // the reading thread does not wait for the manager lock
+        __weak MKResourceManager* weakSelf = self;
+        dispatch_async(_cacheMaintenanceQueue, ^{
+            [weakSelf applyReadAccesses];
+        });
+    } else {
+        [self performSelector:@selector(applyReadAccesses) withObject:nil afterDelay:0];
+    }
+}
+
+- (void)applyReadAccesses {
+    [self lock];
+    pthread_mutex_lock(&_readAccessLock);
+    NSArray* readResources = _readResources;
+    _readResources = [[NSMutableArray alloc] init];
+    _readAccessesScheduled = NO;
+    pthread_mutex_unlock(&_readAccessLock);
+    for (MKResource* resource in readResources) {
+        // the resource read again after its time has been taken is in the next batch
+        CFAbsoluteTime readTime = [resource takeReadAccessTime];
+        if (readTime > 0.0) {
+            resource.lastAccessDate = [NSDate dateWithTimeIntervalSinceReferenceDate:readTime];
+        }
+    }
+    [self unlock];
+}
+
+- (BOOL)isCacheOverBudget {
+    if (_maxCacheSize > 0 && [_recentlyUsedResources totalLength] > _maxCacheSize) {
+        return YES;
+    }
+    if (_maxCacheEntriesCount > 0 && [_recentlyUsedResources count] > _maxCacheEntriesCount) {
+        return YES;
+    }
+    return NO;
+}
+
+- (void)setNeedsCacheTrim {
+    if (_cacheTrimScheduled || ![self isCacheOverBudget]) {
+        return;
+    }
+    // several saves in a row are trimmed at once
+    _cacheTrimScheduled = YES;
+    if (_threadSafe) {
+        // the calling thread may have no run loop
+        __weak MKResourceManager* weakSelf = self;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [weakSelf trimCache];
+        });
+    } else {
+        [self performSelector:@selector(trimCache) withObject:nil afterDelay:0];
+    }
+}
+
+- (NSString*)trashDirectoryPath {
+    return [_pathCache stringByAppendingPathComponent:MKMediaResourceTrashDirectoryName];
+}
+
+- (void)trimCache {
+    [self lock];
+    _cacheTrimScheduled = NO;
+    // eviction order should account for the recent reads
+    [self applyReadAccesses];
+    if (![self isCacheOverBudget]) {
+        [self unlock];
+        return;
+    }
+
+    NSFileManager* fileManager = [NSFileManager defaultManager];
+    NSString* trashPath = [self trashDirectoryPath];
+    [fileManager createDirectoryAtPath:trashPath withIntermediateDirectories:YES attributes:nil error:nil];
+
+    MKResource* candidate = [_recentlyUsedResources tail];
+    while (candidate != nil && [self isCacheOverBudget]) {
+        MKResource* previous = candidate.previousRecentlyUsed;
+        if (candidate.status != MKStatusInProgress && !candidate.revalidating) {
+            // moving into the trash is a cheap rename, the data itself is unlinked in background
+            NSString* pathToResource = [self fullFilePath:[candidate.resourceURL absoluteString]];
+            NSString* trashedPath = [trashPath stringByAppendingPathComponent:[[NSProcessInfo processInfo] globallyUniqueString]];
+            [fileManager moveItemAtPath:pathToResource toPath:trashedPath error:nil];
+            if (candidate.contentDigest != nil) {
+                // the blob is released only after the link is gone
+                unlink([trashedPath fileSystemRepresentation]);
+                [self releaseBlobOfResource:candidate];
+            }
+            [self setMemoryCachedData:nil forResource:candidate];
+            [_recentlyUsedResources removeResource:candidate];
+            [candidate setStatus:MKStatusNotDownloaded];
+            [self setNeedsSaveResource:candidate];
+            [_metrics addValue:1 toCounter:MKResourceMetricsCounterEvictions];
+            [self traceEvent:MKResourceTraceEventEvicted forResource:candidate duration:0.0];
+        }
+        candidate = previous;
+    }
+
+    [self emptyTrash];
+    [self saveResourcesInfo];
+    [self unlock];
+}
+
+- (void)emptyTrash {
+    NSString* trashPath = [self trashDirectoryPath];
+    dispatch_async(_cacheMaintenanceQueue, ^{
+        NSFileManager* fileManager = [[NSFileManager alloc] init];
+        NSArray* items = [fileManager contentsOfDirectoryAtPath:trashPath error:nil];
+        for (NSString* item in items) {
+            [fileManager removeItemAtPath:[trashPath stringByAppendingPathComponent:item] error:nil];
+        }
+    });
+}
+
+#pragma mark - Retries
+
+static NSString* MKHostOfURL(NSURL* url) {
+    NSString* host = [url host];
+    return host != nil ? host : @"";
+}
+
+- (MKResourceRetryPolicy*)retryPolicy {
+    [self lock];
+    MKResourceRetryPolicy* retryPolicy = _retryPolicy;
+    [self unlock];
+    return retryPolicy;
+}
+
+- (void)setRetryPolicy:(MKResourceRetryPolicy*)retryPolicy {
+    [self lock];
+    _retryPolicy = retryPolicy;
+    // failures counted under the previous policy are forgotten
+    [_circuitBreakers removeAllObjects];
+    [_negativeCache removeAllObjects];
+    [self unlock];
+}
+
+// Returns error the resource fails with without request: failure of its URL kept in the negative cache or
+// open circuit breaker of its host. Should be called with the manager lock held.
+- (NSError*)rejectionErrorForResource:(MKResource*)resource {
+    if (_retryPolicy == nil) {
+        return nil;
+    }
+    CFAbsoluteTime currentTime = CFAbsoluteTimeGetCurrent();
+    NSString* urlString = [resource.resourceURL absoluteString];
+    MKResourceNegativeCacheEntry* entry = urlString != nil ? [_negativeCache objectForKey:urlString] : nil;
+    if (entry != nil) {
+        if (entry.expirationTime > currentTime) {
+            return entry.error;
+        }
+        [_negativeCache removeObjectForKey:urlString];
+    }
+    MKResourceCircuitBreaker* circuitBreaker = [_circuitBreakers objectForKey:MKHostOfURL(resource.resourceURL)];
+    if (circuitBreaker != nil && ![circuitBreaker allowsRequestAtTime:currentTime policy:_retryPolicy]) {
+        NSDictionary* userInfo = [NSDictionary dictionaryWithObjectsAndKeys:@"Host is unavailable",NSLocalizedFailureReasonErrorKey, nil];
+        return [NSError errorWithDomain:@"MKResourceManagerErrorDomain" code:61 userInfo:userInfo];
+    }
+    return nil;
+}
+
+// Fails the resource taken from the queue without starting its download. Should be called with the manager lock held.
+- (void)rejectDownloadResource:(MKResource*)resource error:(NSError*)error {
+    [_downloadScheduler removeResource:resource];
+    resource.scheduledTime = 0.0;
+    resource.retryCount = 0;
+    [self traceEvent:MKResourceTraceEventFailed forResource:resource duration:0.0];
+    [self completeDownloadResource:resource buffer:nil error:error httpResponse:nil];
+    // the resource rejected before its retry still holds the URL
+    [self unlockSharedDownloadOfResource:resource];
+}
+
+// Counts the result for the circuit breaker of the host and the negative cache. Returns YES if the failed download
+// is retried later. Should be called with the manager lock held.
+- (BOOL)shouldRetryDownloadResource:(MKResource*)resource error:(NSError*)error httpResponse:(NSHTTPURLResponse*)httpResponse {
+    MKResourceRetryPolicy* policy = _retryPolicy;
+    if (policy == nil) {
+        return NO;
+    }
+    NSString* host = MKHostOfURL(resource.resourceURL);
+    if (error == nil) {
+        resource.retryCount = 0;
+        // success closes the breaker, the host starts over without it
+        [_circuitBreakers removeObjectForKey:host];
+        return NO;
+    }
+    
+    NSInteger statusCode = [httpResponse statusCode];
+    if ((statusCode / 100) == 2) {
+        statusCode = 0;
+    }
+    if (![policy isTransientError:error statusCode:statusCode]) {
+        resource.retryCount = 0;
+        NSString* urlString = [resource.resourceURL absoluteString];
+        if (urlString != nil && policy.negativeCacheInterval > 0.0 && [policy.negativeCacheStatusCodes containsIndex:statusCode]) {
+            CFAbsoluteTime currentTime = CFAbsoluteTimeGetCurrent();
+            if ([_negativeCache count] >= MKMediaResourceNegativeCacheCapacity) {
+                NSSet* expiredURLStrings = [_negativeCache keysOfEntriesPassingTest:^BOOL(id key, MKResourceNegativeCacheEntry* obj, BOOL *stop) {
+                    return obj.expirationTime <= currentTime;
+                }];
+                [_negativeCache removeObjectsForKeys:[expiredURLStrings allObjects]];
+            }
+            MKResourceNegativeCacheEntry* entry = [[MKResourceNegativeCacheEntry alloc] init];
+            entry.error = error;
+            entry.expirationTime = currentTime + policy.negativeCacheInterval;
+            [_negativeCache setObject:entry forKey:urlString];
+        }
+        return NO;
+    }
+    
+    MKResourceCircuitBreaker* circuitBreaker = [_circuitBreakers objectForKey:host];
+    if (circuitBreaker == nil) {
+        circuitBreaker = [[MKResourceCircuitBreaker alloc] init];
+        [_circuitBreakers setObject:circuitBreaker forKey:host];
+    }
+    [circuitBreaker recordFailureAtTime:CFAbsoluteTimeGetCurrent() policy:policy];
+    if (resource.retryCount >= policy.maxRetriesCount || [circuitBreaker isOpen]) {
+        resource.retryCount = 0;
+        return NO;
+    }
+    
+    resource.retryCount++;
+    NSTimeInterval delay = [policy delayBeforeRetry:resource.retryCount];
+    NSString* retryAfter = [[httpResponse allHeaderFields] objectForKey:@"Retry-After"];
+    if ([retryAfter doubleValue] > delay) {
+        delay = MIN([retryAfter doubleValue], policy.maxRetryDelay);
+    }
+    NSLog(@"%@: Retry loading url:%@ in %.1f seconds after error:%@", NSStringFromClass ([self class]), resource.resourceURL, delay, error);//Info
+    [resource setLastError:error];
+    [resource setLastResponse:httpResponse];
+    resource.retryPending = YES;
+    if (_threadSafe) {
+        // the calling thread may have no run loop
+        __weak MKResourceManager* weakSelf = self;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+            [weakSelf retryDownloadResource:resource];
+        });
+    } else {
+        [self performSelector:@selector(retryDownloadResource:) withObject:resource afterDelay:delay];
+    }
+    return YES;
+}
+
+- (void)retryDownloadResource:(MKResource*)resource {
+    [self lock];
+    // the retry is dropped if the resource has been cancelled or downloaded again meanwhile
+    if (resource.retryPending) {
+        resource.retryPending = NO;
+        if (_suspended) {
+            [_suspendedResources addObject:resource];
+        } else {
+            [self scheduleDownloadResource:resource accessDate:resource.lastAccessDate];
+            [self downloadResourceQueueChanged];
+        }
+    }
+    [self unlock];
+}
+
+#pragma mark - Metrics
+
+- (MKResourceMetrics*)metrics {
+    return _metrics;
+}
+
+- (MKResourceMetricsSnapshot*)metricsSnapshot {
+    [self lock];
+    NSUInteger queuedCount = [_downloadScheduler queuedCount];
+    NSUInteger runningCount = [_downloadScheduler runningCount];
+    [self unlock];
+    return [_metrics snapshotWithQueuedCount:queuedCount runningCount:runningCount];
+}
+
+- (void)resetMetrics {
+    [_metrics reset];
+    [_downloadBufferPool resetPeakUsedLength];
+}
+
+- (void)setMetricsReportingInterval:(NSTimeInterval)metricsReportingInterval {
+    [self lock];
+    _metricsReportingInterval = metricsReportingInterval;
+    [self startMetricsTimer];
+    [self unlock];
+}
+
+// Restarts the timer that sends snapshots to the sink. Snapshots are taken on the maintenance queue.
+- (void)startMetricsTimer {
+    if (_metricsTimer != NULL) {
+        dispatch_source_cancel(_metricsTimer);
+        _metricsTimer = NULL;
+    }
+    if (_metricsReportingInterval <= 0.0) {
+        return;
+    }
+    uint64_t interval = (uint64_t)(_metricsReportingInterval * NSEC_PER_SEC);
+    _metricsTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _cacheMaintenanceQueue);
+    dispatch_source_set_timer(_metricsTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+    __weak MKResourceManager* weakSelf = self;
+    dispatch_source_set_event_handler(_metricsTimer, ^{
+        [weakSelf reportMetrics];
+    });
+    dispatch_resume(_metricsTimer);
+}
+
+- (void)reportMetrics {
+    id<MKResourceMetricsSink> sink = self.metricsSink;
+    if (sink == nil) {
+        return;
+    }
+    MKResourceMetricsSnapshot* snapshot = [self metricsSnapshot];
+    dispatch_queue_t callbackQueue = self.callbackQueue;
+    dispatch_async(callbackQueue != NULL ? callbackQueue : dispatch_get_main_queue(), ^{
+        [sink resourceManager:self didCollectMetrics:snapshot];
+    });
+}
+
+- (void)traceEvent:(MKResourceTraceEvent)event forResource:(MKResource*)resource duration:(NSTimeInterval)duration {
+    if (!_tracesResources) {
+        return;
+    }
+    id<MKResourceMetricsSink> sink = self.metricsSink;
+    if ([sink respondsToSelector:@selector(resourceManager:didTraceEvent:forResource:duration:)]) {
+        [self performCallback:^{
+            [sink resourceManager:self didTraceEvent:event forResource:resource duration:duration];
+        }];
+    }
+}
+
+// Counts data returned from the cache. readDuration is 0 for data kept in memory.
+- (void)didServeData:(NSData*)data ofResource:(MKResource*)resource readDuration:(NSTimeInterval)readDuration {
+    [_metrics addValue:1 toCounter:MKResourceMetricsCounterHits];
+    [_metrics addValue:[data length] toCounter:MKResourceMetricsCounterBytesServed];
+    [self traceEvent:MKResourceTraceEventServed forResource:resource duration:readDuration];
+}
+
+#pragma mark - Shared cache
+
+// Download of the URL is owned by the process that holds the lock file of the URL.
+// Returns NO if another process holds it. Should be called with the manager lock held.
+- (BOOL)lockSharedDownloadOfResource:(MKResource*)resource {
+    NSString* urlString = [resource.resourceURL absoluteString];
+    if (urlString == nil || [_sharedDownloadLocks objectForKey:urlString] != nil) {
+        return YES;
+    }
+    NSString* locksPath = [_pathCache stringByAppendingPathComponent:MKMediaResourceLocksDirectoryName];
+    const char* lockPath = [[locksPath stringByAppendingPathComponent:[self nameFromURLString:urlString]] fileSystemRepresentation];
+    int lockDescriptor = open(lockPath, O_RDONLY | O_CREAT, 0644);
+    if (lockDescriptor < 0 && errno == ENOENT) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:locksPath withIntermediateDirectories:YES attributes:nil error:nil];
+        lockDescriptor = open(lockPath, O_RDONLY | O_CREAT, 0644);
+    }
+    if (lockDescriptor < 0) {
+        // the URL is downloaded without the lock rather than never
+        NSLog(@"%@: Fail to open download lock of URL: %@", NSStringFromClass ([self class]), urlString);//Warning
+        return YES;
+    }
+    if (flock(lockDescriptor, LOCK_EX | LOCK_NB) != 0) {
+        close(lockDescriptor);
+        return NO;
+    }
+    [_sharedDownloadLocks setObject:[NSNumber numberWithInt:lockDescriptor] forKey:urlString];
+    return YES;
+}
+
+- (void)releaseSharedDownloadLockOfResource:(MKResource*)resource {
+    NSString* urlString = [resource.resourceURL absoluteString];
+    NSNumber* lockDescriptor = urlString != nil ? [_sharedDownloadLocks objectForKey:urlString] : nil;
+    if (lockDescriptor != nil) {
+        close([lockDescriptor intValue]);
+        [_sharedDownloadLocks removeObjectForKey:urlString];
+    }
+}
+
+// Releases the URL after its result is in the index, so that the processes waiting for it find the result
+// when they get the lock. Should be called with the manager lock held.
+- (void)unlockSharedDownloadOfResource:(MKResource*)resource {
+    NSString* urlString = [resource.resourceURL absoluteString];
+    if (urlString == nil || [_sharedDownloadLocks objectForKey:urlString] == nil) {
+        return;
+    }
+    [_dirtyResources removeObject:resource];
+    [_resourceIndex saveResources:[NSArray arrayWithObject:resource]];
+    [_resourceIndex waitUntilSaved];
+    [self releaseSharedDownloadLockOfResource:resource];
+}
+
+// Thread-safe manager is synchronized on the maintenance queue. Nothing waits for that queue while holding
+// the manager lock, so taking the lock and then the index queue there does not deadlock.
+// The manager that is not thread-safe is synchronized on the main queue, where its downloads are started.
+- (void)startSharedCacheTimer {
+    uint64_t interval = (uint64_t)(MKMediaResourceSharedCacheSyncInterval * NSEC_PER_SEC);
+    _sharedCacheTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _cacheMaintenanceQueue);
+    dispatch_source_set_timer(_sharedCacheTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+    __weak MKResourceManager* weakSelf = self;
+    BOOL threadSafe = _threadSafe;
+    dispatch_source_set_event_handler(_sharedCacheTimer, ^{
+        if (threadSafe) {
+            [weakSelf synchronizeSharedCache];
+        } else {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [weakSelf synchronizeSharedCache];
+            });
+        }
+    });
+    dispatch_resume(_sharedCacheTimer);
+}
+
+- (void)synchronizeSharedCache {
+    if (!_sharesCache) {
+        return;
+    }
+    [self lock];
+    // locks are taken before the index is read, so the result of the download released meanwhile is read too
+    NSMutableArray* lockedWaiters = [NSMutableArray array];
+    for (MKResource* resource in _sharedDownloadWaiters) {
+        if ([self lockSharedDownloadOfResource:resource]) {
+            [lockedWaiters addObject:resource];
+        }
+    }
+    for (MKResource* sharedResource in [_resourceIndex changedResources]) {
+        [self mergeSharedResource:sharedResource];
+    }
+    [_sharedDownloadWaiters removeObjectsInArray:lockedWaiters];
+
+    for (MKResource* resource in lockedWaiters) {
+        NSString* urlString = [resource.resourceURL absoluteString];
+        MKResource* sharedResource = [_sharedDownloadResults objectForKey:urlString];
+        [_sharedDownloadResults removeObjectForKey:urlString];
+        if (sharedResource.status == MKStatusDownloaded && [self existMRinCache:urlString]) {
+            // the other process has downloaded the data, it is taken as the result of this download
+            [self setMemoryCachedData:nil forResource:resource];
+            [resource adoptStateOfRestoredResource:sharedResource];
+            [_recentlyUsedResources setStoredLength:sharedResource.storedLength forResource:resource];
+            resource.scheduledTime = 0.0;
+            [self traceEvent:MKResourceTraceEventFinished forResource:resource duration:0.0];
+            [self completeDownloadResource:resource buffer:nil error:nil httpResponse:nil];
+            [self releaseSharedDownloadLockOfResource:resource];
+        } else {
+            [_downloadScheduler enqueueResource:resource];
+        }
+    }
+    [self downloadResourceQueueChanged];
+    [self unlock];
+}
+
+// Applies the state saved by another process. Resources in progress keep their state, the result of the download
+// waiting for another process is kept till the download gets the lock. Should be called with the manager lock held.
+- (void)mergeSharedResource:(MKResource*)sharedResource {
+    NSString* urlString = [sharedResource.resourceURL absoluteString];
+    MKResource* resource = [self registeredResourceForURLString:urlString];
+    if (resource == nil) {
+        if (sharedResource.status == MKStatusDownloaded) {
+            [sharedResource setResourceManager:self];
+            sharedResource.needsValidation = YES;
+            [self registerResource:sharedResource forURLString:urlString];
+        }
+    } else if ([_sharedDownloadWaiters containsObject:resource]) {
+        [_sharedDownloadResults setObject:sharedResource forKey:urlString];
+    } else if (resource.status == MKStatusInProgress || resource.revalidating) {
+        return;
+    } else if (sharedResource.status == MKStatusDownloaded) {
+        // data may have been replaced, e.g. revalidated by the other process
+        [self setMemoryCachedData:nil forResource:resource];
+        [resource adoptStateOfRestoredResource:sharedResource];
+        if ([_recentlyUsedResources containsResource:resource]) {
+            [_recentlyUsedResources setStoredLength:sharedResource.storedLength forResource:resource];
+        } else {
+            resource.needsValidation = YES;
+        }
+    } else if (resource.status == MKStatusDownloaded && ![self existMRinCache:urlString]) {
+        // the data has been removed or evicted by the other process
+        [self setMemoryCachedData:nil forResource:resource];
+        [_recentlyUsedResources removeResource:resource];
+        [resource setStatus:MKStatusNotDownloaded];
+    }
+}
+
+#pragma mark - Memory cache
+
+- (void)setMemoryCacheCapacity:(NSUInteger)memoryCacheCapacity {
+    _memoryCacheCapacity = memoryCacheCapacity;
+    [_memoryCache setTotalCostLimit:memoryCacheCapacity];
+    if (memoryCacheCapacity == 0) {
+        [_memoryCache removeAllObjects];
+    }
+}
+
+- (NSData*)memoryCachedDataForResource:(MKResource*)resource {
+    if (_memoryCacheCapacity == 0) {
+        return nil;
+    }
+    NSData* data = [_memoryCache objectForKey:[resource.resourceURL absoluteString]];
+    if (data != nil) {
+        __sync_fetch_and_add(&_memoryCacheHitCount, 1);
+    } else {
+        __sync_fetch_and_add(&_memoryCacheMissCount, 1);
+    }
+    return data;
+}
+
+// Passing nil data invalidates data kept in memory for the resource. Should be called with the manager lock held.
+- (void)setMemoryCachedData:(NSData*)data forResource:(MKResource*)resource {
+    NSString* key = [resource.resourceURL absoluteString];
+    if (key == nil) {
+        return;
+    }
+    if (data == nil) {
+        // reads that have started before are not kept in memory
+        resource.dataGeneration++;
+    }
+    if (data != nil && _memoryCacheCapacity > 0 && [data length] <= _memoryCacheMaxDataLength) {
+        [_memoryCache setObject:data forKey:key cost:[data length]];
+    } else {
+        [_memoryCache removeObjectForKey:key];
+    }
+}
+
+- (void)didReceiveMemoryWarning:(NSNotification*)notification {
+    [_memoryCache removeAllObjects];
+    [_downloadBufferPool removeAllChunks];
+}
+
+#pragma mark - Download buffers
+
+- (MKResourceBufferPool*)downloadBufferPool {
+    return _downloadBufferPool;
+}
+
+- (NSUInteger)downloadBufferPoolCapacity {
+    return [_downloadBufferPool maxPooledLength];
+}
+
+- (void)setDownloadBufferPoolCapacity:(NSUInteger)downloadBufferPoolCapacity {
+    [_downloadBufferPool setMaxPooledLength:downloadBufferPoolCapacity];
+}
+
+- (NSUInteger)downloadBufferMemoryLength {
+    return [_downloadBufferPool usedLength];
+}
+
+- (NSUInteger)downloadBufferPeakMemoryLength {
+    return [_downloadBufferPool peakUsedLength];
+}
+
+- (NSUInteger)downloadBufferPooledMemoryLength {
+    return [_downloadBufferPool pooledLength];
+}
+
 - (void)removeWatcherFromAllResources:(id<MKResourceStatusWatcher>)resourceWatcher {
-    for (MKResource* resource in [_statusByURL allValues]) {
+    pthread_rwlock_rdlock(&_resourcesLock);
+    NSArray* resources = [_statusByURL allValues];
+    pthread_rwlock_unlock(&_resourcesLock);
+    for (MKResource* resource in resources) {
         [resource removeWatcher:resourceWatcher];
     }
 }
 
 - (void)registerCustomResourceClass:(Class)aClass {
+    [self lock];
     if (![_customSchemesHandlers containsObject:aClass]) {
         [_customSchemesHandlers addObject:aClass];
     }
+    [self unlock];
 }
 
 @end
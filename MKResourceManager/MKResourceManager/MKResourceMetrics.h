@@ -0,0 +1,149 @@
+//
+//  MKResourceMetrics.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MKResource;
+@class MKResourceManager;
+
+typedef enum {
+      /** Data read from the cache, either from memory or from disk.*/
+    MKResourceMetricsCounterHits = 0,
+      /** Data requested for resource that has not been downloaded.*/
+    MKResourceMetricsCounterMisses,
+    MKResourceMetricsCounterBytesDownloaded,
+      /** Length of data returned from the cache.*/
+    MKResourceMetricsCounterBytesServed,
+      /** Resources removed from the cache to fit its limits.*/
+    MKResourceMetricsCounterEvictions,
+      /** Failed downloads. They are also counted by status code.*/
+    MKResourceMetricsCounterErrors,
+      /** Writes of changed resources into the index.*/
+    MKResourceMetricsCounterIndexSaves,
+    MKResourceMetricsCountersCount
+} MKResourceMetricsCounter;
+
+typedef enum {
+      /** From the moment the resource is queued till its download is started.*/
+    MKResourceMetricsLatencyQueueWait = 0,
+      /** From the start of the download till the response is received.*/
+    MKResourceMetricsLatencyTimeToFirstByte,
+      /** From the start of the download till it is finished.*/
+    MKResourceMetricsLatencyTransfer,
+    MKResourceMetricsLatencyDiskWrite,
+    MKResourceMetricsLatencyDiskRead,
+    MKResourceMetricsLatenciesCount
+} MKResourceMetricsLatency;
+
+typedef enum {
+    MKResourceTraceEventScheduled = 0,
+      /** Duration is the time the resource has waited in the queue.*/
+    MKResourceTraceEventStarted,
+      /** Duration is the time to the first byte.*/
+    MKResourceTraceEventReceivedResponse,
+      /** Duration is the transfer time.*/
+    MKResourceTraceEventFinished,
+      /** Duration is the transfer time.*/
+    MKResourceTraceEventFailed,
+    MKResourceTraceEventCancelled,
+    MKResourceTraceEventEvicted,
+      /** Data has been read from the cache. Duration is the disk read time, 0 for data in memory.*/
+    MKResourceTraceEventServed
+} MKResourceTraceEvent;
+
+// Histogram buckets are powers of two in microseconds: bucket i counts durations shorter than 2^i microseconds
+// and not shorter than 2^(i-1) microseconds. The last bucket counts all longer durations.
+#define MKResourceMetricsHistogramBucketsCount 32
+// Status codes from 0 to this value are counted separately, larger ones are counted as 0
+#define MKResourceMetricsMaxStatusCode 599
+
+/**
+ * Latency histogram taken at the moment of the snapshot.
+ */
+@interface MKResourceLatencyHistogram : NSObject {
+@private
+    uint64_t                _bucketCounts[MKResourceMetricsHistogramBucketsCount];
+    uint64_t                _count;
+    uint64_t                _totalMicroseconds;
+}
+
+@property (nonatomic, readonly) uint64_t count;
+@property (nonatomic, readonly) NSTimeInterval averageDuration;
+
++ (NSTimeInterval)upperBoundOfBucket:(NSUInteger)bucket;
+- (uint64_t)countInBucket:(NSUInteger)bucket;
+// Returns upper bound of the bucket the percentile, from 0 to 100, falls in
+- (NSTimeInterval)durationAtPercentile:(double)percentile;
+- (NSDictionary*)dictionaryRepresentation;
+
+@end
+
+/**
+ * Values of the metrics of the manager at the moment of the snapshot.
+ */
+@interface MKResourceMetricsSnapshot : NSObject {
+@private
+    NSDate*                 _date;
+    uint64_t                _counters[MKResourceMetricsCountersCount];
+    NSArray*                _histograms;
+    NSDictionary*           _errorsByStatusCode;
+    NSUInteger              _queuedCount;
+    NSUInteger              _runningCount;
+}
+
+@property (nonatomic, readonly) NSDate* date;
+// Numbers of failed downloads keyed by HTTP status code. Failures without HTTP response are keyed by 0.
+@property (nonatomic, readonly) NSDictionary* errorsByStatusCode;
+// Number of resources waiting in the download queue
+@property (nonatomic, readonly) NSUInteger queuedCount;
+// Number of running downloads
+@property (nonatomic, readonly) NSUInteger runningCount;
+// Hits divided by hits and misses, 0 if there have been no requests
+@property (nonatomic, readonly) double hitRatio;
+
+- (uint64_t)valueOfCounter:(MKResourceMetricsCounter)counter;
+- (MKResourceLatencyHistogram*)histogramForLatency:(MKResourceMetricsLatency)latency;
+// Property list and JSON compatible representation
+- (NSDictionary*)dictionaryRepresentation;
+
+@end
+
+/**
+ * Receives metrics of the manager. Snapshots are sent on callbackQueue of the manager, or on the main queue if it is NULL.
+ * Trace events are sent like notifications of watchers, synchronously if callbackQueue is NULL.
+ */
+@protocol MKResourceMetricsSink <NSObject>
+
+// Called each metricsReportingInterval of the manager
+- (void)resourceManager:(MKResourceManager*)manager didCollectMetrics:(MKResourceMetricsSnapshot*)snapshot;
+
+@optional
+// Called for each event of each resource when tracesResources of the manager is YES
+- (void)resourceManager:(MKResourceManager*)manager didTraceEvent:(MKResourceTraceEvent)event forResource:(MKResource*)resource duration:(NSTimeInterval)duration;
+
+@end
+
+/**
+ * Counters and histograms of the manager. They are updated with atomic operations, without locks, from any thread.
+ */
+@interface MKResourceMetrics : NSObject {
+@private
+    volatile int64_t        _counters[MKResourceMetricsCountersCount];
+    volatile int64_t        _errorsByStatusCode[MKResourceMetricsMaxStatusCode + 1];
+    volatile int64_t        _bucketCounts[MKResourceMetricsLatenciesCount][MKResourceMetricsHistogramBucketsCount];
+    volatile int64_t        _totalMicroseconds[MKResourceMetricsLatenciesCount];
+}
+
+- (void)addValue:(uint64_t)value toCounter:(MKResourceMetricsCounter)counter;
+// Counts failed download. statusCode is 0 if there is no HTTP response.
+- (void)addErrorWithStatusCode:(NSInteger)statusCode;
+- (void)addDuration:(NSTimeInterval)duration toLatency:(MKResourceMetricsLatency)latency;
+- (MKResourceMetricsSnapshot*)snapshotWithQueuedCount:(NSUInteger)queuedCount runningCount:(NSUInteger)runningCount;
+- (void)reset;
+
+@end
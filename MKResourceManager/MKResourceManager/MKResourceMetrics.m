@@ -0,0 +1,210 @@
+//
+//  MKResourceMetrics.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceMetrics.h"
+
+static NSString* const MKResourceMetricsCounterNames[MKResourceMetricsCountersCount] = {
+    @"hits", @"misses", @"bytesDownloaded", @"bytesServed", @"evictions", @"errors", @"indexSaves"
+};
+
+static NSString* const MKResourceMetricsLatencyNames[MKResourceMetricsLatenciesCount] = {
+    @"queueWait", @"timeToFirstByte", @"transfer", @"diskWrite", @"diskRead"
+};
+
+static NSUInteger MKResourceMetricsBucketForMicroseconds(uint64_t microseconds) {
+    if (microseconds == 0) {
+        return 0;
+    }
+    NSUInteger bucket = 64 - __builtin_clzll(microseconds);
+    return MIN(bucket, (NSUInteger)MKResourceMetricsHistogramBucketsCount - 1);
+}
+
+@interface MKResourceLatencyHistogram ()
+- (id)initWithBucketCounts:(const volatile int64_t*)bucketCounts totalMicroseconds:(int64_t)totalMicroseconds;
+@end
+
+@interface MKResourceMetricsSnapshot ()
+- (id)initWithCounters:(const uint64_t*)counters histograms:(NSArray*)histograms errorsByStatusCode:(NSDictionary*)errorsByStatusCode queuedCount:(NSUInteger)queuedCount runningCount:(NSUInteger)runningCount;
+@end
+
+@implementation MKResourceLatencyHistogram
+
+@synthesize count = _count;
+
+- (id)initWithBucketCounts:(const volatile int64_t*)bucketCounts totalMicroseconds:(int64_t)totalMicroseconds {
+    self = [super init];
+    if (self != nil) {
+        for (NSUInteger i = 0; i < MKResourceMetricsHistogramBucketsCount; i++) {
+            _bucketCounts[i] = (uint64_t)bucketCounts[i];
+            _count += _bucketCounts[i];
+        }
+        _totalMicroseconds = (uint64_t)totalMicroseconds;
+    }
+    return self;
+}
+
++ (NSTimeInterval)upperBoundOfBucket:(NSUInteger)bucket {
+    return ldexp(1.0, (int)bucket) / 1000000.0;
+}
+
+- (uint64_t)countInBucket:(NSUInteger)bucket {
+    return bucket < MKResourceMetricsHistogramBucketsCount ? _bucketCounts[bucket] : 0;
+}
+
+- (NSTimeInterval)averageDuration {
+    return _count > 0 ? (double)_totalMicroseconds / _count / 1000000.0 : 0.0;
+}
+
+- (NSTimeInterval)durationAtPercentile:(double)percentile {
+    if (_count == 0) {
+        return 0.0;
+    }
+    uint64_t rank = (uint64_t)ceil(MIN(MAX(percentile, 0.0), 100.0) / 100.0 * _count);
+    uint64_t accumulatedCount = 0;
+    for (NSUInteger i = 0; i < MKResourceMetricsHistogramBucketsCount; i++) {
+        accumulatedCount += _bucketCounts[i];
+        if (accumulatedCount >= MAX(rank, 1ULL)) {
+            return [MKResourceLatencyHistogram upperBoundOfBucket:i];
+        }
+    }
+    return [MKResourceLatencyHistogram upperBoundOfBucket:MKResourceMetricsHistogramBucketsCount - 1];
+}
+
+- (NSDictionary*)dictionaryRepresentation {
+    NSMutableArray* buckets = [NSMutableArray arrayWithCapacity:MKResourceMetricsHistogramBucketsCount];
+    for (NSUInteger i = 0; i < MKResourceMetricsHistogramBucketsCount; i++) {
+        [buckets addObject:[NSNumber numberWithUnsignedLongLong:_bucketCounts[i]]];
+    }
+    return @{@"count": [NSNumber numberWithUnsignedLongLong:_count],
+             @"average": [NSNumber numberWithDouble:[self averageDuration]],
+             @"p50": [NSNumber numberWithDouble:[self durationAtPercentile:50.0]],
+             @"p99": [NSNumber numberWithDouble:[self durationAtPercentile:99.0]],
+             @"buckets": buckets};
+}
+
+@end
+
+@implementation MKResourceMetricsSnapshot
+
+@synthesize date = _date;
+@synthesize errorsByStatusCode = _errorsByStatusCode;
+@synthesize queuedCount = _queuedCount;
+@synthesize runningCount = _runningCount;
+
+- (id)initWithCounters:(const uint64_t*)counters histograms:(NSArray*)histograms errorsByStatusCode:(NSDictionary*)errorsByStatusCode queuedCount:(NSUInteger)queuedCount runningCount:(NSUInteger)runningCount {
+    self = [super init];
+    if (self != nil) {
+        _date = [NSDate date];
+        memcpy(_counters, counters, sizeof(_counters));
+        _histograms = histograms;
+        _errorsByStatusCode = errorsByStatusCode;
+        _queuedCount = queuedCount;
+        _runningCount = runningCount;
+    }
+    return self;
+}
+
+- (uint64_t)valueOfCounter:(MKResourceMetricsCounter)counter {
+    return counter < MKResourceMetricsCountersCount ? _counters[counter] : 0;
+}
+
+- (MKResourceLatencyHistogram*)histogramForLatency:(MKResourceMetricsLatency)latency {
+    return latency < MKResourceMetricsLatenciesCount ? [_histograms objectAtIndex:latency] : nil;
+}
+
+- (double)hitRatio {
+    uint64_t requestsCount = _counters[MKResourceMetricsCounterHits] + _counters[MKResourceMetricsCounterMisses];
+    return requestsCount > 0 ? (double)_counters[MKResourceMetricsCounterHits] / requestsCount : 0.0;
+}
+
+- (NSDictionary*)dictionaryRepresentation {
+    NSMutableDictionary* counters = [NSMutableDictionary dictionaryWithCapacity:MKResourceMetricsCountersCount];
+    for (NSUInteger i = 0; i < MKResourceMetricsCountersCount; i++) {
+        [counters setObject:[NSNumber numberWithUnsignedLongLong:_counters[i]] forKey:MKResourceMetricsCounterNames[i]];
+    }
+    NSMutableDictionary* latencies = [NSMutableDictionary dictionaryWithCapacity:MKResourceMetricsLatenciesCount];
+    for (NSUInteger i = 0; i < MKResourceMetricsLatenciesCount; i++) {
+        [latencies setObject:[[_histograms objectAtIndex:i] dictionaryRepresentation] forKey:MKResourceMetricsLatencyNames[i]];
+    }
+    // keys of property lists and JSON are strings
+    NSMutableDictionary* errors = [NSMutableDictionary dictionaryWithCapacity:[_errorsByStatusCode count]];
+    [_errorsByStatusCode enumerateKeysAndObjectsUsingBlock:^(NSNumber* statusCode, NSNumber* count, BOOL* stop) {
+        [errors setObject:count forKey:[statusCode stringValue]];
+    }];
+    return @{@"date": [NSNumber numberWithDouble:[_date timeIntervalSince1970]],
+             @"counters": counters,
+             @"latencies": latencies,
+             @"errorsByStatusCode": errors,
+             @"hitRatio": [NSNumber numberWithDouble:[self hitRatio]],
+             @"queuedCount": [NSNumber numberWithUnsignedInteger:_queuedCount],
+             @"runningCount": [NSNumber numberWithUnsignedInteger:_runningCount]};
+}
+
+@end
+
+@implementation MKResourceMetrics
+
+- (void)addValue:(uint64_t)value toCounter:(MKResourceMetricsCounter)counter {
+    if (counter < MKResourceMetricsCountersCount) {
+        __sync_fetch_and_add(&_counters[counter], (int64_t)value);
+    }
+}
+
+- (void)addErrorWithStatusCode:(NSInteger)statusCode {
+    if (statusCode < 0 || statusCode > MKResourceMetricsMaxStatusCode) {
+        statusCode = 0;
+    }
+    __sync_fetch_and_add(&_counters[MKResourceMetricsCounterErrors], 1);
+    __sync_fetch_and_add(&_errorsByStatusCode[statusCode], 1);
+}
+
+- (void)addDuration:(NSTimeInterval)duration toLatency:(MKResourceMetricsLatency)latency {
+    if (latency >= MKResourceMetricsLatenciesCount) {
+        return;
+    }
+    uint64_t microseconds = duration > 0.0 ? (uint64_t)(duration * 1000000.0) : 0;
+    __sync_fetch_and_add(&_bucketCounts[latency][MKResourceMetricsBucketForMicroseconds(microseconds)], 1);
+    __sync_fetch_and_add(&_totalMicroseconds[latency], (int64_t)microseconds);
+}
+
+// Values are read one by one, a snapshot taken while metrics are updated may be off by the updates in progress
+- (MKResourceMetricsSnapshot*)snapshotWithQueuedCount:(NSUInteger)queuedCount runningCount:(NSUInteger)runningCount {
+    uint64_t counters[MKResourceMetricsCountersCount];
+    for (NSUInteger i = 0; i < MKResourceMetricsCountersCount; i++) {
+        counters[i] = (uint64_t)_counters[i];
+    }
+    NSMutableArray* histograms = [NSMutableArray arrayWithCapacity:MKResourceMetricsLatenciesCount];
+    for (NSUInteger i = 0; i < MKResourceMetricsLatenciesCount; i++) {
+        [histograms addObject:[[MKResourceLatencyHistogram alloc] initWithBucketCounts:_bucketCounts[i] totalMicroseconds:_totalMicroseconds[i]]];
+    }
+    NSMutableDictionary* errorsByStatusCode = [NSMutableDictionary dictionary];
+    for (NSInteger statusCode = 0; statusCode <= MKResourceMetricsMaxStatusCode; statusCode++) {
+        int64_t count = _errorsByStatusCode[statusCode];
+        if (count > 0) {
+            [errorsByStatusCode setObject:[NSNumber numberWithLongLong:count] forKey:[NSNumber numberWithInteger:statusCode]];
+        }
+    }
+    return [[MKResourceMetricsSnapshot alloc] initWithCounters:counters histograms:histograms errorsByStatusCode:errorsByStatusCode queuedCount:queuedCount runningCount:runningCount];
+}
+
+- (void)reset {
+    for (NSUInteger i = 0; i < MKResourceMetricsCountersCount; i++) {
+        __sync_lock_test_and_set(&_counters[i], 0);
+    }
+    for (NSUInteger i = 0; i <= MKResourceMetricsMaxStatusCode; i++) {
+        __sync_lock_test_and_set(&_errorsByStatusCode[i], 0);
+    }
+    for (NSUInteger i = 0; i < MKResourceMetricsLatenciesCount; i++) {
+        for (NSUInteger j = 0; j < MKResourceMetricsHistogramBucketsCount; j++) {
+            __sync_lock_test_and_set(&_bucketCounts[i][j], 0);
+        }
+        __sync_lock_test_and_set(&_totalMicroseconds[i], 0);
+    }
+}
+
+@end
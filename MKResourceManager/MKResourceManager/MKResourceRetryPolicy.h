@@ -0,0 +1,74 @@
+//
+//  MKResourceRetryPolicy.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Rules the manager follows when downloads fail. Transient failures are retried after exponentially growing delays,
+ * permanent ones are reported at once. Hosts that keep failing are not asked for a while, and URLs known to be
+ * missing are answered from the negative cache. The policy should not be changed while it is used by a manager.
+ */
+@interface MKResourceRetryPolicy : NSObject
+
+// Maximum number of retries of a failed download. Default value is 3.
+@property (nonatomic, assign) NSUInteger maxRetriesCount;
+// Delay before the first retry, doubled for each next one. Default value is 1 second.
+@property (nonatomic, assign) NSTimeInterval initialRetryDelay;
+// Default value is 60 seconds. Retry-After header of the response is followed up to this delay.
+@property (nonatomic, assign) NSTimeInterval maxRetryDelay;
+// Part of the delay that is random, from 0 to 1, so that downloads failed together are not retried together.
+// Default value is 0.5.
+@property (nonatomic, assign) double retryDelayJitter;
+// HTTP status codes of failures that are retried. Failures without response, e.g. timeouts, are retried too.
+// Default value is 408, 429, 500, 502, 503, 504.
+@property (nonatomic, copy) NSIndexSet* transientStatusCodes;
+// HTTP status codes of failures that are kept in the negative cache. Default value is 404, 410.
+@property (nonatomic, copy) NSIndexSet* negativeCacheStatusCodes;
+// Time the failure is returned for the URL without request. Default value is 30 seconds. 0 disables the negative cache.
+@property (nonatomic, assign) NSTimeInterval negativeCacheInterval;
+// Number of transient failures in a row after which downloads from the host fail without request. Default value is 5.
+// 0 disables the circuit breaker.
+@property (nonatomic, assign) NSUInteger circuitBreakerFailuresCount;
+// Time the host is not asked after the circuit breaker opens. Then one download is let through to probe the host.
+// Default value is 30 seconds.
+@property (nonatomic, assign) NSTimeInterval circuitBreakerInterval;
+
+// Returns YES if the failure may go away by itself. statusCode is 0 if there is no HTTP response.
+- (BOOL)isTransientError:(NSError*)error statusCode:(NSInteger)statusCode;
+// Returns delay before the retry, retryIndex starts at 1
+- (NSTimeInterval)delayBeforeRetry:(NSUInteger)retryIndex;
+
+@end
+
+/**
+ * Failures of a host counted by the manager. Closed breaker lets downloads through, open one fails them
+ * till circuitBreakerInterval passes; then the breaker lets one download through. The manager drops the breaker
+ * of the host once a download from it succeeds.
+ */
+@interface MKResourceCircuitBreaker : NSObject {
+@private
+    NSUInteger              _failuresCount;
+    CFAbsoluteTime          _openTime;
+    BOOL                    _probing;
+}
+
+@property (nonatomic, readonly, getter = isOpen) BOOL open;
+
+// Returns YES if download may be started. Open breaker lets one probe through after circuitBreakerInterval.
+- (BOOL)allowsRequestAtTime:(CFAbsoluteTime)time policy:(MKResourceRetryPolicy*)policy;
+- (void)recordFailureAtTime:(CFAbsoluteTime)time policy:(MKResourceRetryPolicy*)policy;
+
+@end
+
+// Failure of a URL remembered by the manager till expirationTime
+@interface MKResourceNegativeCacheEntry : NSObject
+
+@property (nonatomic, strong) NSError* error;
+@property (nonatomic, assign) CFAbsoluteTime expirationTime;
+
+@end
@@ -0,0 +1,114 @@
+//
+//  MKResourceRetryPolicy.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceRetryPolicy.h"
+
+@implementation MKResourceRetryPolicy
+
+@synthesize maxRetriesCount = _maxRetriesCount;
+@synthesize initialRetryDelay = _initialRetryDelay;
+@synthesize maxRetryDelay = _maxRetryDelay;
+@synthesize retryDelayJitter = _retryDelayJitter;
+@synthesize transientStatusCodes = _transientStatusCodes;
+@synthesize negativeCacheStatusCodes = _negativeCacheStatusCodes;
+@synthesize negativeCacheInterval = _negativeCacheInterval;
+@synthesize circuitBreakerFailuresCount = _circuitBreakerFailuresCount;
+@synthesize circuitBreakerInterval = _circuitBreakerInterval;
+
+- (id)init {
+    self = [super init];
+    if (self != nil) {
+        _maxRetriesCount = 3;
+        _initialRetryDelay = 1.0;
+        _maxRetryDelay = 60.0;
+        _retryDelayJitter = 0.5;
+        NSMutableIndexSet* transientStatusCodes = [NSMutableIndexSet indexSet];
+        [transientStatusCodes addIndex:408];
+        [transientStatusCodes addIndex:429];
+        [transientStatusCodes addIndex:500];
+        [transientStatusCodes addIndexesInRange:NSMakeRange(502, 3)];
+        _transientStatusCodes = [transientStatusCodes copy];
+        NSMutableIndexSet* negativeCacheStatusCodes = [NSMutableIndexSet indexSet];
+        [negativeCacheStatusCodes addIndex:404];
+        [negativeCacheStatusCodes addIndex:410];
+        _negativeCacheStatusCodes = [negativeCacheStatusCodes copy];
+        _negativeCacheInterval = 30.0;
+        _circuitBreakerFailuresCount = 5;
+        _circuitBreakerInterval = 30.0;
+    }
+    return self;
+}
+
+- (BOOL)isTransientError:(NSError*)error statusCode:(NSInteger)statusCode {
+    if (statusCode > 0) {
+        return [_transientStatusCodes containsIndex:statusCode];
+    }
+    if (![[error domain] isEqualToString:NSURLErrorDomain]) {
+        return NO;
+    }
+    switch ([error code]) {
+        case NSURLErrorTimedOut:
+        case NSURLErrorCannotFindHost:
+        case NSURLErrorCannotConnectToHost:
+        case NSURLErrorNetworkConnectionLost:
+        case NSURLErrorDNSLookupFailed:
+        case NSURLErrorNotConnectedToInternet:
+        case NSURLErrorBadServerResponse:
+            return YES;
+        default:
+            return NO;
+    }
+}
+
+- (NSTimeInterval)delayBeforeRetry:(NSUInteger)retryIndex {
+    NSTimeInterval delay = _initialRetryDelay * ldexp(1.0, (int)MIN(MAX(retryIndex, 1U) - 1, 30U));
+    delay = MIN(delay, _maxRetryDelay);
+    double jitter = MIN(MAX(_retryDelayJitter, 0.0), 1.0);
+    return delay * (1.0 - jitter * ((double)arc4random() / UINT32_MAX));
+}
+
+@end
+
+@implementation MKResourceCircuitBreaker
+
+- (BOOL)isOpen {
+    return _openTime > 0.0;
+}
+
+- (BOOL)allowsRequestAtTime:(CFAbsoluteTime)time policy:(MKResourceRetryPolicy*)policy {
+    if (_openTime <= 0.0) {
+        return YES;
+    }
+    if (time - _openTime >= policy.circuitBreakerInterval) {
+        // the interval starts again, so the next probe is let through even if this one never finishes
+        _openTime = time;
+        _probing = YES;
+        return YES;
+    }
+    return NO;
+}
+
+- (void)recordFailureAtTime:(CFAbsoluteTime)time policy:(MKResourceRetryPolicy*)policy {
+    _failuresCount++;
+    if (_probing) {
+        // the host is still failing, it is left alone for another interval
+        _probing = NO;
+        _openTime = time;
+    } else if (_openTime <= 0.0 && policy.circuitBreakerFailuresCount > 0 && _failuresCount >= policy.circuitBreakerFailuresCount) {
+        _openTime = time;
+    }
+}
+
+@end
+
+@implementation MKResourceNegativeCacheEntry
+
+@synthesize error = _error;
+@synthesize expirationTime = _expirationTime;
+
+@end
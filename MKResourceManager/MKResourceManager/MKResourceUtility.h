@@ -18,6 +18,11 @@
 + (NSString*)JSONEncode:(NSString*)aString;
 + (NSString*)base64Encode:(NSData*)anInputData onSeparateLines:(BOOL)separateLines;
 + (NSData*)base64Decode:(NSString*)anInputString;
+// Encodes the input stream chunk by chunk into the output stream, in lines of 64 chars if separateLines is YES.
+// Streams that are not open are opened; the input stream is closed when it is read, the output stream remains open.
++ (BOOL)base64EncodeStream:(NSInputStream*)inputStream toStream:(NSOutputStream*)outputStream onSeparateLines:(BOOL)separateLines;
+// Decodes the input stream chunk by chunk into the output stream. Streams are opened and closed as by base64EncodeStream.
++ (BOOL)base64DecodeStream:(NSInputStream*)inputStream toStream:(NSOutputStream*)outputStream;
 + (NSString*)MD5HashForString:(NSString*)anInputString;
 
 + (NSString*)stringFromStream:(NSInputStream*)stream encoding:(NSStringEncoding)encoding;
@@ -25,3 +30,14 @@
 @end
 
 NSString* MKTemporaryDirectory(void);
+
+// Length of the cache path of a string: two hex digits of the subdirectory, separator and 32 hex digits of MD5
+#define MKResourceDigestPathLength 35
+
+// Writes the cache path "XX/<MD5 hex>" of the string into path, which should hold MKResourceDigestPathLength + 1 chars.
+// Does not allocate memory for strings that take less than 1KB in UTF-8.
+void MKResourceDigestPathForString(NSString* string, char* path);
+// Returns YES if name is 32 hex digits of MD5 as written by MKResourceDigestPathForString
+BOOL MKResourceIsDigestName(const char* name);
+// Returns uppercase hex digits of bytes
+NSString* MKResourceHexString(const unsigned char* bytes, NSUInteger length);
@@ -11,39 +11,45 @@
 
 #import "MKResourceUtility.h"
 #import "MKResourceUtility+Private.h"
+#import "MKResourceBase64.h"
 
 // non-purgeable, non-backed up attributes
 #import <sys/xattr.h>
 
-#define BASE64_SIZE 4
-#define BINARY_SIZE 3
-#define INPUT_LINE_LENGTH ((64 / 4) * 3)
-#define OUTPUT_LINE_LENGTH 64
+// Length of input read at once by stream codecs, whole lines of MKBase64LineLength chars
+#define MKBase64StreamChunkLength (MKBase64LineLength / 4 * 3 * 1024)
 
-static unsigned char encodingTable[64] = {
-    'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P','Q','R','S','T',
-    'U','V','W','X','Y','Z','a','b','c','d','e','f','g','h','i','j','k','l','m','n',
-    'o','p','q','r','s','t','u','v','w','x','y','z','0','1','2','3','4','5','6','7',
-    '8','9','+','/'
+static const char MKHexDigits[16] = {
+    '0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F'
 };
 
-static unsigned char Base64DecodeArray[256] = {
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 62, 65, 65, 65, 63, 52, 53, 54, 55, 56, 57,
-    58, 59, 60, 61, 65, 65, 65, 65, 65, 65, 65,  0,  1,  2,  3,  4,  5,  6,
-    7,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
-    25, 65, 65, 65, 65, 65, 65, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36,
-    37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65, 65,
-    65, 65, 65, 65,
-};
+static BOOL MKWriteAllBytes(NSOutputStream* stream, const uint8_t* bytes, NSUInteger length) {
+    while (length > 0) {
+        NSInteger written = [stream write:bytes maxLength:length];
+        if (written <= 0) {
+            return NO;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return YES;
+}
+
+// Reads until buffer is full or the stream ends. Returns -1 on error.
+static NSInteger MKReadFullBuffer(NSInputStream* stream, uint8_t* buffer, NSUInteger length) {
+    NSUInteger readLength = 0;
+    while (readLength < length) {
+        NSInteger result = [stream read:buffer + readLength maxLength:length - readLength];
+        if (result < 0) {
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        readLength += result;
+    }
+    return (NSInteger)readLength;
+}
 
 @implementation MKResourceUtility
 
@@ -104,63 +110,17 @@ static unsigned char Base64DecodeArray[256] = {
  * Encode string in base64
  */
 + (NSString*)base64Encode:(NSData*)anInputData onSeparateLines:(BOOL)aSeparateLines {
-    const unsigned char* bytes = [anInputData bytes];
-    unsigned int lineLength = 0;
-    unsigned long ixtext = 0;
-    NSMutableString* encodedString = [NSMutableString stringWithCapacity:[anInputData length]];
-    unsigned long textLength = [anInputData length];
-    long ctremaining = 0;
-    unsigned char inbuf[3], outputBuffer[4];
-    short counter = 0;
-    short charsonline = 0, ctcopy = 0;
-    unsigned long ix = 0;
-
-    while (YES) {
-        ctremaining = textLength - ixtext;
-        if (ctremaining <= 0) {
-            break;
-        }
-
-        for (counter = 0; counter < 3; counter++) {
-            ix = ixtext + counter;
-            if (ix < textLength) {
-                inbuf[counter] = bytes[ix];
-            } else {          inbuf [counter] = 0; }
-        }
-
-        outputBuffer [0] = (inbuf [0] & 0xFC) >> 2;
-        outputBuffer [1] = ((inbuf [0] & 0x03) << 4) | ((inbuf [1] & 0xF0) >> 4);
-        outputBuffer [2] = ((inbuf [1] & 0x0F) << 2) | ((inbuf [2] & 0xC0) >> 6);
-        outputBuffer [3] = inbuf [2] & 0x3F;
-        ctcopy = 4;
-
-        switch (ctremaining) {
-            case 1:
-                ctcopy = 2;
-                break;
-            case 2:
-                ctcopy = 3;
-                break;
-        }
-
-        for (counter = 0; counter < ctcopy; counter++)
-            [encodedString appendFormat:@"%c", encodingTable[outputBuffer[counter]]];
-
-        for (counter = ctcopy; counter < 4; counter++)
-            [encodedString appendFormat:@"%c",'='];
-
-        ixtext += 3;
-        charsonline += 4;
-
-        if (lineLength > 0) {
-            if (charsonline >= lineLength) {
-                charsonline = 0;
-                [encodedString appendString:@"\n"];
-            }
-        }
+    size_t lineLength = aSeparateLines ? MKBase64LineLength : 0;
+    size_t encodedLength = MKBase64EncodedLength([anInputData length], lineLength);
+    if (encodedLength == 0) {
+        return @"";
     }
-
-    return encodedString;
+    char* encodedChars = malloc(encodedLength);
+    if (encodedChars == NULL) {
+        return nil;
+    }
+    encodedLength = MKBase64Encode([anInputData bytes], [anInputData length], encodedChars, lineLength);
+    return [[NSString alloc] initWithBytesNoCopy:encodedChars length:encodedLength encoding:NSASCIIStringEncoding freeWhenDone:YES];
 }
 
 /**
@@ -171,63 +131,103 @@ static unsigned char Base64DecodeArray[256] = {
         return nil;
     }
 
-    const char* inputBuffer = [anInputString cStringUsingEncoding:NSASCIIStringEncoding];
-    NSUInteger length = [anInputString length];    
-    size_t outBufLength = ((length + BASE64_SIZE - 1) / BASE64_SIZE) * BINARY_SIZE;
-
-    NSData* data = nil;
-    unsigned char* outputBuffer = (unsigned char*)malloc (outBufLength);
-    if (outputBuffer != NULL) {
-        size_t i = 0;
-        size_t outlength = 0;
-        while (i < length) {
-            unsigned char tempBuffer[BASE64_SIZE] = {}; // {0,0,0,0}
-            size_t index = 0;
-            while (i < length) {
-                unsigned char decodeValue = Base64DecodeArray[inputBuffer[i++]];
-                
-                if (decodeValue != 65) {
-                    tempBuffer[index++] = decodeValue;
-                    
-                    if (index == BASE64_SIZE) {
-                        break;
-                    }
-                }
-            }
-            
-            outputBuffer[outlength] = (tempBuffer[0] << 2) | (tempBuffer[1] >> 4);
-            outputBuffer[outlength + 1] = (tempBuffer[1] << 4) | (tempBuffer[2] >> 2);
-            outputBuffer[outlength + 2] = (tempBuffer[2] << 6) | tempBuffer[3];
-            
-            outlength += index - 1;
+    // chars out of ASCII are replaced and skipped as any char out of the alphabet
+    NSData* chars = [anInputString dataUsingEncoding:NSASCIIStringEncoding allowLossyConversion:YES];
+    NSMutableData* data = [NSMutableData dataWithLength:MKBase64MaxDecodedLength([chars length])];
+    MKBase64DecodingState state;
+    MKBase64DecodingStateInit(&state);
+    size_t length = MKBase64Decode(&state, [chars bytes], [chars length], [data mutableBytes]);
+    length += MKBase64DecodeFinish(&state, (uint8_t*)[data mutableBytes] + length);
+    if (length == 0) {
+        return nil;
+    }
+    [data setLength:length];
+    return data;
+}
+
++ (BOOL)base64EncodeStream:(NSInputStream*)inputStream toStream:(NSOutputStream*)outputStream onSeparateLines:(BOOL)separateLines {
+    size_t lineLength = separateLines ? MKBase64LineLength : 0;
+    uint8_t* inputBuffer = malloc(MKBase64StreamChunkLength);
+    char* outputBuffer = malloc(MKBase64EncodedLength(MKBase64StreamChunkLength, lineLength) + 1);
+    if (inputStream.streamStatus == NSStreamStatusNotOpen) {
+        [inputStream open];
+    }
+    if (outputStream.streamStatus == NSStreamStatusNotOpen) {
+        [outputStream open];
+    }
+
+    BOOL result = inputBuffer != NULL && outputBuffer != NULL;
+    BOOL firstChunk = YES;
+    while (result) {
+        // chunks are whole lines, so each one is encoded on its own
+        NSInteger length = MKReadFullBuffer(inputStream, inputBuffer, MKBase64StreamChunkLength);
+        if (length <= 0) {
+            result = length == 0;
+            break;
         }
-        
-        if (outlength > 0) {
-            data = [[NSData alloc] initWithBytes:outputBuffer length:outlength];
+        size_t encodedLength = 0;
+        if (lineLength > 0 && !firstChunk) {
+            outputBuffer[encodedLength++] = '\n';
+        }
+        encodedLength += MKBase64Encode(inputBuffer, length, outputBuffer + encodedLength, lineLength);
+        result = MKWriteAllBytes(outputStream, (const uint8_t*)outputBuffer, encodedLength);
+        firstChunk = NO;
+        if (length < MKBase64StreamChunkLength) {
+            break;
         }
     }
-    free (outputBuffer);
+    if (!result) {
+        NSLog(@"%@: Fail to encode stream %@", NSStringFromClass ([self class]), [inputStream streamError] ?: [outputStream streamError]);//Error
+    }
 
-    return data;
+    [inputStream close];
+    free(outputBuffer);
+    free(inputBuffer);
+    return result;
+}
+
++ (BOOL)base64DecodeStream:(NSInputStream*)inputStream toStream:(NSOutputStream*)outputStream {
+    uint8_t* inputBuffer = malloc(MKBase64StreamChunkLength);
+    uint8_t* outputBuffer = malloc(MKBase64MaxDecodedLength(MKBase64StreamChunkLength));
+    if (inputStream.streamStatus == NSStreamStatusNotOpen) {
+        [inputStream open];
+    }
+    if (outputStream.streamStatus == NSStreamStatusNotOpen) {
+        [outputStream open];
+    }
+
+    MKBase64DecodingState state;
+    MKBase64DecodingStateInit(&state);
+    BOOL result = inputBuffer != NULL && outputBuffer != NULL;
+    while (result) {
+        // groups split between reads are completed from the state
+        NSInteger length = [inputStream read:inputBuffer maxLength:MKBase64StreamChunkLength];
+        if (length < 0) {
+            result = NO;
+        } else if (length == 0) {
+            size_t decodedLength = MKBase64DecodeFinish(&state, outputBuffer);
+            result = MKWriteAllBytes(outputStream, outputBuffer, decodedLength);
+            break;
+        } else {
+            size_t decodedLength = MKBase64Decode(&state, (const char*)inputBuffer, length, outputBuffer);
+            result = MKWriteAllBytes(outputStream, outputBuffer, decodedLength);
+        }
+    }
+    if (!result) {
+        NSLog(@"%@: Fail to decode stream %@", NSStringFromClass ([self class]), [inputStream streamError] ?: [outputStream streamError]);//Error
+    }
+
+    [inputStream close];
+    free(outputBuffer);
+    free(inputBuffer);
+    return result;
 }
 
 + (NSString*)MD5HashForString:(NSString*)anInputString {
-    const char* cString = [anInputString UTF8String];
-
-    unsigned char chars[CC_MD5_DIGEST_LENGTH];
-
-    CC_MD5 (cString, (unsigned int)strlen(cString), chars);
-
-    return [NSString stringWithFormat:@"%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X",
-            chars[0], chars[1],
-            chars[2], chars[3],
-            chars[4], chars[5],
-            chars[6], chars[7],
-            chars[8], chars[9],
-            chars[10], chars[11],
-            chars[12], chars[13],
-            chars[14], chars[15]
-    ];
+    char path[MKResourceDigestPathLength + 1];
+    MKResourceDigestPathForString(anInputString, path);
+    // skip the subdirectory
+    return [[NSString alloc] initWithBytes:path + 3 length:CC_MD5_DIGEST_LENGTH * 2 encoding:NSASCIIStringEncoding];
 }
 
 #pragma mark - non-purgeable, non-backed up attributes
@@ -320,3 +320,52 @@ NSString* MKTemporaryDirectory(void) {
 
     return currentTemporaryDirectory;
 }
+
+void MKResourceDigestPathForString(NSString* string, char* path) {
+    char buffer[1024];
+    NSUInteger length = 0;
+    const char* cString = NULL;
+    NSRange remainingRange = NSMakeRange(0, 0);
+    if ([string getBytes:buffer maxLength:sizeof(buffer) usedLength:&length encoding:NSUTF8StringEncoding options:0 range:NSMakeRange(0, [string length]) remainingRange:&remainingRange] &&
+        remainingRange.length == 0) {
+        cString = buffer;
+    } else {
+        // the string does not fit in the buffer
+        cString = [string UTF8String];
+        length = strlen(cString);
+    }
+    
+    unsigned char digest[CC_MD5_DIGEST_LENGTH];
+    CC_MD5(cString, (CC_LONG)length, digest);
+    
+    char* hex = path + 3;
+    for (NSUInteger i = 0; i < CC_MD5_DIGEST_LENGTH; i++) {
+        hex[2 * i] = MKHexDigits[digest[i] >> 4];
+        hex[2 * i + 1] = MKHexDigits[digest[i] & 0x0F];
+    }
+    hex[2 * CC_MD5_DIGEST_LENGTH] = '\0';
+    path[0] = hex[0];
+    path[1] = hex[1];
+    path[2] = '/';
+}
+
+NSString* MKResourceHexString(const unsigned char* bytes, NSUInteger length) {
+    NSMutableData* hex = [NSMutableData dataWithLength:2 * length];
+    char* characters = [hex mutableBytes];
+    for (NSUInteger i = 0; i < length; i++) {
+        characters[2 * i] = MKHexDigits[bytes[i] >> 4];
+        characters[2 * i + 1] = MKHexDigits[bytes[i] & 0x0F];
+    }
+    return [[NSString alloc] initWithData:hex encoding:NSASCIIStringEncoding];
+}
+
+BOOL MKResourceIsDigestName(const char* name) {
+    NSUInteger i = 0;
+    for (; name[i] != '\0'; i++) {
+        char c = name[i];
+        if (i >= CC_MD5_DIGEST_LENGTH * 2 || !((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F'))) {
+            return NO;
+        }
+    }
+    return i == CC_MD5_DIGEST_LENGTH * 2;
+}
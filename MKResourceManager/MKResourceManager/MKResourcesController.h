@@ -10,11 +10,24 @@
 
 @interface MKResourcesController : MKResource<MKResourceStatusWatcher> {
     NSMutableArray*         _resources;
-    NSMutableDictionary*    _progresByResource;
-    NSExpression*           _sumExpression;
-    NSExpression*           _averageExpression;
+    CFMutableDictionaryRef  _entriesByResource;
+    long long               _totalExpectedContentLength;
+    long long               _totalReceivedLength;
+    double                  _progressSum;
+    NSUInteger              _outstandingCount;
+    NSUInteger              _completedCount;
+    NSUInteger              _failedCount;
+    NSUInteger              _cancelledCount;
 }
 
+// Totals are kept up to date on each event of the added resources, reading them does not depend on the number of resources.
+@property (nonatomic, readonly) long long totalExpectedContentLength;
+@property (nonatomic, readonly) long long totalReceivedLength;
+// Numbers of resources whose last download has finished, failed or has been cancelled
+@property (nonatomic, readonly) NSUInteger completedCount;
+@property (nonatomic, readonly) NSUInteger failedCount;
+@property (nonatomic, readonly) NSUInteger cancelledCount;
+
 /** Adds resource to watch common progress.
  *  @param resource Resource to be added in common progress.
  */
@@ -8,14 +8,37 @@
 
 #import "MKResourcesController.h"
 #import "MKResource+Private.h"
+#import "MKResourceManager+Private.h"
+
+typedef enum {
+    MKResourceOutcomeNone = 0,
+    MKResourceOutcomeCompleted,
+    MKResourceOutcomeFailed,
+    MKResourceOutcomeCancelled
+} MKResourceOutcome;
+
+// Contribution of an added resource to the totals of the controller
+typedef struct {
+    long long           expectedContentLength;
+    long long           receivedLength;
+    float               progress;
+    BOOL                outstanding;
+    MKResourceOutcome   outcome;
+} MKResourceProgressEntry;
 
 @implementation MKResourcesController
+@synthesize totalExpectedContentLength = _totalExpectedContentLength;
+@synthesize totalReceivedLength = _totalReceivedLength;
+@synthesize completedCount = _completedCount;
+@synthesize failedCount = _failedCount;
+@synthesize cancelledCount = _cancelledCount;
 
 - (id)init {
     self = [super initWithResourceManager:nil andURL:nil];
     if (self != nil) {
         _resources = [[NSMutableArray alloc] init];
-        _progresByResource = [[NSMutableDictionary alloc] init];
+        // resources are the keys by pointer, they are not retained by the dictionary
+        _entriesByResource = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, NULL, NULL);
     }
     return self;
 }
@@ -23,7 +46,9 @@
 - (void)dealloc {
     for (MKResource* resource in _resources) {
         [resource removeWatcher:self];
+        free((void*)CFDictionaryGetValue(_entriesByResource, (__bridge const void*)resource));
     }
+    CFRelease(_entriesByResource);
 }
 
 /** Does nothing.
@@ -49,24 +74,44 @@
     }
 }
 
+- (MKResourceProgressEntry*)entryForResource:(MKResource*)resource {
+    return (MKResourceProgressEntry*)CFDictionaryGetValue(_entriesByResource, (__bridge const void*)resource);
+}
+
 - (void)addResource:(MKResource*)resource {
     if (resource == nil) {
         return;
     }
     _manager = [resource manager];
     
-    [resource addWatcher:self];
-    [_resources addObject:resource];
-
-    float progress = resource.status == MKStatusDownloaded ? 1.0f : 0.0f;
-
-    [_progresByResource setObject:[NSNumber numberWithFloat:progress] forKey:[NSValue valueWithPointer:(__bridge const void *)(resource)]];
+    // events of the resources may be delivered while resources are added on another thread
+    [_manager lock];
+    if ([self entryForResource:resource] == NULL) {
+        [resource addWatcher:self];
+        [_resources addObject:resource];
+        
+        MKResourceProgressEntry* entry = calloc(1, sizeof(MKResourceProgressEntry));
+        CFDictionarySetValue(_entriesByResource, (__bridge const void*)resource, entry);
+        [self setProgress:(resource.status == MKStatusDownloaded ? 1.0f : 0.0f) expectedContentLength:resource.expectedContentLength ofEntry:entry];
+        [self setOutstanding:(resource.status == MKStatusInProgress || resource.revalidating) ofEntry:entry];
+    }
+    [_manager unlock];
 }
 
 - (void)removeResource:(MKResource*)resource {
-    [resource removeWatcher:self];
-    [_resources removeObject:resource];
-    [_progresByResource removeObjectForKey:[NSValue valueWithPointer:(__bridge const void *)(resource)]];
+    [_manager lock];
+    MKResourceProgressEntry* entry = [self entryForResource:resource];
+    if (entry != NULL) {
+        [self setProgress:0.0f expectedContentLength:0 ofEntry:entry];
+        [self setOutstanding:NO ofEntry:entry];
+        [self setOutcome:MKResourceOutcomeNone ofEntry:entry];
+        CFDictionaryRemoveValue(_entriesByResource, (__bridge const void*)resource);
+        free(entry);
+        
+        [resource removeWatcher:self];
+        [_resources removeObject:resource];
+    }
+    [_manager unlock];
 }
 
 - (NSUInteger)count {
@@ -99,91 +144,111 @@
     return [_resources indexOfObject:resource];
 }
 
-- (NSExpression*)sumExpression {
-    if (_sumExpression == nil) {
-        NSExpression* expression = [NSExpression expressionForKeyPath:@"expectedContentLength"];
-        NSExpression* sumExpression = [NSExpression expressionForFunction:@"sum:" arguments:[NSArray arrayWithObject:expression]];
-        _sumExpression = sumExpression;
-    }
-    return _sumExpression;
+#pragma mark -
+#pragma mark Totals
+
+- (void)setProgress:(float)progress expectedContentLength:(long long)expectedContentLength ofEntry:(MKResourceProgressEntry*)entry {
+    long long receivedLength = (long long)(expectedContentLength * (double)progress);
+    _totalExpectedContentLength += expectedContentLength - entry->expectedContentLength;
+    _totalReceivedLength += receivedLength - entry->receivedLength;
+    _progressSum += progress - entry->progress;
+    entry->expectedContentLength = expectedContentLength;
+    entry->receivedLength = receivedLength;
+    entry->progress = progress;
 }
 
-- (NSExpression*)averageExpression {
-    if (_averageExpression == nil) {
-        NSExpression* expression = [NSExpression expressionForKeyPath:@"floatValue"];
-        NSExpression* averageExpression = [NSExpression expressionForFunction:@"average:" arguments:[NSArray arrayWithObject:expression]];
-        _averageExpression = averageExpression;
+- (void)setOutstanding:(BOOL)outstanding ofEntry:(MKResourceProgressEntry*)entry {
+    if (entry->outstanding == outstanding) {
+        return;
+    }
+    entry->outstanding = outstanding;
+    if (outstanding) {
+        _outstandingCount++;
+        // outcome of the previous download is no longer actual
+        [self setOutcome:MKResourceOutcomeNone ofEntry:entry];
+    } else {
+        _outstandingCount--;
     }
-    return _averageExpression;
 }
 
-- (long long)commonExpectedContentLength {
-    NSExpression* sumExpression = [self sumExpression];
-    NSNumber* lenth = [sumExpression expressionValueWithObject:_resources context:nil];
-    return [lenth longLongValue];
+- (void)setOutcome:(MKResourceOutcome)outcome ofEntry:(MKResourceProgressEntry*)entry {
+    switch (entry->outcome) {
+        case MKResourceOutcomeCompleted: _completedCount--; break;
+        case MKResourceOutcomeFailed: _failedCount--; break;
+        case MKResourceOutcomeCancelled: _cancelledCount--; break;
+        default: break;
+    }
+    entry->outcome = outcome;
+    switch (outcome) {
+        case MKResourceOutcomeCompleted: _completedCount++; break;
+        case MKResourceOutcomeFailed: _failedCount++; break;
+        case MKResourceOutcomeCancelled: _cancelledCount++; break;
+        default: break;
+    }
 }
 
-- (float)averageProgress {
-    NSExpression* averageExpression = [self averageExpression];
-    NSNumber* averageProgress = [averageExpression expressionValueWithObject:[_progresByResource allValues] context:nil];
-    return [averageProgress floatValue];
+- (void)updateCommonProgress {
+    NSUInteger count = [_resources count];
+    float averageProgress = count > 0 ? (float)(_progressSum / count) : 0.0f;
+    [self setExpectedContentLength:_totalExpectedContentLength];
+    [self setDownloadedLength:_totalExpectedContentLength * averageProgress];
 }
 
 #pragma mark -
 #pragma mark Implement MKResourceStatusWatcher
 - (void)resourceStatusDidChange:(MKResource*)resource {
+    [_manager lock];
+    MKResourceProgressEntry* entry = [self entryForResource:resource];
+    if (entry != NULL && resource.status == MKStatusInProgress) {
+        [self setOutstanding:YES ofEntry:entry];
+    }
+    [_manager unlock];
 }
 
 - (void)resource:(MKResource*)resource loadProgressChanged:(NSNumber*)progress {
-    [_progresByResource setObject:progress forKey:[NSValue valueWithPointer:(__bridge const void *)(resource)]];
-    long long commonExpectedContentLength = [self commonExpectedContentLength];
-    [self setExpectedContentLength:commonExpectedContentLength];
-    float progressValue = [self averageProgress];
-    [self setDownloadedLength:commonExpectedContentLength * progressValue];
+    [_manager lock];
+    MKResourceProgressEntry* entry = [self entryForResource:resource];
+    if (entry != NULL) {
+        [self setProgress:[progress floatValue] expectedContentLength:resource.expectedContentLength ofEntry:entry];
+        [self updateCommonProgress];
+    }
+    [_manager unlock];
 }
 
 - (void)resource:(MKResource*)resource loadCompletedWithError:(NSError*)error {
-    [_progresByResource setObject:[NSNumber numberWithFloat:1.0f] forKey:[NSValue valueWithPointer:(__bridge const void *)(resource)]];
-
-    BOOL didFinish = YES;
-    for (MKResource* resource in _resources) {
-        if (resource.status == MKStatusInProgress) {
-            didFinish = NO;
-            break;
-        }
-    }
-
-    if (didFinish == YES) {
-        BOOL hasError = NO;
-        for (MKResource* res in _resources) {
-            if (res.lastError != nil) {
-                hasError = YES;
-                break;
+    [_manager lock];
+    MKResourceProgressEntry* entry = [self entryForResource:resource];
+    if (entry != NULL) {
+        [self setProgress:1.0f expectedContentLength:resource.expectedContentLength ofEntry:entry];
+        [self setOutstanding:NO ofEntry:entry];
+        [self setOutcome:(error != nil ? MKResourceOutcomeFailed : MKResourceOutcomeCompleted) ofEntry:entry];
+        
+        if (_outstandingCount == 0) {
+            NSError* error = nil;
+            if (_failedCount > 0) {
+                NSDictionary* userInfo = [NSDictionary dictionaryWithObjectsAndKeys:@"An error has occured. Check lastError of controlled resources",NSLocalizedFailureReasonErrorKey, nil];
+                error = [NSError errorWithDomain:@"MKResourcesControllerErrorDomain" code:60 userInfo:userInfo];
             }
+            [self setLastError:error];
+            [self notifyDidFinishDownload:error];
         }
-        NSError* error = nil;
-        if (hasError) {
-            NSDictionary* userInfo = [NSDictionary dictionaryWithObjectsAndKeys:@"An error has occured. Check lastError of controlled resources",NSLocalizedFailureReasonErrorKey, nil];
-            error = [NSError errorWithDomain:@"MKResourcesControllerErrorDomain" code:60 userInfo:userInfo];
-        }
-        [self notifyDidFinishDownload:error];
     }
+    [_manager unlock];
 }
 
 - (void)resourceDidCancelDownload:(MKResource*)resource {
-    [_progresByResource setObject:[NSNumber numberWithFloat:1.0f] forKey:[NSValue valueWithPointer:(__bridge const void *)(resource)]];
-
-    BOOL didCancel = YES;
-    for (MKResource* resource in _resources) {
-        if (resource.status == MKStatusInProgress) {
-            didCancel = NO;
-            break;
+    [_manager lock];
+    MKResourceProgressEntry* entry = [self entryForResource:resource];
+    if (entry != NULL) {
+        [self setProgress:1.0f expectedContentLength:entry->expectedContentLength ofEntry:entry];
+        [self setOutstanding:NO ofEntry:entry];
+        [self setOutcome:MKResourceOutcomeCancelled ofEntry:entry];
+        
+        if (_outstandingCount == 0) {
+            [super cancelDownload];
         }
     }
-
-    if (didCancel == YES) {
-        [super cancelDownload];
-    }
+    [_manager unlock];
 }
 
 @end
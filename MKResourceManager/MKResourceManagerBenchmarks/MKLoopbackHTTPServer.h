@@ -0,0 +1,54 @@
+//
+//  MKLoopbackHTTPServer.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Minimal HTTP/1.0 server on 127.0.0.1 that stands in for the network in benchmarks.
+ * GET /payload/<length>/<tag> is answered with length bytes of generated data; different tags give different URLs
+ * of the same payload. Byte at offset n of the payload is n % 256. Range requests are answered with 206 and 416 as
+ * a server that supports byte ranges would. If-Range and If-None-Match are compared with payloadETag, the latter
+ * is answered with 304 on match.
+ * Each connection is served on its own thread and closed after the response.
+ */
+@interface MKLoopbackHTTPServer : NSObject {
+@private
+    int                     _listeningSocket;
+    uint16_t                _port;
+    NSThread*               _acceptThread;
+    volatile int32_t        _requestsCount;
+    volatile int32_t        _rangeRequestsCount;
+}
+
+// Port the server listens on, known after start
+@property (nonatomic, readonly) uint16_t port;
+// Delay before the response is sent
+@property (atomic, assign) NSTimeInterval latency;
+// Bytes per second the body of each response is sent at. 0 means unlimited.
+@property (atomic, assign) NSUInteger bandwidth;
+// Fraction of requests, from 0 to 1, answered with errorStatusCode instead of the payload
+@property (atomic, assign) double errorRate;
+// Default value is 500
+@property (atomic, assign) NSInteger errorStatusCode;
+@property (nonatomic, readonly) NSUInteger requestsCount;
+// Number of requests answered with 206 or 416
+@property (nonatomic, readonly) NSUInteger rangeRequestsCount;
+// Entity tag sent with the payload. Changing it makes If-Range fail as if the resource has changed.
+// Default value is "payload".
+@property (atomic, copy) NSString* payloadETag;
+// Range requests are answered with the whole payload if NO. Default value is YES.
+@property (atomic, assign) BOOL acceptsRanges;
+// Ranges are answered from one byte before the requested one, as a broken server would
+@property (atomic, assign) BOOL shiftsRanges;
+
+// Listens on an ephemeral port. Returns NO if the socket can not be bound.
+- (BOOL)start;
+- (void)stop;
+- (NSURL*)URLForPayloadOfLength:(NSUInteger)length tag:(NSString*)tag;
+
+@end
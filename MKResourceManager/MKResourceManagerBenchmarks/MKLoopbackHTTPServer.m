@@ -0,0 +1,263 @@
+//
+//  MKLoopbackHTTPServer.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKLoopbackHTTPServer.h"
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <arpa/inet.h>
+#import <unistd.h>
+
+// Length of the body sent at once
+#define MKLoopbackChunkLength (16 * 1024)
+#define MKLoopbackMaxRequestLength (8 * 1024)
+
+static BOOL MKLoopbackSendAll(int socket, const void* bytes, size_t length) {
+    size_t sentLength = 0;
+    while (sentLength < length) {
+        ssize_t result = send(socket, (const uint8_t*)bytes + sentLength, length - sentLength, 0);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return NO;
+        }
+        sentLength += result;
+    }
+    return YES;
+}
+
+// Returns YES if the request has the header with exactly the value
+static BOOL MKLoopbackHeaderEquals(const char* request, const char* name, const char* value) {
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "\r\n%s: ", name);
+    const char* header = strcasestr(request, prefix);
+    if (header == NULL) {
+        return NO;
+    }
+    header += strlen(prefix);
+    size_t valueLength = strlen(value);
+    return strncmp(header, value, valueLength) == 0 && header[valueLength] == '\r';
+}
+
+static const char* MKLoopbackReasonPhrase(NSInteger statusCode) {
+    switch (statusCode) {
+        case 200:
+            return "OK";
+        case 206:
+            return "Partial Content";
+        case 304:
+            return "Not Modified";
+        default:
+            return "Error";
+    }
+}
+
+@implementation MKLoopbackHTTPServer
+
+@synthesize port = _port;
+@synthesize latency = _latency;
+@synthesize bandwidth = _bandwidth;
+@synthesize errorRate = _errorRate;
+@synthesize errorStatusCode = _errorStatusCode;
+@synthesize payloadETag = _payloadETag;
+@synthesize acceptsRanges = _acceptsRanges;
+@synthesize shiftsRanges = _shiftsRanges;
+
+- (id)init {
+    self = [super init];
+    if (self != nil) {
+        _listeningSocket = -1;
+        _errorStatusCode = 500;
+        _payloadETag = @"\"payload\"";
+        _acceptsRanges = YES;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self stop];
+}
+
+- (BOOL)start {
+    if (_listeningSocket >= 0) {
+        return YES;
+    }
+    int listeningSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listeningSocket < 0) {
+        return NO;
+    }
+    int reuse = 1;
+    setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_len = sizeof(address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t addressLength = sizeof(address);
+    if (bind(listeningSocket, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listeningSocket, 64) != 0 ||
+        getsockname(listeningSocket, (struct sockaddr*)&address, &addressLength) != 0) {
+        NSLog(@"%@: Fail to listen on loopback interface, %s", NSStringFromClass ([self class]), strerror(errno));//Error
+        close(listeningSocket);
+        return NO;
+    }
+    _listeningSocket = listeningSocket;
+    _port = ntohs(address.sin_port);
+    _acceptThread = [[NSThread alloc] initWithTarget:self selector:@selector(acceptConnections:) object:[NSNumber numberWithInt:listeningSocket]];
+    [_acceptThread start];
+    return YES;
+}
+
+- (void)stop {
+    if (_listeningSocket >= 0) {
+        // accept returns with error once the socket is shut down
+        shutdown(_listeningSocket, SHUT_RDWR);
+        close(_listeningSocket);
+        _listeningSocket = -1;
+        _acceptThread = nil;
+    }
+}
+
+- (NSUInteger)requestsCount {
+    return (NSUInteger)_requestsCount;
+}
+
+- (NSUInteger)rangeRequestsCount {
+    return (NSUInteger)_rangeRequestsCount;
+}
+
+- (NSURL*)URLForPayloadOfLength:(NSUInteger)length tag:(NSString*)tag {
+    return [NSURL URLWithString:[NSString stringWithFormat:@"http://127.0.0.1:%u/payload/%lu/%@", (unsigned)_port, (unsigned long)length, tag]];
+}
+
+- (void)acceptConnections:(NSNumber*)listeningSocket {
+    @autoreleasepool {
+        while (YES) {
+            int connection = accept([listeningSocket intValue], NULL, NULL);
+            if (connection < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            int noSigPipe = 1;
+            setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+            [NSThread detachNewThreadSelector:@selector(serveConnection:) toTarget:self withObject:[NSNumber numberWithInt:connection]];
+        }
+    }
+}
+
+- (void)serveConnection:(NSNumber*)connectionNumber {
+    @autoreleasepool {
+        int connection = [connectionNumber intValue];
+        char request[MKLoopbackMaxRequestLength + 1];
+        size_t requestLength = 0;
+        while (requestLength < MKLoopbackMaxRequestLength) {
+            ssize_t result = recv(connection, request + requestLength, MKLoopbackMaxRequestLength - requestLength, 0);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                break;
+            }
+            requestLength += result;
+            request[requestLength] = '\0';
+            if (strstr(request, "\r\n\r\n") != NULL) {
+                break;
+            }
+        }
+        request[requestLength] = '\0';
+        __sync_fetch_and_add(&_requestsCount, 1);
+
+        unsigned long length = 0;
+        BOOL validRequest = sscanf(request, "GET /payload/%lu/", &length) == 1;
+        NSTimeInterval latency = self.latency;
+        if (latency > 0.0) {
+            [NSThread sleepForTimeInterval:latency];
+        }
+
+        NSInteger statusCode = 200;
+        if (!validRequest) {
+            statusCode = 404;
+        } else if (self.errorRate > 0.0 && arc4random_uniform(1000000) < self.errorRate * 1000000) {
+            statusCode = self.errorStatusCode;
+        }
+
+        const char* eTag = [self.payloadETag UTF8String];
+        BOOL acceptsRanges = self.acceptsRanges;
+        if (statusCode == 200 && eTag != NULL && MKLoopbackHeaderEquals(request, "If-None-Match", eTag)) {
+            statusCode = 304;
+        }
+        unsigned long firstPosition = 0;
+        unsigned long lastPosition = length > 0 ? length - 1 : 0;
+        const char* rangeHeader = strcasestr(request, "\r\nRange: bytes=");
+        if (statusCode == 200 && acceptsRanges && rangeHeader != NULL) {
+            // the whole payload is sent if the validator does not match
+            if (strcasestr(request, "\r\nIf-Range: ") == NULL || (eTag != NULL && MKLoopbackHeaderEquals(request, "If-Range", eTag))) {
+                unsigned long requestedLastPosition = ULONG_MAX;
+                if (sscanf(rangeHeader + strlen("\r\nRange: bytes="), "%lu-%lu", &firstPosition, &requestedLastPosition) >= 1) {
+                    statusCode = firstPosition < length ? 206 : 416;
+                    lastPosition = MIN(requestedLastPosition, lastPosition);
+                    if (statusCode == 206 && self.shiftsRanges && firstPosition > 0) {
+                        firstPosition--;
+                    }
+                    __sync_fetch_and_add(&_rangeRequestsCount, 1);
+                } else {
+                    firstPosition = 0;
+                }
+            }
+        }
+        unsigned long bodyLength = 0;
+        if (statusCode == 200 || statusCode == 206) {
+            bodyLength = length > 0 ? lastPosition - firstPosition + 1 : 0;
+        }
+
+        NSMutableString* header = [NSMutableString stringWithFormat:@"HTTP/1.0 %ld %s\r\nContent-Type: application/octet-stream\r\nContent-Length: %lu\r\nConnection: close\r\n",
+                                   (long)statusCode, MKLoopbackReasonPhrase(statusCode), bodyLength];
+        if (validRequest) {
+            [header appendString:acceptsRanges ? @"Accept-Ranges: bytes\r\n" : @"Accept-Ranges: none\r\n"];
+            if (eTag != NULL) {
+                [header appendFormat:@"ETag: %s\r\n", eTag];
+            }
+        }
+        if (statusCode == 206) {
+            [header appendFormat:@"Content-Range: bytes %lu-%lu/%lu\r\n", firstPosition, lastPosition, length];
+        } else if (statusCode == 416) {
+            [header appendFormat:@"Content-Range: bytes */%lu\r\n", length];
+        }
+        [header appendString:@"\r\n"];
+        const char* headerBytes = [header UTF8String];
+        BOOL result = MKLoopbackSendAll(connection, headerBytes, strlen(headerBytes));
+
+        // the chunk is sent from the offset of the first byte of the body modulo 256
+        uint8_t chunk[MKLoopbackChunkLength + 256];
+        for (NSUInteger i = 0; i < sizeof(chunk); i++) {
+            chunk[i] = (uint8_t)i;
+        }
+        NSUInteger bandwidth = self.bandwidth;
+        CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+        unsigned long sentLength = 0;
+        while (result && sentLength < bodyLength) {
+            size_t chunkLength = MIN(MKLoopbackChunkLength, bodyLength - sentLength);
+            result = MKLoopbackSendAll(connection, chunk + ((firstPosition + sentLength) & 0xFF), chunkLength);
+            sentLength += chunkLength;
+            if (bandwidth > 0) {
+                // the body is paced to arrive not earlier than the bandwidth allows
+                NSTimeInterval delay = (double)sentLength / bandwidth - (CFAbsoluteTimeGetCurrent() - startTime);
+                if (delay > 0.0) {
+                    [NSThread sleepForTimeInterval:delay];
+                }
+            }
+        }
+        close(connection);
+    }
+}
+
+@end
@@ -0,0 +1,30 @@
+//
+//  MKResourceManagerBenchmark.h
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+//  Benchmarks run against MKLoopbackHTTPServer, no network access is needed.
+//  Results of a run are written to a JSON file, MKResourceManagerBenchmarks.json in the temporary directory
+//  or the path given in MK_BENCHMARK_RESULTS_PATH environment variable, replacing results of previous runs.
+//  Each result has name, parameters, value and unit.
+//  MK_BENCHMARK_ENTRIES_COUNT sets the number of indexed entries, 5000 by default.
+
+#import <SenTestingKit/SenTestingKit.h>
+
+@class MKLoopbackHTTPServer;
+
+@interface MKResourceManagerBenchmark : SenTestCase {
+    MKLoopbackHTTPServer*   _server;
+    NSString*               _cachePath;
+    NSUInteger              _entriesCount;
+}
+
+- (void)testColdStartup;
+- (void)testCacheHitLookupLatency;
+- (void)testDownloadThroughput;
+- (void)testSaveResourcesInfoCost;
+- (void)testBase64Throughput;
+
+@end
@@ -0,0 +1,273 @@
+//
+//  MKResourceManagerBenchmark.m
+//  MKResourceManager
+//
+//  Created by agent on 10/17/26.
+//  Copyright (c) 2026 agent. All rights reserved.
+//
+
+#import "MKResourceManagerBenchmark.h"
+#import "MKLoopbackHTTPServer.h"
+#import "MKResourceManager.h"
+#import "MKResourceManager+Private.h"
+#import "MKResourceIndex.h"
+#import "MKResourcesController.h"
+#import "MKResourceUtility.h"
+#import <mach/mach_time.h>
+
+static NSUInteger const MKBenchmarkDefaultEntriesCount = 5000;
+static NSUInteger const MKBenchmarkEntryLength = 512;
+static NSUInteger const MKBenchmarkLookupsCount = 10000;
+static NSUInteger const MKBenchmarkDownloadsCount = 32;
+static NSUInteger const MKBenchmarkDownloadLength = 256 * 1024;
+static NSTimeInterval const MKBenchmarkDownloadLatency = 0.02;
+static NSTimeInterval const MKBenchmarkTimeout = 120.0;
+static NSUInteger const MKBenchmarkBase64Length = 4 * 1024 * 1024;
+static NSUInteger const MKBenchmarkBase64RunsCount = 5;
+
+static NSMutableArray* MKBenchmarkResults = nil;
+
+static double MKBenchmarkSecondsFromMachTime(uint64_t machTime) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (double)machTime * timebase.numer / timebase.denom / NSEC_PER_SEC;
+}
+
+@implementation MKResourceManagerBenchmark
+
+- (void)setUp {
+    [super setUp];
+    NSDictionary* environment = [[NSProcessInfo processInfo] environment];
+    _entriesCount = (NSUInteger)[[environment objectForKey:@"MK_BENCHMARK_ENTRIES_COUNT"] integerValue];
+    if (_entriesCount == 0) {
+        _entriesCount = MKBenchmarkDefaultEntriesCount;
+    }
+    _cachePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"BenchmarkDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:_cachePath error:nil];
+    _server = [[MKLoopbackHTTPServer alloc] init];
+    STAssertTrue([_server start], @"Loopback server should be started");
+}
+
+- (void)tearDown {
+    [_server stop];
+    _server = nil;
+    [[NSFileManager defaultManager] removeItemAtPath:_cachePath error:nil];
+    [super tearDown];
+}
+
+#pragma mark - Results
+
+- (NSString*)resultsPath {
+    NSString* path = [[[NSProcessInfo processInfo] environment] objectForKey:@"MK_BENCHMARK_RESULTS_PATH"];
+    return path ?: [NSTemporaryDirectory() stringByAppendingPathComponent:@"MKResourceManagerBenchmarks.json"];
+}
+
+// Results of the run are written after each of them, so that the file is complete whichever benchmarks are run
+- (void)recordResult:(NSString*)name value:(double)value unit:(NSString*)unit parameters:(NSDictionary*)parameters {
+    if (MKBenchmarkResults == nil) {
+        MKBenchmarkResults = [[NSMutableArray alloc] init];
+    }
+    NSDictionary* result = @{@"name": name, @"value": [NSNumber numberWithDouble:value], @"unit": unit, @"parameters": parameters ?: @{}};
+    [MKBenchmarkResults addObject:result];
+    NSLog(@"Benchmark %@ %@: %.3f %@", name, parameters ?: @"", value, unit);//Info
+
+    NSDictionary* run = @{@"date": [NSNumber numberWithDouble:[[NSDate date] timeIntervalSince1970]],
+                          @"system": [[NSProcessInfo processInfo] operatingSystemVersionString],
+                          @"results": MKBenchmarkResults};
+    NSData* data = [NSJSONSerialization dataWithJSONObject:run options:NSJSONWritingPrettyPrinted error:nil];
+    [data writeToFile:[self resultsPath] atomically:YES];
+}
+
+#pragma mark - Helpers
+
+- (MKResourceManager*)managerWithOptions:(MKResourceManagerOptions)options {
+    MKResourceManager* manager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:_cachePath options:options];
+    [manager resume];
+    return manager;
+}
+
+// Saves the index and drops delayed calls that would keep the manager alive
+- (void)closeManager:(MKResourceManager*)manager {
+    [manager flushResourcesInfo];
+    [manager suspend];
+    [NSObject cancelPreviousPerformRequestsWithTarget:manager];
+}
+
+- (NSURL*)entryURLAtIndex:(NSUInteger)index {
+    return [NSURL URLWithString:[NSString stringWithFormat:@"http://example.com/entries/%lu", (unsigned long)index]];
+}
+
+- (void)populateManager:(MKResourceManager*)manager {
+    NSMutableData* data = [NSMutableData dataWithLength:MKBenchmarkEntryLength];
+    arc4random_buf([data mutableBytes], [data length]);
+    for (NSUInteger i = 0; i < _entriesCount; i++) {
+        @autoreleasepool {
+            [manager setData:data forResourceForNSURL:[self entryURLAtIndex:i]];
+        }
+    }
+    [manager flushResourcesInfo];
+}
+
+- (BOOL)runUntil:(BOOL (^)(void))condition {
+    NSDate* timeoutDate = [NSDate dateWithTimeIntervalSinceNow:MKBenchmarkTimeout];
+    while (!condition() && [timeoutDate timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+    return condition();
+}
+
+#pragma mark - Benchmarks
+
+- (void)testColdStartup {
+    @autoreleasepool {
+        MKResourceManager* manager = [self managerWithOptions:MKResourceManagerOptionNone];
+        [self populateManager:manager];
+        [self closeManager:manager];
+    }
+
+    NSDictionary* parameters = @{@"entries": [NSNumber numberWithUnsignedInteger:_entriesCount]};
+    NSMutableArray* durations = [NSMutableArray array];
+    for (NSUInteger attempt = 0; attempt < 5; attempt++) {
+        @autoreleasepool {
+            CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+            MKResourceManager* manager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:_cachePath];
+            [durations addObject:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent() - startTime]];
+            STAssertEquals([manager cacheEntriesCount], _entriesCount, @"All entries should be restored");
+            [self closeManager:manager];
+        }
+    }
+    [durations sortUsingSelector:@selector(compare:)];
+    [self recordResult:@"cold_startup" value:[[durations objectAtIndex:[durations count] / 2] doubleValue] * 1000.0 unit:@"ms" parameters:parameters];
+}
+
+- (void)testCacheHitLookupLatency {
+    MKResourceManager* manager = [self managerWithOptions:MKResourceManagerOptionNone];
+    [self populateManager:manager];
+
+    NSArray* memoryCacheCapacities = @[@0, [NSNumber numberWithUnsignedInteger:_entriesCount * MKBenchmarkEntryLength * 2]];
+    for (NSNumber* memoryCacheCapacity in memoryCacheCapacities) {
+        [manager setMemoryCacheCapacity:[memoryCacheCapacity unsignedIntegerValue]];
+        for (NSUInteger i = 0; i < _entriesCount; i++) {
+            [manager dataForResourceForNSURL:[self entryURLAtIndex:i]];
+        }
+
+        NSMutableData* samples = [NSMutableData dataWithLength:MKBenchmarkLookupsCount * sizeof(double)];
+        double* durations = [samples mutableBytes];
+        for (NSUInteger i = 0; i < MKBenchmarkLookupsCount; i++) {
+            @autoreleasepool {
+                NSURL* url = [self entryURLAtIndex:arc4random_uniform((uint32_t)_entriesCount)];
+                uint64_t startTime = mach_absolute_time();
+                NSData* data = [manager dataForResourceForNSURL:url];
+                durations[i] = MKBenchmarkSecondsFromMachTime(mach_absolute_time() - startTime);
+                STAssertEquals([data length], MKBenchmarkEntryLength, @"");
+            }
+        }
+        qsort_b(durations, MKBenchmarkLookupsCount, sizeof(double), ^int(const void* first, const void* second) {
+            double difference = *(const double*)first - *(const double*)second;
+            return difference < 0 ? -1 : (difference > 0 ? 1 : 0);
+        });
+        NSDictionary* parameters = @{@"entries": [NSNumber numberWithUnsignedInteger:_entriesCount],
+                                     @"memoryCacheCapacity": memoryCacheCapacity};
+        [self recordResult:@"lookup_latency_p50" value:durations[MKBenchmarkLookupsCount / 2] * 1000000.0 unit:@"us" parameters:parameters];
+        [self recordResult:@"lookup_latency_p99" value:durations[MKBenchmarkLookupsCount * 99 / 100] * 1000000.0 unit:@"us" parameters:parameters];
+    }
+    [self closeManager:manager];
+}
+
+- (void)testDownloadThroughput {
+    _server.latency = MKBenchmarkDownloadLatency;
+    NSArray* concurrentDownloadsCounts = @[@1, @4, @10];
+    for (NSNumber* concurrentDownloadsCount in concurrentDownloadsCounts) {
+        [[NSFileManager defaultManager] removeItemAtPath:_cachePath error:nil];
+        MKResourceManager* manager = [self managerWithOptions:MKResourceManagerOptionNone];
+        [manager setMaxConcurrentDownloadsCount:[concurrentDownloadsCount unsignedIntegerValue]];
+        [manager setMaxConcurrentDownloadsPerHostCount:[concurrentDownloadsCount unsignedIntegerValue]];
+        NSMutableArray* URLs = [NSMutableArray array];
+        for (NSUInteger i = 0; i < MKBenchmarkDownloadsCount; i++) {
+            [URLs addObject:[_server URLForPayloadOfLength:MKBenchmarkDownloadLength tag:[NSString stringWithFormat:@"%@-%lu", concurrentDownloadsCount, (unsigned long)i]]];
+        }
+
+        __block BOOL finished = NO;
+        __block NSUInteger failedCount = 0;
+        CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+        [manager prefetchResourcesForNSURLs:URLs priority:MKResourcePriorityNormal completion:^(MKResourcesController* controller, NSError* error) {
+            failedCount = [controller failedCount];
+            finished = YES;
+        }];
+        STAssertTrue([self runUntil:^BOOL{ return finished; }], @"Downloads should be finished");
+        CFAbsoluteTime duration = CFAbsoluteTimeGetCurrent() - startTime;
+        STAssertEquals(failedCount, (NSUInteger)0, @"");
+
+        NSDictionary* parameters = @{@"maxConcurrentDownloadsCount": concurrentDownloadsCount,
+                                     @"downloads": [NSNumber numberWithUnsignedInteger:MKBenchmarkDownloadsCount],
+                                     @"length": [NSNumber numberWithUnsignedInteger:MKBenchmarkDownloadLength],
+                                     @"latency": [NSNumber numberWithDouble:_server.latency],
+                                     @"bandwidth": [NSNumber numberWithUnsignedInteger:_server.bandwidth]};
+        [self recordResult:@"download_throughput" value:MKBenchmarkDownloadsCount * MKBenchmarkDownloadLength / duration / (1024 * 1024) unit:@"MB/s" parameters:parameters];
+        [self closeManager:manager];
+    }
+}
+
+- (void)testSaveResourcesInfoCost {
+    MKResourceManager* manager = [self managerWithOptions:MKResourceManagerOptionNone];
+    [self populateManager:manager];
+
+    NSArray* dirtyCounts = @[@1, [NSNumber numberWithUnsignedInteger:MAX(_entriesCount / 100, 1)], [NSNumber numberWithUnsignedInteger:_entriesCount]];
+    for (NSNumber* dirtyCount in dirtyCounts) {
+        for (NSUInteger i = 0; i < [dirtyCount unsignedIntegerValue]; i++) {
+            [manager setNeedsSaveResource:[manager resourceForNSURL:[self entryURLAtIndex:i]]];
+        }
+        // the index is written in background, the cost includes the write
+        CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+        [manager flushResourcesInfo];
+        [[manager resourceIndex] waitUntilSaved];
+        CFAbsoluteTime duration = CFAbsoluteTimeGetCurrent() - startTime;
+        NSDictionary* parameters = @{@"entries": [NSNumber numberWithUnsignedInteger:_entriesCount], @"changed": dirtyCount};
+        [self recordResult:@"save_resources_info" value:duration * 1000.0 unit:@"ms" parameters:parameters];
+    }
+    [self closeManager:manager];
+}
+
+// Median throughput of runs of the block, in MB/s of binary data
+- (double)base64ThroughputOfBlock:(void (^)(void))block {
+    NSMutableArray* durations = [NSMutableArray arrayWithCapacity:MKBenchmarkBase64RunsCount];
+    for (NSUInteger i = 0; i < MKBenchmarkBase64RunsCount; i++) {
+        @autoreleasepool {
+            uint64_t startTime = mach_absolute_time();
+            block();
+            [durations addObject:[NSNumber numberWithDouble:MKBenchmarkSecondsFromMachTime(mach_absolute_time() - startTime)]];
+        }
+    }
+    [durations sortUsingSelector:@selector(compare:)];
+    return MKBenchmarkBase64Length / [[durations objectAtIndex:[durations count] / 2] doubleValue] / (1024 * 1024);
+}
+
+- (void)testBase64Throughput {
+    NSMutableData* data = [NSMutableData dataWithLength:MKBenchmarkBase64Length];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    for (NSNumber* separateLines in @[@NO, @YES]) {
+        NSDictionary* parameters = @{@"length": [NSNumber numberWithUnsignedInteger:MKBenchmarkBase64Length], @"separateLines": separateLines};
+        NSString* encodedString = [MKResourceUtility base64Encode:data onSeparateLines:[separateLines boolValue]];
+        STAssertEqualObjects([MKResourceUtility base64Decode:encodedString], data, @"");
+        double encodeThroughput = [self base64ThroughputOfBlock:^{
+            [MKResourceUtility base64Encode:data onSeparateLines:[separateLines boolValue]];
+        }];
+        [self recordResult:@"base64_encode_throughput" value:encodeThroughput unit:@"MB/s" parameters:parameters];
+        double decodeThroughput = [self base64ThroughputOfBlock:^{
+            [MKResourceUtility base64Decode:encodedString];
+        }];
+        [self recordResult:@"base64_decode_throughput" value:decodeThroughput unit:@"MB/s" parameters:parameters];
+    }
+
+    double streamThroughput = [self base64ThroughputOfBlock:^{
+        NSOutputStream* outputStream = [NSOutputStream outputStreamToMemory];
+        [MKResourceUtility base64EncodeStream:[NSInputStream inputStreamWithData:data] toStream:outputStream onSeparateLines:YES];
+        [outputStream close];
+    }];
+    [self recordResult:@"base64_stream_encode_throughput" value:streamThroughput unit:@"MB/s" parameters:@{@"length": [NSNumber numberWithUnsignedInteger:MKBenchmarkBase64Length], @"separateLines": @YES}];
+}
+
+@end
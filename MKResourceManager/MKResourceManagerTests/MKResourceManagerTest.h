@@ -31,6 +31,31 @@
 #else
 - (void)test;
 - (void)testSuspendResume;
+- (void)testCacheBudget;
+- (void)testResourceIndexJournal;
+- (void)testAsynchronousRestore;
+- (void)testRangedRead;
+- (void)testMemoryCache;
+- (void)testDownloadScheduler;
+- (void)testDownloadSchedulerSegments;
+- (void)testPartialBuffer;
+- (void)testPooledBuffer;
+- (void)testThreadSafeLookup;
+- (void)testShardedLayout;
+- (void)testResourcesControllerTotals;
+- (void)testProgressCoalescing;
+- (void)testPrefetch;
+- (void)testEncryptedFile;
+- (void)testEncryptionThroughput;
+- (void)testCompressedStorage;
+- (void)testDeduplicatedStorage;
+- (void)testMetrics;
+- (void)testBase64;
+- (void)testRetryPolicy;
+- (void)testSharedCache;
+- (void)testResumeDownload;
+- (void)testRevalidation;
+- (void)testSegmentedDownload;
 #endif
 
 @end
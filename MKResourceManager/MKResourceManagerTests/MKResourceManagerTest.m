@@ -7,9 +7,20 @@
 //
 
 #import "MKResourceManagerTest.h"
+#import <stdatomic.h>
+#import <sys/stat.h>
 #import "MKResourceManager+Private.h"
 #import "MKTestResource.h"
 #import "MKResourceUtility.h"
+#import "MKResource+Private.h"
+#import "MKResourceIndex.h"
+#import "MKResourceDownloadScheduler.h"
+#import "MKResourceBuffer.h"
+#import "MKResourceBufferPool.h"
+#import "MKResourcesController.h"
+#import "AESUtil.h"
+#import "MKResourceCompression.h"
+#import "MKLoopbackHTTPServer.h"
 
 @implementation MKResourceManagerTest
 
@@ -165,6 +176,1016 @@
     _imagesURLs = nil;
 }
 
+- (void)testCacheBudget {
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"BudgetTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    testedManager.maxCacheEntriesCount = 2;
+
+    NSData* data = [@"0123456789" dataUsingEncoding:NSUTF8StringEncoding];
+    NSArray* urls = [NSArray arrayWithObjects:[NSURL URLWithString:@"budget1"], [NSURL URLWithString:@"budget2"], [NSURL URLWithString:@"budget3"], nil];
+    for (NSURL* url in urls) {
+        [testedManager setData:data forResourceForNSURL:url];
+    }
+    STAssertEquals(testedManager.cacheSize, 30ULL, @"All the stored data should be accounted");
+
+      // access the first resource, so the second one becomes the least recently used
+    [testedManager resourceForNSURL:[urls objectAtIndex:0]];
+    [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
+
+    STAssertEquals(testedManager.cacheEntriesCount, (NSUInteger)2, @"Cache should be trimmed to the entries budget");
+    STAssertEquals(testedManager.cacheSize, 20ULL, @"Evicted data should not be accounted");
+    STAssertEquals([testedManager resourceForNSURL:[urls objectAtIndex:1]].status, MKStatusNotDownloaded, @"Least recently used resource should be evicted");
+    STAssertEquals([testedManager resourceForNSURL:[urls objectAtIndex:0]].status, MKStatusDownloaded, @"Recently used resource should be kept");
+
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testResourceIndexJournal {
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"IndexTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    [[NSFileManager defaultManager] createDirectoryAtPath:dirPath withIntermediateDirectories:YES attributes:nil error:nil];
+
+    MKResourceIndex* index = [[MKResourceIndex alloc] initWithDirectoryPath:dirPath];
+    STAssertEquals([[index restoreResources] count], (NSUInteger)0, @"New index should be empty");
+
+    MKResource* keptResource = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://localhost/kept"]];
+    [keptResource setContentType:@"image/png"];
+    [keptResource setStoredLength:42];
+    [keptResource setETag:@"\"kept\""];
+    [keptResource setStatus:MKStatusDownloaded];
+    MKResource* removedResource = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://localhost/removed"]];
+    [removedResource setStatus:MKStatusDownloaded];
+    [index saveResources:[NSArray arrayWithObjects:keptResource, removedResource, nil]];
+    [removedResource setStatus:MKStatusNotDownloaded];
+    [index saveResources:[NSArray arrayWithObject:removedResource]];
+    [index waitUntilSaved];
+
+      // simulate a record torn by crash
+    NSFileHandle* journal = [NSFileHandle fileHandleForWritingAtPath:[dirPath stringByAppendingPathComponent:@"ResourceIndex.journal"]];
+    [journal seekToEndOfFile];
+    [journal writeData:[@"torn" dataUsingEncoding:NSUTF8StringEncoding]];
+    [journal closeFile];
+
+    MKResourceIndex* restoredIndex = [[MKResourceIndex alloc] initWithDirectoryPath:dirPath];
+    NSArray* restoredResources = [restoredIndex restoreResources];
+    STAssertEquals([restoredResources count], (NSUInteger)1, @"Only downloaded resource should be restored");
+    MKResource* restoredResource = [restoredResources lastObject];
+    STAssertEqualObjects([restoredResource.resourceURL absoluteString], @"http://localhost/kept", @"");
+    STAssertEqualObjects(restoredResource.contentType, @"image/png", @"");
+    STAssertEquals(restoredResource.storedLength, 42ULL, @"");
+    STAssertEqualObjects(restoredResource.eTag, @"\"kept\"", @"Validator should be restored");
+    STAssertNil(restoredResource.lastModified, @"");
+    STAssertEquals(restoredResource.status, MKStatusDownloaded, @"");
+
+    // save made before restore should not overwrite the journal it has not read
+    MKResourceIndex* earlySavedIndex = [[MKResourceIndex alloc] initWithDirectoryPath:dirPath];
+    MKResource* earlyResource = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://localhost/early"]];
+    [earlyResource setStatus:MKStatusDownloaded];
+    [earlySavedIndex saveResources:[NSArray arrayWithObject:earlyResource]];
+    STAssertEquals([[earlySavedIndex restoreResources] count], (NSUInteger)1, @"");
+    [earlySavedIndex waitUntilSaved];
+    STAssertEquals([[[[MKResourceIndex alloc] initWithDirectoryPath:dirPath] restoreResources] count], (NSUInteger)2, @"Journaled records should survive the early save");
+
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testAsynchronousRestore {
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"RestoreTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+
+    NSURL* url = [NSURL URLWithString:@"restored"];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    STAssertTrue(testedManager.isReady, @"Manager restored synchronously should be ready");
+    [testedManager setData:[@"restored" dataUsingEncoding:NSUTF8StringEncoding] forResourceForNSURL:url];
+    // the index is written in background, the other manager reads it once the write is finished
+    [testedManager flushResourcesInfo];
+    [[testedManager resourceIndex] waitUntilSaved];
+
+    MKResourceManager* anotherManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath options:MKResourceManagerOptionAsynchronousRestore];
+    [anotherManager resume];
+    __block BOOL readinessHandlerCalled = NO;
+    [anotherManager addReadinessHandler:^(MKResourceManager* manager) {
+        readinessHandlerCalled = YES;
+    }];
+
+    NSDate* timeout = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while (!anotherManager.isReady && [timeout timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+    }
+
+    STAssertTrue(readinessHandlerCalled, @"Readiness handler should be called");
+    STAssertTrue(anotherManager.startupDuration > 0.0, @"Startup duration should be measured");
+    STAssertEquals([anotherManager resourceForNSURL:url].status, MKStatusDownloaded, @"Resource should be restored");
+    STAssertNotNil([anotherManager dataForResourceForNSURL:url], @"Restored resource data should be available");
+
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testRangedRead {
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"RangedReadTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+
+    NSURL* url = [NSURL URLWithString:@"ranged"];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    [testedManager setData:[@"0123456789" dataUsingEncoding:NSUTF8StringEncoding] forResourceForNSURL:url];
+
+    NSError* error = nil;
+    NSData* mappedData = [testedManager dataForResourceForNSURL:url options:MKResourceReadingMapped error:&error];
+    STAssertEqualObjects(mappedData, [@"0123456789" dataUsingEncoding:NSUTF8StringEncoding], @"");
+    STAssertNil(error, @"");
+    STAssertEqualObjects([testedManager dataInRange:NSMakeRange(3, 4) forResourceForNSURL:url error:&error], [@"3456" dataUsingEncoding:NSUTF8StringEncoding], @"");
+    STAssertEqualObjects([testedManager dataInRange:NSMakeRange(8, 10) forResourceForNSURL:url error:&error], [@"89" dataUsingEncoding:NSUTF8StringEncoding], @"Range should be clipped to the data length");
+    STAssertEqualObjects([testedManager dataInRange:NSMakeRange(8, NSUIntegerMax - 8) forResourceForNSURL:url error:&error], [@"89" dataUsingEncoding:NSUTF8StringEncoding], @"Oversized range should be clipped before it is allocated");
+    STAssertNotNil([testedManager inputStreamForResourceForNSURL:url], @"");
+    STAssertNil([testedManager dataInRange:NSMakeRange(0, 1) forResourceForNSURL:[NSURL URLWithString:@"missing"] error:&error], @"");
+
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testMemoryCache {
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"MemoryCacheTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+
+    NSURL* url = [NSURL URLWithString:@"memory"];
+    NSData* data = [@"0123456789" dataUsingEncoding:NSUTF8StringEncoding];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    testedManager.memoryCacheCapacity = 1024;
+    [testedManager setData:data forResourceForNSURL:url];
+
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:url], data, @"");
+    STAssertEquals(testedManager.memoryCacheHitCount, (NSUInteger)1, @"Stored data should be served from memory");
+
+    [testedManager removeResourceForNSURL:url];
+    STAssertNil([testedManager dataForResourceForNSURL:url], @"Removed data should not be served from memory");
+
+    testedManager.memoryCacheMaxDataLength = 4;
+    [testedManager setData:data forResourceForNSURL:url];
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:url], data, @"");
+    STAssertEquals(testedManager.memoryCacheHitCount, (NSUInteger)1, @"Data longer than the limit should not be kept in memory");
+    STAssertEquals(testedManager.memoryCacheMissCount, (NSUInteger)1, @"");
+
+    testedManager.memoryCacheMaxDataLength = 1024;
+    NSMutableData* mutableData = [data mutableCopy];
+    [testedManager setData:mutableData forResourceForNSURL:url];
+    [mutableData resetBytesInRange:NSMakeRange(0, [mutableData length])];
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:url], data, @"Data kept in memory should not change with the data of the caller");
+
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testDownloadScheduler {
+    MKResourceDownloadScheduler* scheduler = [[MKResourceDownloadScheduler alloc] init];
+    scheduler.maxConcurrentDownloadsCount = 3;
+    scheduler.maxConcurrentDownloadsPerHostCount = 1;
+
+    MKResource* first = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host1/first"]];
+    MKResource* second = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host1/second"]];
+    MKResource* third = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host2/third"]];
+    MKResource* urgent = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host3/urgent"]];
+    for (MKResource* resource in [NSArray arrayWithObjects:first, second, third, urgent, nil]) {
+        [scheduler enqueueResource:resource];
+    }
+    [scheduler enqueueResource:first];
+    STAssertEquals(scheduler.queuedCount, (NSUInteger)4, @"Resource should be queued once");
+
+    urgent.priority = MKResourcePriorityHigh;
+    [scheduler reprioritizeResource:urgent];
+
+    STAssertEquals([scheduler dequeueNextResource], urgent, @"Resource with higher priority should be taken first");
+    STAssertEquals([scheduler dequeueNextResource], first, @"");
+    STAssertEquals([scheduler dequeueNextResource], third, @"Host limit should let resource of another host go ahead");
+    STAssertNil([scheduler dequeueNextResource], @"");
+    STAssertEquals(scheduler.runningCount, (NSUInteger)3, @"");
+
+    STAssertTrue([scheduler removeResource:first], @"");
+    STAssertEquals([scheduler dequeueNextResource], second, @"Freed slot should be filled");
+
+    [scheduler enqueueResource:first];
+    STAssertFalse([scheduler removeResource:first], @"Queued resource is not running");
+    STAssertEquals(scheduler.queuedCount, (NSUInteger)0, @"");
+}
+
+- (void)testDownloadSchedulerSegments {
+    MKResourceDownloadScheduler* scheduler = [[MKResourceDownloadScheduler alloc] init];
+    scheduler.maxConcurrentDownloadsCount = 4;
+    scheduler.maxConcurrentDownloadsPerHostCount = 3;
+
+    MKResource* large = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host1/large"]];
+    MKResource* small = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host1/small"]];
+    MKResource* other = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host2/other"]];
+    STAssertEquals([scheduler addRunningSegmentsOfResource:large count:3], (NSUInteger)0, @"Resource that is not running should not take slots");
+
+    [scheduler enqueueResource:large];
+    STAssertEquals([scheduler dequeueNextResource], large, @"");
+    STAssertEquals([scheduler addRunningSegmentsOfResource:large count:3], (NSUInteger)2, @"Segments should fit the host limit");
+    STAssertEquals(scheduler.runningCount, (NSUInteger)3, @"");
+
+    [scheduler enqueueResource:small];
+    [scheduler enqueueResource:other];
+    STAssertEquals([scheduler dequeueNextResource], other, @"Segments should count against the host limit");
+    STAssertNil([scheduler dequeueNextResource], @"Segments should count against the total limit");
+
+    STAssertTrue([scheduler removeRunningSegmentOfResource:large], @"");
+    STAssertEquals([scheduler dequeueNextResource], small, @"Slot of finished segment should be filled");
+    STAssertTrue([scheduler removeResource:large], @"");
+    STAssertFalse([scheduler removeRunningSegmentOfResource:large], @"Slots of the resource should be freed with it");
+    STAssertEquals(scheduler.runningCount, (NSUInteger)2, @"");
+}
+
+- (void)testPartialBuffer {
+    NSString* filePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"PartialBufferTestFile"];
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+
+    @autoreleasepool {
+        MKResourceBuffer* buffer = [MKResourceBuffer bufferWithPartialFileAtPath:filePath];
+        [buffer appendData:[@"01234" dataUsingEncoding:NSUTF8StringEncoding]];
+    }
+    STAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:filePath], @"Partial data should be kept after buffer is released");
+
+    MKResourceBuffer* resumedBuffer = [MKResourceBuffer bufferWithPartialFileAtPath:filePath];
+    STAssertEquals([resumedBuffer length], (NSUInteger)5, @"Resumed buffer should account the kept data");
+    [resumedBuffer appendData:[@"56789" dataUsingEncoding:NSUTF8StringEncoding]];
+    STAssertEqualObjects([resumedBuffer data], [@"0123456789" dataUsingEncoding:NSUTF8StringEncoding], @"");
+
+    [resumedBuffer removeAllData];
+    STAssertEquals([resumedBuffer length], (NSUInteger)0, @"");
+
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+}
+
+- (void)testPooledBuffer {
+    MKResourceBufferPool* pool = [[MKResourceBufferPool alloc] init];
+    NSMutableData* data = [NSMutableData dataWithLength:MKResourceBufferPoolChunkLength * 2 + 100];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    MKResourceBuffer* buffer = [MKResourceBuffer buffer];
+    buffer.pool = pool;
+    [buffer prepareForExpectedLength:[data length]];
+    STAssertEquals(pool.usedLength, MKResourceBufferPoolChunkLength * 3, @"Memory for expected length should be taken at once");
+    // pieces that cross chunk boundaries
+    for (NSUInteger offset = 0; offset < [data length]; offset += 1000) {
+        [buffer appendData:[data subdataWithRange:NSMakeRange(offset, MIN(1000U, [data length] - offset))]];
+    }
+    STAssertFalse([buffer isFileBacked], @"");
+    STAssertEqualObjects([buffer data], data, @"");
+    STAssertEquals(pool.usedLength, (NSUInteger)0, @"Chunks should be returned once data is joined");
+    STAssertEquals(pool.pooledLength, MKResourceBufferPoolChunkLength * 3, @"");
+    STAssertEquals(pool.peakUsedLength, MKResourceBufferPoolChunkLength * 3, @"");
+
+    MKResourceBuffer* reusingBuffer = [MKResourceBuffer buffer];
+    reusingBuffer.pool = pool;
+    [reusingBuffer appendData:data];
+    STAssertEquals(pool.pooledLength, (NSUInteger)0, @"Next buffer should reuse pooled chunks");
+    NSString* filePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"PooledBufferTestFile"];
+    STAssertTrue([reusingBuffer moveToPath:filePath error:NULL], @"");
+    STAssertEqualObjects([NSData dataWithContentsOfFile:filePath], data, @"Chunks should be written to file as they are");
+    STAssertEquals(pool.usedLength, (NSUInteger)0, @"");
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+
+    MKResourceBuffer* largeBuffer = [MKResourceBuffer buffer];
+    largeBuffer.pool = pool;
+    largeBuffer.maxMemoryLength = 1000;
+    [largeBuffer prepareForExpectedLength:[data length]];
+    STAssertTrue([largeBuffer isFileBacked], @"Data longer than maxMemoryLength should be written to file from the start");
+    [largeBuffer appendData:data];
+    STAssertEqualObjects([largeBuffer data], data, @"");
+
+    MKResourceBuffer* spilledBuffer = [MKResourceBuffer buffer];
+    spilledBuffer.maxMemoryLength = MKResourceBufferPoolChunkLength;
+    [spilledBuffer appendData:[data subdataWithRange:NSMakeRange(0, 100)]];
+    STAssertFalse([spilledBuffer isFileBacked], @"");
+    [spilledBuffer appendData:[data subdataWithRange:NSMakeRange(100, [data length] - 100)]];
+    STAssertTrue([spilledBuffer isFileBacked], @"Buffer of unknown length should be spilled when it grows");
+    STAssertEqualObjects([spilledBuffer data], data, @"");
+
+    pool.maxPooledLength = MKResourceBufferPoolChunkLength;
+    STAssertTrue(pool.pooledLength <= MKResourceBufferPoolChunkLength, @"");
+    [pool removeAllChunks];
+    STAssertEquals(pool.pooledLength, (NSUInteger)0, @"");
+}
+
+- (void)testThreadSafeLookup {
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"ThreadSafeTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+
+    NSData* data = [@"0123456789" dataUsingEncoding:NSUTF8StringEncoding];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath options:MKResourceManagerOptionThreadSafe];
+    [testedManager resume];
+    testedManager.memoryCacheCapacity = 1024;
+    for (NSUInteger i = 0; i < 8; i++) {
+        [testedManager setData:data forResourceForNSURL:[NSURL URLWithString:[NSString stringWithFormat:@"threadsafe%lu", (unsigned long)i]]];
+    }
+
+    NSDate* startDate = [NSDate date];
+    __block atomic_int failures = 0;
+    dispatch_apply(256, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t iteration) {
+        NSURL* url = [NSURL URLWithString:[NSString stringWithFormat:@"threadsafe%lu", (unsigned long)(iteration % 8)]];
+        if (![[testedManager dataForResourceForNSURL:url] isEqualToData:data]) {
+            atomic_fetch_add(&failures, 1);
+        }
+    });
+    STAssertEquals(atomic_load(&failures), 0, @"Concurrent reads should return the stored data");
+    STAssertEquals(testedManager.memoryCacheHitCount + testedManager.memoryCacheMissCount, (NSUInteger)256, @"");
+    // reads are applied to access dates in batches
+    [testedManager applyReadAccesses];
+    for (NSUInteger i = 0; i < 8; i++) {
+        MKResource* resource = [testedManager resourceForNSURL:[NSURL URLWithString:[NSString stringWithFormat:@"threadsafe%lu", (unsigned long)i]]];
+        STAssertTrue([resource.lastAccessDate compare:startDate] != NSOrderedAscending, @"Reads should update the access date");
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testShardedLayout {
+    STAssertEqualObjects([MKResourceUtility MD5HashForString:@""], @"D41D8CD98F00B204E9800998ECF8427E", @"");
+
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"ShardedLayoutTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    [[NSFileManager defaultManager] createDirectoryAtPath:dirPath withIntermediateDirectories:YES attributes:nil error:nil];
+
+    // data file left by a version that kept all files in the cache directory
+    NSURL* url = [NSURL URLWithString:@"sharded"];
+    NSString* name = [MKResourceUtility MD5HashForString:[url absoluteString]];
+    NSData* data = [@"0123456789" dataUsingEncoding:NSUTF8StringEncoding];
+    [data writeToFile:[dirPath stringByAppendingPathComponent:name] atomically:YES];
+
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    NSString* shardedPath = [[dirPath stringByAppendingPathComponent:[name substringToIndex:2]] stringByAppendingPathComponent:name];
+    STAssertEqualObjects([testedManager fullFilePath:[url absoluteString]], shardedPath, @"");
+    STAssertEqualObjects([NSData dataWithContentsOfFile:[testedManager fullFilePath:[url absoluteString]]], data, @"Data file should be moved into its subdirectory");
+    STAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[dirPath stringByAppendingPathComponent:name]], @"");
+
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testResourcesControllerTotals {
+    MKResource* first = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host1/first"]];
+    MKResource* second = [[MKResource alloc] initWithResourceManager:nil andURL:[NSURL URLWithString:@"http://host1/second"]];
+    MKResourcesController* controller = [[MKResourcesController alloc] init];
+    [controller addResource:first];
+    [controller addResource:second];
+
+    [first setStatus:MKStatusInProgress];
+    [second setStatus:MKStatusInProgress];
+    [first setExpectedContentLength:100];
+    [second setExpectedContentLength:300];
+    [first setDownloadedLength:50];
+    STAssertEquals(controller.totalExpectedContentLength, 100LL, @"Expected length of the resource is accounted on its progress");
+    STAssertEquals(controller.totalReceivedLength, 50LL, @"");
+    [second setDownloadedLength:150];
+    STAssertEquals(controller.totalExpectedContentLength, 400LL, @"");
+    STAssertEquals(controller.totalReceivedLength, 200LL, @"");
+
+    [first notifyDidFinishDownload:nil];
+    STAssertEquals(controller.completedCount, (NSUInteger)1, @"");
+    [second notifyDidFinishDownload:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil]];
+    STAssertEquals(controller.failedCount, (NSUInteger)1, @"");
+    STAssertEquals(controller.totalReceivedLength, 400LL, @"");
+
+    [controller removeResource:second];
+    STAssertEquals(controller.failedCount, (NSUInteger)0, @"");
+    STAssertEquals(controller.totalExpectedContentLength, 100LL, @"");
+}
+
+- (void)testProgressCoalescing {
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"ProgressTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    testedManager.progressNotificationInterval = 60.0;
+    MKResource* resource = [testedManager resourceForNSURL:[NSURL URLWithString:@"http://host1/progress"]];
+    MKResourcesController* controller = [[MKResourcesController alloc] init];
+    [controller addResource:resource];
+
+    [resource setStatus:MKStatusInProgress];
+    [resource setExpectedContentLength:100];
+    [resource setDownloadedLength:10];
+    STAssertEquals(controller.totalReceivedLength, 10LL, @"First update should be notified");
+    [resource setDownloadedLength:20];
+    [resource setDownloadedLength:30];
+    STAssertEquals(controller.totalReceivedLength, 10LL, @"Updates within the interval should be coalesced");
+    [resource setDownloadedLength:100];
+    STAssertEquals(controller.totalReceivedLength, 100LL, @"Completion should be notified");
+
+    [controller removeResource:resource];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testPrefetch {
+    NSString* dirPath = NSTemporaryDirectory();
+    dirPath = [dirPath stringByAppendingPathComponent:@"PrefetchTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    [testedManager registerCustomResourceClass:[MKTestResource class]];
+    NSURL* downloadedURL = [NSURL URLWithString:@"prefetched"];
+    [testedManager setData:[@"prefetched" dataUsingEncoding:NSUTF8StringEncoding] forResourceForNSURL:downloadedURL];
+    NSURL* testURL = [NSURL URLWithString:@"MKTestResource"];
+
+    __block NSUInteger completionsCount = 0;
+    MKResourcesController* controller = [testedManager prefetchResourcesForNSURLs:@[testURL, testURL, downloadedURL] priority:MKResourcePriorityLow completion:^(MKResourcesController* controller, NSError* error) {
+        completionsCount++;
+    }];
+    STAssertEquals([controller count], (NSUInteger)1, @"Repeated and downloaded URLs should be skipped");
+    MKResource* resource = [controller resourceAtIndex:0];
+    STAssertEquals(resource.status, MKStatusInProgress, @"");
+
+    MKResourcesController* anotherController = [testedManager prefetchResourcesForNSURLs:@[testURL] priority:MKResourcePriorityHigh completion:^(MKResourcesController* controller, NSError* error) {
+        completionsCount++;
+    }];
+    STAssertEquals([anotherController resourceAtIndex:0], resource, @"Batches should share the download in flight");
+    STAssertEquals(resource.priority, MKResourcePriorityHigh, @"");
+
+    [resource didFinishDownloadMR:[@"MKTestResource" dataUsingEncoding:NSUTF8StringEncoding] error:nil];
+    STAssertEquals(completionsCount, (NSUInteger)2, @"Both batches should be completed by one download");
+    STAssertEquals(resource.priority, MKResourcePriorityNormal, @"Priority of the batch should not outlive its download");
+
+    [testedManager prefetchResourcesForNSURLs:@[downloadedURL] priority:MKResourcePriorityNormal completion:^(MKResourcesController* controller, NSError* error) {
+        completionsCount++;
+    }];
+    STAssertEquals(completionsCount, (NSUInteger)3, @"Batch with nothing to download should be completed at once");
+
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testEncryptedFile {
+    NSString* filePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"EncryptedTestFile"];
+    MKEncryptionKey* key = [[MKEncryptionKey alloc] initWithKey:@"abcdefjxyz"];
+    NSMutableData* data = [NSMutableData dataWithLength:5000];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    MKEncryptedFileWriter* writer = [[MKEncryptedFileWriter alloc] initWithKey:key path:filePath chunkSize:1024];
+    STAssertTrue([writer appendBytes:[data bytes] length:100], @"");
+    STAssertTrue([writer appendBytes:(const uint8_t*)[data bytes] + 100 length:[data length] - 100], @"");
+    STAssertTrue([writer finish], @"");
+    STAssertTrue([MKEncryptedFileReader isEncryptedFileAtPath:filePath], @"");
+
+    MKEncryptedFileReader* reader = [[MKEncryptedFileReader alloc] initWithKey:key path:filePath];
+    STAssertEquals([reader length], (unsigned long long)[data length], @"");
+    STAssertEqualObjects([reader data], data, @"");
+    STAssertEqualObjects([reader dataInRange:NSMakeRange(1000, 100)], [data subdataWithRange:NSMakeRange(1000, 100)], @"Range across chunks should be decrypted");
+
+    // damaged chunk is detected
+    NSFileHandle* fileHandle = [NSFileHandle fileHandleForUpdatingAtPath:filePath];
+    [fileHandle seekToFileOffset:MKEncryptionHeaderLength + 2 * (1024 + MKEncryptionTagLength) + 10];
+    [fileHandle writeData:[NSData dataWithBytes:"x" length:1]];
+    [fileHandle closeFile];
+    reader = [[MKEncryptedFileReader alloc] initWithKey:key path:filePath];
+    STAssertNotNil([reader dataInRange:NSMakeRange(0, 1024)], @"Chunks that have not been damaged should be readable");
+    STAssertNil([reader data], @"");
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"EncryptedTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath options:MKResourceManagerOptionEncryptsData];
+    [testedManager resume];
+    NSURL* url = [NSURL URLWithString:@"encrypted"];
+    [testedManager setData:data forResourceForNSURL:url];
+    STAssertTrue([MKEncryptedFileReader isEncryptedFileAtPath:[testedManager fullFilePath:[url absoluteString]]], @"Data should be encrypted in the cache");
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:url], data, @"");
+    STAssertEqualObjects([testedManager dataInRange:NSMakeRange(4000, 2000) forResourceForNSURL:url error:nil], [data subdataWithRange:NSMakeRange(4000, 1000)], @"");
+
+    // download that does not fit in memory is spilled encrypted and is moved into the cache as is
+    MKResourceBuffer* buffer = [MKResourceBuffer buffer];
+    buffer.temporaryDirectory = [testedManager temporaryDirectoryPath];
+    buffer.maxMemoryLength = 1024;
+    buffer.encryptionKey = [testedManager encryptionKey];
+    [buffer appendData:[data subdataWithRange:NSMakeRange(0, 1000)]];
+    [buffer appendData:[data subdataWithRange:NSMakeRange(1000, [data length] - 1000)]];
+    STAssertTrue([buffer isEncryptedFileBacked], @"");
+    STAssertEqualObjects([buffer data], data, @"");
+    STAssertTrue([MKEncryptedFileReader isEncryptedFileAtPath:buffer.dataFileName], @"Spilled data should be encrypted");
+    NSURL* spilledURL = [NSURL URLWithString:@"encrypted/spilled"];
+    [testedManager setBuffer:buffer forResource:[testedManager resourceForNSURL:spilledURL]];
+    STAssertTrue([MKEncryptedFileReader isEncryptedFileAtPath:[testedManager fullFilePath:[spilledURL absoluteString]]], @"");
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:spilledURL], data, @"");
+
+    // file that has not been encrypted is not served
+    [testedManager setMemoryCacheCapacity:0];
+    NSString* path = [testedManager fullFilePath:[url absoluteString]];
+    STAssertTrue([data writeToFile:path atomically:YES], @"");
+    STAssertNil([testedManager dataForResourceForNSURL:url], @"Plain file should not be read by manager that encrypts data");
+    STAssertEquals([testedManager resourceForNSURL:url].status, MKStatusNotDownloaded, @"Plain file should be downloaded again");
+    STAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:path], @"Plain file should be removed");
+    STAssertTrue([data writeToFile:[testedManager fullFilePath:[spilledURL absoluteString]] atomically:YES], @"");
+    STAssertNil([testedManager inputStreamForResourceForNSURL:spilledURL], @"");
+    STAssertEquals([testedManager resourceForNSURL:spilledURL].status, MKStatusNotDownloaded, @"");
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testEncryptionThroughput {
+    NSString* filePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"EncryptionThroughputTestFile"];
+    MKEncryptionKey* key = [[MKEncryptionKey alloc] initWithKey:@"abcdefjxyz"];
+    NSUInteger length = 16 * 1024 * 1024;
+    NSMutableData* chunk = [NSMutableData dataWithLength:64 * 1024];
+
+    CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+    MKEncryptedFileWriter* writer = [[MKEncryptedFileWriter alloc] initWithKey:key path:filePath];
+    for (NSUInteger written = 0; written < length; written += [chunk length]) {
+        [writer appendBytes:[chunk bytes] length:[chunk length]];
+    }
+    STAssertTrue([writer finish], @"");
+    CFAbsoluteTime encryptionTime = CFAbsoluteTimeGetCurrent() - startTime;
+
+    startTime = CFAbsoluteTimeGetCurrent();
+    MKEncryptedFileReader* reader = [[MKEncryptedFileReader alloc] initWithKey:key path:filePath];
+    for (unsigned long long offset = 0; offset < length; offset += [chunk length]) {
+        STAssertEquals([reader readBytes:[chunk mutableBytes] length:[chunk length] atOffset:offset], (NSInteger)[chunk length], @"");
+    }
+    CFAbsoluteTime decryptionTime = CFAbsoluteTimeGetCurrent() - startTime;
+
+    NSLog(@"Encryption: %.1f MB/s, decryption: %.1f MB/s", length / encryptionTime / (1024 * 1024), length / decryptionTime / (1024 * 1024));//Info
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+}
+
+- (void)testCompressedStorage {
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"CompressionTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager setCompressedContentTypes:[NSSet setWithObjects:@"application/json", @"+xml", nil]];
+    [testedManager resume];
+    NSMutableString* json = [NSMutableString stringWithString:@"["];
+    for (NSUInteger i = 0; i < 1000; i++) {
+        [json appendFormat:@"{\"id\":%u,\"name\":\"item\"},", (unsigned)i];
+    }
+    NSData* data = [json dataUsingEncoding:NSUTF8StringEncoding];
+
+    NSURL* url = [NSURL URLWithString:@"compressed"];
+    MKResource* resource = [testedManager resourceForNSURL:url];
+    [resource setContentType:@"application/json; charset=utf-8"];
+    [testedManager setData:data forResource:resource];
+    NSString* path = [testedManager fullFilePath:[url absoluteString]];
+    NSData* storedData = [NSData dataWithContentsOfFile:path];
+    unsigned long long dataLength = 0;
+    STAssertTrue(MKIsCompressedDataHeader([storedData bytes], [storedData length], &dataLength), @"Data should be compressed in the cache");
+    STAssertEquals(dataLength, (unsigned long long)[data length], @"");
+    STAssertEquals(resource.storedLength, (unsigned long long)[storedData length], @"Stored length should be the length of the file");
+    STAssertEquals(resource.expectedContentLength, (long long)[data length], @"Expected content length should be the length of the data");
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:url], data, @"");
+    STAssertEqualObjects([testedManager dataInRange:NSMakeRange(20000, 100000) forResourceForNSURL:url error:nil], [data subdataWithRange:NSMakeRange(20000, [data length] - 20000)], @"");
+    STAssertEqualObjects([MKResourceUtility stringFromStream:[testedManager inputStreamForResource:resource] encoding:NSUTF8StringEncoding], json, @"");
+
+    // other types and short data are stored as is
+    NSURL* plainURL = [NSURL URLWithString:@"plain"];
+    MKResource* plainResource = [testedManager resourceForNSURL:plainURL];
+    [plainResource setContentType:@"image/png"];
+    [testedManager setData:data forResource:plainResource];
+    STAssertEqualObjects([NSData dataWithContentsOfFile:[testedManager fullFilePath:[plainURL absoluteString]]], data, @"");
+
+    // data stored as is that starts like compressed data is read as is
+    NSMutableData* lookalikeData = [NSMutableData dataWithBytes:[storedData bytes] length:MKCompressionHeaderLength];
+    [lookalikeData appendData:data];
+    NSURL* lookalikeURL = [NSURL URLWithString:@"lookalike"];
+    [testedManager setData:lookalikeData forResourceForNSURL:lookalikeURL];
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:lookalikeURL], lookalikeData, @"");
+    STAssertEqualObjects([testedManager dataInRange:NSMakeRange(0, 100) forResourceForNSURL:lookalikeURL error:nil], [lookalikeData subdataWithRange:NSMakeRange(0, 100)], @"");
+
+    // whether data is compressed is restored from the index
+    [testedManager flushResourcesInfo];
+    [[testedManager resourceIndex] waitUntilSaved];
+    MKResourceManager* restoredManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [restoredManager resume];
+    STAssertEqualObjects([restoredManager dataForResourceForNSURL:url], data, @"");
+    STAssertEqualObjects([restoredManager dataForResourceForNSURL:lookalikeURL], lookalikeData, @"");
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testDeduplicatedStorage {
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"DeduplicationTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath options:MKResourceManagerOptionDeduplicatesData];
+    [testedManager resume];
+    NSMutableData* data = [NSMutableData dataWithLength:5000];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    MKResourceBuffer* buffer = [MKResourceBuffer buffer];
+    buffer.computesDigest = YES;
+    [buffer appendData:[data subdataWithRange:NSMakeRange(0, 1000)]];
+    [buffer appendData:[data subdataWithRange:NSMakeRange(1000, 4000)]];
+    STAssertEqualObjects([buffer digest], [[MKResourceBuffer bufferWithData:data] digest], @"Digest computed while data is appended should match");
+
+    NSURL* firstURL = [NSURL URLWithString:@"http://example.com/data?v=1"];
+    NSURL* secondURL = [NSURL URLWithString:@"http://example.com/data?v=2"];
+    [testedManager setData:data forResourceForNSURL:firstURL];
+    [testedManager setData:data forResourceForNSURL:secondURL];
+    MKResource* firstResource = [testedManager resourceForNSURL:firstURL];
+    MKResource* secondResource = [testedManager resourceForNSURL:secondURL];
+    STAssertNotNil(firstResource.contentDigest, @"");
+    STAssertEqualObjects(firstResource.contentDigest, secondResource.contentDigest, @"");
+    NSString* blobPath = [testedManager blobPathForDigest:firstResource.contentDigest compressed:NO];
+    struct stat firstStat, secondStat, blobStat;
+    STAssertEquals(stat([[testedManager fullFilePath:[firstURL absoluteString]] fileSystemRepresentation], &firstStat), 0, @"");
+    STAssertEquals(stat([[testedManager fullFilePath:[secondURL absoluteString]] fileSystemRepresentation], &secondStat), 0, @"");
+    STAssertEquals(firstStat.st_ino, secondStat.st_ino, @"Identical data should be stored once");
+    STAssertEquals(firstStat.st_nlink, (nlink_t)3, @"The blob should be linked by both URLs");
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:secondURL], data, @"");
+
+    STAssertTrue([testedManager removeResourceFromStorage:firstResource], @"");
+    STAssertEquals(stat([blobPath fileSystemRepresentation], &blobStat), 0, @"The blob should be kept while other URL refers to it");
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:secondURL], data, @"");
+    STAssertTrue([testedManager removeResourceFromStorage:secondResource], @"");
+    STAssertTrue(stat([blobPath fileSystemRepresentation], &blobStat) != 0, @"The blob should be removed with the last URL");
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testMetrics {
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"MetricsTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    testedManager.memoryCacheCapacity = 0;
+    [testedManager resume];
+    NSData* data = [NSMutableData dataWithLength:3000];
+    NSURL* storedURL = [NSURL URLWithString:@"http://example.com/metrics/stored"];
+    NSURL* missingURL = [NSURL URLWithString:@"http://example.com/metrics/missing"];
+    [testedManager setData:data forResourceForNSURL:storedURL];
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:storedURL], data, @"");
+    STAssertEquals([[testedManager dataInRange:NSMakeRange(0, 100) forResourceForNSURL:storedURL error:NULL] length], (NSUInteger)100, @"");
+    STAssertNil([testedManager dataForResourceForNSURL:missingURL], @"");
+
+    MKResource* failedResource = [testedManager resourceForNSURL:missingURL];
+    NSHTTPURLResponse* response = [[NSHTTPURLResponse alloc] initWithURL:missingURL statusCode:404 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    NSError* error = [NSError errorWithDomain:@"MKResourceManagerErrorDomain" code:404 userInfo:nil];
+    [testedManager didFinishDownloadResource:failedResource data:nil error:error httpResponse:response];
+
+    MKResourceMetricsSnapshot* snapshot = [testedManager metricsSnapshot];
+    STAssertEquals([snapshot valueOfCounter:MKResourceMetricsCounterHits], 2ULL, @"");
+    STAssertEquals([snapshot valueOfCounter:MKResourceMetricsCounterMisses], 1ULL, @"");
+    STAssertEquals([snapshot valueOfCounter:MKResourceMetricsCounterBytesServed], 3100ULL, @"");
+    STAssertEquals([snapshot valueOfCounter:MKResourceMetricsCounterErrors], 1ULL, @"");
+    STAssertEqualObjects([snapshot.errorsByStatusCode objectForKey:[NSNumber numberWithInteger:404]], [NSNumber numberWithInt:1], @"");
+    STAssertEquals([[snapshot histogramForLatency:MKResourceMetricsLatencyDiskRead] count], 2ULL, @"");
+    STAssertEquals([[snapshot histogramForLatency:MKResourceMetricsLatencyDiskWrite] count], 1ULL, @"");
+    STAssertEqualsWithAccuracy(snapshot.hitRatio, 2.0 / 3.0, 0.001, @"");
+    STAssertNotNil([NSJSONSerialization dataWithJSONObject:[snapshot dictionaryRepresentation] options:0 error:NULL], @"");
+
+    [testedManager resetMetrics];
+    STAssertEquals([[testedManager metricsSnapshot] valueOfCounter:MKResourceMetricsCounterHits], 0ULL, @"");
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testBase64 {
+    NSData* foobar = [@"foobar" dataUsingEncoding:NSASCIIStringEncoding];
+    STAssertEqualObjects([MKResourceUtility base64Encode:foobar onSeparateLines:NO], @"Zm9vYmFy", @"");
+    STAssertEqualObjects([MKResourceUtility base64Encode:[foobar subdataWithRange:NSMakeRange(0, 4)] onSeparateLines:NO], @"Zm9vYg==", @"");
+    STAssertEqualObjects([MKResourceUtility base64Decode:@"Zm9v\r\nYmE="], [foobar subdataWithRange:NSMakeRange(0, 5)], @"Line breaks and padding should be skipped");
+
+    // lengths around the 48 bytes encoded at once
+    for (NSUInteger length = 0; length < 200; length++) {
+        NSMutableData* data = [NSMutableData dataWithLength:length];
+        arc4random_buf([data mutableBytes], length);
+        NSString* encodedString = [MKResourceUtility base64Encode:data onSeparateLines:NO];
+        STAssertEquals([encodedString length], (length + 2) / 3 * 4, @"");
+        if (length > 0) {
+            STAssertEqualObjects([MKResourceUtility base64Decode:encodedString], data, @"");
+            // a char out of the alphabet inside a block of 64 chars decoded at once
+            NSMutableString* brokenString = [encodedString mutableCopy];
+            [brokenString insertString:@"\r\n" atIndex:[encodedString length] / 2 / 4 * 4];
+            STAssertEqualObjects([MKResourceUtility base64Decode:brokenString], data, @"");
+        }
+    }
+
+    NSMutableData* data = [NSMutableData dataWithLength:100 * 1024 + 1];
+    arc4random_buf([data mutableBytes], [data length]);
+    NSString* encodedString = [MKResourceUtility base64Encode:data onSeparateLines:YES];
+    NSArray* lines = [encodedString componentsSeparatedByString:@"\n"];
+    STAssertEquals([lines count], ([data length] + 47) / 48, @"");
+    STAssertEquals([[lines objectAtIndex:0] length], (NSUInteger)64, @"");
+    STAssertEqualObjects([MKResourceUtility base64Decode:encodedString], data, @"");
+
+    NSOutputStream* encodedStream = [NSOutputStream outputStreamToMemory];
+    STAssertTrue([MKResourceUtility base64EncodeStream:[NSInputStream inputStreamWithData:data] toStream:encodedStream onSeparateLines:YES], @"");
+    NSData* encodedData = [encodedStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+    STAssertEqualObjects([[NSString alloc] initWithData:encodedData encoding:NSASCIIStringEncoding], encodedString, @"Stream should be encoded as data at once");
+    NSOutputStream* decodedStream = [NSOutputStream outputStreamToMemory];
+    STAssertTrue([MKResourceUtility base64DecodeStream:[NSInputStream inputStreamWithData:encodedData] toStream:decodedStream], @"");
+    STAssertEqualObjects([decodedStream propertyForKey:NSStreamDataWrittenToMemoryStreamKey], data, @"");
+}
+
+- (void)testRetryPolicy {
+    MKResourceRetryPolicy* policy = [[MKResourceRetryPolicy alloc] init];
+    STAssertTrue([policy isTransientError:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil] statusCode:0], @"");
+    STAssertTrue([policy isTransientError:nil statusCode:503], @"");
+    STAssertFalse([policy isTransientError:nil statusCode:404], @"");
+    for (NSUInteger retryIndex = 1; retryIndex <= 10; retryIndex++) {
+        NSTimeInterval maxDelay = MIN(policy.initialRetryDelay * (1 << (retryIndex - 1)), policy.maxRetryDelay);
+        NSTimeInterval delay = [policy delayBeforeRetry:retryIndex];
+        STAssertTrue(delay >= maxDelay * (1.0 - policy.retryDelayJitter) && delay <= maxDelay, @"Delay should grow exponentially with jitter");
+    }
+
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"RetryPolicyTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    // retries do not fire while the test runs
+    policy.initialRetryDelay = 60.0;
+    policy.circuitBreakerFailuresCount = 2;
+    testedManager.retryPolicy = policy;
+
+    NSURL* missingURL = [NSURL URLWithString:@"http://example.com/retry/missing"];
+    MKResource* missingResource = [testedManager resourceForNSURL:missingURL];
+    NSHTTPURLResponse* notFoundResponse = [[NSHTTPURLResponse alloc] initWithURL:missingURL statusCode:404 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    NSError* notFoundError = [NSError errorWithDomain:NSURLErrorDomain code:404 userInfo:nil];
+    [testedManager didFinishDownloadResource:missingResource data:nil error:notFoundError httpResponse:notFoundResponse];
+    [testedManager startDownloadResource:missingResource];
+    STAssertEquals(missingResource.lastError, notFoundError, @"Failure should be answered from the negative cache");
+    STAssertEquals(missingResource.status, MKStatusNotDownloaded, @"");
+
+    NSURL* retriedURL = [NSURL URLWithString:@"http://down.example.com/retried"];
+    NSHTTPURLResponse* unavailableResponse = [[NSHTTPURLResponse alloc] initWithURL:retriedURL statusCode:503 HTTPVersion:@"HTTP/1.1" headerFields:nil];
+    NSError* unavailableError = [NSError errorWithDomain:NSURLErrorDomain code:503 userInfo:nil];
+    MKResource* retriedResource = [testedManager resourceForNSURL:retriedURL];
+    [retriedResource setStatus:MKStatusInProgress];
+    [testedManager didFinishDownloadResource:retriedResource data:nil error:unavailableError httpResponse:unavailableResponse];
+    STAssertTrue(retriedResource.retryPending, @"Transient failure should be retried");
+    STAssertEquals(retriedResource.status, MKStatusInProgress, @"Retried resource should stay in progress");
+    STAssertEquals(retriedResource.retryCount, (NSUInteger)1, @"");
+    [testedManager startDownloadResource:retriedResource];
+    STAssertFalse(retriedResource.retryPending, @"Download started by client should replace the pending retry");
+    STAssertEquals(retriedResource.retryCount, (NSUInteger)0, @"Download started by client should get retries of its own");
+
+    MKResource* failedResource = [testedManager resourceForNSURL:[NSURL URLWithString:@"http://down.example.com/failed"]];
+    [testedManager didFinishDownloadResource:failedResource data:nil error:unavailableError httpResponse:unavailableResponse];
+    STAssertFalse(failedResource.retryPending, @"Failure that opens the circuit breaker should not be retried");
+    STAssertEquals(failedResource.lastError, unavailableError, @"");
+
+    MKResource* rejectedResource = [testedManager resourceForNSURL:[NSURL URLWithString:@"http://down.example.com/rejected"]];
+    [testedManager startDownloadResource:rejectedResource];
+    STAssertEquals([rejectedResource.lastError code], (NSInteger)61, @"Open circuit breaker should fail downloads from the host");
+
+    [testedManager cancelDownloadResource:retriedResource];
+    STAssertFalse(retriedResource.retryPending, @"Cancelled resource should not be retried");
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testSharedCache {
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"SharedCacheTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    // locks of the files are taken per open file, so two managers of one process share the directory as two processes would
+    MKResourceManager* firstManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath options:MKResourceManagerOptionSharesCache];
+    MKResourceManager* secondManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath options:MKResourceManagerOptionSharesCache];
+    [firstManager resume];
+    [secondManager resume];
+    STAssertFalse([[firstManager temporaryDirectoryPath] isEqualToString:[secondManager temporaryDirectoryPath]], @"Each manager should spill downloads into its own directory");
+
+    NSURL* url = [NSURL URLWithString:@"http://example.com/shared/resource"];
+    NSData* data = [@"shared resource data" dataUsingEncoding:NSUTF8StringEncoding];
+    MKResource* firstResource = [firstManager resourceForNSURL:url];
+    [firstManager lock];
+    STAssertTrue([firstManager lockSharedDownloadOfResource:firstResource], @"");
+    [firstManager unlock];
+
+    MKResource* secondResource = [secondManager resourceForNSURL:url];
+    [secondManager startDownloadResource:secondResource];
+    STAssertEquals(secondResource.status, MKStatusInProgress, @"Download owned by another manager should wait");
+    [secondManager synchronizeSharedCache];
+    STAssertEquals(secondResource.status, MKStatusInProgress, @"");
+
+    [firstManager didFinishDownloadResource:firstResource data:data error:nil httpResponse:nil];
+    [secondManager synchronizeSharedCache];
+    STAssertEquals(secondResource.status, MKStatusDownloaded, @"Waiting download should take the result of the other manager");
+    STAssertEqualObjects([secondManager dataForResourceForNSURL:url], data, @"");
+
+    [firstManager removeResourceForNSURL:url];
+    [firstManager flushResourcesInfo];
+    // the index is written in background
+    for (NSUInteger attempt = 0; attempt < 100 && secondResource.status == MKStatusDownloaded; attempt++) {
+        usleep(10000);
+        [secondManager synchronizeSharedCache];
+    }
+    STAssertEquals(secondResource.status, MKStatusNotDownloaded, @"Removal by the other manager should be picked up");
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testRevalidation {
+    MKLoopbackHTTPServer* server = [[MKLoopbackHTTPServer alloc] init];
+    STAssertTrue([server start], @"");
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"RevalidationTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    testedManager.staleWhileRevalidateInterval = 0.1;
+
+    NSURL* url = [server URLForPayloadOfLength:1024 tag:@"revalidated"];
+    NSData* payload = [self loopbackPayloadOfLength:1024];
+    STAssertEqualObjects([self downloadDataForNSURL:url manager:testedManager], payload, @"");
+    MKResource* resource = [testedManager resourceForNSURL:url];
+    STAssertEqualObjects(resource.eTag, server.payloadETag, @"");
+    NSDate* loadedDate = resource.loadedDate;
+
+    // stale data is returned and revalidated with If-None-Match, response 304 keeps it
+    [NSThread sleepForTimeInterval:0.2];
+    NSUInteger requestsCount = server.requestsCount;
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:url], payload, @"");
+    STAssertTrue(resource.revalidating, @"Stale data should be revalidated");
+    STAssertTrue([self runUntil:^BOOL{ return !resource.revalidating; }], @"");
+    STAssertEquals(server.requestsCount, requestsCount + 1, @"");
+    STAssertEquals(resource.status, MKStatusDownloaded, @"");
+    STAssertTrue([resource.loadedDate compare:loadedDate] == NSOrderedDescending, @"Response 304 should refresh the data");
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:url], payload, @"");
+
+    // empty body of successful response replaces the cached data
+    NSURL* emptyURL = [server URLForPayloadOfLength:0 tag:@"empty"];
+    MKResource* emptyResource = [testedManager resourceForNSURL:emptyURL];
+    [testedManager setData:payload forResource:emptyResource];
+    [testedManager startDownloadResource:emptyResource];
+    STAssertTrue([self runUntil:^BOOL{ return emptyResource.status != MKStatusInProgress && !emptyResource.revalidating; }], @"");
+    STAssertEquals(emptyResource.status, MKStatusDownloaded, @"Empty body should be stored as empty data");
+    STAssertEquals([[testedManager dataForResourceForNSURL:emptyURL] length], (NSUInteger)0, @"Cached data should not outlive the empty response");
+
+    // data set by client has nothing to be revalidated against
+    NSURL* clientURL = [server URLForPayloadOfLength:1024 tag:@"client"];
+    MKResource* clientResource = [testedManager resourceForNSURL:clientURL];
+    NSData* clientData = [@"client data" dataUsingEncoding:NSUTF8StringEncoding];
+    [testedManager setData:clientData forResource:clientResource];
+    [NSThread sleepForTimeInterval:0.2];
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:clientURL], clientData, @"");
+    STAssertFalse(clientResource.revalidating, @"Data set by client should not be revalidated");
+
+    [testedManager suspend];
+    [server stop];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testResumeDownload {
+    MKLoopbackHTTPServer* server = [[MKLoopbackHTTPServer alloc] init];
+    STAssertTrue([server start], @"");
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"ResumeDownloadTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath];
+    [testedManager resume];
+    // partial data is kept only for responses not shorter than 300KB
+    NSUInteger length = 400 * 1024;
+    NSData* payload = [self loopbackPayloadOfLength:length];
+    NSData* partialData = [payload subdataWithRange:NSMakeRange(0, 100 * 1024)];
+
+    // 206 with the requested range continues the partial data
+    NSURL* resumedURL = [server URLForPayloadOfLength:length tag:@"resumed"];
+    [self writePartialData:partialData eTag:server.payloadETag forNSURL:resumedURL manager:testedManager];
+    NSUInteger requestsCount = server.requestsCount;
+    NSUInteger rangeRequestsCount = server.rangeRequestsCount;
+    STAssertEqualObjects([self downloadDataForNSURL:resumedURL manager:testedManager], payload, @"");
+    STAssertEquals(server.requestsCount, requestsCount + 1, @"Partial data should be resumed with one request");
+    STAssertEquals(server.rangeRequestsCount, rangeRequestsCount + 1, @"");
+
+    // 206 with other range restarts the download without range
+    server.shiftsRanges = YES;
+    NSURL* shiftedURL = [server URLForPayloadOfLength:length tag:@"shifted"];
+    [self writePartialData:partialData eTag:server.payloadETag forNSURL:shiftedURL manager:testedManager];
+    requestsCount = server.requestsCount;
+    STAssertEqualObjects([self downloadDataForNSURL:shiftedURL manager:testedManager], payload, @"");
+    STAssertEquals(server.requestsCount, requestsCount + 2, @"Mismatched range should be requested again without range");
+    server.shiftsRanges = NO;
+
+    // 416 for partial data longer than the resource restarts the download
+    NSURL* overlongURL = [server URLForPayloadOfLength:length tag:@"overlong"];
+    [self writePartialData:[self loopbackPayloadOfLength:length + 1024] eTag:server.payloadETag forNSURL:overlongURL manager:testedManager];
+    requestsCount = server.requestsCount;
+    STAssertEqualObjects([self downloadDataForNSURL:overlongURL manager:testedManager], payload, @"");
+    STAssertEquals(server.requestsCount, requestsCount + 2, @"Unsatisfiable range should be requested again without range");
+
+    // 200 for changed resource replaces the partial data
+    NSURL* changedURL = [server URLForPayloadOfLength:length tag:@"changed"];
+    [self writePartialData:[NSMutableData dataWithLength:[partialData length]] eTag:@"\"changed\"" forNSURL:changedURL manager:testedManager];
+    requestsCount = server.requestsCount;
+    rangeRequestsCount = server.rangeRequestsCount;
+    STAssertEqualObjects([self downloadDataForNSURL:changedURL manager:testedManager], payload, @"Stale partial data should be dropped");
+    STAssertEquals(server.requestsCount, requestsCount + 1, @"");
+    STAssertEquals(server.rangeRequestsCount, rangeRequestsCount, @"");
+
+    // 200 from server that does not support ranges replaces the partial data
+    server.acceptsRanges = NO;
+    NSURL* unrangedURL = [server URLForPayloadOfLength:length tag:@"unranged"];
+    [self writePartialData:[NSMutableData dataWithLength:[partialData length]] eTag:server.payloadETag forNSURL:unrangedURL manager:testedManager];
+    STAssertEqualObjects([self downloadDataForNSURL:unrangedURL manager:testedManager], payload, @"");
+    STAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[testedManager partialDownloadPathForResource:[testedManager resourceForNSURL:unrangedURL]]], @"");
+
+    [testedManager suspend];
+    [server stop];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+- (void)testSegmentedDownload {
+    MKLoopbackHTTPServer* server = [[MKLoopbackHTTPServer alloc] init];
+    STAssertTrue([server start], @"");
+    NSString* dirPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"SegmentedDownloadTestDir"];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+    MKResourceManager* testedManager = [[MKResourceManager alloc] initWithKey:@"abcdefjxyz" pathCache:dirPath options:MKResourceManagerOptionDeduplicatesData];
+    [testedManager resume];
+    testedManager.segmentedDownloadMinimumLength = 1;
+    testedManager.maxDownloadSegmentsCount = 4;
+    testedManager.maxConcurrentDownloadsCount = 4;
+    // ranges are not shorter than 1MB
+    NSUInteger length = 4 * 1024 * 1024;
+    NSData* payload = [self loopbackPayloadOfLength:length];
+
+    // the first connection keeps its range, the others are requested with If-Range
+    NSURL* url = [server URLForPayloadOfLength:length tag:@"segmented"];
+    NSUInteger requestsCount = server.requestsCount;
+    NSUInteger rangeRequestsCount = server.rangeRequestsCount;
+    __block BOOL finished = NO;
+    __block NSUInteger failedCount = 0;
+    MKResourcesController* controller = [testedManager prefetchResourcesForNSURLs:@[url] priority:MKResourcePriorityNormal completion:^(MKResourcesController* controller, NSError* error) {
+        failedCount = [controller failedCount];
+        finished = YES;
+    }];
+    __block long long maxReceivedLength = 0;
+    STAssertTrue([self runUntil:^BOOL{
+        maxReceivedLength = MAX(maxReceivedLength, controller.totalReceivedLength);
+        return finished;
+    }], @"");
+    STAssertEquals(failedCount, (NSUInteger)0, @"");
+    STAssertEquals(server.requestsCount, requestsCount + 4, @"");
+    STAssertEquals(server.rangeRequestsCount, rangeRequestsCount + 3, @"");
+    STAssertEqualObjects([testedManager dataForResourceForNSURL:url], payload, @"Ranges should be assembled in place");
+    // progress of all ranges is summed up in the length of the resource
+    STAssertEquals(maxReceivedLength, (long long)length, @"Progress should not count bytes beyond the ranges");
+    STAssertEquals(controller.totalExpectedContentLength, (long long)length, @"");
+
+    // assembled file is deduplicated as any other data
+    NSURL* sameURL = [server URLForPayloadOfLength:length tag:@"same"];
+    STAssertEqualObjects([self downloadDataForNSURL:sameURL manager:testedManager], payload, @"");
+    struct stat fileStat;
+    STAssertEquals(stat([[testedManager fullFilePath:[url absoluteString]] fileSystemRepresentation], &fileStat), 0, @"");
+    STAssertEquals(fileStat.st_nlink, (nlink_t)3, @"The blob should be linked by both URLs");
+
+    // resource changed after the first response fails the download instead of mixing versions
+    server.latency = 0.5;
+    NSURL* changedURL = [server URLForPayloadOfLength:length tag:@"changed"];
+    MKResource* changedResource = [testedManager resourceForNSURL:changedURL];
+    finished = NO;
+    [testedManager prefetchResourcesForNSURLs:@[changedURL] priority:MKResourcePriorityNormal completion:^(MKResourcesController* controller, NSError* error) {
+        failedCount = [controller failedCount];
+        finished = YES;
+    }];
+    // ranges are requested right after the first response and answered after the latency
+    STAssertTrue([self runUntil:^BOOL{ return changedResource.expectedContentLength > 0; }], @"");
+    server.payloadETag = @"\"changed\"";
+    STAssertTrue([self runUntil:^BOOL{ return finished; }], @"");
+    STAssertEquals(failedCount, (NSUInteger)1, @"Range of the other version should fail the download");
+    STAssertFalse(changedResource.status == MKStatusDownloaded, @"");
+    NSArray* temporaryFiles = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[testedManager temporaryDirectoryPath] error:nil];
+    STAssertEquals([[temporaryFiles filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"SELF BEGINSWITH 'segments'"]] count], (NSUInteger)0, @"File of the ranges should be removed");
+
+    [testedManager suspend];
+    [server stop];
+    [[NSFileManager defaultManager] removeItemAtPath:dirPath error:nil];
+}
+
+// Payload of the loopback server, byte at offset n is n % 256
+- (NSData*)loopbackPayloadOfLength:(NSUInteger)length {
+    NSMutableData* payload = [NSMutableData dataWithLength:length];
+    uint8_t* bytes = [payload mutableBytes];
+    for (NSUInteger i = 0; i < length; i++) {
+        bytes[i] = (uint8_t)i;
+    }
+    return payload;
+}
+
+- (BOOL)runUntil:(BOOL (^)(void))condition {
+    NSDate* timeoutDate = [NSDate dateWithTimeIntervalSinceNow:30.0];
+    while (!condition() && [timeoutDate timeIntervalSinceNow] > 0) {
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+    }
+    return condition();
+}
+
+- (NSData*)downloadDataForNSURL:(NSURL*)url manager:(MKResourceManager*)manager {
+    __block BOOL finished = NO;
+    __block NSUInteger failedCount = 0;
+    [manager prefetchResourcesForNSURLs:@[url] priority:MKResourcePriorityNormal completion:^(MKResourcesController* controller, NSError* error) {
+        failedCount = [controller failedCount];
+        finished = YES;
+    }];
+    STAssertTrue([self runUntil:^BOOL{ return finished; }], @"Download should be finished");
+    STAssertEquals(failedCount, (NSUInteger)0, @"");
+    return [manager dataForResourceForNSURL:url];
+}
+
+// Leaves partial data of the resource as an interrupted download would
+- (void)writePartialData:(NSData*)data eTag:(NSString*)eTag forNSURL:(NSURL*)url manager:(MKResourceManager*)manager {
+    NSString* partialPath = [manager partialDownloadPathForResource:[manager resourceForNSURL:url]];
+    [[NSFileManager defaultManager] createDirectoryAtPath:[partialPath stringByDeletingLastPathComponent] withIntermediateDirectories:YES attributes:nil error:nil];
+    [data writeToFile:partialPath atomically:YES];
+    NSDictionary* validator = @{@"URL": [url absoluteString], @"ETag": eTag};
+    [validator writeToFile:[partialPath stringByAppendingPathExtension:@"validator"] atomically:YES];
+}
+
 - (void)suspend:(MKResourceManager *)manager {
     [manager suspend];
     [manager performSelector:@selector(resume) withObject:nil afterDelay:1.0f];